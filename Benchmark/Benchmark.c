@@ -0,0 +1,899 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+//
+// Microbenchmarks of the library's switch, spawn and synchronization paths. Each
+// benchmark runs the scheduler to completion and reports the elapsed time per 
+// operation, and the resulting throughput, as JSON on the standard output, so that
+// results can be compared release over release. 
+//
+// Usage: Benchmark [workers [scale]]
+//
+// Workers is the number of workers the scheduler runs on, 1 by default, and scale 
+// multiplies the number of operations of every benchmark.
+//
+
+#include <stdio.h>
+#include "UThread.h"
+#include "SyncObjects.h"
+#include "List.h"
+
+//
+// The default number of operations of each benchmark.
+//
+
+#define YIELD_OPERATIONS 4000000
+#define SPAWN_OPERATIONS 1000000
+#define PARK_OPERATIONS 2000000
+#define MUTEX_OPERATIONS 4000000
+#define SEMAPHORE_WAITERS 64
+#define SEMAPHORE_OPERATIONS 2000000
+#define MAILBOX_PRODUCERS 4
+#define MAILBOX_CONSUMERS 2
+#define MAILBOX_OPERATIONS 1000000
+#define CHANNEL_CAPACITY 16
+#define WAKEUP_OPERATIONS 200000
+
+//
+// The number of contending threads in the contended mutex benchmark.
+//
+
+#define MUTEX_THREADS 8
+
+//
+// The mutex convoy benchmark: the number of threads that use the mutex, how often they
+// yield while holding it, and the number of other threads that keep the ready queue busy.
+//
+
+#define CONVOY_THREADS 8
+#define CONVOY_YIELD_INTERVAL 16
+#define CONVOY_READY_THREADS 64
+
+//
+// The thread counts of the yield benchmark.
+//
+
+static ULONG YieldThreads[] = { 2, 16, 256, 4096 };
+
+//
+// The number of ready threads ahead of a woken waiter in the wake-up latency benchmark.
+//
+
+#define WAKEUP_READY_THREADS 64
+
+//
+// The byte-budget benchmark: how long it runs, the budget, in permits, the number of 
+// threads with small requests, of 1 to 4 permits, and with large requests, and the 
+// size of the large requests.
+//
+
+#define BUDGET_MILLISECONDS 500
+#define BUDGET_PERMITS 64
+#define BUDGET_SMALL_THREADS 32
+#define BUDGET_LARGE_THREADS 4
+#define BUDGET_LARGE_PERMITS 32
+
+//
+// The benchmark parameters, and whether a result was already reported.
+//
+
+static ULONG Workers = 1;
+static ULONG Scale = 1;
+static BOOL FirstResult = TRUE;
+
+//
+// Returns a monotonic time stamp, in nanoseconds.
+//
+
+static
+ULONGLONG
+ReadNanoseconds (
+    )
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER Frequency;
+    LARGE_INTEGER Counter;
+
+    if (Frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&Frequency);
+    }
+
+    QueryPerformanceCounter(&Counter);
+    return (ULONGLONG) ((double) Counter.QuadPart * 1e9 / (double) Frequency.QuadPart);
+#else
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (ULONGLONG) Time.tv_sec * 1000000000 + Time.tv_nsec;
+#endif
+}
+
+//
+// Reports that the specified number of operations with the specified number of threads
+// took Elapsed nanoseconds.
+//
+
+static
+VOID
+ReportBenchmark (
+    __in const char * Name,
+    __in ULONG Threads,
+    __in ULONGLONG Operations,
+    __in double Elapsed
+    )
+{
+    printf("%s    { \"name\": \"%s\", \"threads\": %u, \"operations\": %llu, "
+           "\"ns_per_op\": %.2f, \"ops_per_sec\": %.0f }",
+           FirstResult ? "" : ",\n", Name, Threads, (unsigned long long) Operations, 
+           Elapsed / (double) Operations, (double) Operations * 1e9 / Elapsed);
+    fflush(stdout);
+    FirstResult = FALSE;
+}
+
+//
+// Runs the scheduler with the threads the benchmark created, and reports the time it
+// took to perform the specified number of operations with the specified number of threads.
+//
+
+static
+VOID
+RunBenchmark (
+    __in const char * Name,
+    __in ULONG Threads,
+    __in ULONGLONG Operations
+    )
+{
+    ULONGLONG Start;
+
+    Start = ReadNanoseconds();
+    UtRunEx(Workers);
+    ReportBenchmark(Name, Threads, Operations, (double) (ReadNanoseconds() - Start));
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// UtYield ping-pong between N threads						 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+static ULONG YieldIterations;
+
+static
+VOID
+YieldThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < YieldIterations; ++Index) {
+        UtYield();
+    }
+}
+
+static
+VOID
+BenchmarkYield (
+    __in ULONG Threads
+    )
+{
+    ULONG Index;
+
+    YieldIterations = YIELD_OPERATIONS * Scale / Threads;
+
+    for (Index = 0; Index < Threads; ++Index) {
+        UtCreate(YieldThread, NULL);
+    }
+
+    RunBenchmark("yield", Threads, (ULONGLONG) YieldIterations * Threads);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// UtCreate and UtExit throughput							 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// The number of threads created by the spawner between yields, which let them run.
+//
+
+#define SPAWN_BATCH 64
+
+static
+VOID
+EmptyThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+}
+
+static
+VOID
+SpawnerThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+    ULONG Threads;
+
+    Threads = (ULONG) (ULONG_PTR) Argument;
+
+    for (Index = 1; Index <= Threads; ++Index) {
+        UtCreate(EmptyThread, NULL);
+
+        if ((Index % SPAWN_BATCH) == 0) {
+            UtYield();
+        }
+    }
+}
+
+static
+VOID
+BenchmarkSpawn (
+    )
+{
+    ULONG Threads;
+
+    Threads = SPAWN_OPERATIONS * Scale;
+    UtCreate(SpawnerThread, (UT_ARGUMENT) (ULONG_PTR) Threads);
+    RunBenchmark("create_exit", SPAWN_BATCH, Threads);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// UtPark and UtUnpark round trip							 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+static HANDLE ParkInitiator;
+static HANDLE ParkResponder;
+static volatile BOOL ParkResponderStarted;
+static ULONG ParkIterations;
+
+static
+VOID
+ParkInitiatorThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    //
+    // The responder must have started before it can be unparked.
+    //
+
+    while (!ParkResponderStarted) {
+        UtYield();
+    }
+
+    for (Index = 0; Index < ParkIterations; ++Index) {
+        UtUnpark(ParkResponder);
+        UtPark();
+    }
+}
+
+static
+VOID
+ParkResponderThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    ParkResponderStarted = TRUE;
+
+    for (Index = 0; Index < ParkIterations; ++Index) {
+        UtPark();
+        UtUnpark(ParkInitiator);
+    }
+}
+
+static
+VOID
+BenchmarkPark (
+    )
+{
+    ParkIterations = PARK_OPERATIONS * Scale;
+    ParkResponderStarted = FALSE;
+    ParkResponder = UtCreate(ParkResponderThread, NULL);
+    ParkInitiator = UtCreate(ParkInitiatorThread, NULL);
+    RunBenchmark("park_unpark_round_trip", 2, ParkIterations);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Uncontended and contended mutex acquisition				 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+static UTHREAD_MUTEX Mutex;
+static ULONG MutexIterations;
+
+static
+VOID
+UncontendedMutexThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < MutexIterations; ++Index) {
+        UtAcquireMutex(&Mutex);
+        UtReleaseMutex(&Mutex);
+    }
+}
+
+//
+// Yields while holding the mutex, so that the other threads block on it.
+//
+
+static
+VOID
+ContendedMutexThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < MutexIterations; ++Index) {
+        UtAcquireMutex(&Mutex);
+        UtYield();
+        UtReleaseMutex(&Mutex);
+    }
+}
+
+//
+// Holds the mutex for short critical sections, yielding only occasionally inside them,
+// and yields after every release, while other threads keep the ready queue busy. With
+// handoff, a release makes the mutex owned by a thread at the tail of the ready queue,
+// so the acquisitions made until that thread runs block, and the mutex is acquired about
+// once per pass over the ready queue. With barging, running threads take the free mutex.
+//
+
+static volatile BOOL ConvoyDone;
+static volatile LONG ConvoyLiveThreads;
+
+static
+VOID
+ConvoyMutexThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 1; Index <= MutexIterations; ++Index) {
+        UtAcquireMutex(&Mutex);
+        if ((Index % CONVOY_YIELD_INTERVAL) == 0) {
+            UtYield();
+        }
+        UtReleaseMutex(&Mutex);
+        UtYield();
+    }
+
+    if (InterlockedDecrement(&ConvoyLiveThreads) == 0) {
+        ConvoyDone = TRUE;
+    }
+}
+
+static
+VOID
+ConvoyBusyThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (!ConvoyDone) {
+        UtYield();
+    }
+}
+
+static
+VOID
+BenchmarkMutexConvoy (
+    __in ULONG Flags
+    )
+{
+    ULONG Index;
+
+    UtInitializeMutexEx(&Mutex, FALSE, Flags);
+    MutexIterations = MUTEX_OPERATIONS * Scale / CONVOY_THREADS / 20;
+    ConvoyLiveThreads = CONVOY_THREADS;
+    ConvoyDone = FALSE;
+
+    for (Index = 0; Index < CONVOY_THREADS; ++Index) {
+        UtCreate(ConvoyMutexThread, NULL);
+    }
+    for (Index = 0; Index < CONVOY_READY_THREADS; ++Index) {
+        UtCreate(ConvoyBusyThread, NULL);
+    }
+
+    RunBenchmark(Flags == 0 ? "mutex_convoy" : "mutex_convoy_barging", 
+                 CONVOY_THREADS + CONVOY_READY_THREADS, (ULONGLONG) MutexIterations * CONVOY_THREADS);
+}
+
+static
+VOID
+BenchmarkMutex (
+    )
+{
+    ULONG Index;
+
+    UtInitializeMutex(&Mutex, FALSE);
+    MutexIterations = MUTEX_OPERATIONS * Scale;
+    UtCreate(UncontendedMutexThread, NULL);
+    RunBenchmark("mutex_uncontended", 1, MutexIterations);
+
+    MutexIterations = MUTEX_OPERATIONS * Scale / MUTEX_THREADS / 4;
+    for (Index = 0; Index < MUTEX_THREADS; ++Index) {
+        UtCreate(ContendedMutexThread, NULL);
+    }
+
+    RunBenchmark("mutex_contended", MUTEX_THREADS, (ULONGLONG) MutexIterations * MUTEX_THREADS);
+
+    BenchmarkMutexConvoy(0);
+    BenchmarkMutexConvoy(UT_SYNC_BARGING);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Semaphore releases waking many waiters					 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+static UTHREAD_SEMAPHORE Semaphore;
+static ULONG SemaphoreRounds;
+static volatile LONG SemaphoreArrivals;
+
+static
+VOID
+SemaphoreWaiterThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < SemaphoreRounds; ++Index) {
+        InterlockedIncrement(&SemaphoreArrivals);
+        UtAcquireSemaphore(&Semaphore, 1);
+    }
+}
+
+//
+// Waits for all the waiters to block on the semaphore, and wakes them with a single release.
+//
+
+static
+VOID
+SemaphoreReleaserThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 1; Index <= SemaphoreRounds; ++Index) {
+        while (SemaphoreArrivals < (LONG) (Index * SEMAPHORE_WAITERS)) {
+            UtYield();
+        }
+
+        UtReleaseSemaphore(&Semaphore, SEMAPHORE_WAITERS);
+    }
+}
+
+static
+VOID
+BenchmarkSemaphore (
+    )
+{
+    ULONG Index;
+
+    UtInitializeSemaphore(&Semaphore, 0, SEMAPHORE_WAITERS);
+    SemaphoreRounds = SEMAPHORE_OPERATIONS * Scale / SEMAPHORE_WAITERS;
+    SemaphoreArrivals = 0;
+
+    for (Index = 0; Index < SEMAPHORE_WAITERS; ++Index) {
+        UtCreate(SemaphoreWaiterThread, NULL);
+    }
+    UtCreate(SemaphoreReleaserThread, NULL);
+
+    RunBenchmark("semaphore_wake_many", SEMAPHORE_WAITERS + 1, 
+                 (ULONGLONG) SemaphoreRounds * SEMAPHORE_WAITERS);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Semaphore wake-up latency behind a busy ready queue		 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// The time from a release of the semaphore to the moment the waiter it satisfies runs,
+// while other threads keep the ready queue busy, with and without direct handoff. The 
+// time reported per operation is the average wake-up latency.
+//
+
+static ULONG WakeupRounds;
+static volatile BOOL WakeupWaiting;
+static volatile BOOL WakeupDone;
+static ULONGLONG WakeupReleaseTime;
+static ULONGLONG WakeupLatency;
+
+static
+VOID
+WakeupWaiterThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < WakeupRounds; ++Index) {
+        WakeupWaiting = TRUE;
+        UtAcquireSemaphore(&Semaphore, 1);
+        WakeupLatency += ReadNanoseconds() - WakeupReleaseTime;
+    }
+
+    WakeupDone = TRUE;
+}
+
+static
+VOID
+WakeupReleaserThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < WakeupRounds; ++Index) {
+        while (!WakeupWaiting) {
+            UtYield();
+        }
+
+        WakeupWaiting = FALSE;
+        WakeupReleaseTime = ReadNanoseconds();
+        UtReleaseSemaphore(&Semaphore, 1);
+    }
+}
+
+static
+VOID
+WakeupBusyThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (!WakeupDone) {
+        UtYield();
+    }
+}
+
+static
+VOID
+BenchmarkWakeup (
+    __in BOOL DirectHandoff
+    )
+{
+    ULONG Index;
+
+    UtInitializeSemaphoreEx(&Semaphore, 0, 1, DirectHandoff ? UT_SYNC_DIRECT_HANDOFF : 0);
+    WakeupRounds = WAKEUP_OPERATIONS * Scale;
+    WakeupWaiting = FALSE;
+    WakeupDone = FALSE;
+    WakeupLatency = 0;
+
+    UtCreate(WakeupWaiterThread, NULL);
+    for (Index = 0; Index < WAKEUP_READY_THREADS; ++Index) {
+        UtCreate(WakeupBusyThread, NULL);
+    }
+    UtCreate(WakeupReleaserThread, NULL);
+
+    UtRunEx(Workers);
+    ReportBenchmark(DirectHandoff ? "semaphore_wakeup_handoff" : "semaphore_wakeup", 
+                    WAKEUP_READY_THREADS + 2, WakeupRounds, (double) WakeupLatency);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// A semaphore as a byte-budget limiter, with mixed requests //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// Threads take permits from a budget, hold them across a sleep, as if waiting for I/O
+// on the budgeted buffers, and give them back, until the benchmark's time is up. The
+// operations are the permits granted. Under FIFO, a large request at the head of the 
+// wait list holds up the small ones queued behind it, and is itself starved by small 
+// requests that take the permits without queueing; the time large requests spend 
+// waiting for their permits shows whether they are served at all.
+//
+
+static ULONGLONG BudgetDeadline;
+static ULONGLONG BudgetPermits;
+static ULONGLONG BudgetLargeAcquisitions;
+static ULONGLONG BudgetLargeWait;
+
+static
+VOID
+BudgetThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Permits;
+    ULONGLONG Start;
+
+    Permits = (ULONG) (ULONG_PTR) Argument;
+
+    while ((Start = ReadNanoseconds()) < BudgetDeadline) {
+        UtAcquireSemaphore(&Semaphore, Permits);
+
+        if (Permits > BUDGET_PERMITS / 4) {
+            BudgetLargeWait += ReadNanoseconds() - Start;
+            BudgetLargeAcquisitions += 1;
+        }
+
+        BudgetPermits += Permits;
+        UtSleep(1);
+        UtReleaseSemaphore(&Semaphore, Permits);
+    }
+}
+
+static
+VOID
+BenchmarkBudget (
+    __in ULONG Flags
+    )
+{
+    ULONG Index;
+    char Name[64];
+    const char * Policy;
+    ULONGLONG Start;
+    ULONG Threads;
+
+    Policy = Flags == UT_SYNC_FIRST_FIT ? "first_fit" : Flags == UT_SYNC_BEST_FIT ? "best_fit" : "fifo";
+    Threads = BUDGET_SMALL_THREADS + BUDGET_LARGE_THREADS;
+    UtInitializeSemaphoreEx(&Semaphore, BUDGET_PERMITS, BUDGET_PERMITS, Flags);
+    BudgetPermits = BudgetLargeAcquisitions = BudgetLargeWait = 0;
+
+    for (Index = 0; Index < Threads; ++Index) {
+        UtCreate(BudgetThread, (UT_ARGUMENT) (ULONG_PTR) (Index < BUDGET_SMALL_THREADS 
+                                                          ? Index % 4 + 1 : BUDGET_LARGE_PERMITS));
+    }
+
+    Start = ReadNanoseconds();
+    BudgetDeadline = Start + (ULONGLONG) BUDGET_MILLISECONDS * Scale * 1000000;
+    UtRunEx(Workers);
+
+    sprintf(Name, "semaphore_budget_%s", Policy);
+    ReportBenchmark(Name, Threads, BudgetPermits, (double) (ReadNanoseconds() - Start));
+    sprintf(Name, "semaphore_budget_%s_large_wait", Policy);
+    ReportBenchmark(Name, BUDGET_LARGE_THREADS, BudgetLargeAcquisitions, (double) BudgetLargeWait);
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// The Test3 mailbox, and a channel in its place			 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// The mailbox of Test3: a message queue, a lock to ensure exclusive access 
+// and a semaphore to control the message queue.
+//
+
+typedef struct _MAILBOX {
+    UTHREAD_MUTEX Lock;      
+    UTHREAD_SEMAPHORE Semaphore;   
+    LIST_ENTRY MessageQueue;
+} MAILBOX, *PMAILBOX;
+
+typedef struct _MAILBOX_MESSAGE {
+    LIST_ENTRY QueueEntry;
+    PVOID Data;
+} MAILBOX_MESSAGE, *PMAILBOX_MESSAGE;
+
+static MAILBOX Mailbox;
+static UTHREAD_CHANNEL Channel;
+static PVOID ChannelBuffer[CHANNEL_CAPACITY];
+static ULONG MessagesPerProducer;
+
+static
+VOID
+MailboxPost (
+    __in PVOID Data
+    )
+{
+    PMAILBOX_MESSAGE Message;
+
+    Message = (PMAILBOX_MESSAGE) malloc(sizeof *Message);
+    _ASSERTE(Message != NULL);
+    Message->Data = Data;
+
+    UtAcquireMutex(&Mailbox.Lock);
+    UtYield();
+    InsertTailList(&Mailbox.MessageQueue, &Message->QueueEntry);
+    UtReleaseMutex(&Mailbox.Lock);
+
+    UtReleaseSemaphore(&Mailbox.Semaphore, 1);
+}
+
+static 
+PVOID
+MailboxWait (
+    )
+{
+    PVOID Data;
+    PMAILBOX_MESSAGE Message;
+
+    UtAcquireSemaphore(&Mailbox.Semaphore, 1);
+
+    UtAcquireMutex(&Mailbox.Lock);
+    UtYield();
+    Message = CONTAINING_RECORD(RemoveHeadList(&Mailbox.MessageQueue), MAILBOX_MESSAGE, QueueEntry);
+    UtReleaseMutex(&Mailbox.Lock);
+
+    Data = Message->Data;
+    free(Message);
+    return Data;
+}
+
+static
+VOID
+MailboxProducerThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < MessagesPerProducer; ++Index) {
+        MailboxPost((PVOID) (ULONG_PTR) (Index + 1));
+    }
+}
+
+static
+VOID
+MailboxConsumerThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+    ULONG Messages;
+
+    Messages = (ULONG) (ULONG_PTR) Argument;
+
+    for (Index = 0; Index < Messages; ++Index) {
+        MailboxWait();
+    }
+}
+
+static
+VOID
+ChannelProducerThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < MessagesPerProducer; ++Index) {
+        UtSendChannel(&Channel, (PVOID) (ULONG_PTR) (Index + 1));
+    }
+}
+
+static
+VOID
+ChannelConsumerThread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    PVOID Value;
+    ULONG Index;
+    ULONG Messages;
+
+    Messages = (ULONG) (ULONG_PTR) Argument;
+
+    for (Index = 0; Index < Messages; ++Index) {
+        UtReceiveChannel(&Channel, &Value);
+    }
+}
+
+static
+VOID
+BenchmarkMessaging (
+    __in BOOL UseChannel
+    )
+{
+    ULONG Index;
+    ULONG Messages;
+
+    MessagesPerProducer = MAILBOX_OPERATIONS * Scale / MAILBOX_PRODUCERS;
+    Messages = MessagesPerProducer * MAILBOX_PRODUCERS;
+
+    UtInitializeMutex(&Mailbox.Lock, FALSE);
+    UtInitializeSemaphore(&Mailbox.Semaphore, 0, Messages);
+    InitializeListHead(&Mailbox.MessageQueue);
+    UtInitializeChannel(&Channel, ChannelBuffer, CHANNEL_CAPACITY);
+
+    for (Index = 0; Index < MAILBOX_CONSUMERS; ++Index) {
+        UtCreate(UseChannel ? ChannelConsumerThread : MailboxConsumerThread, 
+                 (UT_ARGUMENT) (ULONG_PTR) (Messages / MAILBOX_CONSUMERS));
+    }
+
+    for (Index = 0; Index < MAILBOX_PRODUCERS; ++Index) {
+        UtCreate(UseChannel ? ChannelProducerThread : MailboxProducerThread, NULL);
+    }
+
+    RunBenchmark(UseChannel ? "channel" : "mailbox", MAILBOX_PRODUCERS + MAILBOX_CONSUMERS, Messages);
+}
+
+int
+__cdecl
+main (
+    __in int argc,
+    __in_ecount(argc) PCHAR argv[]
+    )
+{
+    ULONG Index;
+
+    if (argc > 1 && (Workers = (ULONG) atoi(argv[1])) == 0) {
+        Workers = 1;
+    }
+
+    if (argc > 2 && (Scale = (ULONG) atoi(argv[2])) == 0) {
+        Scale = 1;
+    }
+
+    printf("{\n  \"workers\": %u,\n  \"scale\": %u,\n  \"benchmarks\": [\n", Workers, Scale);
+
+    for (Index = 0; Index < sizeof(YieldThreads) / sizeof(YieldThreads[0]); ++Index) {
+        BenchmarkYield(YieldThreads[Index]);
+    }
+
+    BenchmarkSpawn();
+    BenchmarkPark();
+    BenchmarkMutex();
+    BenchmarkSemaphore();
+    BenchmarkWakeup(FALSE);
+    BenchmarkWakeup(TRUE);
+    BenchmarkBudget(0);
+    BenchmarkBudget(UT_SYNC_FIRST_FIT);
+    BenchmarkBudget(UT_SYNC_BEST_FIT);
+    BenchmarkMessaging(FALSE);
+    BenchmarkMessaging(TRUE);
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -16,7 +16,7 @@
 
 #pragma once
 
-#include <windows.h>
+#include "Platform.h"
 
 #ifndef CONTAINING_RECORD
 
@@ -151,3 +151,28 @@ InsertHeadList (
     Flink->Blink = Entry;
     ListHead->Flink = Entry;
 }
+
+//
+// Moves all the entries of the list headed by List to the tail of the list headed
+// by ListHead, in constant time, leaving List empty.
+//
+
+FORCEINLINE
+VOID
+SpliceTailList (
+    __inout PLIST_ENTRY ListHead,
+    __inout PLIST_ENTRY List
+    )
+{
+    PLIST_ENTRY First;
+    PLIST_ENTRY Last;
+
+    if ((First = List->Flink) != List) {
+        Last = List->Blink;
+        First->Blink = ListHead->Blink;
+        ListHead->Blink->Flink = First;
+        Last->Flink = ListHead;
+        ListHead->Blink = Last;
+        List->Flink = List->Blink = List;
+    }
+}
@@ -14,7 +14,6 @@
 // 
 // 
 
-#include <crtdbg.h>
 #include <stdio.h>
 #include "UThread.h"
 #include "SyncObjects.h"
@@ -36,7 +35,7 @@ Test1_Thread (
     UCHAR Char;
     ULONG Index;
     
-    Char = (UCHAR) Argument;	
+    Char = (UCHAR) (ULONG_PTR) Argument;	
 
     for (Index = 0; Index < 1000; ++Index) {
         putchar(Char);
@@ -62,7 +61,7 @@ Test1 (
     printf("\n :: Test 1 - BEGIN :: \n\n");
 
     for (Index = 0; Index < 10; ++Index) {
-        UtCreate(Test1_Thread, (UT_ARGUMENT) ('0' + Index));
+        UtCreate(Test1_Thread, (UT_ARGUMENT) (ULONG_PTR) ('0' + Index));
     }   
 
     UtRun();
@@ -387,6 +386,9 @@ Test3_FirstThread (
     )
 {
     MAILBOX Mailbox;
+    HANDLE Consumers[2];
+    HANDLE Producers[4];
+    ULONG Index;
 
     UNREFERENCED_PARAMETER(Argument);
 
@@ -395,23 +397,27 @@ Test3_FirstThread (
     Test3_CountProducers = 0;
     Test3_CountConsumers = 0;
 
-    UtCreate(Test3_ConsumerThread, &Mailbox);
-    UtCreate(Test3_ConsumerThread, &Mailbox);
-    UtCreate(Test3_ProducerThread, &Mailbox);
-    UtCreate(Test3_ProducerThread, &Mailbox);
-    UtCreate(Test3_ProducerThread, &Mailbox);
-    UtCreate(Test3_ProducerThread, &Mailbox);
+    for (Index = 0; Index < 2; ++Index) {
+        Consumers[Index] = UtCreateEx(Test3_ConsumerThread, &Mailbox, 0, UT_CREATE_JOINABLE);
+    }
+    for (Index = 0; Index < 4; ++Index) {
+        Producers[Index] = UtCreateEx(Test3_ProducerThread, &Mailbox, 0, UT_CREATE_JOINABLE);
+    }
 
-    do {
-        UtYield();
-    } while (Test3_CountProducers != 4);
+    for (Index = 0; Index < 4; ++Index) {
+        UtJoin(Producers[Index], NULL);
+    }
+
+    _ASSERTE(Test3_CountProducers == 4);
 
     Mailbox_Post(&Mailbox, TERMINATOR);
     Mailbox_Post(&Mailbox, TERMINATOR);
     
-    do {
-        UtYield();
-    } while (Test3_CountConsumers != 2);
+    for (Index = 0; Index < 2; ++Index) {
+        UtJoin(Consumers[Index], NULL);
+    }
+
+    _ASSERTE(Test3_CountConsumers == 2);
 }
 
 VOID
@@ -424,6 +430,3116 @@ Test3 (
     printf("\n-:: Test 3 -  END  ::-\n");
 }
 
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 4: Mutexes and semaphores on multiple workers		 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST4_WORKERS 4
+#define TEST4_THREADS 16
+#define TEST4_ITERATIONS 10000
+
+ULONG Test4_Count;
+volatile LONG Test4_Finished;
+
+VOID
+Test4_Thread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    PUTHREAD_MUTEX Mutex;
+    ULONG Count;
+    ULONG Index;
+
+    Mutex = (PUTHREAD_MUTEX) Argument;
+
+    for (Index = 0; Index < TEST4_ITERATIONS; ++Index) {
+        UtAcquireMutex(Mutex);
+
+        //
+        // Yield inside the critical section, so that the increment isn't atomic.
+        //
+
+        Count = Test4_Count;
+        UtYield();
+        Test4_Count = Count + 1;
+
+        UtReleaseMutex(Mutex);
+    }
+
+    InterlockedIncrement(&Test4_Finished);
+}
+
+//
+// Pairs of threads that unpark each other and then park, so that a thread is often
+// readied, and taken by another worker, before it has switched out.
+//
+
+#define TEST4_PAIRS 4
+#define TEST4_EXCHANGES 1000
+
+HANDLE Test4_Pingers[TEST4_PAIRS];
+volatile LONG Test4_Parking[TEST4_PAIRS];
+
+VOID
+Test4_Ponger (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Pair;
+    ULONG Index;
+
+    Pair = (ULONG) (ULONG_PTR) Argument;
+    Test4_Parking[Pair] = TRUE;
+
+    for (Index = 0; Index < TEST4_EXCHANGES; ++Index) {
+        UtPark();
+        UtUnpark(Test4_Pingers[Pair]);
+    }
+
+    InterlockedIncrement(&Test4_Finished);
+}
+
+VOID
+Test4_Pinger (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    HANDLE Ponger;
+    ULONG Pair;
+    ULONG Index;
+
+    Pair = (ULONG) (ULONG_PTR) Argument;
+    Test4_Pingers[Pair] = UtSelf();
+    Ponger = UtCreate(Test4_Ponger, (UT_ARGUMENT) (ULONG_PTR) Pair);
+
+    while (!Test4_Parking[Pair]) {
+        UtYield();
+    }
+
+    for (Index = 0; Index < TEST4_EXCHANGES; ++Index) {
+        UtUnpark(Ponger);
+        UtPark();
+    }
+
+    InterlockedIncrement(&Test4_Finished);
+}
+
+VOID
+Test4 (
+    ) 
+{
+    UTHREAD_MUTEX Mutex;
+    ULONG Index;
+
+    printf("\n-:: Test 4 - BEGIN ::-\n\n");
+
+    Test4_Count = 0;
+    Test4_Finished = 0;
+    UtInitializeMutex(&Mutex, FALSE);
+
+    for (Index = 0; Index < TEST4_THREADS; ++Index) {
+        UtCreate(Test4_Thread, &Mutex);
+    }
+
+    UtRunEx(TEST4_WORKERS);
+
+    _ASSERTE(Test4_Finished == TEST4_THREADS);
+    _ASSERTE(Test4_Count == TEST4_THREADS * TEST4_ITERATIONS);
+    printf("%d threads on %d workers counted to %d\n", TEST4_THREADS, TEST4_WORKERS, Test4_Count);
+
+    Test4_Finished = 0;
+    for (Index = 0; Index < TEST4_PAIRS; ++Index) {
+        Test4_Parking[Index] = FALSE;
+        UtCreate(Test4_Pinger, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+    UtRunEx(TEST4_WORKERS);
+
+    _ASSERTE(Test4_Finished == 2 * TEST4_PAIRS);
+    printf("%d pairs of threads unparked each other %d times\n", TEST4_PAIRS, TEST4_EXCHANGES);
+
+    printf("\n-:: Test 4 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 5: Unparking user threads from an OS thread			 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST5_THREADS 4
+#define TEST5_ROUNDS 1000
+
+HANDLE volatile Test5_Parked[TEST5_THREADS];
+volatile LONG Test5_Finished;
+ULONG Test5_Count;
+
+VOID
+Test5_Thread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Slot;
+    ULONG Round;
+
+    Slot = (ULONG) (ULONG_PTR) Argument;
+
+    for (Round = 0; Round < TEST5_ROUNDS; ++Round) {
+
+        //
+        // Publish our handle and park. The waker may unpark us before we park,
+        // in which case we are already in the inbound queue when we do.
+        //
+
+        InterlockedExchangePointer((PVOID volatile *) &Test5_Parked[Slot], UtSelf());
+        UtPark();
+        ++Test5_Count;
+    }
+
+    InterlockedIncrement(&Test5_Finished);
+}
+
+#if defined(_WIN32)
+DWORD
+WINAPI
+#else
+PVOID
+#endif
+Test5_Waker (
+    __in PVOID Argument
+    )
+{
+    HANDLE Thread;
+    ULONG Slot;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (Test5_Finished != TEST5_THREADS) {
+        for (Slot = 0; Slot < TEST5_THREADS; ++Slot) {
+            if ((Thread = InterlockedExchangePointer((PVOID volatile *) &Test5_Parked[Slot], NULL)) != NULL) {
+                UtUnpark(Thread);
+            }
+        }
+    }
+
+    return 0;
+}
+
+VOID
+Test5 (
+    ) 
+{
+    ULONG Index;
+#if defined(_WIN32)
+    HANDLE Waker;
+#else
+    pthread_t Waker;
+#endif
+
+    printf("\n-:: Test 5 - BEGIN ::-\n\n");
+
+    Test5_Count = 0;
+    Test5_Finished = 0;
+
+    for (Index = 0; Index < TEST5_THREADS; ++Index) {
+        UtCreate(Test5_Thread, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+#if defined(_WIN32)
+    Waker = CreateThread(NULL, 0, Test5_Waker, NULL, 0, NULL);
+    UtRun();
+    WaitForSingleObject(Waker, INFINITE);
+    CloseHandle(Waker);
+#else
+    pthread_create(&Waker, NULL, Test5_Waker, NULL);
+    UtRun();
+    pthread_join(Waker, NULL);
+#endif
+
+    _ASSERTE(Test5_Count == TEST5_THREADS * TEST5_ROUNDS);
+    printf("%d threads were unparked %d times from an OS thread\n", TEST5_THREADS, Test5_Count);
+
+    printf("\n-:: Test 5 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 6: Shutting down a scheduler with parked threads	 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST6_WORKERS 2
+#define TEST6_THREADS 4
+
+HANDLE volatile Test6_Parked[TEST6_THREADS];
+volatile LONG Test6_Count;
+
+VOID
+Test6_Thread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Slot;
+    ULONG Round;
+
+    Slot = (ULONG) (ULONG_PTR) Argument;
+
+    //
+    // Park twice: first until unparked by the waker, while the workers are blocked,
+    // and then until the scheduler is run again after being shut down.
+    //
+
+    for (Round = 0; Round < 2; ++Round) {
+        InterlockedExchangePointer((PVOID volatile *) &Test6_Parked[Slot], UtSelf());
+        UtPark();
+        InterlockedIncrement(&Test6_Count);
+    }
+}
+
+HANDLE
+Test6_TakeParked (
+    __in ULONG Slot
+    )
+{
+    HANDLE Thread;
+
+    while ((Thread = InterlockedExchangePointer((PVOID volatile *) &Test6_Parked[Slot], NULL)) == NULL) {
+        YieldProcessor();
+    }
+
+    return Thread;
+}
+
+#if defined(_WIN32)
+DWORD
+WINAPI
+#else
+PVOID
+#endif
+Test6_Waker (
+    __in PVOID Argument
+    )
+{
+    ULONG Slot;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Slot = 0; Slot < TEST6_THREADS; ++Slot) {
+#if defined(_WIN32)
+        Sleep(10);
+#else
+        usleep(10000);
+#endif
+        UtUnpark(Test6_TakeParked(Slot));
+    }
+
+    while (Test6_Count != TEST6_THREADS) {
+        YieldProcessor();
+    }
+
+    UtShutdown();
+    return 0;
+}
+
+VOID
+Test6 (
+    ) 
+{
+    ULONG Index;
+#if defined(_WIN32)
+    HANDLE Waker;
+#else
+    pthread_t Waker;
+#endif
+
+    printf("\n-:: Test 6 - BEGIN ::-\n\n");
+
+    Test6_Count = 0;
+
+    for (Index = 0; Index < TEST6_THREADS; ++Index) {
+        UtCreate(Test6_Thread, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+#if defined(_WIN32)
+    Waker = CreateThread(NULL, 0, Test6_Waker, NULL, 0, NULL);
+    UtRunEx(TEST6_WORKERS);
+    WaitForSingleObject(Waker, INFINITE);
+    CloseHandle(Waker);
+#else
+    pthread_create(&Waker, NULL, Test6_Waker, NULL);
+    UtRunEx(TEST6_WORKERS);
+    pthread_join(Waker, NULL);
+#endif
+
+    _ASSERTE(Test6_Count == TEST6_THREADS);
+    printf("the scheduler was shut down with %d threads parked\n", TEST6_THREADS);
+
+    //
+    // Unpark the remaining threads from outside the scheduler and run it again.
+    //
+
+    for (Index = 0; Index < TEST6_THREADS; ++Index) {
+        UtUnpark(Test6_TakeParked(Index));
+    }
+
+    UtRunEx(TEST6_WORKERS);
+
+    _ASSERTE(Test6_Count == 2 * TEST6_THREADS);
+    printf("the parked threads resumed when the scheduler ran again\n");
+
+    printf("\n-:: Test 6 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 7: Sleeping threads									 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST7_THREADS 1000
+
+ULONG Test7_Order[4];
+volatile LONG Test7_Count;
+volatile LONG Test7_Late;
+
+ULONG64
+Test7_Now (
+    )
+{
+#if defined(_WIN32)
+    return GetTickCount64();
+#else
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (ULONG64) Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+#endif
+}
+
+VOID
+Test7_Thread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Milliseconds;
+    ULONG64 Start;
+    LONG Count;
+
+    Milliseconds = (ULONG) (ULONG_PTR) Argument;
+
+    Start = Test7_Now();
+    UtSleep(Milliseconds);
+    
+    if (Test7_Now() - Start < Milliseconds) {
+        InterlockedIncrement(&Test7_Late);
+    }
+
+    if ((Count = InterlockedIncrement(&Test7_Count)) <= 4) {
+        Test7_Order[Count - 1] = Milliseconds;
+    }
+}
+
+VOID
+Test7 (
+    ) 
+{
+    ULONG Index;
+
+    printf("\n-:: Test 7 - BEGIN ::-\n\n");
+
+    //
+    // Threads wake up in the order of their deadlines, including the one that
+    // sleeps past the first level of the timer wheel.
+    //
+
+    Test7_Count = 0;
+    Test7_Late = 0;
+    UtCreate(Test7_Thread, (UT_ARGUMENT) 300);
+    UtCreate(Test7_Thread, (UT_ARGUMENT) 150);
+    UtCreate(Test7_Thread, (UT_ARGUMENT) 50);
+    UtCreate(Test7_Thread, (UT_ARGUMENT) 10);
+    UtRun();
+
+    _ASSERTE(Test7_Late == 0);
+    _ASSERTE(Test7_Order[0] == 10 && Test7_Order[1] == 50 && Test7_Order[2] == 150 && Test7_Order[3] == 300);
+    printf("threads woke up after %d, %d, %d and %d ms\n", 
+           Test7_Order[0], Test7_Order[1], Test7_Order[2], Test7_Order[3]);
+
+    //
+    // Many threads sleeping concurrently, on two workers.
+    //
+
+    Test7_Count = 0;
+    for (Index = 0; Index < TEST7_THREADS; ++Index) {
+        UtCreate(Test7_Thread, (UT_ARGUMENT) (ULONG_PTR) (1 + (Index * 7919) % 400));
+    }
+
+    UtRunEx(2);
+
+    _ASSERTE(Test7_Late == 0);
+    printf("%d threads slept concurrently\n", Test7_Count);
+
+    printf("\n-:: Test 7 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 8: Acquiring mutexes and semaphores with timeouts	 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST8_THREADS 8
+#define TEST8_ROUNDS 2000
+
+UTHREAD_MUTEX Test8_Mutex;
+UTHREAD_SEMAPHORE Test8_Semaphore;
+ULONG Test8_Step;
+volatile LONG Test8_Acquired;
+volatile LONG Test8_Released;
+volatile LONG Test8_InUse;
+LONG Test8_Inside;
+
+VOID
+Test8_Owner (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireMutex(&Test8_Mutex);
+    UtSleep(100);
+    UtReleaseMutex(&Test8_Mutex);
+}
+
+VOID
+Test8_Waiter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    BOOL Acquired;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Acquired = UtTryAcquireMutex(&Test8_Mutex);
+    _ASSERTE(!Acquired);
+    Acquired = UtAcquireMutexTimeout(&Test8_Mutex, 20);
+    _ASSERTE(!Acquired);
+    Acquired = UtAcquireMutexTimeout(&Test8_Mutex, 1000);
+    _ASSERTE(Acquired);
+    Acquired = UtTryAcquireMutex(&Test8_Mutex);
+    _ASSERTE(Acquired);
+    UtReleaseMutex(&Test8_Mutex);
+    UtReleaseMutex(&Test8_Mutex);
+    Test8_Step += 1;
+}
+
+VOID
+Test8_LargeRequest (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    BOOL Acquired;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Acquired = UtAcquireSemaphoreTimeout(&Test8_Semaphore, 5, 30);
+    _ASSERTE(!Acquired);
+    Test8_Step += 1;
+}
+
+VOID
+Test8_SmallRequest (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireSemaphore(&Test8_Semaphore, 1);
+
+    //
+    // The large request ahead of this one must have given up first.
+    //
+
+    _ASSERTE(Test8_Step == 1);
+    Test8_Step += 1;
+}
+
+VOID
+Test8_Releaser (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    BOOL Acquired;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtReleaseSemaphore(&Test8_Semaphore, 2);
+    _ASSERTE(Test8_Step == 0);
+    Acquired = UtTryAcquireSemaphore(&Test8_Semaphore, 3);
+    _ASSERTE(!Acquired);
+}
+
+VOID
+Test8_Contender (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    LONG InUse;
+    ULONG Permits;
+
+    for (Index = 0; Index < TEST8_ROUNDS; ++Index) {
+        if (UtAcquireMutexTimeout(&Test8_Mutex, Index % 3)) {
+            _ASSERTE(Test8_Inside == 0);
+            Test8_Inside += 1;
+            UtYield();
+            Test8_Inside -= 1;
+            UtReleaseMutex(&Test8_Mutex);
+        }
+
+        Permits = 1 + (Index + (ULONG) (ULONG_PTR) Argument) % 3;
+        if (UtAcquireSemaphoreTimeout(&Test8_Semaphore, Permits, Index % 2)) {
+            InUse = InterlockedExchangeAdd(&Test8_InUse, (LONG) Permits) + (LONG) Permits;
+            _ASSERTE(InUse <= 4);
+            InterlockedIncrement(&Test8_Acquired);
+            UtYield();
+            InterlockedExchangeAdd(&Test8_InUse, -(LONG) Permits);
+            UtReleaseSemaphore(&Test8_Semaphore, Permits);
+        }
+
+        if ((Index % 64) == 0) {
+            UtSleep(1);
+        }
+    }
+}
+
+VOID
+Test8 (
+    ) 
+{
+    ULONG Index;
+
+    printf("\n-:: Test 8 - BEGIN ::-\n\n");
+
+    //
+    // A waiter that times out on a mutex and then acquires it.
+    //
+
+    Test8_Step = 0;
+    UtInitializeMutex(&Test8_Mutex, FALSE);
+    UtCreate(Test8_Owner, NULL);
+    UtCreate(Test8_Waiter, NULL);
+    UtRun();
+
+    _ASSERTE(Test8_Step == 1);
+    printf("the mutex waiter timed out and then acquired the mutex\n");
+
+    //
+    // A large semaphore request that times out lets the smaller one queued behind
+    // it be satisfied by the permits that are already available.
+    //
+
+    Test8_Step = 0;
+    UtInitializeSemaphore(&Test8_Semaphore, 0, 4);
+    UtCreate(Test8_LargeRequest, NULL);
+    UtCreate(Test8_SmallRequest, NULL);
+    UtCreate(Test8_Releaser, NULL);
+    UtRun();
+
+    _ASSERTE(Test8_Step == 2);
+    printf("the request behind the one that timed out was satisfied\n");
+
+    //
+    // Many threads contending with short timeouts, on four workers.
+    //
+
+    Test8_Acquired = 0;
+    Test8_InUse = 0;
+    Test8_Inside = 0;
+    UtInitializeMutex(&Test8_Mutex, FALSE);
+    UtInitializeSemaphore(&Test8_Semaphore, 4, 4);
+
+    for (Index = 0; Index < TEST8_THREADS; ++Index) {
+        UtCreate(Test8_Contender, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+    UtRunEx(4);
+
+    _ASSERTE(Test8_Mutex.Owner == NULL && IsListEmpty(&Test8_Mutex.WaitListHead));
+    _ASSERTE(Test8_Semaphore.Permits == 4 && IsListEmpty(&Test8_Semaphore.WaitListHead));
+    printf("%d semaphore acquisitions with timeouts by %d threads\n", Test8_Acquired, TEST8_THREADS);
+
+    printf("\n-:: Test 8 -  END  ::-\n");
+}
+
+#if !defined(_WIN32)
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 9: Blocking I/O through the reactor					 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "Reactor.h"
+
+#define TEST9_PAIRS 64
+#define TEST9_ROUNDS 100
+#define TEST9_BYTES (4 * 1024 * 1024)
+#define TEST9_ACCEPTORS 8
+
+volatile LONG Test9_Rounds;
+volatile LONG Test9_Accepted;
+ULONG Test9_Received;
+struct sockaddr_in Test9_Address;
+int Test9_Listener;
+
+VOID
+Test9_Pinger (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    int Descriptor;
+    ULONG Index;
+    LONG_PTR Result;
+    ULONG Value;
+
+    Descriptor = (int) (ULONG_PTR) Argument;
+
+    for (Index = 0; Index < TEST9_ROUNDS; ++Index) {
+        Result = UtWrite(Descriptor, &Index, sizeof(Index));
+        _ASSERTE(Result == sizeof(Index));
+        Result = UtRead(Descriptor, &Value, sizeof(Value));
+        _ASSERTE(Result == sizeof(Value) && Value == Index + 1);
+        InterlockedIncrement(&Test9_Rounds);
+    }
+
+    UtClose(Descriptor);
+}
+
+VOID
+Test9_Ponger (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    int Descriptor;
+    LONG_PTR Result;
+    ULONG Value;
+
+    Descriptor = (int) (ULONG_PTR) Argument;
+
+    while (UtRead(Descriptor, &Value, sizeof(Value)) == sizeof(Value)) {
+        Value += 1;
+        Result = UtWrite(Descriptor, &Value, sizeof(Value));
+        _ASSERTE(Result == sizeof(Value));
+    }
+
+    UtClose(Descriptor);
+}
+
+VOID
+Test9_Server (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UCHAR Buffer[4096];
+    int Connection;
+    LONG_PTR Result;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Connection = UtAccept(Test9_Listener, NULL, NULL);
+    _ASSERTE(Connection >= 0);
+
+    while ((Result = UtRead(Connection, Buffer, sizeof(Buffer))) > 0) {
+        Test9_Received += (ULONG) Result;
+    }
+
+    UtClose(Connection);
+    UtClose(Test9_Listener);
+}
+
+VOID
+Test9_Client (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    static UCHAR Buffer[64 * 1024];
+    int Descriptor;
+    LONG_PTR Result;
+    ULONG Sent;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    _ASSERTE(Descriptor >= 0);
+    Result = UtConnect(Descriptor, (struct sockaddr *) &Test9_Address, sizeof(Test9_Address));
+    _ASSERTE(Result == 0);
+
+    for (Sent = 0; Sent < TEST9_BYTES; Sent += (ULONG) Result) {
+        Result = UtWrite(Descriptor, Buffer, TEST9_BYTES - Sent < sizeof(Buffer) ? TEST9_BYTES - Sent : sizeof(Buffer));
+        _ASSERTE(Result > 0);
+    }
+
+    UtClose(Descriptor);
+}
+
+VOID
+Test9_Acceptor (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    int Connection;
+    LONG_PTR Result;
+    ULONG Value;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Connection = UtAccept(Test9_Listener, NULL, NULL);
+    _ASSERTE(Connection >= 0);
+    Result = UtRead(Connection, &Value, sizeof(Value));
+    _ASSERTE(Result == sizeof(Value));
+    InterlockedIncrement(&Test9_Accepted);
+    UtClose(Connection);
+}
+
+VOID
+Test9_Connector (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    int Descriptor;
+    LONG_PTR Result;
+    ULONG Value;
+
+    Value = (ULONG) (ULONG_PTR) Argument;
+    Descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    _ASSERTE(Descriptor >= 0);
+    Result = UtConnect(Descriptor, (struct sockaddr *) &Test9_Address, sizeof(Test9_Address));
+    _ASSERTE(Result == 0);
+    Result = UtWrite(Descriptor, &Value, sizeof(Value));
+    _ASSERTE(Result == sizeof(Value));
+    UtClose(Descriptor);
+}
+
+VOID
+Test9_Listen (
+    )
+{
+    socklen_t Length;
+    int Result;
+
+    Test9_Listener = socket(AF_INET, SOCK_STREAM, 0);
+    _ASSERTE(Test9_Listener >= 0);
+
+    memset(&Test9_Address, 0, sizeof(Test9_Address));
+    Test9_Address.sin_family = AF_INET;
+    Test9_Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Length = sizeof(Test9_Address);
+    Result = bind(Test9_Listener, (struct sockaddr *) &Test9_Address, sizeof(Test9_Address));
+    _ASSERTE(Result == 0);
+    Result = listen(Test9_Listener, 16);
+    _ASSERTE(Result == 0);
+    Result = getsockname(Test9_Listener, (struct sockaddr *) &Test9_Address, &Length);
+    _ASSERTE(Result == 0);
+}
+
+VOID
+Test9 (
+    ) 
+{
+    int Descriptors[2];
+    ULONG Index;
+    int Result;
+
+    printf("\n-:: Test 9 - BEGIN ::-\n\n");
+
+    //
+    // Pairs of threads exchanging messages through socket pairs, on two workers.
+    //
+
+    Test9_Rounds = 0;
+    for (Index = 0; Index < TEST9_PAIRS; ++Index) {
+        Result = socketpair(AF_UNIX, SOCK_STREAM, 0, Descriptors);
+        _ASSERTE(Result == 0);
+        UtCreate(Test9_Pinger, (UT_ARGUMENT) (ULONG_PTR) Descriptors[0]);
+        UtCreate(Test9_Ponger, (UT_ARGUMENT) (ULONG_PTR) Descriptors[1]);
+    }
+
+    UtRunEx(2);
+
+    _ASSERTE(Test9_Rounds == TEST9_PAIRS * TEST9_ROUNDS);
+    printf("%d threads made %d round trips through socket pairs\n", 2 * TEST9_PAIRS, Test9_Rounds);
+
+    //
+    // A client streaming data to a server over a loopback connection, with writes
+    // that block when the socket buffers fill up.
+    //
+
+    Test9_Received = 0;
+    Test9_Listen();
+
+    UtCreate(Test9_Server, NULL);
+    UtCreate(Test9_Client, NULL);
+    UtRun();
+
+    _ASSERTE(Test9_Received == TEST9_BYTES);
+    printf("the server received %d bytes over loopback\n", Test9_Received);
+
+    //
+    // Several threads blocked accepting connections on the same listening socket, on 
+    // two workers.
+    //
+
+    Test9_Accepted = 0;
+    Test9_Listen();
+
+    for (Index = 0; Index < TEST9_ACCEPTORS; ++Index) {
+        UtCreate(Test9_Acceptor, NULL);
+    }
+
+    for (Index = 0; Index < TEST9_ACCEPTORS; ++Index) {
+        UtCreate(Test9_Connector, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+    UtRunEx(2);
+    UtClose(Test9_Listener);
+
+    _ASSERTE(Test9_Accepted == TEST9_ACCEPTORS);
+    printf("%d threads accepted connections on one listening socket\n", Test9_Accepted);
+
+    printf("\n-:: Test 9 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 10: File I/O through io_uring						 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <fcntl.h>
+#include "Uring.h"
+
+#define TEST10_THREADS 1000
+#define TEST10_RECORDS 16
+#define TEST10_RECORD_SIZE 64
+
+char Test10_Path[] = "/tmp/UThreadTest10XXXXXX";
+int Test10_File;
+volatile LONG Test10_Written;
+volatile LONG Test10_Verified;
+
+VOID
+Test10_Writer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UCHAR Record[TEST10_RECORD_SIZE];
+    ULONG Index;
+    ULONG Number;
+    LONG_PTR Result;
+
+    Number = (ULONG) (ULONG_PTR) Argument;
+
+    for (Index = 0; Index < TEST10_RECORDS; ++Index) {
+        memset(Record, (UCHAR) (Number + Index), sizeof(Record));
+        Result = UtWriteAt(Test10_File, Record, sizeof(Record), 
+                           ((LONGLONG) Number * TEST10_RECORDS + Index) * TEST10_RECORD_SIZE);
+        _ASSERTE(Result == sizeof(Record));
+        InterlockedIncrement(&Test10_Written);
+    }
+}
+
+VOID
+Test10_Reader (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UCHAR Record[TEST10_RECORD_SIZE];
+    int File;
+    ULONG Index;
+    ULONG Number;
+    LONG_PTR Result;
+
+    Number = (ULONG) (ULONG_PTR) Argument;
+
+    File = UtOpenAt(AT_FDCWD, Test10_Path, O_RDONLY, 0);
+    _ASSERTE(File >= 0);
+
+    for (Index = 0; Index < TEST10_RECORDS; ++Index) {
+        Result = UtReadAt(File, Record, sizeof(Record), 
+                          ((LONGLONG) Number * TEST10_RECORDS + Index) * TEST10_RECORD_SIZE);
+        _ASSERTE(Result == sizeof(Record));
+        _ASSERTE(Record[0] == (UCHAR) (Number + Index) && Record[TEST10_RECORD_SIZE - 1] == Record[0]);
+    }
+
+    close(File);
+    InterlockedIncrement(&Test10_Verified);
+}
+
+VOID
+Test10_Syncer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    int Result;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Result = UtFsync(Test10_File, TRUE);
+    _ASSERTE(Result == 0);
+    Result = UtFsync(-1, FALSE);
+    _ASSERTE(Result == -1 && errno == EBADF);
+}
+
+VOID
+Test10 (
+    ) 
+{
+    ULONG Index;
+
+    printf("\n-:: Test 10 - BEGIN ::-\n\n");
+
+    Test10_File = mkstemp(Test10_Path);
+    _ASSERTE(Test10_File >= 0);
+
+    //
+    // Many threads making small writes to the same file, on two workers.
+    //
+
+    Test10_Written = 0;
+    for (Index = 0; Index < TEST10_THREADS; ++Index) {
+        UtCreate(Test10_Writer, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+    UtRunEx(2);
+
+    _ASSERTE(Test10_Written == TEST10_THREADS * TEST10_RECORDS);
+    printf("%d threads made %d writes\n", TEST10_THREADS, Test10_Written);
+
+    //
+    // Sync the file, and read the records back through separately opened descriptors.
+    //
+
+    Test10_Verified = 0;
+    UtCreate(Test10_Syncer, NULL);
+    for (Index = 0; Index < TEST10_THREADS; ++Index) {
+        UtCreate(Test10_Reader, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+
+    UtRun();
+
+    _ASSERTE(Test10_Verified == TEST10_THREADS);
+    printf("%d threads read their records back\n", Test10_Verified);
+
+    close(Test10_File);
+    unlink(Test10_Path);
+
+    printf("\n-:: Test 10 -  END  ::-\n");
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 11: Condition variables and events					 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST11_WAITERS 16
+#define TEST11_ITEMS 20000
+#define TEST11_CAPACITY 8
+#define TEST11_PRODUCERS 4
+
+UTHREAD_MUTEX Test11_Mutex;
+UTHREAD_CONDITION Test11_Condition;
+UTHREAD_CONDITION Test11_NotFull;
+UTHREAD_EVENT Test11_Event;
+BOOL Test11_Ready;
+ULONG Test11_Woken;
+ULONG Test11_Buffer[TEST11_CAPACITY];
+ULONG Test11_Count;
+ULONG Test11_Consumed;
+ULONGLONG Test11_Sum;
+
+VOID
+Test11_Waiter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UtAcquireMutex(&Test11_Mutex);
+    UtAcquireMutex(&Test11_Mutex);
+
+    while (!Test11_Ready) {
+        UtWaitCondition(&Test11_Condition, &Test11_Mutex);
+    }
+
+    //
+    // The waiters acquire the mutex in the order in which they started waiting, 
+    // and with their previous recursion count.
+    //
+
+    _ASSERTE(Test11_Woken == (ULONG) (ULONG_PTR) Argument);
+    _ASSERTE(Test11_Mutex.RecursionCounter == 2);
+    Test11_Woken += 1;
+    UtYield();
+
+    UtReleaseMutex(&Test11_Mutex);
+    UtReleaseMutex(&Test11_Mutex);
+}
+
+VOID
+Test11_Broadcaster (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireMutex(&Test11_Mutex);
+    Test11_Ready = TRUE;
+    UtBroadcastCondition(&Test11_Condition);
+
+    //
+    // All the waiters were moved to the wait list of the mutex, rather than unparked.
+    //
+
+    _ASSERTE(IsListEmpty(&Test11_Condition.WaitListHead));
+    _ASSERTE(!IsListEmpty(&Test11_Mutex.WaitListHead));
+    UtYield();
+    _ASSERTE(Test11_Woken == 0);
+
+    UtReleaseMutex(&Test11_Mutex);
+}
+
+VOID
+Test11_Producer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+
+    for (Index = (ULONG) (ULONG_PTR) Argument; Index < TEST11_ITEMS; Index += TEST11_PRODUCERS) {
+        UtAcquireMutex(&Test11_Mutex);
+
+        while (Test11_Count == TEST11_CAPACITY) {
+            UtWaitCondition(&Test11_NotFull, &Test11_Mutex);
+        }
+
+        Test11_Buffer[Test11_Count++] = Index;
+        UtSignalCondition(&Test11_Condition);
+        UtReleaseMutex(&Test11_Mutex);
+    }
+}
+
+VOID
+Test11_Consumer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireMutex(&Test11_Mutex);
+
+    while (Test11_Consumed < TEST11_ITEMS) {
+        if (Test11_Count == 0) {
+            UtWaitCondition(&Test11_Condition, &Test11_Mutex);
+            continue;
+        }
+
+        Test11_Sum += Test11_Buffer[--Test11_Count];
+        Test11_Consumed += 1;
+        UtSignalCondition(&Test11_NotFull);
+
+        if (Test11_Consumed == TEST11_ITEMS) {
+            UtBroadcastCondition(&Test11_Condition);
+        }
+    }
+
+    UtReleaseMutex(&Test11_Mutex);
+}
+
+VOID
+Test11_EventWaiter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtWaitForEvent(&Test11_Event);
+    InterlockedIncrement((volatile LONG *) &Test11_Woken);
+}
+
+VOID
+Test11_EventSetter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    if (Test11_Event.ManualReset) {
+        UtSetEvent(&Test11_Event);
+        UtResetEvent(&Test11_Event);
+        UtYield();
+        _ASSERTE(Test11_Woken == TEST11_WAITERS);
+        return;
+    }
+
+    //
+    // Each set of an auto-reset event releases a single waiter.
+    //
+
+    for (Index = 1; Index <= TEST11_WAITERS; ++Index) {
+        UtSetEvent(&Test11_Event);
+        UtYield();
+        _ASSERTE(Test11_Woken == Index);
+    }
+}
+
+VOID
+Test11 (
+    ) 
+{
+    ULONG Index;
+    ULONG Waiter;
+
+    printf("\n-:: Test 11 - BEGIN ::-\n\n");
+
+    //
+    // A broadcast requeues the waiters on the mutex, which they acquire in order.
+    //
+
+    Test11_Ready = FALSE;
+    Test11_Woken = 0;
+    UtInitializeMutex(&Test11_Mutex, FALSE);
+    UtInitializeCondition(&Test11_Condition);
+
+    for (Index = 0; Index < TEST11_WAITERS; ++Index) {
+        UtCreate(Test11_Waiter, (UT_ARGUMENT) (ULONG_PTR) Index);
+    }
+    UtCreate(Test11_Broadcaster, NULL);
+
+    UtRun();
+
+    _ASSERTE(Test11_Woken == TEST11_WAITERS);
+    printf("%d waiters woken by a broadcast acquired the mutex in order\n", Test11_Woken);
+
+    //
+    // A bounded buffer with producers and consumers, on four workers.
+    //
+
+    Test11_Count = 0;
+    Test11_Consumed = 0;
+    Test11_Sum = 0;
+    UtInitializeMutex(&Test11_Mutex, FALSE);
+    UtInitializeCondition(&Test11_Condition);
+    UtInitializeCondition(&Test11_NotFull);
+
+    for (Index = 0; Index < TEST11_PRODUCERS; ++Index) {
+        UtCreate(Test11_Producer, (UT_ARGUMENT) (ULONG_PTR) Index);
+        UtCreate(Test11_Consumer, NULL);
+    }
+
+    UtRunEx(4);
+
+    _ASSERTE(Test11_Sum == (ULONGLONG) TEST11_ITEMS * (TEST11_ITEMS - 1) / 2);
+    _ASSERTE(IsListEmpty(&Test11_Condition.WaitListHead) && IsListEmpty(&Test11_NotFull.WaitListHead));
+    printf("%d items went through the bounded buffer\n", Test11_Consumed);
+
+    //
+    // Setting a manual-reset event releases all the waiters, and setting an 
+    // auto-reset event releases one at a time.
+    //
+
+    for (Index = 0; Index < 2; ++Index) {
+        Test11_Woken = 0;
+        UtInitializeEvent(&Test11_Event, Index == 0, FALSE);
+
+        for (Waiter = 0; Waiter < TEST11_WAITERS; ++Waiter) {
+            UtCreate(Test11_EventWaiter, NULL);
+        }
+        UtCreate(Test11_EventSetter, NULL);
+
+        UtRun();
+
+        _ASSERTE(Test11_Woken == TEST11_WAITERS && !Test11_Event.Signalled);
+    }
+
+    printf("the events released their waiters\n");
+
+    printf("\n-:: Test 11 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 12: Reader-writer locks								 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST12_READERS 8
+#define TEST12_THREADS 32
+#define TEST12_ROUNDS 2000
+
+UTHREAD_RWLOCK Test12_RWLock;
+ULONG Test12_Order[TEST12_READERS + 1];
+ULONG Test12_Step;
+volatile LONG Test12_ReadersInside;
+volatile LONG Test12_WritersInside;
+LONG Test12_Value;
+
+VOID
+Test12_Reader (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UtAcquireRWLockShared(&Test12_RWLock);
+    Test12_Order[Test12_Step++] = (ULONG) (ULONG_PTR) Argument;
+    UtYield();
+    UtReleaseRWLockShared(&Test12_RWLock);
+}
+
+VOID
+Test12_Writer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UtAcquireRWLockExclusive(&Test12_RWLock);
+    UtAcquireRWLockExclusive(&Test12_RWLock);
+    Test12_Order[Test12_Step++] = (ULONG) (ULONG_PTR) Argument;
+    UtYield();
+    UtReleaseRWLockExclusive(&Test12_RWLock);
+    UtReleaseRWLockExclusive(&Test12_RWLock);
+}
+
+VOID
+Test12_Owner (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    //
+    // Queue the readers, then a writer, behind the current thread.
+    //
+
+    UtAcquireRWLockExclusive(&Test12_RWLock);
+
+    for (Index = 0; Index < TEST12_READERS; ++Index) {
+        UtCreate(Test12_Reader, (UT_ARGUMENT) (ULONG_PTR) 'R');
+    }
+    UtCreate(Test12_Writer, (UT_ARGUMENT) (ULONG_PTR) 'W');
+    UtYield();
+
+    UtReleaseRWLockExclusive(&Test12_RWLock);
+}
+
+VOID
+Test12_RecursiveReader (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    BOOL Acquired;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireRWLockShared(&Test12_RWLock);
+    UtYield();
+
+    //
+    // A writer is now waiting, but the recursive acquisition must not block.
+    //
+
+    _ASSERTE(!IsListEmpty(&Test12_RWLock.WriterWaitListHead));
+    Acquired = UtTryAcquireRWLockExclusive(&Test12_RWLock);
+    _ASSERTE(!Acquired);
+    UtAcquireRWLockShared(&Test12_RWLock);
+    Test12_Step += 1;
+    UtReleaseRWLockShared(&Test12_RWLock);
+    UtReleaseRWLockShared(&Test12_RWLock);
+}
+
+VOID
+Test12_Contender (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    LONG Inside;
+
+    for (Index = 0; Index < TEST12_ROUNDS; ++Index) {
+        if (((Index + (ULONG) (ULONG_PTR) Argument) % 8) == 0) {
+            UtAcquireRWLockExclusive(&Test12_RWLock);
+            Inside = InterlockedIncrement(&Test12_WritersInside);
+            _ASSERTE(Inside == 1 && Test12_ReadersInside == 0);
+            Test12_Value += 1;
+            UtYield();
+            InterlockedDecrement(&Test12_WritersInside);
+            UtReleaseRWLockExclusive(&Test12_RWLock);
+        } else {
+            UtAcquireRWLockShared(&Test12_RWLock);
+            InterlockedIncrement(&Test12_ReadersInside);
+            _ASSERTE(Test12_WritersInside == 0);
+            UtYield();
+            InterlockedDecrement(&Test12_ReadersInside);
+            UtReleaseRWLockShared(&Test12_RWLock);
+        }
+    }
+}
+
+VOID
+Test12 (
+    ) 
+{
+    ULONG Index;
+    RWLOCK_POLICY Policy;
+
+    printf("\n-:: Test 12 - BEGIN ::-\n\n");
+
+    for (Policy = RWLockReaderPreference; Policy <= RWLockPhaseFair; ++Policy) {
+
+        //
+        // When the writer releases the lock, the readers are admitted in a batch,
+        // unless writers are preferred.
+        //
+
+        Test12_Step = 0;
+        UtInitializeRWLock(&Test12_RWLock, Policy);
+        UtCreate(Test12_Owner, NULL);
+        UtRun();
+
+        _ASSERTE(Test12_Step == TEST12_READERS + 1);
+        printf("policy %d: ", Policy);
+        for (Index = 0; Index < Test12_Step; ++Index) {
+            putchar(Test12_Order[Index]);
+        }
+        putchar('\n');
+
+        _ASSERTE(Test12_Order[Policy == RWLockWriterPreference ? 0 : TEST12_READERS] == 'W');
+
+        //
+        // A recursive shared acquisition succeeds while a writer is waiting.
+        //
+
+        Test12_Step = 0;
+        UtInitializeRWLock(&Test12_RWLock, Policy);
+        UtCreate(Test12_RecursiveReader, NULL);
+        UtCreate(Test12_Writer, (UT_ARGUMENT) (ULONG_PTR) 'W');
+        UtRun();
+
+        _ASSERTE(Test12_Step == 2);
+
+        //
+        // Many readers and a few writers, on four workers.
+        //
+
+        Test12_Value = 0;
+        UtInitializeRWLock(&Test12_RWLock, Policy);
+
+        for (Index = 0; Index < TEST12_THREADS; ++Index) {
+            UtCreate(Test12_Contender, (UT_ARGUMENT) (ULONG_PTR) Index);
+        }
+
+        UtRunEx(4);
+
+        _ASSERTE(Test12_Value == TEST12_THREADS * TEST12_ROUNDS / 8);
+        _ASSERTE(Test12_RWLock.Readers == 0 && Test12_RWLock.Writer == NULL);
+    }
+
+    printf("%d writes among reads under each policy\n", Test12_Value);
+
+    printf("\n-:: Test 12 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 13: Channels										 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST13_PRODUCERS 4
+#define TEST13_CONSUMERS 2
+#define TEST13_MESSAGES 20000
+#define TEST13_CAPACITY 16
+
+UTHREAD_CHANNEL Test13_Channel;
+PVOID Test13_Buffer[TEST13_CAPACITY];
+volatile LONG Test13_ActiveProducers;
+volatile LONG Test13_Received;
+volatile LONG Test13_Sum;
+
+VOID
+Test13_Producer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    BOOL Sent;
+
+    for (Index = (ULONG) (ULONG_PTR) Argument; Index < TEST13_MESSAGES; Index += TEST13_PRODUCERS) {
+        if (!UtSendChannel(&Test13_Channel, (PVOID) (ULONG_PTR) (Index + 1))) {
+            _ASSERTE(!"the channel was closed early");
+        }
+    }
+
+    //
+    // The last producer to finish closes the channel, which ends the consumers.
+    //
+
+    if (InterlockedDecrement(&Test13_ActiveProducers) == 0) {
+        UtCloseChannel(&Test13_Channel);
+        Sent = UtSendChannel(&Test13_Channel, NULL);
+        _ASSERTE(!Sent);
+    }
+}
+
+VOID
+Test13_Consumer (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    PVOID Value;
+    LONG Sum;
+    LONG Received;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Sum = 0;
+    Received = 0;
+
+    while (UtReceiveChannel(&Test13_Channel, &Value)) {
+        Sum += (LONG) (ULONG_PTR) Value;
+        Received += 1;
+    }
+
+    InterlockedExchangeAdd(&Test13_Received, Received);
+    InterlockedExchangeAdd(&Test13_Sum, Sum);
+}
+
+VOID
+Test13 (
+    ) 
+{
+    ULONG Capacity;
+    ULONG Index;
+    ULONG Workers;
+
+    printf("\n-:: Test 13 - BEGIN ::-\n\n");
+
+    //
+    // Producers and consumers on one and on four workers, through a buffered channel
+    // and through one without buffer, where every send is a direct handoff.
+    //
+
+    for (Workers = 1; Workers <= 4; Workers += 3) {
+        for (Capacity = 0; Capacity <= TEST13_CAPACITY; Capacity += TEST13_CAPACITY) {
+            Test13_ActiveProducers = TEST13_PRODUCERS;
+            Test13_Received = 0;
+            Test13_Sum = 0;
+            UtInitializeChannel(&Test13_Channel, Test13_Buffer, Capacity);
+
+            for (Index = 0; Index < TEST13_CONSUMERS; ++Index) {
+                UtCreate(Test13_Consumer, NULL);
+            }
+            for (Index = 0; Index < TEST13_PRODUCERS; ++Index) {
+                UtCreate(Test13_Producer, (UT_ARGUMENT) (ULONG_PTR) Index);
+            }
+
+            UtRunEx(Workers);
+
+            _ASSERTE(Test13_Received == TEST13_MESSAGES);
+            _ASSERTE(Test13_Sum == TEST13_MESSAGES / 2 * (TEST13_MESSAGES + 1));
+            _ASSERTE(Test13_Channel.Count == 0);
+            printf("%d messages through a channel of capacity %d on %d workers\n", 
+                   Test13_Received, Capacity, Workers);
+        }
+    }
+
+    printf("\n-:: Test 13 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 14: Joinable threads								 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST14_THREADS 1000
+
+volatile LONG Test14_Detached;
+
+VOID
+Test14_Child (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Yields;
+
+    //
+    // Exit either by returning, with a NULL exit value, or with twice the argument.
+    //
+
+    for (Yields = (ULONG) (ULONG_PTR) Argument % 4; Yields > 0; --Yields) {
+        UtYield();
+    }
+
+    if (((ULONG_PTR) Argument % 2) == 0) {
+        UtExitEx((PVOID) ((ULONG_PTR) Argument * 2));
+    }
+}
+
+VOID
+Test14_DetachedChild (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtYield();
+    InterlockedIncrement(&Test14_Detached);
+}
+
+VOID
+Test14_Parent (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    HANDLE Children[TEST14_THREADS];
+    PVOID ExitValue;
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < TEST14_THREADS; ++Index) {
+        Children[Index] = UtCreateEx(Test14_Child, (UT_ARGUMENT) (ULONG_PTR) Index, 0, UT_CREATE_JOINABLE);
+    }
+
+    //
+    // Some of the children have exited by the time they are joined, others haven't.
+    //
+
+    UtYield();
+
+    for (Index = 0; Index < TEST14_THREADS; ++Index) {
+        UtJoin(Children[Index], &ExitValue);
+        _ASSERTE((ULONG_PTR) ExitValue == ((Index % 2) == 0 ? Index * 2 : 0));
+    }
+
+    //
+    // Joinable threads that are detached before and after exiting.
+    //
+
+    Children[0] = UtCreateEx(Test14_DetachedChild, NULL, 0, UT_CREATE_JOINABLE);
+    Children[1] = UtCreateEx(Test14_DetachedChild, NULL, 0, UT_CREATE_JOINABLE);
+    UtDetach(Children[0]);
+
+    while (Test14_Detached != 2) {
+        UtYield();
+    }
+
+    UtDetach(Children[1]);
+}
+
+VOID
+Test14 (
+    ) 
+{
+    ULONG Workers;
+
+    printf("\n-:: Test 14 - BEGIN ::-\n\n");
+
+    for (Workers = 1; Workers <= 4; Workers += 3) {
+        Test14_Detached = 0;
+        UtCreate(Test14_Parent, NULL);
+        UtRunEx(Workers);
+        printf("%d threads joined on %d workers\n", TEST14_THREADS, Workers);
+    }
+
+    printf("\n-:: Test 14 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 15: Runtime counters								 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST15_YIELDERS 64
+#define TEST15_ROUNDS 5
+
+UT_THREAD_STATS Test15_HogStats;
+UT_THREAD_STATS Test15_SleeperStats;
+
+VOID
+Test15_Hog (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Round;
+    volatile ULONG Spin;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST15_ROUNDS; ++Round) {
+        for (Spin = 0; Spin < 2000000; ++Spin) {
+        }
+
+        UtYield();
+    }
+
+    UtGetThreadStats(UtSelf(), &Test15_HogStats);
+}
+
+VOID
+Test15_Sleeper (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST15_ROUNDS; ++Round) {
+        UtSleep(10);
+    }
+
+    UtGetThreadStats(UtSelf(), &Test15_SleeperStats);
+}
+
+VOID
+Test15_Yielder (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST15_ROUNDS; ++Round) {
+        UtYield();
+    }
+}
+
+VOID
+Test15 (
+    ) 
+{
+    UT_SCHEDULER_STATS After;
+    UT_SCHEDULER_STATS Before;
+    ULONG Index;
+    ULONG Workers;
+
+    printf("\n-:: Test 15 - BEGIN ::-\n\n");
+
+    if (!UtGetSchedulerStats(&Before)) {
+        printf("runtime counters are disabled, define UT_STATS to enable them\n");
+        printf("\n-:: Test 15 -  END  ::-\n");
+        return;
+    }
+
+    for (Workers = 1; Workers <= 4; Workers += 3) {
+        UtGetSchedulerStats(&Before);
+
+        UtCreate(Test15_Hog, NULL);
+        UtCreate(Test15_Sleeper, NULL);
+        for (Index = 0; Index < TEST15_YIELDERS; ++Index) {
+            UtCreate(Test15_Yielder, NULL);
+        }
+
+        UtRunEx(Workers);
+        UtGetSchedulerStats(&After);
+
+        //
+        // Each thread sampled its counters while running, after being switched out 
+        // one time less than it was switched in.
+        //
+
+        _ASSERTE(Test15_HogStats.SwitchesOut + 1 == Test15_HogStats.SwitchesIn);
+        _ASSERTE(Test15_SleeperStats.SwitchesOut + 1 == Test15_SleeperStats.SwitchesIn);
+        _ASSERTE(Test15_SleeperStats.SwitchesIn == TEST15_ROUNDS + 1);
+        _ASSERTE(Test15_HogStats.RunTicks > Test15_SleeperStats.RunTicks);
+        _ASSERTE(Test15_SleeperStats.ParkedTicks > Test15_SleeperStats.RunTicks);
+
+        _ASSERTE(After.Creations - Before.Creations == TEST15_YIELDERS + 2);
+        _ASSERTE(After.Exits - Before.Exits == TEST15_YIELDERS + 2);
+        _ASSERTE(After.LiveThreads == 0 && After.ReadyThreads == 0);
+        _ASSERTE(Workers > 1 || After.ReadyHighWatermark >= TEST15_YIELDERS + 2);
+
+        printf("hog: %llu switches, %llu ticks running, %llu ready, %llu parked\n",
+               (unsigned long long) Test15_HogStats.SwitchesIn, 
+               (unsigned long long) Test15_HogStats.RunTicks,
+               (unsigned long long) Test15_HogStats.ReadyTicks,
+               (unsigned long long) Test15_HogStats.ParkedTicks);
+        printf("sleeper: %llu switches, %llu ticks running, %llu ready, %llu parked\n",
+               (unsigned long long) Test15_SleeperStats.SwitchesIn, 
+               (unsigned long long) Test15_SleeperStats.RunTicks,
+               (unsigned long long) Test15_SleeperStats.ReadyTicks,
+               (unsigned long long) Test15_SleeperStats.ParkedTicks);
+        printf("scheduler on %d workers: %llu creations, %llu exits, ready high watermark %d\n",
+               Workers, (unsigned long long) (After.Creations - Before.Creations),
+               (unsigned long long) (After.Exits - Before.Exits), After.ReadyHighWatermark);
+    }
+
+    printf("\n-:: Test 15 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 16: Stack profiling									 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST16_THREADS 32
+#define TEST16_DEPTH 16
+
+volatile SIZE_T Test16_DeepHighWater;
+
+//
+// Uses about a kilobyte of stack per level of recursion. The frame of the caller is
+// passed down so that the calls can't be turned into a loop.
+//
+
+DECLSPEC_NOINLINE
+ULONG
+Test16_Recurse (
+    __in ULONG Depth,
+    __in volatile UCHAR * CallerFrame
+    )
+{
+    volatile UCHAR Frame[1024];
+
+    Frame[0] = (UCHAR) Depth;
+    return CallerFrame[0] + (Depth == 0 ? 0 : Test16_Recurse(Depth - 1, Frame));
+}
+
+VOID
+Test16_Shallow (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtYield();
+}
+
+VOID
+Test16_Deep (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    volatile UCHAR Frame[1];
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Frame[0] = 0;
+    Test16_Recurse(TEST16_DEPTH, Frame);
+    UtYield();
+    Test16_DeepHighWater = UtGetStackHighWater(UtSelf());
+}
+
+VOID
+Test16 (
+    ) 
+{
+    UT_STACK_PROFILE Deep;
+    ULONG Index;
+    BOOL Profiled;
+    UT_STACK_PROFILE Shallow;
+    ULONG Workers;
+
+    printf("\n-:: Test 16 - BEGIN ::-\n\n");
+
+    UtConfigureStackProfiling(TRUE, TRUE);
+
+    //
+    // The first run profiles the threads' functions, and the second one runs threads
+    // with the stack sizes chosen for them.
+    //
+
+    for (Workers = 1; Workers <= 4; Workers += 3) {
+        for (Index = 0; Index < TEST16_THREADS; ++Index) {
+            UtCreate(Test16_Shallow, NULL);
+            UtCreate(Test16_Deep, NULL);
+        }
+
+        UtRunEx(Workers);
+
+        _ASSERTE(Test16_DeepHighWater >= TEST16_DEPTH * 1024);
+        Profiled = UtGetStackProfile(Test16_Shallow, &Shallow);
+        _ASSERTE(Profiled);
+        Profiled = UtGetStackProfile(Test16_Deep, &Deep);
+        _ASSERTE(Profiled);
+        _ASSERTE(Shallow.Threads == TEST16_THREADS * (Workers == 1 ? 1 : 2));
+        _ASSERTE(Shallow.HighWater < 4096 && Shallow.StackSize == 2 * 4096);
+        _ASSERTE(Deep.HighWater >= TEST16_DEPTH * 1024 && Deep.StackSize == 8 * 4096);
+
+        printf("on %d workers, shallow threads used %d bytes of stack and get %d\n", 
+               Workers, (ULONG) Shallow.HighWater, (ULONG) Shallow.StackSize);
+        printf("on %d workers, deep threads used %d bytes of stack and get %d\n", 
+               Workers, (ULONG) Deep.HighWater, (ULONG) Deep.StackSize);
+    }
+
+    UtConfigureStackProfiling(FALSE, FALSE);
+
+    printf("\n-:: Test 16 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 17: Threads running on the shared stack				 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST17_SESSIONS 1000
+#define TEST17_ROUNDS 4
+
+HANDLE Test17_Sessions[TEST17_SESSIONS];
+volatile LONG Test17_Parked;
+
+//
+// Recurses to a depth that depends on the session, keeping a pointer to a frame of 
+// the caller, and checks on the way back that the frames survived the switches.
+//
+
+DECLSPEC_NOINLINE
+ULONG
+Test17_Recurse (
+    __in ULONG Index,
+    __in ULONG Depth,
+    __in volatile ULONG_PTR * CallerFrame
+    )
+{
+    volatile ULONG_PTR Frame[32];
+    ULONG Slot;
+
+    for (Slot = 0; Slot < 32; ++Slot) {
+        Frame[Slot] = Index * 1000 + Depth * 32 + Slot;
+    }
+
+    if (Depth == 0) {
+        InterlockedIncrement(&Test17_Parked);
+        Test17_Sessions[Index] = UtSelf();
+        UtPark();
+        UtYield();
+    } else {
+        Test17_Recurse(Index, Depth - 1, Frame);
+    }
+
+    for (Slot = 0; Slot < 32; ++Slot) {
+        _ASSERTE(Frame[Slot] == Index * 1000 + Depth * 32 + Slot);
+    }
+
+    return (ULONG) CallerFrame[0];
+}
+
+VOID
+Test17_Session (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    ULONG Result;
+    ULONG Round;
+    volatile ULONG_PTR Frame[1];
+
+    Index = (ULONG) (ULONG_PTR) Argument;
+    Frame[0] = Index;
+
+    for (Round = 0; Round < TEST17_ROUNDS; ++Round) {
+        Result = Test17_Recurse(Index, Index % 8, Frame);
+        _ASSERTE(Result == Index);
+
+        if (Round == 1 && Index % 16 == 0) {
+            UtSleep(1);
+        }
+    }
+
+    UtExitEx((PVOID) (ULONG_PTR) (Index + 1));
+}
+
+VOID
+Test17_Driver (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    PVOID ExitValue;
+    HANDLE Sessions[TEST17_SESSIONS];
+    ULONG Index;
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < TEST17_SESSIONS; ++Index) {
+        Sessions[Index] = UtCreateEx(Test17_Session, (UT_ARGUMENT) (ULONG_PTR) Index, 0, 
+                                     UT_CREATE_JOINABLE | UT_CREATE_SHARED_STACK);
+        _ASSERTE(Sessions[Index] != NULL);
+    }
+
+    //
+    // Wait for all the sessions to park, and unpark them in reverse order.
+    //
+
+    for (Round = 0; Round < TEST17_ROUNDS; ++Round) {
+        while (Test17_Parked != TEST17_SESSIONS) {
+            UtYield();
+        }
+
+        Test17_Parked = 0;
+        for (Index = TEST17_SESSIONS; Index > 0; --Index) {
+            UtUnpark(Test17_Sessions[Index - 1]);
+        }
+    }
+
+    for (Index = 0; Index < TEST17_SESSIONS; ++Index) {
+        UtJoin(Sessions[Index], &ExitValue);
+        _ASSERTE((ULONG_PTR) ExitValue == Index + 1);
+    }
+}
+
+VOID
+Test17 (
+    ) 
+{
+    printf("\n-:: Test 17 - BEGIN ::-\n\n");
+
+    Test17_Parked = 0;
+    UtCreate(Test17_Driver, NULL);
+    UtRun();
+
+    printf("%d sessions on the shared stack parked %d times each\n", TEST17_SESSIONS, TEST17_ROUNDS);
+
+    printf("\n-:: Test 17 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 18: Direct handoffs that skip the ready queue		 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST18_YIELDERS 8
+#define TEST18_ROUNDS 1000
+
+//
+// The ways in which the driver hands control to the waiter.
+//
+
+#define TEST18_SWITCH 0
+#define TEST18_MUTEX 1
+#define TEST18_SEMAPHORE 2
+#define TEST18_CHANNEL 3
+#define TEST18_CONDITION 4
+#define TEST18_MODES 5
+
+static const char * Test18_ModeNames[TEST18_MODES] = {
+    "UtSwitchTo", "mutex", "semaphore", "channel", "condition"
+};
+
+ULONG Test18_Mode;
+HANDLE Test18_Driver;
+HANDLE Test18_Waiter;
+UTHREAD_MUTEX Test18_Mutex;
+UTHREAD_SEMAPHORE Test18_Semaphore;
+UTHREAD_CHANNEL Test18_Channel;
+UTHREAD_CONDITION Test18_Condition;
+volatile BOOL Test18_Ready;
+volatile BOOL Test18_Held;
+volatile BOOL Test18_Done;
+volatile ULONG Test18_Switches;
+ULONG Test18_Stamp;
+ULONG Test18_Handoffs;
+
+//
+// Counts the times it runs, so that a handoff can tell whether any of the
+// yielders ran between the handing thread and the thread it handed to.
+//
+
+VOID
+Test18_Yielder (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (!Test18_Done) {
+        Test18_Switches += 1;
+        UtYield();
+    }
+}
+
+//
+// Marks the start of a handoff, and checks that the receiving thread ran right away.
+//
+
+#define Test18_StartHandoff() (Test18_Stamp = Test18_Switches)
+
+VOID
+Test18_CompleteHandoff (
+    ) 
+{
+    _ASSERTE(Test18_Switches == Test18_Stamp);
+    Test18_Handoffs += 1;
+}
+
+VOID
+Test18_WaiterThread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    PVOID Value;
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    if (Test18_Mode == TEST18_SWITCH) {
+        Test18_Ready = TRUE;
+        UtPark();
+    }
+
+    for (Round = 0; Round < TEST18_ROUNDS; ++Round) {
+        switch (Test18_Mode) {
+        case TEST18_SWITCH:
+            Test18_CompleteHandoff();
+            Test18_StartHandoff();
+
+            if (Round + 1 < TEST18_ROUNDS) {
+                UtSwitchTo(Test18_Driver);
+            } else {
+                UtUnparkAndSwitch(Test18_Driver);
+            }
+            break;
+
+        case TEST18_MUTEX:
+            while (!Test18_Held) {
+                UtYield();
+            }
+
+            Test18_Ready = TRUE;
+            UtAcquireMutex(&Test18_Mutex);
+            Test18_CompleteHandoff();
+            Test18_Held = FALSE;
+            UtReleaseMutex(&Test18_Mutex);
+            break;
+
+        case TEST18_SEMAPHORE:
+            Test18_Ready = TRUE;
+            UtAcquireSemaphore(&Test18_Semaphore, 1);
+            Test18_CompleteHandoff();
+            break;
+
+        case TEST18_CHANNEL:
+            Test18_Ready = TRUE;
+            UtReceiveChannel(&Test18_Channel, &Value);
+            Test18_CompleteHandoff();
+            _ASSERTE((ULONG_PTR) Value == Round);
+            break;
+
+        case TEST18_CONDITION:
+
+            //
+            // Yield while holding the mutex, so that the driver blocks on it, and hand
+            // it to the driver by waiting on the condition.
+            //
+
+            UtAcquireMutex(&Test18_Mutex);
+            Test18_Ready = TRUE;
+            UtYield();
+            Test18_StartHandoff();
+            UtWaitCondition(&Test18_Condition, &Test18_Mutex);
+            Test18_CompleteHandoff();
+            UtReleaseMutex(&Test18_Mutex);
+            break;
+        }
+    }
+}
+
+VOID
+Test18_DriverThread (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST18_ROUNDS; ++Round) {
+        if (Test18_Mode == TEST18_MUTEX) {
+            UtAcquireMutex(&Test18_Mutex);
+            Test18_Held = TRUE;
+        }
+
+        if (Round == 0 || Test18_Mode != TEST18_SWITCH) {
+            while (!Test18_Ready) {
+                UtYield();
+            }
+        }
+
+        Test18_Ready = FALSE;
+
+        switch (Test18_Mode) {
+        case TEST18_SWITCH:
+            Test18_StartHandoff();
+            UtSwitchTo(Test18_Waiter);
+            Test18_CompleteHandoff();
+            break;
+
+        case TEST18_MUTEX:
+            Test18_StartHandoff();
+            UtReleaseMutex(&Test18_Mutex);
+            break;
+
+        case TEST18_SEMAPHORE:
+            Test18_StartHandoff();
+            UtReleaseSemaphore(&Test18_Semaphore, 1);
+            break;
+
+        case TEST18_CHANNEL:
+            Test18_StartHandoff();
+            UtSendChannel(&Test18_Channel, (PVOID) (ULONG_PTR) Round);
+            break;
+
+        case TEST18_CONDITION:
+            UtAcquireMutex(&Test18_Mutex);
+            Test18_CompleteHandoff();
+            UtSignalCondition(&Test18_Condition);
+            Test18_StartHandoff();
+            UtReleaseMutex(&Test18_Mutex);
+            break;
+        }
+    }
+
+    Test18_Done = TRUE;
+}
+
+VOID
+Test18 (
+    ) 
+{
+    ULONG Index;
+
+    printf("\n-:: Test 18 - BEGIN ::-\n\n");
+
+    for (Test18_Mode = 0; Test18_Mode < TEST18_MODES; ++Test18_Mode) {
+        UtInitializeMutexEx(&Test18_Mutex, FALSE, UT_SYNC_DIRECT_HANDOFF);
+        UtInitializeSemaphoreEx(&Test18_Semaphore, 0, 1, UT_SYNC_DIRECT_HANDOFF);
+        UtInitializeChannelEx(&Test18_Channel, NULL, 0, UT_SYNC_DIRECT_HANDOFF);
+        UtInitializeCondition(&Test18_Condition);
+        Test18_Ready = FALSE;
+        Test18_Held = FALSE;
+        Test18_Done = FALSE;
+        Test18_Handoffs = 0;
+
+        Test18_Waiter = UtCreate(Test18_WaiterThread, NULL);
+        for (Index = 0; Index < TEST18_YIELDERS; ++Index) {
+            UtCreate(Test18_Yielder, NULL);
+        }
+        Test18_Driver = UtCreate(Test18_DriverThread, NULL);
+        UtRun();
+
+        printf("%u direct handoffs through the %s, past %d ready threads\n", 
+               Test18_Handoffs, Test18_ModeNames[Test18_Mode], TEST18_YIELDERS);
+    }
+
+    printf("\n-:: Test 18 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 19: Barging mutexes									 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST19_HOG_ROUNDS 1000
+#define TEST19_CONTENDERS 16
+#define TEST19_ITERATIONS 2000
+#define TEST19_TURNS 1000
+
+UTHREAD_MUTEX Test19_Mutex;
+UTHREAD_CONDITION Test19_Condition;
+volatile ULONG Test19_HogRounds;
+ULONG Test19_AcquiredAt;
+volatile BOOL Test19_Inside;
+ULONG Test19_Counter;
+volatile LONG Test19_Acquisitions;
+ULONG Test19_Turn;
+
+//
+// Releases the mutex and takes it back right away, barging ahead of the waiter it woke.
+//
+
+VOID
+Test19_Hog (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (Test19_HogRounds < TEST19_HOG_ROUNDS) {
+        UtAcquireMutex(&Test19_Mutex);
+        Test19_HogRounds += 1;
+        UtYield();
+        UtReleaseMutex(&Test19_Mutex);
+    }
+}
+
+VOID
+Test19_Waiter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (Test19_HogRounds == 0) {
+        UtYield();
+    }
+
+    UtAcquireMutex(&Test19_Mutex);
+    Test19_AcquiredAt = Test19_HogRounds;
+    UtReleaseMutex(&Test19_Mutex);
+}
+
+//
+// Acquires the mutex in all possible ways, yielding inside and outside of it.
+//
+
+VOID
+Test19_Contender (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    ULONG Iteration;
+
+    Index = (ULONG) (ULONG_PTR) Argument;
+
+    for (Iteration = 0; Iteration < TEST19_ITERATIONS; ++Iteration) {
+        switch ((Index + Iteration) % 3) {
+        case 0:
+            UtAcquireMutex(&Test19_Mutex);
+            break;
+        case 1:
+            if (!UtAcquireMutexTimeout(&Test19_Mutex, 1)) {
+                continue;
+            }
+            break;
+        default:
+            if (!UtTryAcquireMutex(&Test19_Mutex)) {
+                UtYield();
+                continue;
+            }
+            break;
+        }
+
+        _ASSERTE(!Test19_Inside);
+        Test19_Inside = TRUE;
+        Test19_Counter += 1;
+        if (Iteration % 4 == 0) {
+            UtYield();
+        }
+        Test19_Inside = FALSE;
+        UtReleaseMutex(&Test19_Mutex);
+
+        InterlockedIncrement(&Test19_Acquisitions);
+        if (Iteration % 2 == 0) {
+            UtYield();
+        }
+    }
+}
+
+//
+// Takes turns with another thread through a condition over the barging mutex.
+//
+
+VOID
+Test19_TurnTaker (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Index;
+    ULONG Turn;
+
+    Index = (ULONG) (ULONG_PTR) Argument;
+
+    for (Turn = 0; Turn < TEST19_TURNS; ++Turn) {
+        UtAcquireMutex(&Test19_Mutex);
+
+        while (Test19_Turn % 2 != Index) {
+            UtWaitCondition(&Test19_Condition, &Test19_Mutex);
+        }
+
+        Test19_Turn += 1;
+        UtBroadcastCondition(&Test19_Condition);
+        UtReleaseMutex(&Test19_Mutex);
+    }
+}
+
+VOID
+Test19 (
+    ) 
+{
+    ULONG Flags;
+    ULONG Index;
+    ULONG Workers;
+
+    printf("\n-:: Test 19 - BEGIN ::-\n\n");
+
+    //
+    // A waiter woken by the hog's releases only loses the mutex to it a few times
+    // before the mutex is handed to it.
+    //
+
+    UtInitializeMutexEx(&Test19_Mutex, FALSE, UT_SYNC_BARGING);
+    Test19_HogRounds = 0;
+    UtCreate(Test19_Hog, NULL);
+    UtCreate(Test19_Waiter, NULL);
+    UtRun();
+
+    _ASSERTE(Test19_AcquiredAt > 1 && Test19_AcquiredAt < 16);
+    printf("the waiter got the barging mutex after %d rounds of the hog\n", Test19_AcquiredAt);
+
+    //
+    // Contenders and turn takers, with and without direct handoff, on one and on four workers.
+    //
+
+    for (Workers = 1; Workers <= 4; Workers += 3) {
+        for (Flags = UT_SYNC_BARGING; Flags <= (UT_SYNC_BARGING | UT_SYNC_DIRECT_HANDOFF); ++Flags) {
+            UtInitializeMutexEx(&Test19_Mutex, FALSE, Flags);
+            UtInitializeCondition(&Test19_Condition);
+            Test19_Counter = 0;
+            Test19_Acquisitions = 0;
+            Test19_Turn = 0;
+
+            for (Index = 0; Index < TEST19_CONTENDERS; ++Index) {
+                UtCreate(Test19_Contender, (UT_ARGUMENT) (ULONG_PTR) Index);
+            }
+            UtCreate(Test19_TurnTaker, (UT_ARGUMENT) 0);
+            UtCreate(Test19_TurnTaker, (UT_ARGUMENT) 1);
+            UtRunEx(Workers);
+
+            _ASSERTE(Test19_Counter == (ULONG) Test19_Acquisitions);
+            _ASSERTE(Test19_Turn == 2 * TEST19_TURNS);
+            _ASSERTE(Test19_Mutex.Owner == NULL && IsListEmpty(&Test19_Mutex.WaitListHead));
+            printf("%d acquisitions of a barging mutex%s on %d workers\n", Test19_Acquisitions,
+                   (Flags & UT_SYNC_DIRECT_HANDOFF) != 0 ? " with direct handoff" : "", Workers);
+        }
+    }
+
+    printf("\n-:: Test 19 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 20: Semaphore grant policies						 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+UTHREAD_SEMAPHORE Test20_Semaphore;
+volatile ULONG Test20_Granted;
+
+//
+// Requests the number of permits given by Argument, and records its grant in Test20_Granted,
+// where each waiter gets a bit numbered after its request.
+//
+
+VOID
+Test20_Waiter (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    ULONG Permits;
+
+    Permits = (ULONG) (ULONG_PTR) Argument;
+    UtAcquireSemaphore(&Test20_Semaphore, Permits);
+    Test20_Granted |= 1 << Permits;
+}
+
+//
+// Lets the waiters queue up, in the order in which they were created.
+//
+
+VOID
+Test20_Settle (
+    ) 
+{
+    ULONG Index;
+
+    for (Index = 0; Index < 4; ++Index) {
+        UtYield();
+    }
+}
+
+//
+// Queues requests for 8, 2 and 3 permits, releases 3 permits and then 10 more, and
+// returns the grants after each release.
+//
+
+VOID
+Test20_Releaser (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    PULONG Grants;
+
+    Grants = (PULONG) Argument;
+
+    Test20_Settle();
+    UtReleaseSemaphore(&Test20_Semaphore, 3);
+    Test20_Settle();
+    Grants[0] = Test20_Granted;
+
+    UtReleaseSemaphore(&Test20_Semaphore, 10);
+    Test20_Settle();
+    Grants[1] = Test20_Granted;
+}
+
+//
+// Small requests keep bypassing a large one until permits are held back for it.
+//
+
+VOID
+Test20_Ager (
+    __in UT_ARGUMENT Argument
+    ) 
+{
+    BOOL Acquired;
+    PULONG Bypasses;
+
+    Bypasses = (PULONG) Argument;
+
+    Test20_Settle();
+
+    while (UtTryAcquireSemaphore(&Test20_Semaphore, 1)) {
+        *Bypasses += 1;
+        UtReleaseSemaphore(&Test20_Semaphore, 1);
+        _ASSERTE(*Bypasses < 1000);
+    }
+
+    //
+    // The permit is held back for the large request, which is granted once enough
+    // permits are released. Then small requests are satisfied again.
+    //
+
+    _ASSERTE(Test20_Granted == 0);
+    UtReleaseSemaphore(&Test20_Semaphore, 8);
+    Test20_Settle();
+    _ASSERTE(Test20_Granted == 1 << 8);
+    Acquired = UtTryAcquireSemaphore(&Test20_Semaphore, 1);
+    _ASSERTE(Acquired);
+}
+
+VOID
+Test20 (
+    ) 
+{
+    static const ULONG Policies[] = { 0, UT_SYNC_FIRST_FIT, UT_SYNC_BEST_FIT };
+    static const char * PolicyNames[] = { "FIFO", "first fit", "best fit" };
+    ULONG Bypasses;
+    ULONG Grants[2];
+    ULONG Policy;
+
+    printf("\n-:: Test 20 - BEGIN ::-\n\n");
+
+    for (Policy = 0; Policy < 3; ++Policy) {
+        UtInitializeSemaphoreEx(&Test20_Semaphore, 0, 16, Policies[Policy]);
+        Test20_Granted = 0;
+
+        UtCreate(Test20_Waiter, (UT_ARGUMENT) 8);
+        UtCreate(Test20_Waiter, (UT_ARGUMENT) 2);
+        UtCreate(Test20_Waiter, (UT_ARGUMENT) 3);
+        UtCreate(Test20_Releaser, (UT_ARGUMENT) Grants);
+        UtRun();
+
+        //
+        // With FIFO, the request for 8 blocks the others; with first fit, the request
+        // for 2 is the oldest that fits; with best fit, the request for 3 is the largest.
+        //
+
+        _ASSERTE(Grants[0] == (Policy == 0 ? 0 : Policy == 1 ? 1 << 2 : 1 << 3));
+        _ASSERTE(Grants[1] == ((1 << 8) | (1 << 2) | (1 << 3)));
+        printf("%s granted 3 permits to requests 0x%03x and 10 more to 0x%03x\n", 
+               PolicyNames[Policy], Grants[0], Grants[1]);
+    }
+
+    UtInitializeSemaphoreEx(&Test20_Semaphore, 1, 16, UT_SYNC_FIRST_FIT);
+    Test20_Granted = 0;
+    Bypasses = 0;
+    UtCreate(Test20_Waiter, (UT_ARGUMENT) 8);
+    UtCreate(Test20_Ager, &Bypasses);
+    UtRun();
+
+    printf("a request for 8 permits was bypassed %d times before permits were held back\n", Bypasses);
+
+    printf("\n-:: Test 20 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 21: Independent schedulers							 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST21_SCHEDULERS 3
+#define TEST21_THREADS 8
+#define TEST21_YIELDS 1000
+#define TEST21_ROUNDS 1000
+
+volatile LONG Test21_Counts[TEST21_SCHEDULERS];
+HANDLE volatile Test21_Parked;
+volatile LONG Test21_Woken;
+
+//
+// Yields to the other threads of its scheduler, counting each round in the slot of
+// the scheduler given by Argument. Only the scheduler with two workers takes spin
+// locks, even though the others run at the same time.
+//
+
+VOID
+Test21_Counter (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Slot;
+    ULONG Index;
+
+    Slot = (ULONG) (ULONG_PTR) Argument;
+
+    for (Index = 0; Index < TEST21_YIELDS; ++Index) {
+        _ASSERTE(UtSingleWorker == (Slot < 2));
+        InterlockedIncrement(&Test21_Counts[Slot]);
+        UtYield();
+    }
+}
+
+//
+// Publishes its handle and parks, to be unparked by a thread of another scheduler.
+//
+
+VOID
+Test21_Sleeper (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST21_ROUNDS; ++Round) {
+        InterlockedExchangePointer((PVOID volatile *) &Test21_Parked, UtSelf());
+        UtPark();
+        InterlockedIncrement(&Test21_Woken);
+    }
+}
+
+VOID
+Test21_Unparker (
+    __in UT_ARGUMENT Argument
+    )
+{
+    HANDLE Thread;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (Test21_Woken != TEST21_ROUNDS) {
+        if ((Thread = InterlockedExchangePointer((PVOID volatile *) &Test21_Parked, NULL)) != NULL) {
+            UtUnpark(Thread);
+        }
+        UtYield();
+    }
+}
+
+//
+// Runs a private scheduler on its own OS thread, with the number of workers given
+// by its slot.
+//
+
+#if defined(_WIN32)
+DWORD
+WINAPI
+#else
+PVOID
+#endif
+Test21_Run (
+    __in PVOID Argument
+    )
+{
+    PUT_SCHEDULER Scheduler;
+    PUT_SCHEDULER Previous;
+    ULONG Slot;
+    ULONG Index;
+
+    Slot = (ULONG) (ULONG_PTR) Argument;
+    Scheduler = UtCreateScheduler();
+    _ASSERTE(Scheduler != NULL);
+    Previous = UtSelectScheduler(Scheduler);
+    _ASSERTE(Previous == NULL);
+
+    for (Index = 0; Index < TEST21_THREADS; ++Index) {
+        UtCreate(Test21_Counter, (UT_ARGUMENT) (ULONG_PTR) Slot);
+    }
+    if (Slot == 1) {
+        UtCreate(Test21_Sleeper, NULL);
+    }
+    UtRunEx(Slot);
+
+    UtSelectScheduler(Previous);
+    UtDeleteScheduler(Scheduler);
+    return 0;
+}
+
+VOID
+Test21 (
+    ) 
+{
+    ULONG Slot;
+    ULONG Index;
+#if defined(_WIN32)
+    HANDLE Runners[TEST21_SCHEDULERS];
+#else
+    pthread_t Runners[TEST21_SCHEDULERS];
+#endif
+
+    printf("\n-:: Test 21 - BEGIN ::-\n\n");
+
+    for (Slot = 0; Slot < TEST21_SCHEDULERS; ++Slot) {
+        Test21_Counts[Slot] = 0;
+    }
+    Test21_Parked = NULL;
+    Test21_Woken = 0;
+
+    //
+    // The default scheduler runs on this thread, while private schedulers with one
+    // and two workers run on their own OS threads. A thread of the default scheduler
+    // unparks a thread of the first private scheduler.
+    //
+
+    for (Index = 0; Index < TEST21_THREADS; ++Index) {
+        UtCreate(Test21_Counter, (UT_ARGUMENT) 0);
+    }
+    UtCreate(Test21_Unparker, NULL);
+
+    for (Slot = 1; Slot < TEST21_SCHEDULERS; ++Slot) {
+#if defined(_WIN32)
+        Runners[Slot] = CreateThread(NULL, 0, Test21_Run, (PVOID) (ULONG_PTR) Slot, 0, NULL);
+#else
+        pthread_create(&Runners[Slot], NULL, Test21_Run, (PVOID) (ULONG_PTR) Slot);
+#endif
+    }
+
+    UtRun();
+
+    for (Slot = 1; Slot < TEST21_SCHEDULERS; ++Slot) {
+#if defined(_WIN32)
+        WaitForSingleObject(Runners[Slot], INFINITE);
+        CloseHandle(Runners[Slot]);
+#else
+        pthread_join(Runners[Slot], NULL);
+#endif
+    }
+
+    for (Slot = 0; Slot < TEST21_SCHEDULERS; ++Slot) {
+        _ASSERTE(Test21_Counts[Slot] == TEST21_THREADS * TEST21_YIELDS);
+    }
+    _ASSERTE(Test21_Woken == TEST21_ROUNDS);
+    _ASSERTE(!UtMultipleWorkers);
+
+    printf("%d schedulers ran %d yields each; a thread was unparked %d times across schedulers\n",
+           TEST21_SCHEDULERS, Test21_Counts[0], Test21_Woken);
+
+    printf("\n-:: Test 21 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 22: Workers pinned to processors					 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST22_THREADS 16
+#define TEST22_ROUNDS 100
+
+volatile LONG Test22_Rounds;
+volatile LONG Test22_Misplaced;
+
+//
+// Returns the processor the calling operating system thread is running on.
+//
+
+ULONG
+Test22_GetProcessor (
+    )
+{
+#if defined(_WIN32)
+    return GetCurrentProcessorNumber();
+#else
+    unsigned Processor;
+
+    return syscall(SYS_getcpu, &Processor, NULL, NULL) == 0 ? (ULONG) Processor : 0;
+#endif
+}
+
+VOID
+Test22_Child (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtYield();
+}
+
+//
+// Checks that it runs on processor 0 at every round, while creating short-lived
+// threads whose blocks are recycled through the pools.
+//
+
+VOID
+Test22_Thread (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Round;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Round = 0; Round < TEST22_ROUNDS; ++Round) {
+        if (Test22_GetProcessor() != 0) {
+            InterlockedIncrement(&Test22_Misplaced);
+        }
+
+        UtCreate(Test22_Child, NULL);
+        InterlockedIncrement(&Test22_Rounds);
+        UtYield();
+    }
+}
+
+VOID
+Test22 (
+    ) 
+{
+    static const ULONG Processors[] = { 0 };
+    ULONG Index;
+    ULONG Workers;
+    BOOL Configured;
+
+    printf("\n-:: Test 22 - BEGIN ::-\n\n");
+
+    Configured = UtConfigureWorkerAffinity(Processors, 1);
+    _ASSERTE(Configured);
+
+    for (Workers = 1; Workers <= 2; ++Workers) {
+        Test22_Rounds = 0;
+        Test22_Misplaced = 0;
+
+        for (Index = 0; Index < TEST22_THREADS; ++Index) {
+            UtCreate(Test22_Thread, NULL);
+        }
+        UtRunEx(Workers);
+
+        _ASSERTE(Test22_Rounds == TEST22_THREADS * TEST22_ROUNDS);
+        _ASSERTE(Test22_Misplaced == 0);
+        printf("%d rounds ran on processor 0 on %d workers\n", Test22_Rounds, Workers);
+    }
+
+    UtConfigureWorkerAffinity(NULL, 0);
+
+    printf("\n-:: Test 22 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 23: Thread priorities								 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST23_ROUNDS 3
+
+CHAR Test23_Log[32];
+ULONG Test23_Length;
+UTHREAD_MUTEX Test23_Mutex;
+
+//
+// Logs the character given by Argument at every round, yielding in between.
+//
+
+VOID
+Test23_Yielder (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Round;
+
+    for (Round = 0; Round < TEST23_ROUNDS; ++Round) {
+        Test23_Log[Test23_Length++] = (CHAR) (ULONG_PTR) Argument;
+        UtYield();
+    }
+}
+
+//
+// Takes the priority named by the character given by Argument and blocks on the mutex,
+// logging the character once it acquires it.
+//
+
+VOID
+Test23_Waiter (
+    __in UT_ARGUMENT Argument
+    )
+{
+    CHAR Name;
+
+    Name = (CHAR) (ULONG_PTR) Argument;
+    UtSetPriority(UtSelf(), Name == 'H' ? UT_PRIORITY_HIGHEST : Name == 'L' ? UT_PRIORITY_LOWEST 
+                                                                            : UT_PRIORITY_NORMAL);
+
+    UtAcquireMutex(&Test23_Mutex);
+    Test23_Log[Test23_Length++] = Name;
+    UtReleaseMutex(&Test23_Mutex);
+}
+
+//
+// Holds the mutex while the waiters block on it, in the order they were created.
+//
+
+VOID
+Test23_Owner (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    UtAcquireMutex(&Test23_Mutex);
+    UtCreate(Test23_Waiter, (UT_ARGUMENT) 'L');
+    UtCreate(Test23_Waiter, (UT_ARGUMENT) 'N');
+    UtCreate(Test23_Waiter, (UT_ARGUMENT) 'H');
+    UtYield();
+    UtReleaseMutex(&Test23_Mutex);
+}
+
+VOID
+Test23 (
+    ) 
+{
+    HANDLE Thread;
+    ULONG Flags;
+    LONG Priority;
+
+    printf("\n-:: Test 23 - BEGIN ::-\n\n");
+
+    //
+    // The threads run in order of priority, regardless of the order they were created in.
+    //
+
+    Test23_Length = 0;
+    UtCreateEx(Test23_Yielder, (UT_ARGUMENT) 'L', 0, UT_CREATE_PRIORITY(UT_PRIORITY_LOWEST));
+    UtCreateEx(Test23_Yielder, (UT_ARGUMENT) 'N', 0, 0);
+    Thread = UtCreateEx(Test23_Yielder, (UT_ARGUMENT) 'H', 0, UT_CREATE_PRIORITY(UT_PRIORITY_HIGHEST));
+    Priority = UtGetPriority(Thread);
+    _ASSERTE(Priority == UT_PRIORITY_HIGHEST);
+    UtRun();
+
+    Test23_Log[Test23_Length] = '\0';
+    _ASSERTE(strcmp(Test23_Log, "HHHNNNLLL") == 0);
+    printf("threads of three priorities ran as %s\n", Test23_Log);
+
+    //
+    // With priority ordering, the mutex goes to the waiters in order of priority rather
+    // than in the order they blocked.
+    //
+
+    for (Flags = 0; Flags <= UT_SYNC_PRIORITY; Flags += UT_SYNC_PRIORITY) {
+        Test23_Length = 0;
+        UtInitializeMutexEx(&Test23_Mutex, FALSE, Flags);
+        UtCreate(Test23_Owner, NULL);
+        UtRun();
+
+        Test23_Log[Test23_Length] = '\0';
+        _ASSERTE(strcmp(Test23_Log, Flags == 0 ? "LNH" : "HNL") == 0);
+        printf("a %s mutex was acquired as %s\n", Flags == 0 ? "FIFO" : "priority", Test23_Log);
+    }
+
+    printf("\n-:: Test 23 -  END  ::-\n");
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 24: Fair scheduling									 //
+//															 //
+///////////////////////////////////////////////////////////////
+
+#define TEST24_UNITS 20000
+#define TEST24_SPINS 2000
+#define TEST24_CREATORS 4
+#define TEST24_CHILDREN 64
+
+ULONG Test24_Units[2];
+ULONG Test24_Periods[2];
+HANDLE Test24_Children[TEST24_CREATORS * TEST24_CHILDREN];
+volatile LONG Test24_Created;
+volatile LONG Test24_Parked;
+volatile LONG Test24_Resumed;
+
+//
+// Does units of work until both threads together did TEST24_UNITS, counting them in the
+// slot given by Argument and yielding after the number of units of its period.
+//
+
+VOID
+Test24_Worker (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+    ULONG Period;
+    volatile ULONG Spin;
+
+    Index = (ULONG) (ULONG_PTR) Argument;
+    Period = Test24_Periods[Index];
+
+    while (Test24_Units[0] + Test24_Units[1] < TEST24_UNITS) {
+        for (Spin = 0; Spin < TEST24_SPINS; ++Spin) {
+        }
+
+        if (++Test24_Units[Index] % Period == 0) {
+            UtYield();
+        }
+    }
+}
+
+//
+// Threads created on multiple workers with fair scheduling enabled, which park until
+// the scheduler runs again on a single worker and places them in the fair queue.
+//
+
+VOID
+Test24_Child (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    InterlockedIncrement(&Test24_Parked);
+    UtPark();
+    InterlockedIncrement(&Test24_Resumed);
+}
+
+VOID
+Test24_Creator (
+    __in UT_ARGUMENT Argument
+    )
+{
+    ULONG Index;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    for (Index = 0; Index < TEST24_CHILDREN; ++Index) {
+        Test24_Children[InterlockedIncrement(&Test24_Created) - 1] = UtCreate(Test24_Child, NULL);
+        UtYield();
+    }
+}
+
+VOID
+Test24_Stopper (
+    __in UT_ARGUMENT Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    while (Test24_Parked != TEST24_CREATORS * TEST24_CHILDREN) {
+        UtYield();
+    }
+
+    UtShutdown();
+}
+
+//
+// Runs a thread that yields after every unit of work along with another that yields 
+// after Period units, with the specified weights, and returns the ratio of the work
+// done by the latter to that done by the former.
+//
+
+double
+Test24_Run (
+    __in ULONG Period,
+    __in ULONG Weight
+    )
+{
+    HANDLE Thread;
+
+    Test24_Units[0] = Test24_Units[1] = 0;
+    Test24_Periods[0] = 1;
+    Test24_Periods[1] = Period;
+    UtCreate(Test24_Worker, (UT_ARGUMENT) 0);
+    Thread = UtCreate(Test24_Worker, (UT_ARGUMENT) 1);
+    UtSetWeight(Thread, Weight);
+    UtRun();
+
+    return (double) Test24_Units[1] / Test24_Units[0];
+}
+
+VOID
+Test24 (
+    ) 
+{
+    ULONG Index;
+    double Ratio;
+
+    printf("\n-:: Test 24 - BEGIN ::-\n\n");
+
+    //
+    // In FIFO order, a thread that yields rarely gets as many times more processor time
+    // than one that yields after every unit of work.
+    //
+
+    Ratio = Test24_Run(8, UT_WEIGHT_NORMAL);
+    _ASSERTE(Ratio > 4);
+    printf("in FIFO order, the rare yielder did %s the work\n", Ratio > 4 ? "several times" : "about");
+
+    //
+    // With fair scheduling, both get about the same, unless weighted.
+    //
+
+    UtConfigureFairScheduling(TRUE, 1000000);
+
+    Ratio = Test24_Run(8, UT_WEIGHT_NORMAL);
+    _ASSERTE(Ratio > 0.5 && Ratio < 2);
+    printf("with fair scheduling, the rare yielder did %s the work\n", Ratio > 0.5 && Ratio < 2 ? "about" : "not");
+
+    Ratio = Test24_Run(1, 3 * UT_WEIGHT_NORMAL);
+    _ASSERTE(Ratio > 2 && Ratio < 4.5);
+    printf("a thread of triple weight did %s the work\n", Ratio > 2 && Ratio < 4.5 ? "about three times" : "not");
+
+    //
+    // Threads created on multiple workers have room in the fair queue once the scheduler
+    // runs again on a single worker.
+    //
+
+    Test24_Created = Test24_Parked = Test24_Resumed = 0;
+    for (Index = 0; Index < TEST24_CREATORS; ++Index) {
+        UtCreate(Test24_Creator, NULL);
+    }
+
+    UtCreate(Test24_Stopper, NULL);
+    UtRunEx(2);
+
+    for (Index = 0; Index < TEST24_CREATORS * TEST24_CHILDREN; ++Index) {
+        UtUnpark(Test24_Children[Index]);
+    }
+
+    UtRun();
+
+    _ASSERTE(Test24_Resumed == TEST24_CREATORS * TEST24_CHILDREN);
+    printf("%d threads created on two workers resumed on one\n", Test24_Resumed);
+
+    UtConfigureFairScheduling(FALSE, 0);
+
+    printf("\n-:: Test 24 -  END  ::-\n");
+}
+
 VOID
 __cdecl
 main (
@@ -437,6 +3553,29 @@ main (
     Test1();
     Test2();
     Test3();
+    Test4();
+    Test5();
+    Test6();
+    Test7();
+    Test8();
+#if !defined(_WIN32)
+    Test9();
+    Test10();
+#endif
+    Test11();
+    Test12();
+    Test13();
+    Test14();
+    Test15();
+    Test16();
+    Test17();
+    Test18();
+    Test19();
+    Test20();
+    Test21();
+    Test22();
+    Test23();
+    Test24();
 
     getchar();
 }
@@ -0,0 +1,222 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#pragma once
+
+//
+// The size of a cache line, to which data shared between workers is aligned.
+//
+
+#define CACHE_LINE_SIZE 64
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+#include <crtdbg.h>
+#include <intrin.h>
+#include <malloc.h>
+
+//
+// Fiber-safe TLS (/GT) must be enabled so that the address of thread-local data 
+// is not cached across a context switch, as user threads may migrate between workers.
+//
+
+#define THREAD_LOCAL __declspec(thread)
+
+#else
+
+//
+// On non-Windows targets, provide the subset of the Windows types, annotations
+// and helpers used throughout the library, so that the same sources build with
+// GCC or Clang on System V platforms.
+//
+
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VOID void
+
+typedef char CHAR, *PCHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned char BOOLEAN;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, ULONG64;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef int BOOL;
+typedef void *PVOID, *HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+
+#define INFINITE 0xFFFFFFFF
+
+typedef uint32_t DWORD;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define DECLSPEC_NORETURN __attribute__((noreturn))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define DECLSPEC_NOINLINE __attribute__((noinline))
+
+//
+// The initial-exec model keeps the access to thread-local data a single FS-relative
+// load, which is never cached across a context switch to another worker.
+//
+
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+#define __fastcall
+#define __cdecl
+
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define __in_ecount(Count)
+#define __in_ecount_opt(Count)
+#define __inout_ecount(Count)
+
+#define FIELD_OFFSET(Type, Field) ((LONG) offsetof(Type, Field))
+#define C_ASSERT(Expression) _Static_assert(Expression, #Expression)
+
+#define UNREFERENCED_PARAMETER(Parameter) ((VOID) (Parameter))
+#define _aligned_free(Block) free(Block)
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+
+//
+// Like the CRT's, a release build doesn't evaluate the expression, but still refers
+// to it, so that the variables that only assertions check aren't reported as unused.
+//
+
+#if defined(NDEBUG)
+#define _ASSERTE(Expression) ((VOID) sizeof(Expression))
+#else
+#define _ASSERTE(Expression) assert(Expression)
+#endif
+
+#define sprintf_s snprintf
+
+//
+// Interlocked operations and processor hints, with the semantics of their Win32 
+// counterparts: full barriers, returning the resulting (increment and decrement)
+// or the initial (exchange and compare-exchange) value.
+//
+
+#define InterlockedIncrement(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Target, Value) __atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange (
+    __inout volatile LONG * Target,
+    __in LONG Exchange,
+    __in LONG Comparand
+    )
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedExchangePointer (
+    __inout PVOID volatile * Target,
+    __in PVOID Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+PVOID
+InterlockedCompareExchangePointer (
+    __inout PVOID volatile * Target,
+    __in PVOID Exchange,
+    __in PVOID Comparand
+    )
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE
+PVOID
+_aligned_malloc (
+    __in SIZE_T Size,
+    __in SIZE_T Alignment
+    )
+{
+    PVOID Block;
+
+    return posix_memalign(&Block, Alignment, Size) == 0 ? Block : NULL;
+}
+
+//
+// Stores in Index the position of the most significant bit set in Mask. Returns FALSE
+// if Mask is zero, in which case Index is undefined.
+//
+
+FORCEINLINE
+BOOLEAN
+_BitScanReverse (
+    __out PULONG Index,
+    __in ULONG Mask
+    )
+{
+    *Index = 31 - __builtin_clz(Mask | 1);
+    return Mask != 0;
+}
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define _ReadWriteBarrier() __asm__ __volatile__ ("" ::: "memory")
+#define YieldProcessor() __builtin_ia32_pause()
+#define __rdtsc() __builtin_ia32_rdtsc()
+
+FORCEINLINE
+BOOL
+SwitchToThread (
+    )
+{
+    return sched_yield() == 0;
+}
+
+#endif
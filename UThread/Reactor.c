@@ -0,0 +1,474 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+//
+// accept4 is a GNU extension.
+//
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "Reactor.h"
+#include "List.h"
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+//
+// The reactor's state of a descriptor. As descriptors are registered edge-triggered,
+// the poller counts the readiness events in ReadSequence and WriteSequence, so that a
+// thread whose operation would block can tell, before parking, whether the descriptor
+// became ready after it sampled the sequence, in which case it retries the operation
+// instead. Readers and Writers list the threads parked waiting for the descriptor, 
+// linked through their list entries, so that no wait block lives on the stack of a
+// thread that may run on the shared stack. Lock protects the descriptor's state when 
+// the scheduler runs on multiple workers.
+//
+
+typedef struct _IO_DESCRIPTOR {
+    UT_SPIN_LOCK Lock;
+    BOOL Registered;
+    volatile ULONG ReadSequence;
+    volatile ULONG WriteSequence;
+    LIST_ENTRY Readers;
+    LIST_ENTRY Writers;
+} IO_DESCRIPTOR, *PIO_DESCRIPTOR;
+
+//
+// The states of descriptors are kept in a two-level table indexed by descriptor number,
+// whose chunks are allocated on first use and never freed, so that they can be looked
+// up without locking.
+//
+
+#define IO_TABLE_CHUNK_BITS 10
+#define IO_TABLE_CHUNK_SIZE (1 << IO_TABLE_CHUNK_BITS)
+#define IO_TABLE_CHUNKS 1024
+
+static PIO_DESCRIPTOR volatile IoTable[IO_TABLE_CHUNKS];
+
+//
+// The maximum number of readiness events collected by a call to epoll_wait.
+//
+
+#define REACTOR_BATCH_SIZE 64
+
+//
+// The epoll instance of the reactor, and the scheduler's wake event added to it.
+//
+
+static int PollDescriptor = -1;
+static int WakeDescriptor = -1;
+
+//
+// The number of user threads parked waiting for descriptors to become ready.
+//
+
+volatile LONG NumberOfIoWaiters;
+
+//
+// The kinds of readiness a thread can wait for.
+//
+
+#define IO_READ 0
+#define IO_WRITE 1
+
+//
+// Returns the state of the specified descriptor, registering the descriptor with the
+// reactor on first use. Returns NULL, with errno set, if the descriptor can't be used.
+//
+
+static
+PIO_DESCRIPTOR
+GetIoDescriptor (
+    __in int Descriptor
+    )
+{
+    PIO_DESCRIPTOR Chunk;
+    PIO_DESCRIPTOR IoDescriptor;
+    struct epoll_event Event;
+    int Flags;
+
+    if (Descriptor < 0 || (Descriptor >> IO_TABLE_CHUNK_BITS) >= IO_TABLE_CHUNKS) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if ((Chunk = IoTable[Descriptor >> IO_TABLE_CHUNK_BITS]) == NULL) {
+        Chunk = (PIO_DESCRIPTOR) calloc(IO_TABLE_CHUNK_SIZE, sizeof(IO_DESCRIPTOR));
+        if (Chunk == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if (InterlockedCompareExchangePointer((PVOID volatile *) &IoTable[Descriptor >> IO_TABLE_CHUNK_BITS],
+                                              Chunk, NULL) != NULL) {
+            free(Chunk);
+            Chunk = IoTable[Descriptor >> IO_TABLE_CHUNK_BITS];
+        }
+    }
+
+    IoDescriptor = &Chunk[Descriptor & (IO_TABLE_CHUNK_SIZE - 1)];
+    if (IoDescriptor->Registered) {
+        return IoDescriptor;
+    }
+
+    UtAcquireSpinLock(&IoDescriptor->Lock);
+
+    if (!IoDescriptor->Registered) {
+        if ((Flags = fcntl(Descriptor, F_GETFL)) < 0
+            || fcntl(Descriptor, F_SETFL, Flags | O_NONBLOCK) < 0) {
+            UtReleaseSpinLock(&IoDescriptor->Lock);
+            return NULL;
+        }
+
+        Event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        Event.data.ptr = IoDescriptor;
+        if (epoll_ctl(PollDescriptor, EPOLL_CTL_ADD, Descriptor, &Event) < 0) {
+            UtReleaseSpinLock(&IoDescriptor->Lock);
+            return NULL;
+        }
+
+        InitializeListHead(&IoDescriptor->Readers);
+        InitializeListHead(&IoDescriptor->Writers);
+        IoDescriptor->Registered = TRUE;
+    }
+
+    UtReleaseSpinLock(&IoDescriptor->Lock);
+    return IoDescriptor;
+}
+
+//
+// Parks the current thread until the descriptor is ready for the specified kind of I/O,
+// unless it became ready since the thread sampled Sequence. Any number of threads may
+// wait for the same descriptor.
+//
+
+static
+VOID
+WaitForIoDescriptor (
+    __inout PIO_DESCRIPTOR IoDescriptor,
+    __in ULONG Kind,
+    __in ULONG Sequence
+    )
+{
+    UtAcquireSpinLock(&IoDescriptor->Lock);
+
+    if ((Kind == IO_READ ? IoDescriptor->ReadSequence : IoDescriptor->WriteSequence) != Sequence) {
+        UtReleaseSpinLock(&IoDescriptor->Lock);
+        return;
+    }
+
+    InsertTailList(Kind == IO_READ ? &IoDescriptor->Readers : &IoDescriptor->Writers, 
+                   UtGetThreadListEntry(UtSelf()));
+
+    InterlockedIncrement(&NumberOfIoWaiters);
+    UtReleaseSpinLock(&IoDescriptor->Lock);
+
+    UtPark();
+}
+
+//
+// Reads up to Length bytes from the specified descriptor into Buffer, blocking the
+// current thread until data is available. Returns the number of bytes read, 0 at
+// end of file, or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtRead (
+    __in int Descriptor,
+    __out PVOID Buffer,
+    __in SIZE_T Length
+    )
+{
+    PIO_DESCRIPTOR IoDescriptor;
+    LONG_PTR Result;
+    ULONG Sequence;
+
+    if ((IoDescriptor = GetIoDescriptor(Descriptor)) == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+        Sequence = IoDescriptor->ReadSequence;
+        _ReadWriteBarrier();
+
+        if ((Result = read(Descriptor, Buffer, Length)) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return Result;
+        }
+
+        WaitForIoDescriptor(IoDescriptor, IO_READ, Sequence);
+    }
+}
+
+//
+// Writes up to Length bytes from Buffer to the specified descriptor, blocking the current
+// thread until some can be written. Returns the number of bytes written, or -1 with errno
+// set on failure.
+//
+
+LONG_PTR
+UtWrite (
+    __in int Descriptor,
+    __in const VOID * Buffer,
+    __in SIZE_T Length
+    )
+{
+    PIO_DESCRIPTOR IoDescriptor;
+    LONG_PTR Result;
+    ULONG Sequence;
+
+    if ((IoDescriptor = GetIoDescriptor(Descriptor)) == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+        Sequence = IoDescriptor->WriteSequence;
+        _ReadWriteBarrier();
+
+        if ((Result = write(Descriptor, Buffer, Length)) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return Result;
+        }
+
+        WaitForIoDescriptor(IoDescriptor, IO_WRITE, Sequence);
+    }
+}
+
+//
+// Accepts a connection on the specified listening socket, blocking the current thread
+// until one arrives. Returns the non-blocking socket of the connection, or -1 with errno
+// set on failure.
+//
+
+int
+UtAccept (
+    __in int Descriptor,
+    __out_opt struct sockaddr * Address,
+    __inout_opt socklen_t * AddressLength
+    )
+{
+    PIO_DESCRIPTOR IoDescriptor;
+    int Result;
+    ULONG Sequence;
+
+    if ((IoDescriptor = GetIoDescriptor(Descriptor)) == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+        Sequence = IoDescriptor->ReadSequence;
+        _ReadWriteBarrier();
+
+        if ((Result = accept4(Descriptor, Address, AddressLength, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0
+            || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return Result;
+        }
+
+        WaitForIoDescriptor(IoDescriptor, IO_READ, Sequence);
+    }
+}
+
+//
+// Connects the specified socket to Address, blocking the current thread until the
+// connection is established. Returns 0, or -1 with errno set on failure.
+//
+
+int
+UtConnect (
+    __in int Descriptor,
+    __in const struct sockaddr * Address,
+    __in socklen_t AddressLength
+    )
+{
+    int Error;
+    PIO_DESCRIPTOR IoDescriptor;
+    socklen_t Length;
+    ULONG Sequence;
+
+    if ((IoDescriptor = GetIoDescriptor(Descriptor)) == NULL) {
+        return -1;
+    }
+
+    Sequence = IoDescriptor->WriteSequence;
+    _ReadWriteBarrier();
+
+    if (connect(Descriptor, Address, AddressLength) == 0) {
+        return 0;
+    }
+
+    if (errno != EINPROGRESS) {
+        return -1;
+    }
+
+    //
+    // The socket becomes writable when the connection is established or fails.
+    //
+
+    for (;;) {
+        WaitForIoDescriptor(IoDescriptor, IO_WRITE, Sequence);
+
+        Sequence = IoDescriptor->WriteSequence;
+        _ReadWriteBarrier();
+
+        Length = sizeof(Error);
+        if (getsockopt(Descriptor, SOL_SOCKET, SO_ERROR, &Error, &Length) < 0) {
+            return -1;
+        }
+
+        if (Error == 0) {
+            return 0;
+        }
+
+        if (Error != EINPROGRESS) {
+            errno = Error;
+            return -1;
+        }
+    }
+}
+
+//
+// Unregisters the specified descriptor from the reactor and closes it. Descriptors
+// used with the reactor must be closed through this function, and not while user
+// threads are blocked on them.
+//
+
+int
+UtClose (
+    __in int Descriptor
+    )
+{
+    PIO_DESCRIPTOR Chunk;
+    PIO_DESCRIPTOR IoDescriptor;
+
+    if (Descriptor >= 0 && (Descriptor >> IO_TABLE_CHUNK_BITS) < IO_TABLE_CHUNKS
+        && (Chunk = IoTable[Descriptor >> IO_TABLE_CHUNK_BITS]) != NULL) {
+        IoDescriptor = &Chunk[Descriptor & (IO_TABLE_CHUNK_SIZE - 1)];
+
+        UtAcquireSpinLock(&IoDescriptor->Lock);
+        if (IoDescriptor->Registered) {
+            _ASSERTE(IsListEmpty(&IoDescriptor->Readers) && IsListEmpty(&IoDescriptor->Writers));
+            epoll_ctl(PollDescriptor, EPOLL_CTL_DEL, Descriptor, NULL);
+            IoDescriptor->Registered = FALSE;
+        }
+
+        UtReleaseSpinLock(&IoDescriptor->Lock);
+    }
+
+    return close(Descriptor);
+}
+
+//
+// Creates the epoll instance of the reactor, to which WakeEvent is also added, so that
+// the scheduler can wait for readiness events and for its wake event at the same time.
+//
+
+VOID
+InitializeReactor (
+    __in int WakeEvent
+    )
+{
+    struct epoll_event Event;
+
+    PollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    _ASSERTE(PollDescriptor >= 0);
+
+    WakeDescriptor = WakeEvent;
+    Event.events = EPOLLIN;
+    Event.data.ptr = NULL;
+    if (epoll_ctl(PollDescriptor, EPOLL_CTL_ADD, WakeEvent, &Event) < 0) {
+        _ASSERTE(!"failed to add the wake event to the reactor");
+    }
+}
+
+//
+// Unparks the threads in the specified list, leaving it empty. Returns their number.
+//
+
+static
+ULONG
+UnparkIoWaiters (
+    __inout PLIST_ENTRY Waiters
+    )
+{
+    ULONG Count;
+
+    for (Count = 0; !IsListEmpty(Waiters); ++Count) {
+        InterlockedDecrement(&NumberOfIoWaiters);
+        UtUnpark(UtGetListEntryThread(RemoveHeadList(Waiters)));
+    }
+
+    return Count;
+}
+
+//
+// Waits for up to Timeout milliseconds for readiness events, unparking the threads
+// waiting for them in a batch. As descriptors are edge-triggered, an event unparks all 
+// the threads waiting for that kind of readiness, and those that still find nothing to
+// do park again. If DrainWakeEvent is TRUE, a signalled wake event is
+// reset; otherwise, it remains signalled for the worker that is blocked on it. Returns
+// the number of unparked threads. Must be called by a worker.
+//
+
+ULONG
+PollReactor (
+    __in ULONG Timeout,
+    __in BOOL DrainWakeEvent
+    )
+{
+    struct epoll_event Events[REACTOR_BATCH_SIZE];
+    ULONG Count;
+    int Index;
+    PIO_DESCRIPTOR IoDescriptor;
+    int NumberOfEvents;
+    LIST_ENTRY Readers;
+    ULONG64 Value;
+    LIST_ENTRY Writers;
+
+    NumberOfEvents = epoll_wait(PollDescriptor, Events, REACTOR_BATCH_SIZE,
+                                Timeout == INFINITE ? -1 : (int) Timeout);
+
+    for (Count = 0, Index = 0; Index < NumberOfEvents; ++Index) {
+        if ((IoDescriptor = (PIO_DESCRIPTOR) Events[Index].data.ptr) == NULL) {
+            if (DrainWakeEvent) {
+                read(WakeDescriptor, &Value, sizeof(Value));
+            }
+
+            continue;
+        }
+
+        InitializeListHead(&Readers);
+        InitializeListHead(&Writers);
+        UtAcquireSpinLock(&IoDescriptor->Lock);
+
+        if (Events[Index].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            IoDescriptor->ReadSequence += 1;
+            SpliceTailList(&Readers, &IoDescriptor->Readers);
+        }
+
+        if (Events[Index].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            IoDescriptor->WriteSequence += 1;
+            SpliceTailList(&Writers, &IoDescriptor->Writers);
+        }
+
+        UtReleaseSpinLock(&IoDescriptor->Lock);
+
+        Count += UnparkIoWaiters(&Readers);
+        Count += UnparkIoWaiters(&Writers);
+    }
+
+    return Count;
+}
+
+#endif
@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#pragma once
+
+#include "UThread.h"
+
+#if !defined(_WIN32)
+
+#include <sys/socket.h>
+
+//
+// The reactor lets user threads perform socket and pipe I/O in blocking style, without
+// blocking the worker they run on. Descriptors are made non-blocking and registered,
+// edge-triggered, with an epoll instance the first time a user thread operates on them.
+// A thread whose operation would block parks until the descriptor becomes ready. The
+// scheduler collects readiness events in batches, both periodically while it has threads
+// to run and when it would otherwise block, and unparks the waiting threads. Several
+// threads may block on the same descriptor, such as a pool of threads accepting
+// connections on one listening socket; each readiness event unparks all the threads
+// waiting for it, and those that find nothing to do block again.
+//
+
+//
+// Reads up to Length bytes from the specified descriptor into Buffer, blocking the
+// current thread until data is available. Returns the number of bytes read, 0 at
+// end of file, or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtRead (
+    __in int Descriptor,
+    __out PVOID Buffer,
+    __in SIZE_T Length
+    );
+
+//
+// Writes up to Length bytes from Buffer to the specified descriptor, blocking the current
+// thread until some can be written. Returns the number of bytes written, or -1 with errno
+// set on failure.
+//
+
+LONG_PTR
+UtWrite (
+    __in int Descriptor,
+    __in const VOID * Buffer,
+    __in SIZE_T Length
+    );
+
+//
+// Accepts a connection on the specified listening socket, blocking the current thread
+// until one arrives. Returns the non-blocking socket of the connection, or -1 with errno
+// set on failure.
+//
+
+int
+UtAccept (
+    __in int Descriptor,
+    __out_opt struct sockaddr * Address,
+    __inout_opt socklen_t * AddressLength
+    );
+
+//
+// Connects the specified socket to Address, blocking the current thread until the
+// connection is established. Returns 0, or -1 with errno set on failure.
+//
+
+int
+UtConnect (
+    __in int Descriptor,
+    __in const struct sockaddr * Address,
+    __in socklen_t AddressLength
+    );
+
+//
+// Unregisters the specified descriptor from the reactor and closes it. Descriptors
+// used with the reactor must be closed through this function, and not while user
+// threads are blocked on them.
+//
+
+int
+UtClose (
+    __in int Descriptor
+    );
+
+//
+// The scheduler's interface to the reactor.
+//
+
+//
+// The number of user threads parked waiting for descriptors to become ready.
+//
+
+extern volatile LONG NumberOfIoWaiters;
+
+//
+// Creates the epoll instance of the reactor, to which WakeEvent is also added, so that
+// the scheduler can wait for readiness events and for its wake event at the same time.
+//
+
+VOID
+InitializeReactor (
+    __in int WakeEvent
+    );
+
+//
+// Waits for up to Timeout milliseconds for readiness events, unparking the threads
+// waiting for them in a batch. If DrainWakeEvent is TRUE, a signalled wake event is
+// reset. Returns the number of unparked threads. Must be called by a worker.
+//
+
+ULONG
+PollReactor (
+    __in ULONG Timeout,
+    __in BOOL DrainWakeEvent
+    );
+
+#endif
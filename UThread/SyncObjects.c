@@ -14,10 +14,49 @@
 // 
 // 
 
-#include <crtdbg.h>
 #include "SyncObjects.h"
 #include "List.h"
 
+//
+// The number of times in a row that the thread at the head of the wait list of a barging
+// mutex may be woken only to find the mutex taken, before the mutex is handed to it.
+//
+
+#define MUTEX_BARGING_LIMIT 4
+
+//
+// The number of requests that may be satisfied ahead of the request at the head of the
+// wait list of a first-fit or best-fit semaphore, before permits are held back for it.
+//
+
+#define SEMAPHORE_BYPASS_LIMIT 32
+
+//
+// The semaphore grant policies other than FIFO.
+//
+
+#define SEMAPHORE_FIT_POLICIES (UT_SYNC_FIRST_FIT | UT_SYNC_BEST_FIT)
+
+//
+// Unparks the specified thread, to which a synchronization object initialized with
+// the specified options handed a mutex, permits or a value, switching to it right away
+// if the object uses direct handoff.
+//
+
+FORCEINLINE
+VOID
+UnparkWaiter (
+    __in HANDLE Thread,
+    __in ULONG Flags
+    )
+{
+    if ((Flags & UT_SYNC_DIRECT_HANDOFF) != 0) {
+        UtUnparkAndSwitch(Thread);
+    } else {
+        UtUnpark(Thread);
+    }
+}
+
 //
 // Initializes a mutex instance. If Owned is TRUE, then the current thread becomes
 // the owner.
@@ -29,9 +68,111 @@ UtInitializeMutex (
     __in BOOL Owned
     )
 {
+    UtInitializeMutexEx(Mutex, Owned, 0);
+}
+
+//
+// Initializes a mutex instance with the specified UT_SYNC_* options.
+//
+
+VOID
+UtInitializeMutexEx (
+    __out PUTHREAD_MUTEX Mutex,
+    __in BOOL Owned,
+    __in ULONG Flags
+    )
+{
+    UtInitializeSpinLock(&Mutex->Lock);
     InitializeListHead(&Mutex->WaitListHead);
     Mutex->Owner = Owned ? UtSelf() : NULL;
     Mutex->RecursionCounter = Owned ? 1 : 0;
+    Mutex->Flags = Flags;
+    Mutex->Waking = FALSE;
+    Mutex->Bargings = 0;
+}
+
+//
+// Inserts the specified wait block in the wait list of the specified mutex: at the tail,
+// or, with priority ordering, behind the last waiter of the same or higher priority. 
+// Must be called with the lock held.
+//
+
+static
+VOID
+InsertMutexWaiter (
+    __inout PUTHREAD_MUTEX Mutex,
+    __inout PWAIT_BLOCK WaitBlock
+    )
+{
+    PLIST_ENTRY Entry;
+    LONG Priority;
+
+    if ((Mutex->Flags & UT_SYNC_PRIORITY) == 0) {
+        InsertTailList(&Mutex->WaitListHead, &WaitBlock->WaitListEntry);
+        return;
+    }
+
+    //
+    // Scan from the tail, as waiters usually have the same priority. A waiter woken
+    // to compete for a barging mutex must stay at the head of the list.
+    //
+
+    Priority = UtGetPriority(WaitBlock->Thread);
+
+    for (Entry = Mutex->WaitListHead.Blink; Entry != &Mutex->WaitListHead; Entry = Entry->Blink) {
+        if (UtGetPriority(CONTAINING_RECORD(Entry, WAIT_BLOCK, WaitListEntry)->Thread) >= Priority
+            || (Mutex->Waking && Entry == Mutex->WaitListHead.Flink)) {
+            break;
+        }
+    }
+
+    InsertHeadList(Entry, &WaitBlock->WaitListEntry);
+}
+
+//
+// Competes for the specified barging mutex on behalf of the current thread, which was
+// woken at the head of the wait list. Returns TRUE if the thread owns the mutex, either 
+// because it was free or because it was handed to the thread. Otherwise, the thread 
+// stays at the head of the wait list and must park again, having been prepared for a 
+// timed park if Timed is TRUE.
+//
+
+static
+BOOL
+RetryBargingMutex (
+    __inout PUTHREAD_MUTEX Mutex,
+    __inout PWAIT_BLOCK WaitBlock,
+    __in BOOL Timed
+    )
+{
+    BOOL Acquired;
+
+    UtAcquireSpinLock(&Mutex->Lock);
+
+    if (!(Acquired = Mutex->Owner == WaitBlock->Thread)) {
+        _ASSERTE(Mutex->Waking && Mutex->WaitListHead.Flink == &WaitBlock->WaitListEntry);
+        Mutex->Waking = FALSE;
+
+        if ((Acquired = Mutex->Owner == NULL)) {
+            RemoveEntryList(&WaitBlock->WaitListEntry);
+            Mutex->Owner = WaitBlock->Thread;
+            Mutex->RecursionCounter = 1;
+            Mutex->Bargings = 0;
+        } else {
+
+            //
+            // A barging thread took the mutex. Its release will wake us again.
+            //
+
+            Mutex->Bargings += 1;
+            if (Timed) {
+                UtPrepareParkTimeout();
+            }
+        }
+    }
+
+    UtReleaseSpinLock(&Mutex->Lock);
+    return Acquired;
 }
 
 //
@@ -46,6 +187,8 @@ UtAcquireMutex (
     HANDLE Self;
     WAIT_BLOCK WaitBlock;
 
+    UtAcquireSpinLock(&Mutex->Lock);
+
     if (Mutex->Owner == (Self = UtSelf())) {
 
         //
@@ -68,63 +211,247 @@ UtAcquireMutex (
         //
 
         InitializeWaitBlock(&WaitBlock);
-        InsertTailList(&Mutex->WaitListHead, &WaitBlock.WaitListEntry);
+        InsertMutexWaiter(Mutex, &WaitBlock);
+        UtReleaseSpinLock(&Mutex->Lock);
 
         //
-        // Park the current thread. When the thread is unparked, it will have ownership of the mutex.
+        // Park the current thread. When the thread is unparked, it will have ownership of the 
+        // mutex, unless the mutex is barging, in which case the thread competes for it.
         //
         
-        UtPark();
+        do {
+            UtPark();
+        } while ((Mutex->Flags & UT_SYNC_BARGING) != 0 && !RetryBargingMutex(Mutex, &WaitBlock, FALSE));
+
         _ASSERTE(Mutex->Owner == Self);
+        return;
     }
+
+    UtReleaseSpinLock(&Mutex->Lock);
 }
 
 //
-// Releases the specified mutex, eventually unblocking a waiting thread to which the
-// ownership of the mutex is transfered.
+// Acquires the specified mutex if it is free or owned by the current thread. Returns
+// FALSE, without blocking, otherwise.
 //
 
-VOID
-UtReleaseMutex (
+BOOL
+UtTryAcquireMutex (
     __inout PUTHREAD_MUTEX Mutex
     )
 {
-    PWAIT_BLOCK WaitBlock;
+    HANDLE Self;
+    BOOL Acquired;
 
-    _ASSERTE(Mutex->Owner == UtSelf());
+    UtAcquireSpinLock(&Mutex->Lock);
+
+    if ((Acquired = Mutex->Owner == (Self = UtSelf()))) {
+        Mutex->RecursionCounter += 1;
+    } else if ((Acquired = Mutex->Owner == NULL)) {
+        Mutex->Owner = Self;
+        Mutex->RecursionCounter = 1;
+    }
+
+    UtReleaseSpinLock(&Mutex->Lock);
+    return Acquired;
+}
+
+//
+// Acquires the specified mutex, blocking the current thread for up to the specified 
+// number of milliseconds if the mutex is not free. Returns FALSE if the timeout expired.
+//
+
+BOOL
+UtAcquireMutexTimeout (
+    __inout PUTHREAD_MUTEX Mutex,
+    __in ULONG Milliseconds
+    )
+{
+    HANDLE Self;
+    HANDLE Thread;
+    BOOL Acquired;
+    BOOL Woken;
+    ULONG64 Deadline;
+    ULONG64 Now;
+    WAIT_BLOCK WaitBlock;
+
+    if (Milliseconds == INFINITE) {
+        UtAcquireMutex(Mutex);
+        return TRUE;
+    }
+
+    UtAcquireSpinLock(&Mutex->Lock);
+
+    if (Mutex->Owner == (Self = UtSelf())) {
+        Mutex->RecursionCounter += 1;
+    } else if (Mutex->Owner == NULL) {
+        Mutex->Owner = Self;
+        Mutex->RecursionCounter = 1;
+    } else if (Milliseconds == 0) {
+        UtReleaseSpinLock(&Mutex->Lock);
+        return FALSE;
+    } else {
 
-    if ((Mutex->RecursionCounter -= 1) > 0) {
-        
         //
-        // The current thread is still the owner of the mutex.
+        // Insert the running thread in the wait list and park it until it is given
+        // ownership of the mutex or the timeout expires. A thread that loses a barging 
+        // mutex parks again for the rest of the timeout.
         //
 
-        return;
-    }
+        InitializeWaitBlock(&WaitBlock);
+        UtPrepareParkTimeout();
+        InsertMutexWaiter(Mutex, &WaitBlock);
+        UtReleaseSpinLock(&Mutex->Lock);
 
-    if (IsListEmpty(&Mutex->WaitListHead)) {
+        Deadline = UtReadClock(FALSE) + Milliseconds;
+
+        while (UtParkTimeout(Milliseconds)) {
+            if ((Mutex->Flags & UT_SYNC_BARGING) == 0 || RetryBargingMutex(Mutex, &WaitBlock, TRUE)) {
+                _ASSERTE(Mutex->Owner == Self);
+                return TRUE;
+            }
+
+            Now = UtReadClock(FALSE);
+            Milliseconds = Now < Deadline ? (ULONG) (Deadline - Now) : 0;
+        }
 
         //
-        // No threads are blocked; the mutex becomes free.
+        // The timeout expired, but the mutex may have been handed to the current 
+        // thread in the meantime. Otherwise, the wait block is still linked, and
+        // the thread may have been woken to compete for a barging mutex, in which
+        // case the wake up is passed on to the next waiter.
         //
 
-        Mutex->Owner = NULL;
-        return;
+        Thread = NULL;
+        UtAcquireSpinLock(&Mutex->Lock);
+
+        if ((Acquired = Mutex->Owner == Self)) {
+            Woken = FALSE;
+        } else {
+            if (Mutex->WaitListHead.Flink == &WaitBlock.WaitListEntry) {
+                Woken = Mutex->Waking;
+                Mutex->Waking = FALSE;
+                Mutex->Bargings = 0;
+            } else {
+                Woken = FALSE;
+            }
+
+            RemoveEntryList(&WaitBlock.WaitListEntry);
+
+            if (Woken && Mutex->Owner == NULL && !IsListEmpty(&Mutex->WaitListHead)) {
+                Mutex->Waking = TRUE;
+                Thread = CONTAINING_RECORD(Mutex->WaitListHead.Flink, WAIT_BLOCK, WaitListEntry)->Thread;
+            }
+        }
+
+        UtCompleteParkTimeout(Acquired | Woken);
+        UtReleaseSpinLock(&Mutex->Lock);
+
+        if (Thread != NULL) {
+            UtUnpark(Thread);
+        }
+
+        return Acquired;
     }
 
-    //
-    // Get the next blocked thread and transfer mutex ownership to it.
-    //
+    UtReleaseSpinLock(&Mutex->Lock);
+    return TRUE;
+}
+
+//
+// Transfers the ownership of the specified mutex, which is being released, to the next
+// blocked thread, which is returned so that it can be unparked once the lock is released.
+// If no threads are blocked, the mutex becomes free and NULL is returned. Must be called
+// with the lock held.
+//
+
+static
+HANDLE
+TransferMutex (
+    __inout PUTHREAD_MUTEX Mutex
+    )
+{
+    PWAIT_BLOCK WaitBlock;
+
+    if (IsListEmpty(&Mutex->WaitListHead)) {
+        Mutex->Owner = NULL;
+        return NULL;
+    }
 
     WaitBlock = CONTAINING_RECORD(RemoveHeadList(&Mutex->WaitListHead), WAIT_BLOCK, WaitListEntry);
     Mutex->Owner = WaitBlock->Thread;
     Mutex->RecursionCounter = 1;
+    return WaitBlock->Thread;
+}
+
+//
+// Gives up the ownership of the specified mutex, which is being released, returning the
+// thread that must be unparked once the lock is released, if any. A barging mutex is freed, and
+// the thread at the head of the wait list is woken to compete for it, unless it was
+// already woken. If that thread lost the mutex too many times in a row, it is handed
+// the mutex instead. Must be called with the lock held.
+//
+
+static
+HANDLE
+ReleaseMutexOwnership (
+    __inout PUTHREAD_MUTEX Mutex
+    )
+{
+    if ((Mutex->Flags & UT_SYNC_BARGING) == 0 || IsListEmpty(&Mutex->WaitListHead)) {
+        return TransferMutex(Mutex);
+    }
+
+    if (Mutex->Bargings >= MUTEX_BARGING_LIMIT) {
+        _ASSERTE(!Mutex->Waking);
+        Mutex->Bargings = 0;
+        return TransferMutex(Mutex);
+    }
+
+    Mutex->Owner = NULL;
+
+    if (Mutex->Waking) {
+        return NULL;
+    }
+
+    Mutex->Waking = TRUE;
+    return CONTAINING_RECORD(Mutex->WaitListHead.Flink, WAIT_BLOCK, WaitListEntry)->Thread;
+}
+
+//
+// Releases the specified mutex, eventually unblocking a waiting thread to which the
+// ownership of the mutex is transfered, or which competes for it if the mutex is barging.
+//
+
+VOID
+UtReleaseMutex (
+    __inout PUTHREAD_MUTEX Mutex
+    )
+{
+    HANDLE Thread;
+
+    _ASSERTE(Mutex->Owner == UtSelf());
+
+    if ((Mutex->RecursionCounter -= 1) > 0) {
+        
+        //
+        // The current thread is still the owner of the mutex.
+        //
+
+        return;
+    }
+
+    UtAcquireSpinLock(&Mutex->Lock);
+    Thread = ReleaseMutexOwnership(Mutex);
+    UtReleaseSpinLock(&Mutex->Lock);
         
     //
-    // Unpark the thread.
+    // Unpark the thread that got ownership of the mutex, or that competes for it, if any.
     //
 
-    UtUnpark(WaitBlock->Thread);
+    if (Thread != NULL) {
+        UnparkWaiter(Thread, Mutex->Flags);
+    }
 }
 
 //
@@ -140,9 +467,57 @@ UtInitializeSemaphore (
     __in ULONG Limit
     )
 {
+    UtInitializeSemaphoreEx(Semaphore, Permits, Limit, 0);
+}
+
+//
+// Initializes a semaphore instance with the specified UT_SYNC_* options.
+//
+
+VOID
+UtInitializeSemaphoreEx (
+    __out PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits,
+    __in ULONG Limit,
+    __in ULONG Flags
+    )
+{
+    UtInitializeSpinLock(&Semaphore->Lock);
     InitializeListHead(&Semaphore->WaitListHead);
     Semaphore->Permits = Permits;
     Semaphore->Limit = Limit;
+    Semaphore->Flags = Flags;
+    Semaphore->Bypasses = 0;
+}
+
+//
+// Takes the specified number of permits from the semaphore for a thread that isn't 
+// queued, if they are available. Under the first-fit and best-fit policies, a thread
+// that bypasses waiting requests ages the one at the head of the wait list, and can't
+// bypass it once it reached the bypass limit. Must be called with the lock held.
+//
+
+FORCEINLINE
+BOOL
+TakeSemaphorePermits (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits
+    )
+{
+    if (Semaphore->Permits < Permits) {
+        return FALSE;
+    }
+
+    if ((Semaphore->Flags & SEMAPHORE_FIT_POLICIES) != 0 && !IsListEmpty(&Semaphore->WaitListHead)) {
+        if (Semaphore->Bypasses >= SEMAPHORE_BYPASS_LIMIT) {
+            return FALSE;
+        }
+
+        Semaphore->Bypasses += 1;
+    }
+
+    Semaphore->Permits -= Permits;
+    return TRUE;
 }
 
 //
@@ -159,12 +534,14 @@ UtAcquireSemaphore (
 {
     SEMAPHORE_WAIT_BLOCK WaitBlock;
 
+    UtAcquireSpinLock(&Semaphore->Lock);
+
     //
     // If there are enough permits available, get them and keep running.
     //
 
-    if (Semaphore->Permits >= Permits) {
-        Semaphore->Permits -= Permits;
+    if (TakeSemaphorePermits(Semaphore, Permits)) {
+        UtReleaseSpinLock(&Semaphore->Lock);
         return;
     }
 
@@ -174,6 +551,7 @@ UtAcquireSemaphore (
 
     InitializeSemaphoreWaitBlock(&WaitBlock, Permits);   
     InsertTailList(&Semaphore->WaitListHead, &WaitBlock.Header.WaitListEntry);
+    UtReleaseSpinLock(&Semaphore->Lock);
 
     //
     // Park the current thread.
@@ -183,44 +561,1033 @@ UtAcquireSemaphore (
 }
 
 //
-// Adds the specified number of permits to the semaphore, eventually unblocking 
-// waiting threads.
+// Selects the waiter whose request is satisfied next, according to the semaphore's grant
+// policy, or returns NULL if no request can be satisfied. Once the request at the head of
+// the wait list reached the bypass limit, only that request is considered. Must be called
+// with the lock held.
 //
 
-VOID
-UtReleaseSemaphore (
-    __inout PUTHREAD_SEMAPHORE Semaphore,
-    __in ULONG Permits
+static
+PSEMAPHORE_WAIT_BLOCK
+SelectSemaphoreWaiter (
+    __in PUTHREAD_SEMAPHORE Semaphore
     )
 {
+    PSEMAPHORE_WAIT_BLOCK Best;
     PLIST_ENTRY ListHead;
     PSEMAPHORE_WAIT_BLOCK WaitBlock;
     PLIST_ENTRY WaitEntry;
 
-    if ((Semaphore->Permits += Permits) > Semaphore->Limit) {
-        Semaphore->Permits = Semaphore->Limit;
+    ListHead = &Semaphore->WaitListHead;
+
+    if ((WaitEntry = ListHead->Flink) == ListHead) {
+        return NULL;
     }
 
-    ListHead = &Semaphore->WaitListHead;
+    if ((Semaphore->Flags & SEMAPHORE_FIT_POLICIES) == 0 || Semaphore->Bypasses >= SEMAPHORE_BYPASS_LIMIT) {
+        WaitBlock = CONTAINING_RECORD(WaitEntry, SEMAPHORE_WAIT_BLOCK, Header.WaitListEntry);
+        return Semaphore->Permits >= WaitBlock->RequestedPermits ? WaitBlock : NULL;
+    }
 
-    //
-    // Release all blocked threads whose request can be satisfied.
-    //
-    
-    while (Semaphore->Permits > 0 && (WaitEntry = ListHead->Flink) != ListHead) {
+    Best = NULL;
+
+    do {
         WaitBlock = CONTAINING_RECORD(WaitEntry, SEMAPHORE_WAIT_BLOCK, Header.WaitListEntry);
 
-        if (Semaphore->Permits < WaitBlock->RequestedPermits) {
-            
-            //
-            // We stop at the first request that cannot be satisfied to ensure FIFO ordering.
-            //
+        if (Semaphore->Permits >= WaitBlock->RequestedPermits) {
+            if ((Semaphore->Flags & UT_SYNC_FIRST_FIT) != 0) {
+                return WaitBlock;
+            }
 
-            break;
+            if (Best == NULL || WaitBlock->RequestedPermits > Best->RequestedPermits) {
+                Best = WaitBlock;
+            }
+        }
+    } while ((WaitEntry = WaitEntry->Flink) != ListHead);
+
+    return Best;
+}
+
+//
+// Releases the blocked threads whose requests can be satisfied, in the order given by
+// the semaphore's grant policy. The wait entry of a released thread is reinitialized, 
+// so that a thread whose timeout expired can tell whether its request was satisfied. 
+// If Defer is TRUE, the first released thread isn't unparked but returned, so that the
+// caller can switch to it once the lock is released. Must be called with the lock held.
+//
+
+static
+HANDLE
+ReleaseSemaphoreWaiters (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in BOOL Defer
+    )
+{
+    HANDLE Deferred;
+    PSEMAPHORE_WAIT_BLOCK WaitBlock;
+    PLIST_ENTRY WaitEntry;
+
+    Deferred = NULL;
+
+    while (Semaphore->Permits > 0 && (WaitBlock = SelectSemaphoreWaiter(Semaphore)) != NULL) {
+        WaitEntry = &WaitBlock->Header.WaitListEntry;
+
+        if (WaitEntry == Semaphore->WaitListHead.Flink) {
+            Semaphore->Bypasses = 0;
+        } else {
+            Semaphore->Bypasses += 1;
         }
 
         Semaphore->Permits -= WaitBlock->RequestedPermits;
-        RemoveHeadList(ListHead);
-        UtUnpark(WaitBlock->Header.Thread);
+        RemoveEntryList(WaitEntry);
+        InitializeListHead(WaitEntry);
+
+        if (Defer && Deferred == NULL) {
+            Deferred = WaitBlock->Header.Thread;
+        } else {
+            UtUnpark(WaitBlock->Header.Thread);
+        }
     }
+
+    return Deferred;
+}
+
+//
+// Gets the specified number of permits from the semaphore if they are available. 
+// Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireSemaphore (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits
+    )
+{
+    BOOL Acquired;
+
+    UtAcquireSpinLock(&Semaphore->Lock);
+    Acquired = TakeSemaphorePermits(Semaphore, Permits);
+    UtReleaseSpinLock(&Semaphore->Lock);
+    return Acquired;
+}
+
+//
+// Gets the specified number of permits from the semaphore, blocking the current thread 
+// for up to the specified number of milliseconds if there aren't enough permits available. 
+// Returns FALSE if the timeout expired. A thread that gives up while at the head of the 
+// wait list lets the requests queued behind it be satisfied by the available permits.
+//
+
+BOOL
+UtAcquireSemaphoreTimeout (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits,
+    __in ULONG Milliseconds
+    )
+{
+    BOOL Acquired;
+    BOOL WasHead;
+    SEMAPHORE_WAIT_BLOCK WaitBlock;
+
+    if (Milliseconds == INFINITE) {
+        UtAcquireSemaphore(Semaphore, Permits);
+        return TRUE;
+    }
+
+    UtAcquireSpinLock(&Semaphore->Lock);
+
+    if (TakeSemaphorePermits(Semaphore, Permits)) {
+        UtReleaseSpinLock(&Semaphore->Lock);
+        return TRUE;
+    }
+
+    if (Milliseconds == 0) {
+        UtReleaseSpinLock(&Semaphore->Lock);
+        return FALSE;
+    }
+
+    //
+    // Insert the running thread in the wait list and park it until its request is 
+    // satisfied or the timeout expires.
+    //
+
+    InitializeSemaphoreWaitBlock(&WaitBlock, Permits);   
+    UtPrepareParkTimeout();
+    InsertTailList(&Semaphore->WaitListHead, &WaitBlock.Header.WaitListEntry);
+    UtReleaseSpinLock(&Semaphore->Lock);
+
+    if (UtParkTimeout(Milliseconds)) {
+        return TRUE;
+    }
+
+    //
+    // The timeout expired, but the request may have been satisfied in the meantime,
+    // in which case the wait entry was reinitialized. 
+    //
+
+    UtAcquireSpinLock(&Semaphore->Lock);
+
+    if (!(Acquired = IsListEmpty(&WaitBlock.Header.WaitListEntry))) {
+        WasHead = Semaphore->WaitListHead.Flink == &WaitBlock.Header.WaitListEntry;
+        RemoveEntryList(&WaitBlock.Header.WaitListEntry);
+
+        //
+        // The request may have been blocking smaller ones queued behind it, or have
+        // had permits held back for it.
+        //
+
+        if (WasHead) {
+            Semaphore->Bypasses = 0;
+            ReleaseSemaphoreWaiters(Semaphore, FALSE);
+        }
+    }
+
+    UtCompleteParkTimeout(Acquired);
+    UtReleaseSpinLock(&Semaphore->Lock);
+    return Acquired;
+}
+
+//
+// Adds the specified number of permits to the semaphore, eventually unblocking 
+// waiting threads.
+//
+
+VOID
+UtReleaseSemaphore (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits
+    )
+{
+    HANDLE Thread;
+
+    UtAcquireSpinLock(&Semaphore->Lock);
+
+    if ((Semaphore->Permits += Permits) > Semaphore->Limit) {
+        Semaphore->Permits = Semaphore->Limit;
+    }
+
+    //
+    // Release all blocked threads whose request can be satisfied. With direct handoff, 
+    // switch to the first of them once the lock is released.
+    //
+    
+    Thread = ReleaseSemaphoreWaiters(Semaphore, (Semaphore->Flags & UT_SYNC_DIRECT_HANDOFF) != 0);
+    UtReleaseSpinLock(&Semaphore->Lock);
+
+    if (Thread != NULL) {
+        UtUnparkAndSwitch(Thread);
+    }
+}
+
+//
+// Initializes a condition variable instance.
+//
+
+VOID
+UtInitializeCondition (
+    __out PUTHREAD_CONDITION Condition
+    )
+{
+    UtInitializeSpinLock(&Condition->Lock);
+    InitializeListHead(&Condition->WaitListHead);
+    Condition->Mutex = NULL;
+}
+
+//
+// Releases the specified mutex, which must be owned by the current thread, and blocks
+// the current thread until the condition is signalled. The mutex is reacquired, with
+// its previous recursion count, before the function returns.
+//
+
+VOID
+UtWaitCondition (
+    __inout PUTHREAD_CONDITION Condition,
+    __inout PUTHREAD_MUTEX Mutex
+    )
+{
+    ULONG RecursionCounter;
+    HANDLE Thread;
+    WAIT_BLOCK WaitBlock;
+
+    _ASSERTE(Mutex->Owner == UtSelf());
+
+    RecursionCounter = Mutex->RecursionCounter;
+    InitializeWaitBlock(&WaitBlock);
+
+    //
+    // Insert the running thread in the wait list and release the mutex while holding the
+    // condition's lock, so that the thread can't be requeued on the mutex it still owns.
+    //
+
+    UtAcquireSpinLock(&Condition->Lock);
+    _ASSERTE(IsListEmpty(&Condition->WaitListHead) || Condition->Mutex == Mutex);
+    Condition->Mutex = Mutex;
+    InsertTailList(&Condition->WaitListHead, &WaitBlock.WaitListEntry);
+    UtAcquireSpinLock(&Mutex->Lock);
+    Thread = ReleaseMutexOwnership(Mutex);
+    UtReleaseSpinLock(&Mutex->Lock);
+    UtReleaseSpinLock(&Condition->Lock);
+
+    //
+    // Park the current thread. When the thread is unparked, it will have been signalled
+    // and will have ownership of the mutex, unless the mutex is barging, in which case
+    // the thread competes for it. With direct handoff, switch straight to the thread that
+    // got ownership of the mutex, or that competes for it.
+    //
+
+    if (Thread != NULL && (Mutex->Flags & UT_SYNC_DIRECT_HANDOFF) != 0) {
+        UtSwitchTo(Thread);
+    } else {
+        if (Thread != NULL) {
+            UtUnpark(Thread);
+        }
+
+        UtPark();
+    }
+
+    while ((Mutex->Flags & UT_SYNC_BARGING) != 0 && !RetryBargingMutex(Mutex, &WaitBlock, FALSE)) {
+        UtPark();
+    }
+
+    _ASSERTE(Mutex->Owner == WaitBlock.Thread);
+    Mutex->RecursionCounter = RecursionCounter;
+}
+
+//
+// Moves the thread that has been waiting the longest on the condition, or all of the 
+// waiting threads if All is TRUE, to the wait list of the associated mutex. If the mutex
+// is free, it is given to the first of those threads, which is returned so that it can
+// be unparked once the locks are released. Must be called with the condition's lock held
+// and with waiting threads.
+//
+
+static
+HANDLE
+RequeueConditionWaiters (
+    __inout PUTHREAD_CONDITION Condition,
+    __in BOOL All
+    )
+{
+    PUTHREAD_MUTEX Mutex;
+    HANDLE Thread;
+    PWAIT_BLOCK WaitBlock;
+
+    Mutex = Condition->Mutex;
+    Thread = NULL;
+
+    UtAcquireSpinLock(&Mutex->Lock);
+
+    if (Mutex->Owner == NULL) {
+        WaitBlock = CONTAINING_RECORD(RemoveHeadList(&Condition->WaitListHead), WAIT_BLOCK, WaitListEntry);
+        Mutex->Owner = Thread = WaitBlock->Thread;
+        Mutex->RecursionCounter = 1;
+    } else if (!All) {
+        InsertMutexWaiter(Mutex, CONTAINING_RECORD(RemoveHeadList(&Condition->WaitListHead), 
+                                                   WAIT_BLOCK, WaitListEntry));
+    }
+
+    if (All) {
+        if ((Mutex->Flags & UT_SYNC_PRIORITY) == 0) {
+            SpliceTailList(&Mutex->WaitListHead, &Condition->WaitListHead);
+        } else {
+            while (!IsListEmpty(&Condition->WaitListHead)) {
+                InsertMutexWaiter(Mutex, CONTAINING_RECORD(RemoveHeadList(&Condition->WaitListHead), 
+                                                           WAIT_BLOCK, WaitListEntry));
+            }
+        }
+    }
+
+    UtReleaseSpinLock(&Mutex->Lock);
+    return Thread;
+}
+
+//
+// Wakes up the thread that has been waiting the longest on the condition, if any.
+//
+
+VOID
+UtSignalCondition (
+    __inout PUTHREAD_CONDITION Condition
+    )
+{
+    HANDLE Thread;
+
+    Thread = NULL;
+
+    UtAcquireSpinLock(&Condition->Lock);
+
+    if (!IsListEmpty(&Condition->WaitListHead)) {
+        Thread = RequeueConditionWaiters(Condition, FALSE);
+    }
+
+    UtReleaseSpinLock(&Condition->Lock);
+
+    if (Thread != NULL) {
+        UtUnpark(Thread);
+    }
+}
+
+//
+// Wakes up all the threads waiting on the condition. The waiters are moved to the wait 
+// list of the mutex in a single operation, and acquire the mutex in the order in which 
+// they started waiting.
+//
+
+VOID
+UtBroadcastCondition (
+    __inout PUTHREAD_CONDITION Condition
+    )
+{
+    HANDLE Thread;
+
+    Thread = NULL;
+
+    UtAcquireSpinLock(&Condition->Lock);
+
+    if (!IsListEmpty(&Condition->WaitListHead)) {
+        Thread = RequeueConditionWaiters(Condition, TRUE);
+    }
+
+    UtReleaseSpinLock(&Condition->Lock);
+
+    if (Thread != NULL) {
+        UtUnpark(Thread);
+    }
+}
+
+//
+// Initializes an event instance, which is a manual-reset event if ManualReset is TRUE,
+// and is initially signalled if Signalled is TRUE.
+//
+
+VOID
+UtInitializeEvent (
+    __out PUTHREAD_EVENT Event,
+    __in BOOL ManualReset,
+    __in BOOL Signalled
+    )
+{
+    UtInitializeSpinLock(&Event->Lock);
+    InitializeListHead(&Event->WaitListHead);
+    Event->Signalled = Signalled;
+    Event->ManualReset = ManualReset;
+}
+
+//
+// Blocks the current thread until the specified event is signalled. If the event is
+// an auto-reset event, it is reset.
+//
+
+VOID
+UtWaitForEvent (
+    __inout PUTHREAD_EVENT Event
+    )
+{
+    UtAcquireSpinLock(&Event->Lock);
+
+    if (Event->Signalled) {
+        Event->Signalled = Event->ManualReset;
+        UtReleaseSpinLock(&Event->Lock);
+        return;
+    }
+
+    //
+    // Insert the running thread in the wait list, through its own list entry, and park it.
+    //
+
+    InsertTailList(&Event->WaitListHead, UtGetThreadListEntry(UtSelf()));
+    UtReleaseSpinLock(&Event->Lock);
+
+    UtPark();
+}
+
+//
+// Signals the specified event, eventually unblocking waiting threads.
+//
+
+VOID
+UtSetEvent (
+    __inout PUTHREAD_EVENT Event
+    )
+{
+    LIST_ENTRY Waiters;
+    HANDLE Thread;
+
+    UtAcquireSpinLock(&Event->Lock);
+
+    if (Event->ManualReset) {
+
+        //
+        // Detach all the waiters and ready them with a single splice.
+        //
+
+        Event->Signalled = TRUE;
+        InitializeListHead(&Waiters);
+        SpliceTailList(&Waiters, &Event->WaitListHead);
+        UtReleaseSpinLock(&Event->Lock);
+        UtUnparkList(&Waiters);
+        return;
+    }
+
+    if (IsListEmpty(&Event->WaitListHead)) {
+        Event->Signalled = TRUE;
+        UtReleaseSpinLock(&Event->Lock);
+        return;
+    }
+
+    Thread = UtGetListEntryThread(RemoveHeadList(&Event->WaitListHead));
+    UtReleaseSpinLock(&Event->Lock);
+    UtUnpark(Thread);
+}
+
+//
+// Resets the specified event to the non-signalled state.
+//
+
+VOID
+UtResetEvent (
+    __inout PUTHREAD_EVENT Event
+    )
+{
+    UtAcquireSpinLock(&Event->Lock);
+    Event->Signalled = FALSE;
+    UtReleaseSpinLock(&Event->Lock);
+}
+
+//
+// Initializes a reader-writer lock instance with the specified policy.
+//
+
+VOID
+UtInitializeRWLock (
+    __out PUTHREAD_RWLOCK RWLock,
+    __in RWLOCK_POLICY Policy
+    )
+{
+    UtInitializeSpinLock(&RWLock->Lock);
+    InitializeListHead(&RWLock->ReaderWaitListHead);
+    InitializeListHead(&RWLock->WriterWaitListHead);
+    RWLock->Readers = 0;
+    RWLock->RecursionCounter = 0;
+    RWLock->Writer = NULL;
+    RWLock->Policy = Policy;
+}
+
+//
+// Returns TRUE if a thread that already holds SharedLocks shared acquisitions can be
+// admitted as a reader. Must be called with the lock held.
+//
+
+FORCEINLINE
+BOOL
+AreReadersAdmitted (
+    __in PUTHREAD_RWLOCK RWLock,
+    __in ULONG SharedLocks
+    )
+{
+    return RWLock->Writer == NULL 
+        && (RWLock->Policy == RWLockReaderPreference 
+            || IsListEmpty(&RWLock->WriterWaitListHead)
+            || (SharedLocks > 0 && RWLock->Readers > 0));
+}
+
+//
+// Admits all the waiting readers, which are moved from their wait blocks to a list
+// linked through their own list entries, so that they can be readied in a single batch
+// once the lock is released. Must be called with the lock held.
+//
+
+static
+VOID
+AdmitWaitingReaders (
+    __inout PUTHREAD_RWLOCK RWLock,
+    __out PLIST_ENTRY Readers
+    )
+{
+    PWAIT_BLOCK WaitBlock;
+
+    while (!IsListEmpty(&RWLock->ReaderWaitListHead)) {
+        WaitBlock = CONTAINING_RECORD(RemoveHeadList(&RWLock->ReaderWaitListHead), WAIT_BLOCK, WaitListEntry);
+        InsertTailList(Readers, UtGetThreadListEntry(WaitBlock->Thread));
+        RWLock->Readers += 1;
+    }
+}
+
+//
+// Hands the lock, which is free, to the next waiting writer, which is returned so that
+// it can be unparked once the lock is released, or NULL if no writers are waiting.
+// Must be called with the lock held.
+//
+
+static
+HANDLE
+AdmitWaitingWriter (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    PWAIT_BLOCK WaitBlock;
+
+    if (IsListEmpty(&RWLock->WriterWaitListHead)) {
+        return NULL;
+    }
+
+    WaitBlock = CONTAINING_RECORD(RemoveHeadList(&RWLock->WriterWaitListHead), WAIT_BLOCK, WaitListEntry);
+    RWLock->Writer = WaitBlock->Thread;
+    RWLock->RecursionCounter = 1;
+    return WaitBlock->Thread;
+}
+
+//
+// Acquires the specified reader-writer lock in shared mode, blocking the current thread
+// until readers are admitted. Shared acquisitions may be recursive.
+//
+
+VOID
+UtAcquireRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    PULONG SharedLocks;
+    WAIT_BLOCK WaitBlock;
+
+    SharedLocks = UtGetSharedLockCount();
+
+    UtAcquireSpinLock(&RWLock->Lock);
+    _ASSERTE(RWLock->Writer != UtSelf());
+
+    if (AreReadersAdmitted(RWLock, *SharedLocks)) {
+        RWLock->Readers += 1;
+        UtReleaseSpinLock(&RWLock->Lock);
+        *SharedLocks += 1;
+        return;
+    }
+
+    //
+    // Insert the running thread in the readers' wait list and park it. When the 
+    // thread is unparked, it will have been admitted as a reader.
+    //
+
+    InitializeWaitBlock(&WaitBlock);
+    InsertTailList(&RWLock->ReaderWaitListHead, &WaitBlock.WaitListEntry);
+    UtReleaseSpinLock(&RWLock->Lock);
+
+    UtPark();
+    *SharedLocks += 1;
+}
+
+//
+// Acquires the specified reader-writer lock in shared mode if readers are admitted.
+// Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    PULONG SharedLocks;
+    BOOL Acquired;
+
+    SharedLocks = UtGetSharedLockCount();
+
+    UtAcquireSpinLock(&RWLock->Lock);
+
+    if ((Acquired = AreReadersAdmitted(RWLock, *SharedLocks))) {
+        RWLock->Readers += 1;
+    }
+
+    UtReleaseSpinLock(&RWLock->Lock);
+
+    if (Acquired) {
+        *SharedLocks += 1;
+    }
+
+    return Acquired;
+}
+
+//
+// Releases a shared acquisition of the specified reader-writer lock. When the last
+// reader leaves, the lock is handed to the next waiting writer.
+//
+
+VOID
+UtReleaseRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    HANDLE Thread;
+
+    Thread = NULL;
+    *UtGetSharedLockCount() -= 1;
+
+    UtAcquireSpinLock(&RWLock->Lock);
+    _ASSERTE(RWLock->Readers > 0);
+
+    if ((RWLock->Readers -= 1) == 0) {
+        Thread = AdmitWaitingWriter(RWLock);
+    }
+
+    UtReleaseSpinLock(&RWLock->Lock);
+
+    if (Thread != NULL) {
+        UtUnpark(Thread);
+    }
+}
+
+//
+// Acquires the specified reader-writer lock in exclusive mode, blocking the current 
+// thread until the lock is free. Exclusive acquisitions may be recursive.
+//
+
+VOID
+UtAcquireRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    HANDLE Self;
+    WAIT_BLOCK WaitBlock;
+
+    UtAcquireSpinLock(&RWLock->Lock);
+
+    if (RWLock->Writer == (Self = UtSelf())) {
+        RWLock->RecursionCounter += 1;
+    } else if (RWLock->Writer == NULL && RWLock->Readers == 0) {
+        RWLock->Writer = Self;
+        RWLock->RecursionCounter = 1;
+    } else {
+
+        //
+        // Insert the running thread in the writers' wait list and park it. When the
+        // thread is unparked, it will have ownership of the lock.
+        //
+
+        InitializeWaitBlock(&WaitBlock);
+        InsertTailList(&RWLock->WriterWaitListHead, &WaitBlock.WaitListEntry);
+        UtReleaseSpinLock(&RWLock->Lock);
+
+        UtPark();
+        _ASSERTE(RWLock->Writer == Self);
+        return;
+    }
+
+    UtReleaseSpinLock(&RWLock->Lock);
+}
+
+//
+// Acquires the specified reader-writer lock in exclusive mode if it is free or owned
+// exclusively by the current thread. Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    HANDLE Self;
+    BOOL Acquired;
+
+    UtAcquireSpinLock(&RWLock->Lock);
+
+    if ((Acquired = RWLock->Writer == (Self = UtSelf()))) {
+        RWLock->RecursionCounter += 1;
+    } else if ((Acquired = RWLock->Writer == NULL && RWLock->Readers == 0)) {
+        RWLock->Writer = Self;
+        RWLock->RecursionCounter = 1;
+    }
+
+    UtReleaseSpinLock(&RWLock->Lock);
+    return Acquired;
+}
+
+//
+// Releases an exclusive acquisition of the specified reader-writer lock. When the 
+// writer releases the lock, it is handed either to all the waiting readers or to the 
+// next waiting writer, according to the lock's policy.
+//
+
+VOID
+UtReleaseRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    )
+{
+    LIST_ENTRY Readers;
+    HANDLE Thread;
+
+    _ASSERTE(RWLock->Writer == UtSelf());
+
+    if ((RWLock->RecursionCounter -= 1) > 0) {
+        return;
+    }
+
+    Thread = NULL;
+    InitializeListHead(&Readers);
+
+    UtAcquireSpinLock(&RWLock->Lock);
+    RWLock->Writer = NULL;
+
+    //
+    // Writer preference hands the lock to the next writer, if any. Otherwise, all the
+    // waiting readers are admitted in a batch, or else the next writer gets the lock.
+    //
+
+    if (RWLock->Policy == RWLockWriterPreference) {
+        Thread = AdmitWaitingWriter(RWLock);
+    }
+
+    if (Thread == NULL) {
+        AdmitWaitingReaders(RWLock, &Readers);
+
+        if (RWLock->Readers == 0) {
+            Thread = AdmitWaitingWriter(RWLock);
+        }
+    }
+
+    UtReleaseSpinLock(&RWLock->Lock);
+
+    if (Thread != NULL) {
+        UtUnpark(Thread);
+    } else {
+        UtUnparkList(&Readers);
+    }
+}
+
+//
+// Initializes a channel instance that buffers up to Capacity values in Buffer, which
+// must remain valid for as long as the channel is used. Capacity may be zero.
+//
+
+VOID
+UtInitializeChannel (
+    __out PUTHREAD_CHANNEL Channel,
+    __in_ecount_opt(Capacity) PVOID * Buffer,
+    __in ULONG Capacity
+    )
+{
+    UtInitializeChannelEx(Channel, Buffer, Capacity, 0);
+}
+
+//
+// Initializes a channel instance with the specified UT_SYNC_* options.
+//
+
+VOID
+UtInitializeChannelEx (
+    __out PUTHREAD_CHANNEL Channel,
+    __in_ecount_opt(Capacity) PVOID * Buffer,
+    __in ULONG Capacity,
+    __in ULONG Flags
+    )
+{
+    _ASSERTE(Buffer != NULL || Capacity == 0);
+
+    UtInitializeSpinLock(&Channel->Lock);
+    InitializeListHead(&Channel->SenderWaitListHead);
+    InitializeListHead(&Channel->ReceiverWaitListHead);
+    Channel->Buffer = Buffer;
+    Channel->Capacity = Capacity;
+    Channel->Head = 0;
+    Channel->Count = 0;
+    Channel->Closed = FALSE;
+    Channel->Flags = Flags;
+}
+
+//
+// Removes the first waiter from the specified wait list, marking its operation as
+// completed. Must be called with the lock held and with waiters in the list.
+//
+
+FORCEINLINE
+PCHANNEL_WAIT_BLOCK
+CompleteChannelWaiter (
+    __inout PLIST_ENTRY WaitListHead
+    )
+{
+    PCHANNEL_WAIT_BLOCK WaitBlock;
+
+    WaitBlock = CONTAINING_RECORD(RemoveHeadList(WaitListHead), CHANNEL_WAIT_BLOCK, Header.WaitListEntry);
+    WaitBlock->Completed = TRUE;
+    return WaitBlock;
+}
+
+//
+// Sends the specified value through the channel, blocking the current thread while the
+// buffer is full and no receivers are waiting. Returns FALSE if the channel is closed.
+//
+
+BOOL
+UtSendChannel (
+    __inout PUTHREAD_CHANNEL Channel,
+    __in PVOID Value
+    )
+{
+    ULONG Tail;
+    HANDLE Thread;
+    PCHANNEL_WAIT_BLOCK Receiver;
+    CHANNEL_WAIT_BLOCK WaitBlock;
+
+    UtAcquireSpinLock(&Channel->Lock);
+
+    if (Channel->Closed) {
+        UtReleaseSpinLock(&Channel->Lock);
+        return FALSE;
+    }
+
+    if (!IsListEmpty(&Channel->ReceiverWaitListHead)) {
+
+        //
+        // Receivers only wait while the buffer is empty. Hand the value directly to 
+        // the first of them.
+        //
+
+        Receiver = CompleteChannelWaiter(&Channel->ReceiverWaitListHead);
+        Receiver->Value = Value;
+        Thread = Receiver->Header.Thread;
+        UtReleaseSpinLock(&Channel->Lock);
+
+        UnparkWaiter(Thread, Channel->Flags);
+        return TRUE;
+    }
+
+    if (Channel->Count < Channel->Capacity) {
+        if ((Tail = Channel->Head + Channel->Count) >= Channel->Capacity) {
+            Tail -= Channel->Capacity;
+        }
+
+        Channel->Buffer[Tail] = Value;
+        Channel->Count += 1;
+        UtReleaseSpinLock(&Channel->Lock);
+        return TRUE;
+    }
+
+    //
+    // The buffer is full. Insert the running thread in the senders' wait list and park
+    // it until a receiver takes the value.
+    //
+
+    InitializeChannelWaitBlock(&WaitBlock, Value);
+    InsertTailList(&Channel->SenderWaitListHead, &WaitBlock.Header.WaitListEntry);
+    UtReleaseSpinLock(&Channel->Lock);
+
+    UtPark();
+    return WaitBlock.Completed;
+}
+
+//
+// Receives a value from the channel, blocking the current thread until one is sent.
+// Returns FALSE if the channel is closed and there are no more values to receive.
+//
+
+BOOL
+UtReceiveChannel (
+    __inout PUTHREAD_CHANNEL Channel,
+    __out PVOID * Value
+    )
+{
+    ULONG Tail;
+    HANDLE Thread;
+    PCHANNEL_WAIT_BLOCK Sender;
+    CHANNEL_WAIT_BLOCK WaitBlock;
+
+    UtAcquireSpinLock(&Channel->Lock);
+
+    if (Channel->Count > 0) {
+        *Value = Channel->Buffer[Channel->Head];
+
+        if ((Channel->Head += 1) == Channel->Capacity) {
+            Channel->Head = 0;
+        }
+
+        if (IsListEmpty(&Channel->SenderWaitListHead)) {
+            Channel->Count -= 1;
+            UtReleaseSpinLock(&Channel->Lock);
+            return TRUE;
+        }
+
+        //
+        // Senders only wait while the buffer is full. Move the value of the first of
+        // them to the slot that was just freed, at the tail of the buffer.
+        //
+
+        Sender = CompleteChannelWaiter(&Channel->SenderWaitListHead);
+
+        if ((Tail = Channel->Head + Channel->Count - 1) >= Channel->Capacity) {
+            Tail -= Channel->Capacity;
+        }
+
+        Channel->Buffer[Tail] = Sender->Value;
+    } else if (!IsListEmpty(&Channel->SenderWaitListHead)) {
+
+        //
+        // The channel has no buffer. Take the value directly from the first sender.
+        //
+
+        Sender = CompleteChannelWaiter(&Channel->SenderWaitListHead);
+        *Value = Sender->Value;
+    } else if (Channel->Closed) {
+        UtReleaseSpinLock(&Channel->Lock);
+        return FALSE;
+    } else {
+
+        //
+        // Insert the running thread in the receivers' wait list and park it until
+        // a sender hands it a value.
+        //
+
+        InitializeChannelWaitBlock(&WaitBlock, NULL);
+        InsertTailList(&Channel->ReceiverWaitListHead, &WaitBlock.Header.WaitListEntry);
+        UtReleaseSpinLock(&Channel->Lock);
+
+        UtPark();
+        *Value = WaitBlock.Value;
+        return WaitBlock.Completed;
+    }
+
+    Thread = Sender->Header.Thread;
+    UtReleaseSpinLock(&Channel->Lock);
+
+    UnparkWaiter(Thread, Channel->Flags);
+    return TRUE;
+}
+
+//
+// Moves the threads waiting in the specified list, whose operations fail, to a list
+// linked through their own list entries. Must be called with the lock held.
+//
+
+static
+VOID
+FailChannelWaiters (
+    __inout PLIST_ENTRY WaitListHead,
+    __inout PLIST_ENTRY Threads
+    )
+{
+    PCHANNEL_WAIT_BLOCK WaitBlock;
+
+    while (!IsListEmpty(WaitListHead)) {
+        WaitBlock = CONTAINING_RECORD(RemoveHeadList(WaitListHead), CHANNEL_WAIT_BLOCK, Header.WaitListEntry);
+        InsertTailList(Threads, UtGetThreadListEntry(WaitBlock->Header.Thread));
+    }
+}
+
+//
+// Closes the specified channel, failing the operations of the waiting senders and
+// receivers. Values that are already buffered can still be received.
+//
+
+VOID
+UtCloseChannel (
+    __inout PUTHREAD_CHANNEL Channel
+    )
+{
+    LIST_ENTRY Threads;
+
+    InitializeListHead(&Threads);
+
+    UtAcquireSpinLock(&Channel->Lock);
+    Channel->Closed = TRUE;
+    FailChannelWaiters(&Channel->SenderWaitListHead, &Threads);
+    FailChannelWaiters(&Channel->ReceiverWaitListHead, &Threads);
+    UtReleaseSpinLock(&Channel->Lock);
+
+    UtUnparkList(&Threads);
 }
@@ -40,15 +40,69 @@ InitializeWaitBlock (
     WaitBlock->Thread = UtSelf();
 }
 
+//
+// Options for the initialization of mutexes, semaphores and channels. With direct
+// handoff, a thread that hands a mutex, permits or a value to a waiting thread switches
+// to it right away, through UtUnparkAndSwitch, rather than placing it at the tail of the
+// ready queue, so that the waiter runs next regardless of how many threads are ready.
+//
+
+#define UT_SYNC_DIRECT_HANDOFF 0x00000001
+
+//
+// By default, a released mutex is handed to the thread at the head of the wait list,
+// which owns it before it even runs, so that a hot mutex forms a convoy: every thread 
+// that tries to acquire it waits behind the whole ready queue. A barging mutex is freed
+// on release instead, and the thread at the head of the wait list is only woken to
+// compete for it, while running threads may take the free mutex in the meantime. Once
+// the woken thread has lost the mutex to barging threads a few times in a row, the
+// next release hands the mutex to it, which bounds how long it can be starved.
+// Applies to mutexes only.
+//
+
+#define UT_SYNC_BARGING 0x00000002
+
+//
+// The policies with which a semaphore grants permits to its waiters. By default, requests
+// are granted in FIFO order, and a request that can't be satisfied blocks all the ones
+// queued behind it, even while permits sit unused. With first fit, the released permits
+// go to the oldest requests that can be satisfied, skipping the ones that can't. With
+// best fit, they go to the largest requests that can be satisfied, so that fewer permits
+// are left unused, the oldest one first among equal requests. In both cases, once the 
+// request at the head of the wait list has been bypassed a number of times, permits are 
+// held back for it, so that large requests are eventually served. Apply to semaphores only.
+//
+
+#define UT_SYNC_FIRST_FIT 0x00000004
+#define UT_SYNC_BEST_FIT 0x00000008
+
+//
+// By default, the threads blocked on a mutex acquire it in FIFO order. With priority
+// ordering, a blocking thread is queued behind the waiters of the same or higher priority
+// and ahead of those of lower priority, so that the mutex goes to the waiter with the
+// highest priority. A barging mutex never queues a thread ahead of a waiter that was 
+// already woken to compete for the mutex. Applies to mutexes only.
+//
+
+#define UT_SYNC_PRIORITY 0x00000010
+
 //
 // A mutex, containing the handle of the user thread that acquired RecursionCounter 
-// times the Mutex. If Owner is NULL, then the Mutex is free.
+// times the Mutex. If Owner is NULL, then the Mutex is free. Lock protects the 
+// mutex's state when the scheduler runs on multiple workers. For barging mutexes,
+// Waking tells whether the thread at the head of the wait list was woken and hasn't
+// run yet, and Bargings is the number of times in a row that thread was woken only
+// to find the mutex taken.
 //
 
 typedef struct _UTHREAD_MUTEX {
+    UT_SPIN_LOCK Lock;
     LIST_ENTRY WaitListHead;
     ULONG RecursionCounter;
     HANDLE Owner;
+    ULONG Flags;
+    BOOL Waking;
+    ULONG Bargings;
 } UTHREAD_MUTEX, *PUTHREAD_MUTEX;
 
 //
@@ -62,6 +116,17 @@ UtInitializeMutex (
     __in BOOL Owned
     );
 
+//
+// Initializes a mutex instance with the specified UT_SYNC_* options.
+//
+
+VOID
+UtInitializeMutexEx (
+    __out PUTHREAD_MUTEX Mutex,
+    __in BOOL Owned,
+    __in ULONG Flags
+    );
+
 //
 // Acquires the specified mutex, blocking the current thread if the mutex is not free.
 //
@@ -71,9 +136,30 @@ UtAcquireMutex (
     __inout PUTHREAD_MUTEX Mutex
     );
 
+//
+// Acquires the specified mutex if it is free or owned by the current thread. Returns
+// FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireMutex (
+    __inout PUTHREAD_MUTEX Mutex
+    );
+
+//
+// Acquires the specified mutex, blocking the current thread for up to the specified 
+// number of milliseconds if the mutex is not free. Returns FALSE if the timeout expired.
+//
+
+BOOL
+UtAcquireMutexTimeout (
+    __inout PUTHREAD_MUTEX Mutex,
+    __in ULONG Milliseconds
+    );
+
 //
 // Releases the specified mutex, eventually unblocking a waiting thread to which the
-// ownership of the mutex is transfered.
+// ownership of the mutex is transfered, or which competes for it if the mutex is barging.
 //
 
 VOID
@@ -83,12 +169,18 @@ UtReleaseMutex (
 
 //
 // A semaphore, containing the current number of permits, upper bounded by Limit.
+// Lock protects the semaphore's state when the scheduler runs on multiple workers.
+// Bypasses is the number of requests satisfied ahead of the request at the head of
+// the wait list, under the first-fit and best-fit policies.
 //
 
 typedef struct _UTHREAD_SEMAPHORE {
+    UT_SPIN_LOCK Lock;
     LIST_ENTRY WaitListHead;
     ULONG Permits;
     ULONG Limit;
+    ULONG Flags;
+    ULONG Bypasses;
 } UTHREAD_SEMAPHORE, *PUTHREAD_SEMAPHORE;
 
 //
@@ -128,6 +220,19 @@ UtInitializeSemaphore (
     __in ULONG Limit
     );
 
+//
+// Initializes a semaphore instance with the specified UT_SYNC_* options. With direct
+// handoff, the releasing thread switches to the first of the waiters it satisfies.
+//
+
+VOID
+UtInitializeSemaphoreEx (
+    __out PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits,
+    __in ULONG Limit,
+    __in ULONG Flags
+    );
+
 //
 // Gets the specified number of permits from the semaphore. If there aren't enough 
 // permits available, the calling thread is blocked until they are added by a call 
@@ -140,6 +245,30 @@ UtAcquireSemaphore (
     __in ULONG Permits
     );
 
+//
+// Gets the specified number of permits from the semaphore if they are available. 
+// Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireSemaphore (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits
+    );
+
+//
+// Gets the specified number of permits from the semaphore, blocking the current thread 
+// for up to the specified number of milliseconds if there aren't enough permits available. 
+// Returns FALSE if the timeout expired.
+//
+
+BOOL
+UtAcquireSemaphoreTimeout (
+    __inout PUTHREAD_SEMAPHORE Semaphore,
+    __in ULONG Permits,
+    __in ULONG Milliseconds
+    );
+
 //
 // Adds the specified number of permits to the semaphore, eventually unblocking 
 // waiting threads.
@@ -150,3 +279,327 @@ UtReleaseSemaphore (
     __inout PUTHREAD_SEMAPHORE Semaphore,
     __in ULONG Permits
     );
+
+//
+// A condition variable, on which threads wait for a condition protected by a mutex
+// to hold. Mutex is the mutex associated with the waiters, which is the same for all
+// of them. Signalled waiters are requeued on the wait list of the mutex, rather than
+// being unparked, so that they run one at a time as they get ownership of the mutex.
+// Lock protects the condition's state when the scheduler runs on multiple workers.
+//
+
+typedef struct _UTHREAD_CONDITION {
+    UT_SPIN_LOCK Lock;
+    LIST_ENTRY WaitListHead;
+    PUTHREAD_MUTEX Mutex;
+} UTHREAD_CONDITION, *PUTHREAD_CONDITION;
+
+//
+// Initializes a condition variable instance.
+//
+
+VOID
+UtInitializeCondition (
+    __out PUTHREAD_CONDITION Condition
+    );
+
+//
+// Releases the specified mutex, which must be owned by the current thread, and blocks
+// the current thread until the condition is signalled. The mutex is reacquired, with
+// its previous recursion count, before the function returns.
+//
+
+VOID
+UtWaitCondition (
+    __inout PUTHREAD_CONDITION Condition,
+    __inout PUTHREAD_MUTEX Mutex
+    );
+
+//
+// Wakes up the thread that has been waiting the longest on the condition, if any.
+//
+
+VOID
+UtSignalCondition (
+    __inout PUTHREAD_CONDITION Condition
+    );
+
+//
+// Wakes up all the threads waiting on the condition. The waiters are moved to the wait 
+// list of the mutex in a single operation, and acquire the mutex in the order in which 
+// they started waiting.
+//
+
+VOID
+UtBroadcastCondition (
+    __inout PUTHREAD_CONDITION Condition
+    );
+
+//
+// An event, which is either signalled or not. Setting a manual-reset event releases all
+// the waiting threads, and the event stays signalled until it is reset. Setting an 
+// auto-reset event releases a single waiting thread, or else leaves the event signalled
+// until a thread waits on it. Waiting threads are linked through their own list entries,
+// so that they can all be readied with a single splice. Lock protects the event's state 
+// when the scheduler runs on multiple workers.
+//
+
+typedef struct _UTHREAD_EVENT {
+    UT_SPIN_LOCK Lock;
+    LIST_ENTRY WaitListHead;
+    BOOL Signalled;
+    BOOL ManualReset;
+} UTHREAD_EVENT, *PUTHREAD_EVENT;
+
+//
+// Initializes an event instance, which is a manual-reset event if ManualReset is TRUE,
+// and is initially signalled if Signalled is TRUE.
+//
+
+VOID
+UtInitializeEvent (
+    __out PUTHREAD_EVENT Event,
+    __in BOOL ManualReset,
+    __in BOOL Signalled
+    );
+
+//
+// Blocks the current thread until the specified event is signalled. If the event is
+// an auto-reset event, it is reset.
+//
+
+VOID
+UtWaitForEvent (
+    __inout PUTHREAD_EVENT Event
+    );
+
+//
+// Signals the specified event, eventually unblocking waiting threads.
+//
+
+VOID
+UtSetEvent (
+    __inout PUTHREAD_EVENT Event
+    );
+
+//
+// Resets the specified event to the non-signalled state.
+//
+
+VOID
+UtResetEvent (
+    __inout PUTHREAD_EVENT Event
+    );
+
+//
+// The policies with which a reader-writer lock arbitrates between readers and writers.
+// With reader preference, readers are admitted whenever no writer owns the lock, even
+// if writers are waiting. With writer preference, readers aren't admitted while writers
+// are waiting, and a releasing writer hands the lock to the next writer. With phase-fair
+// arbitration, readers aren't admitted while writers are waiting either, but a releasing
+// writer admits all the waiting readers, so that reader and writer phases alternate.
+//
+
+typedef enum _RWLOCK_POLICY {
+    RWLockReaderPreference,
+    RWLockWriterPreference,
+    RWLockPhaseFair
+} RWLOCK_POLICY;
+
+//
+// A reader-writer lock, owned either exclusively by Writer, RecursionCounter times,
+// or shared by Readers acquisitions. Readers and writers wait in separate lists, and
+// the waiting readers that are admitted together are readied in a single batch. A
+// thread that already holds shared acquisitions is admitted as a reader while writers
+// are waiting, so that recursive shared acquisitions don't deadlock. Lock protects the 
+// state of the reader-writer lock when the scheduler runs on multiple workers.
+//
+
+typedef struct _UTHREAD_RWLOCK {
+    UT_SPIN_LOCK Lock;
+    LIST_ENTRY ReaderWaitListHead;
+    LIST_ENTRY WriterWaitListHead;
+    ULONG Readers;
+    ULONG RecursionCounter;
+    HANDLE Writer;
+    RWLOCK_POLICY Policy;
+} UTHREAD_RWLOCK, *PUTHREAD_RWLOCK;
+
+//
+// Initializes a reader-writer lock instance with the specified policy.
+//
+
+VOID
+UtInitializeRWLock (
+    __out PUTHREAD_RWLOCK RWLock,
+    __in RWLOCK_POLICY Policy
+    );
+
+//
+// Acquires the specified reader-writer lock in shared mode, blocking the current thread
+// until readers are admitted. Shared acquisitions may be recursive.
+//
+
+VOID
+UtAcquireRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// Acquires the specified reader-writer lock in shared mode if readers are admitted.
+// Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// Releases a shared acquisition of the specified reader-writer lock. When the last
+// reader leaves, the lock is handed to the next waiting writer.
+//
+
+VOID
+UtReleaseRWLockShared (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// Acquires the specified reader-writer lock in exclusive mode, blocking the current 
+// thread until the lock is free. Exclusive acquisitions may be recursive.
+//
+
+VOID
+UtAcquireRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// Acquires the specified reader-writer lock in exclusive mode if it is free or owned
+// exclusively by the current thread. Returns FALSE, without blocking, otherwise.
+//
+
+BOOL
+UtTryAcquireRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// Releases an exclusive acquisition of the specified reader-writer lock. When the 
+// writer releases the lock, it is handed either to all the waiting readers or to the 
+// next waiting writer, according to the lock's policy.
+//
+
+VOID
+UtReleaseRWLockExclusive (
+    __inout PUTHREAD_RWLOCK RWLock
+    );
+
+//
+// A bounded channel, through which threads send pointer-sized values to other threads,
+// in FIFO order. Values are buffered in the caller-supplied ring Buffer of Capacity 
+// slots, of which Count, starting at Head, are in use. A value sent while receivers 
+// are waiting is handed directly to the first of them, without going through the 
+// buffer; with a capacity of zero, every send is such a handoff. Once the channel is 
+// closed, sends fail and receives fail after the buffer is drained. Lock protects the 
+// channel's state when the scheduler runs on multiple workers.
+//
+
+typedef struct _UTHREAD_CHANNEL {
+    UT_SPIN_LOCK Lock;
+    LIST_ENTRY SenderWaitListHead;
+    LIST_ENTRY ReceiverWaitListHead;
+    PVOID * Buffer;
+    ULONG Capacity;
+    ULONG Head;
+    ULONG Count;
+    BOOL Closed;
+    ULONG Flags;
+} UTHREAD_CHANNEL, *PUTHREAD_CHANNEL;
+
+//
+// Wait block used to queue senders and receivers on channels. Value is the value being
+// sent or received, and Completed tells whether the operation was completed by the
+// thread that unparked the waiter, rather than failed by the closing of the channel.
+//
+
+typedef struct _CHANNEL_WAIT_BLOCK {
+    WAIT_BLOCK Header;
+    PVOID Value;
+    BOOL Completed;
+} CHANNEL_WAIT_BLOCK, *PCHANNEL_WAIT_BLOCK;
+
+//
+// Initializes the specified channel wait block.
+//
+
+FORCEINLINE
+VOID
+InitializeChannelWaitBlock (
+    __out PCHANNEL_WAIT_BLOCK ChannelWaitBlock,
+    __in PVOID Value
+    )
+{
+    InitializeWaitBlock(&ChannelWaitBlock->Header);
+    ChannelWaitBlock->Value = Value;
+    ChannelWaitBlock->Completed = FALSE;
+}
+
+//
+// Initializes a channel instance that buffers up to Capacity values in Buffer, which
+// must remain valid for as long as the channel is used. Capacity may be zero.
+//
+
+VOID
+UtInitializeChannel (
+    __out PUTHREAD_CHANNEL Channel,
+    __in_ecount_opt(Capacity) PVOID * Buffer,
+    __in ULONG Capacity
+    );
+
+//
+// Initializes a channel instance with the specified UT_SYNC_* options. With direct
+// handoff, a thread that completes the operation of a waiting sender or receiver
+// switches to it.
+//
+
+VOID
+UtInitializeChannelEx (
+    __out PUTHREAD_CHANNEL Channel,
+    __in_ecount_opt(Capacity) PVOID * Buffer,
+    __in ULONG Capacity,
+    __in ULONG Flags
+    );
+
+//
+// Sends the specified value through the channel, blocking the current thread while the
+// buffer is full and no receivers are waiting. Returns FALSE if the channel is closed.
+//
+
+BOOL
+UtSendChannel (
+    __inout PUTHREAD_CHANNEL Channel,
+    __in PVOID Value
+    );
+
+//
+// Receives a value from the channel, blocking the current thread until one is sent.
+// Returns FALSE if the channel is closed and there are no more values to receive.
+//
+
+BOOL
+UtReceiveChannel (
+    __inout PUTHREAD_CHANNEL Channel,
+    __out PVOID * Value
+    );
+
+//
+// Closes the specified channel, failing the operations of the waiting senders and
+// receivers. Values that are already buffered can still be received.
+//
+
+VOID
+UtCloseChannel (
+    __inout PUTHREAD_CHANNEL Channel
+    );
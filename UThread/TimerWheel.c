@@ -0,0 +1,293 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#include "TimerWheel.h"
+#include "List.h"
+
+//
+// The number of ticks spanned by a slot of the specified upper level.
+//
+
+#define LEVEL_SHIFT(Level) (TIMER_WHEEL_LEVEL0_BITS + ((Level) - 1) * TIMER_WHEEL_LEVEL_BITS)
+
+//
+// The number of ticks covered by the whole wheel.
+//
+
+#define WHEEL_SPAN ((ULONG64) 1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+//
+// Links the specified timer in the slot where it is due, relative to the current
+// tick. Timers due beyond the span of the wheel are placed in the slot of the last
+// level that comes due last, from where they are cascaded down again.
+//
+
+static
+VOID
+InsertWheelTimer (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PWHEEL_TIMER Timer
+    )
+{
+    ULONG64 Deadline;
+    ULONG64 Delta;
+    ULONG Level;
+
+    Deadline = Timer->Deadline < Wheel->CurrentTick ? Wheel->CurrentTick : Timer->Deadline;
+    Delta = Deadline - Wheel->CurrentTick;
+
+    if (Delta < TIMER_WHEEL_LEVEL0_SIZE) {
+        InsertTailList(&Wheel->Level0[Deadline & (TIMER_WHEEL_LEVEL0_SIZE - 1)], &Timer->Link);
+        return;
+    }
+
+    if (Delta >= WHEEL_SPAN) {
+        Deadline = Wheel->CurrentTick + WHEEL_SPAN - 1;
+        Delta = WHEEL_SPAN - 1;
+    }
+
+    for (Level = 1; Delta >= ((ULONG64) 1 << LEVEL_SHIFT(Level + 1)); ++Level) {
+        ;
+    }
+
+    InsertTailList(&Wheel->Levels[Level - 1][(Deadline >> LEVEL_SHIFT(Level)) & (TIMER_WHEEL_LEVEL_SIZE - 1)],
+                   &Timer->Link);
+}
+
+//
+// Moves the timers in the specified slot of an upper level to the levels below.
+//
+
+static
+VOID
+CascadeWheelTimers (
+    __inout PTIMER_WHEEL Wheel,
+    __in ULONG Level,
+    __in ULONG Index
+    )
+{
+    LIST_ENTRY Timers;
+    PLIST_ENTRY Slot;
+
+    Slot = &Wheel->Levels[Level - 1][Index];
+    if (IsListEmpty(Slot)) {
+        return;
+    }
+
+    //
+    // Detach the slot's list first, as timers may be reinserted in the same slot.
+    //
+
+    Timers.Flink = Slot->Flink;
+    Timers.Blink = Slot->Blink;
+    Timers.Flink->Blink = &Timers;
+    Timers.Blink->Flink = &Timers;
+    InitializeListHead(Slot);
+
+    while (!IsListEmpty(&Timers)) {
+        InsertWheelTimer(Wheel, CONTAINING_RECORD(RemoveHeadList(&Timers), WHEEL_TIMER, Link));
+    }
+}
+
+//
+// Initializes the specified wheel, starting at CurrentTick.
+//
+
+VOID
+InitializeTimerWheel (
+    __out PTIMER_WHEEL Wheel,
+    __in ULONG64 CurrentTick
+    )
+{
+    ULONG Level;
+    ULONG Index;
+
+    Wheel->CurrentTick = CurrentTick;
+    Wheel->NumberOfTimers = 0;
+
+    for (Index = 0; Index < TIMER_WHEEL_LEVEL0_SIZE; ++Index) {
+        InitializeListHead(&Wheel->Level0[Index]);
+    }
+
+    for (Level = 1; Level < TIMER_WHEEL_LEVELS; ++Level) {
+        for (Index = 0; Index < TIMER_WHEEL_LEVEL_SIZE; ++Index) {
+            InitializeListHead(&Wheel->Levels[Level - 1][Index]);
+        }
+    }
+}
+
+//
+// Inserts the specified timer, whose Deadline must be set, in the wheel.
+// A timer due before the current tick expires on the next advance.
+//
+
+VOID
+AddWheelTimer (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PWHEEL_TIMER Timer
+    )
+{
+    InsertWheelTimer(Wheel, Timer);
+    Wheel->NumberOfTimers += 1;
+}
+
+//
+// Advances the wheel up to and including tick Now, moving the timers that expire
+// to the tail of the Expired list. Returns the number of expired timers.
+//
+
+ULONG
+AdvanceTimerWheel (
+    __inout PTIMER_WHEEL Wheel,
+    __in ULONG64 Now,
+    __inout PLIST_ENTRY Expired
+    )
+{
+    ULONG Count;
+    ULONG Index;
+    ULONG Level;
+    ULONG64 Next;
+    PLIST_ENTRY Slot;
+
+    Count = 0;
+
+    while (Wheel->CurrentTick <= Now) {
+
+        //
+        // When far behind, skip the ticks at which there is nothing to do.
+        //
+
+        if (Wheel->NumberOfTimers == 0) {
+            Wheel->CurrentTick = Now + 1;
+            break;
+        }
+
+        if (Now - Wheel->CurrentTick >= TIMER_WHEEL_LEVEL0_SIZE) {
+            Next = GetNextWheelEvent(Wheel);
+            if (Next > Now) {
+                Wheel->CurrentTick = Now + 1;
+                break;
+            }
+
+            Wheel->CurrentTick = Next;
+        }
+
+        //
+        // At the start of a turn of the first level, cascade the next slot of each
+        // upper level that also starts a turn, starting from the lowest.
+        //
+
+        Index = (ULONG) (Wheel->CurrentTick & (TIMER_WHEEL_LEVEL0_SIZE - 1));
+
+        if (Index == 0) {
+            for (Level = 1; Level < TIMER_WHEEL_LEVELS; ++Level) {
+                Index = (ULONG) (Wheel->CurrentTick >> LEVEL_SHIFT(Level)) & (TIMER_WHEEL_LEVEL_SIZE - 1);
+                CascadeWheelTimers(Wheel, Level, Index);
+                if (Index != 0) {
+                    break;
+                }
+            }
+
+            Index = 0;
+        }
+
+        Slot = &Wheel->Level0[Index];
+        while (!IsListEmpty(Slot)) {
+            InsertTailList(Expired, RemoveHeadList(Slot));
+            Wheel->NumberOfTimers -= 1;
+            Count += 1;
+        }
+
+        Wheel->CurrentTick += 1;
+    }
+
+    return Count;
+}
+
+//
+// Returns the tick at which the wheel must next be advanced, because a timer expires
+// or must be cascaded, or TIMER_WHEEL_NO_EVENT if the wheel is empty.
+//
+
+ULONG64
+GetNextWheelEvent (
+    __in PTIMER_WHEEL Wheel
+    )
+{
+    ULONG Index;
+    ULONG Level;
+    ULONG64 Next;
+    ULONG64 Tick;
+
+    if (Wheel->NumberOfTimers == 0) {
+        return TIMER_WHEEL_NO_EVENT;
+    }
+
+    Next = TIMER_WHEEL_NO_EVENT;
+
+    for (Index = 0; Index < TIMER_WHEEL_LEVEL0_SIZE; ++Index) {
+        Tick = Wheel->CurrentTick + Index;
+        if (!IsListEmpty(&Wheel->Level0[Tick & (TIMER_WHEEL_LEVEL0_SIZE - 1)])) {
+            Next = Tick;
+            break;
+        }
+    }
+
+    //
+    // A slot of an upper level must be cascaded at the start of its span. Slots are
+    // visited in the order in which they come due, the slot that is due next being
+    // the current one only if its span hasn't started.
+    //
+
+    for (Level = 1; Level < TIMER_WHEEL_LEVELS; ++Level) {
+        for (Index = 0; Index <= TIMER_WHEEL_LEVEL_SIZE; ++Index) {
+            Tick = ((Wheel->CurrentTick >> LEVEL_SHIFT(Level)) + Index) << LEVEL_SHIFT(Level);
+            if (Tick >= Next) {
+                break;
+            }
+
+            if (Tick >= Wheel->CurrentTick
+                && !IsListEmpty(&Wheel->Levels[Level - 1][(Tick >> LEVEL_SHIFT(Level)) & (TIMER_WHEEL_LEVEL_SIZE - 1)])) {
+                Next = Tick;
+                break;
+            }
+        }
+    }
+
+    return Next;
+}
+
+//
+// Removes all the timers from the wheel, moving them to the tail of the Timers list.
+//
+
+VOID
+FlushWheelTimers (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PLIST_ENTRY Timers
+    )
+{
+    ULONG Index;
+    ULONG Level;
+    PLIST_ENTRY Slot;
+
+    for (Level = 0; Level < TIMER_WHEEL_LEVELS; ++Level) {
+        for (Index = 0; Index < (Level == 0 ? TIMER_WHEEL_LEVEL0_SIZE : TIMER_WHEEL_LEVEL_SIZE); ++Index) {
+            Slot = Level == 0 ? &Wheel->Level0[Index] : &Wheel->Levels[Level - 1][Index];
+            while (!IsListEmpty(Slot)) {
+                InsertTailList(Timers, RemoveHeadList(Slot));
+            }
+        }
+    }
+
+    Wheel->NumberOfTimers = 0;
+}
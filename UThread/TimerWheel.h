@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#pragma once
+
+#include "Platform.h"
+
+//
+// A hierarchical timing wheel, after Varghese and Lauck, holding timers with a
+// resolution of one tick. The first level has a slot per tick for the next 256
+// ticks. Each of the other three levels has 64 slots, each spanning a whole turn
+// of the level below, so that the wheel covers 2^26 ticks; timers due further away
+// are placed in the last level and moved down again when it turns. Timers are
+// inserted and cancelled in constant time. As the wheel advances, the timers in
+// a slot of a higher level are cascaded to the levels below when the slot comes
+// due, and the timers in the current slot of the first level expire.
+//
+
+#define TIMER_WHEEL_LEVEL0_BITS 8
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_LEVELS 4
+
+#define TIMER_WHEEL_LEVEL0_SIZE (1 << TIMER_WHEEL_LEVEL0_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+
+//
+// A timer, linked in a slot of the wheel through Link, which expires at Deadline.
+//
+
+typedef struct _WHEEL_TIMER {
+    LIST_ENTRY Link;
+    ULONG64 Deadline;
+} WHEEL_TIMER, *PWHEEL_TIMER;
+
+typedef struct _TIMER_WHEEL {
+
+    //
+    // The next tick to be processed. All timers due before it have expired.
+    //
+
+    ULONG64 CurrentTick;
+
+    //
+    // The number of timers in the wheel.
+    //
+
+    ULONG NumberOfTimers;
+
+    //
+    // The slots of the first level and of the upper levels.
+    //
+
+    LIST_ENTRY Level0[TIMER_WHEEL_LEVEL0_SIZE];
+    LIST_ENTRY Levels[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_LEVEL_SIZE];
+
+} TIMER_WHEEL, *PTIMER_WHEEL;
+
+//
+// The value returned by GetNextWheelEvent when the wheel is empty.
+//
+
+#define TIMER_WHEEL_NO_EVENT (~(ULONG64) 0)
+
+//
+// Initializes the specified wheel, starting at CurrentTick.
+//
+
+VOID
+InitializeTimerWheel (
+    __out PTIMER_WHEEL Wheel,
+    __in ULONG64 CurrentTick
+    );
+
+//
+// Inserts the specified timer, whose Deadline must be set, in the wheel.
+// A timer due before the current tick expires on the next advance.
+//
+
+VOID
+AddWheelTimer (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PWHEEL_TIMER Timer
+    );
+
+//
+// Removes the specified timer from the wheel, before it expires.
+//
+
+FORCEINLINE
+VOID
+CancelWheelTimer (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PWHEEL_TIMER Timer
+    )
+{
+    PLIST_ENTRY Flink;
+    PLIST_ENTRY Blink;
+
+    Flink = Timer->Link.Flink;
+    Blink = Timer->Link.Blink;
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    Wheel->NumberOfTimers -= 1;
+}
+
+//
+// Advances the wheel up to and including tick Now, moving the timers that expire
+// to the tail of the Expired list. Returns the number of expired timers.
+//
+
+ULONG
+AdvanceTimerWheel (
+    __inout PTIMER_WHEEL Wheel,
+    __in ULONG64 Now,
+    __inout PLIST_ENTRY Expired
+    );
+
+//
+// Returns the tick at which the wheel must next be advanced, because a timer expires
+// or must be cascaded, or TIMER_WHEEL_NO_EVENT if the wheel is empty.
+//
+
+ULONG64
+GetNextWheelEvent (
+    __in PTIMER_WHEEL Wheel
+    );
+
+//
+// Removes all the timers from the wheel, moving them to the tail of the Timers list.
+//
+
+VOID
+FlushWheelTimers (
+    __inout PTIMER_WHEEL Wheel,
+    __inout PLIST_ENTRY Timers
+    );
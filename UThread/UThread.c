@@ -14,15 +14,32 @@
 // 
 //
 
-#include <crtdbg.h>
+//
+// pthread_setaffinity_np is a GNU extension.
+//
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "UThread.h"
 #include "List.h"
+#include "Reactor.h"
+#include "TimerWheel.h"
+#include "Uring.h"
+#include "WorkDeque.h"
+
+#if defined(_WIN32)
+#pragma comment(lib, "Synchronization.lib")
+#endif
 
 //
 // The data structure representing the layout of a thread's execution 
 // context when saved in the thread's stack.
 //
 
+#if defined(_M_IX86)
+
 typedef struct _UTHREAD_CONTEXT {
     ULONG EDI;
     ULONG ESI;
@@ -31,11 +48,61 @@ typedef struct _UTHREAD_CONTEXT {
     VOID (*RetAddr)();
 } UTHREAD_CONTEXT, *PUTHREAD_CONTEXT;
 
+#elif defined(__x86_64__)
+
+//
+// Only the registers that the System V AMD64 ABI defines as callee-saved are
+// part of the context: RBX, RBP and R12-R15, plus the control bits of MXCSR and
+// the x87 control word. Everything else is dead across the call to ContextSwitch.
+//
+
+typedef struct _UTHREAD_CONTEXT {
+    ULONG MXCSR;
+    USHORT FPUCW;
+    USHORT Padding;
+    ULONG64 R15;
+    ULONG64 R14;
+    ULONG64 R13;
+    ULONG64 R12;
+    ULONG64 RBX;
+    ULONG64 RBP;
+    VOID (*RetAddr)();
+} UTHREAD_CONTEXT, *PUTHREAD_CONTEXT;
+
+//
+// The default MXCSR (all exceptions masked, round to nearest) and x87 control 
+// word (all exceptions masked, 64-bit precision, round to nearest) values.
+//
+
+#define INITIAL_MXCSR 0x1F80
+#define INITIAL_FPUCW 0x037F
+
+#else
+#error "UThread: unsupported architecture."
+#endif
+
 //
 // The descriptor of a user thread, containing an intrusive link through which 
 // the thread is linked in the ready queue, the thread's starting function and 
 // argument, the memory block used as the thread's stack and a pointer to the  
-// saved execution context.
+// saved execution context. The descriptor is placed at the top of the stack's 
+// memory block, right above the highest stack word, and the link also chains
+// the blocks of exited threads in the thread block pool. Running is set while
+// the thread's context is loaded on a worker. Timer links the thread in the timer
+// wheel of TimerWorker while it is in a timed park, and ParkState tells whether the 
+// park ended because the thread was unparked or because the timer expired. Scheduler is
+// the scheduler the thread was created on, and runs on until it exits. SharedLocks
+// counts the shared acquisitions of reader-writer locks held by the thread. JoinState
+// tells whether the thread is detached or joinable, and whether a joinable thread has
+// exited or is being joined by Joiner; ExitValue is the value the thread exited with.
+// StackHighWater is the stack depth measured when the thread exited, if stack profiling
+// was enabled. A thread that UsesSharedStack has no stack of its own; while another
+// thread runs on the shared stack, its frames are kept in the SavedFrames buffer, of
+// SavedFramesSize bytes. PriorityLevel is the thread's priority less UT_PRIORITY_LOWEST,
+// which indexes the ready queues. Under fair scheduling, VirtualRuntime is the time the
+// thread ran, scaled by UT_WEIGHT_NORMAL over its Weight. With UT_STATS, the thread's
+// runtime counters follow, along with the state they are being accumulated for and the
+// timestamp at which the thread entered it.
 //
 
 typedef struct _UTHREAD {
@@ -44,40 +111,525 @@ typedef struct _UTHREAD {
     UT_ARGUMENT Argument;   
     PUCHAR Stack;
     PUTHREAD_CONTEXT ThreadContext;
+    SIZE_T StackSize;
+    volatile LONG Running;
+    volatile LONG ParkState;
+    ULONG PriorityLevel;
+    ULONG Weight;
+    ULONG64 VirtualRuntime;
+    WHEEL_TIMER Timer;
+    struct _UT_WORKER * TimerWorker;
+    PUT_SCHEDULER Scheduler;
+    ULONG SharedLocks;
+    volatile LONG JoinState;
+    struct _UTHREAD * Joiner;
+    PVOID ExitValue;
+    SIZE_T StackHighWater;
+    BOOL UsesSharedStack;
+    PUCHAR SavedFrames;
+    SIZE_T SavedFramesSize;
+#if defined(UT_STATS)
+    UT_THREAD_STATS Stats;
+    ULONG StatsState;
+    ULONG64 StatsTimestamp;
+#endif
 } UTHREAD, *PUTHREAD;
 
 //
-// The fixed stack size of a user thread.
+// UtGetThreadListEntry relies on the link being the first field of the descriptor.
+//
+
+C_ASSERT(FIELD_OFFSET(UTHREAD, Link) == 0);
+
+#if defined(__x86_64__)
+
+//
+// The offset of UTHREAD.ThreadContext, as used by the assembly routines.
+//
+
+#define UTHREAD_CONTEXT_OFFSET 40
+C_ASSERT(FIELD_OFFSET(UTHREAD, ThreadContext) == UTHREAD_CONTEXT_OFFSET);
+
+#endif
+
+//
+// The default stack size of a user thread, which includes the thread's descriptor.
 //
 
 #define STACK_SIZE (16 * 4096)
 
 //
-// The number of existing user threads.
+// The stack memory block of a user thread is reserved with page granularity, 
+// starting with an inaccessible guard page that turns a stack overflow into a 
+// fault. The descriptor occupies the topmost bytes of the block.
+//
+// +------------+
+// |  UTHREAD   |    <- Thread, at Thread->Stack + Thread->StackSize - DESCRIPTOR_SIZE
+// +============+
+// |            | -+
+// |     :      |  |
+// |     :      |  +-> Stack space, committed page by page on first touch.
+// |     :      |  |
+// |            | -+  <- Thread->Stack
+// +============+
+// | Guard page |
+// +------------+
+//
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define GUARD_SIZE PAGE_SIZE
+#define ROUND_TO_PAGES(Size) (((Size) + PAGE_SIZE - 1) & ~((SIZE_T) PAGE_SIZE - 1))
+#define DESCRIPTOR_SIZE ((sizeof(UTHREAD) + 15) & ~((SIZE_T) 15))
+
+//
+// Stack blocks come in size classes of 2, 4, 8 and 16 pages, the largest being the
+// default size. Only blocks of a size class are pooled, and adaptive stack sizing
+// picks among them.
+//
+
+#define NUMBER_OF_STACK_CLASSES 4
+#define STACK_CLASS_SIZE(Class) (((SIZE_T) 2 * PAGE_SIZE) << (Class))
+
+C_ASSERT(STACK_CLASS_SIZE(NUMBER_OF_STACK_CLASSES - 1) == STACK_SIZE);
+
+//
+// The number of slots of the stack profile table, and the number of threads running
+// a function that must have exited before new ones get an adaptive stack size.
+//
+
+#define STACK_PROFILE_ENTRIES 256
+#define STACK_PROFILE_SAMPLES 16
+
+//
+// The size of the shared stack, and of the frames that a thread running on it starts
+// with, which hold its initial context.
+//
+
+#define SHARED_STACK_SIZE (64 * PAGE_SIZE)
+#define INITIAL_FRAMES_SIZE (sizeof(UTHREAD_CONTEXT) + sizeof(ULONG_PTR))
+
+//
+// The default limits of the thread block pool.
+//
+
+#define POOL_LOW_WATERMARK 16
+#define POOL_HIGH_WATERMARK 64
+
+//
+// The priority level of threads of normal priority, and the decoding of the priority
+// given to UtCreateEx through UT_CREATE_PRIORITY, sign-extending its five bits.
+//
+
+#define NORMAL_PRIORITY_LEVEL (UT_PRIORITY_NORMAL - UT_PRIORITY_LOWEST)
+#define GET_CREATE_PRIORITY(Flags) ((LONG) ((((Flags) >> 8) & 0x1F) ^ 0x10) - 0x10)
+
+//
+// The number of NUMA nodes with a thread block pool of their own. Workers pinned to 
+// processors of higher nodes share the pool of the last one.
+//
+
+#define MAXIMUM_NODES 16
+
+//
+// The processor of a worker that isn't pinned.
+//
+
+#define PROCESSOR_ANY ((ULONG) -1)
+
+//
+// The number of times an idle worker spins looking for ready threads before blocking.
+//
+
+#define IDLE_SPIN_COUNT 64
+
+//
+// The number of ready threads a worker takes between polls for readiness events and
+// submissions of queued io_uring operations, while there are threads waiting for I/O.
+//
+
+#define IO_POLL_INTERVAL 64
+
+//
+// The states of a thread with respect to a timed park. A thread in a timed park is
+// readied by whichever comes first of an unpark, which moves it from PARK_TIMED to 
+// PARK_NONE, and the expiry of its timer, which moves it to PARK_TIMED_OUT. An unpark 
+// that comes after the timer expired is absorbed, moving the thread to PARK_NONE 
+// without readying it again.
+//
+
+#define PARK_NONE 0
+#define PARK_TIMED 1
+#define PARK_TIMED_OUT 2
+
+//
+// The states of a thread with respect to joining. A detached thread's block is released
+// as soon as it exits. A joinable thread moves to JOIN_JOINING when a thread waits for it
+// to exit, and to JOIN_EXITED when it exits, after which its stack is released, but its
+// descriptor is kept until the thread is joined or detached.
+//
+
+#define JOIN_DETACHED 0
+#define JOIN_JOINABLE 1
+#define JOIN_JOINING 2
+#define JOIN_EXITED 3
+
+#if defined(UT_STATS)
+
+//
+// The states for which the runtime counters of a thread accumulate time.
+//
+
+#define STATS_PARKED 0
+#define STATS_READY 1
+#define STATS_RUNNING 2
+
+#endif
+
+//
+// A worker is an operating system thread that runs the user threads of a scheduler.
+// Each worker has its own ready queue, running thread and thread block pool. When the 
+// scheduler runs on a single worker, ready threads are linked in the ReadyQueues list of
+// their priority. With multiple workers, threads of normal priority are held in the
+// worker's work-stealing Deque instead, from which workers that run out of ready threads
+// steal. Either way, the other levels are only looked at when ReadyLevels says so.
+//
+
+typedef struct _UT_WORKER {
+
+    //
+    // The work-stealing deque of ready threads, used with multiple workers.
+    //
+
+    WORK_DEQUE Deque;
+
+    //
+    // The bitmap of the priority levels, other than normal, whose ready queues aren't
+    // empty. The threads of normal priority are found by checking their queue directly,
+    // except under fair scheduling, where the normal bit is set while the fair queue of
+    // the scheduler isn't empty.
+    //
+
+    ULONG ReadyLevels;
+
+    //
+    // The currently executing thread.
+    //
+
+    PUTHREAD RunningThread;
+
+    //
+    // The scheduler the worker belongs to.
+    //
+
+    PUT_SCHEDULER Scheduler;
+
+    //
+    // The sentinels of the circular lists linking the user threads that are schedulable,
+    // one per priority level. The next thread to run is retrieved from the head of the
+    // highest priority list that isn't empty.
+    //
+
+    LIST_ENTRY ReadyQueues[UT_PRIORITY_LEVELS];
+
+    //
+    // The user thread proxy of the worker's operating system thread. This thread 
+    // is switched back in when there are no more runnable user threads in the 
+    // worker's ready queue, to look for work elsewhere or to exit the scheduler.
+    //
+
+    PUTHREAD MainThread;
+
+    //
+    // The thread switched out by the context switch in progress, whose Running 
+    // flag is cleared once its context is saved.
+    //
+
+    PUTHREAD SwitchedOutThread;
+
+    //
+    // The worker's pool of descriptor and stack blocks of exited threads, which
+    // are reused by UtCreate. Blocks are recycled LIFO, so that the most recently
+    // touched stack is handed out first. When the pool grows beyond HighWatermark
+    // blocks, it is trimmed down to LowWatermark blocks. There is a list per stack
+    // size class; blocks of other sizes aren't pooled.
+    //
+
+    LIST_ENTRY ThreadBlockPool[NUMBER_OF_STACK_CLASSES];
+    ULONG NumberOfPooledBlocks;
+
+    //
+    // The state of the pseudo-random choice of the first victim to steal from.
+    //
+
+    ULONG StealSeed;
+
+    //
+    // The processor the worker is pinned to, or PROCESSOR_ANY, and its NUMA node, which
+    // is 0 when the worker isn't pinned. Workers steal from others on their node first.
+    //
+
+    ULONG Processor;
+    ULONG Node;
+
+    //
+    // The timers of the threads in a timed park on the worker, in milliseconds. 
+    // TimerLock protects the wheel, as threads cancel their timers from whichever 
+    // worker they resume on.
+    //
+
+    UT_SPIN_LOCK TimerLock;
+    TIMER_WHEEL TimerWheel;
+
+#if !defined(_WIN32)
+
+    //
+    // The number of ready threads to take before the worker next polls the reactor
+    // and submits the queued io_uring operations.
+    //
+
+    ULONG IoPollCountdown;
+#endif
+
+#if defined(UT_STATS)
+
+    //
+    // The worker's share of the scheduler gauges. ReadyCount is the length of ReadyQueues
+    // on a single worker, and PrioritizedCount the number of threads in the queues of 
+    // other than normal priority, which are the only ones besides the deque with multiple
+    // workers. ReadyHighWatermark is the highest number of ready threads the worker held.
+    //
+
+    ULONG ReadyCount;
+    ULONG PrioritizedCount;
+    ULONG ReadyHighWatermark;
+    ULONG64 Creations;
+    ULONG64 Exits;
+#endif
+
+    //
+    // The operating system thread running the worker, if not the primary worker.
+    //
+
+#if defined(_WIN32)
+    HANDLE OsThread;
+#else
+    pthread_t OsThread;
+#endif
+
+} UT_WORKER, *PUT_WORKER;
+
+//
+// The inbound queue, through which operating system threads that aren't running
+// the scheduler, and the threads of other schedulers, ready user threads. They push 
+// threads onto a lock-free stack linked through UTHREAD.Link.Flink, which the scheduler
+// detaches as a whole and drains in FIFO order at its next switch point. Head is kept
+// in its own cache line, as it is written by foreign threads and read by the scheduler
+// at every switch.
+//
+
+typedef struct _INBOUND_QUEUE {
+    DECLSPEC_CACHEALIGN PLIST_ENTRY volatile Head;
+} INBOUND_QUEUE, *PINBOUND_QUEUE;
+
+//
+// The state through which workers with nothing to run block until there is work
+// for them, so that an idle scheduler uses no processor time. With multiple workers,
+// idle workers first spin for a while looking for ready threads, being counted in
+// NumberOfSpinningWorkers. Then, one of them becomes the Poller and blocks on 
+// WakeEvent, which is signalled when threads are posted to the inbound queue, and, on
+// the default scheduler, on the descriptors of the reactor, while the others block on
+// the WakeSequence futex, which is advanced to wake them up when threads are readied 
+// and no worker is spinning. Workers are also woken up when the last user thread exits
+// and when the scheduler is shut down.
+//
+
+typedef struct _IDLE_WORKERS {
+    DECLSPEC_CACHEALIGN volatile LONG Poller;
+    volatile LONG NumberOfSpinningWorkers;
+    volatile LONG NumberOfSleepingWorkers;
+    volatile LONG WakeSequence;
+    volatile LONG ShutdownRequested;
+#if defined(_WIN32)
+    HANDLE WakeEvent;
+#else
+    int WakeEvent;
+#endif
+} IDLE_WORKERS, *PIDLE_WORKERS;
+
+//
+// The shared stack, on which the threads created with UT_CREATE_SHARED_STACK run, one
+// at a time. The frames of the thread that last ran on the stack, its Owner, are left
+// in place when it's switched out, and are only copied out to a buffer that fits them 
+// when another thread needs the stack, which gets its frames copied back in. Frames are
+// anchored at Top, so they are always copied back to the same addresses, and pointers 
+// into them remain valid. A switch between two threads that run on the shared stack 
+// goes through Transit, a thread with a small stack of its own, which moves the frames
+// of both, switching out From or releasing its resources if it is exiting, and then
+// switching in To.
+//
+
+typedef struct _SHARED_STACK {
+    PUCHAR Top;
+    PUTHREAD Owner;
+    PUTHREAD Transit;
+    PUTHREAD TransitFrom;
+    PUTHREAD TransitTo;
+    BOOL TransitExit;
+} SHARED_STACK, *PSHARED_STACK;
+
+//
+// The ready threads of normal priority of a scheduler with fair scheduling, when it runs
+// on a single worker, in a 4-ary min-heap ordered by virtual runtime. The entries hold
+// a copy of the key, so that sifting doesn't touch the descriptors, and the heap has 
+// room for all the threads of the scheduler, so that inserting a thread never fails.
+// MinVirtualRuntime is the greatest virtual runtime of the threads taken from the heap,
+// WakeupCredit how far behind it a readied thread may be placed, and SliceStart the
+// timestamp from which the running thread is charged. ChargedThread is the thread that
+// was just charged before switching out, so that the switch doesn't read the time again.
+// Lock serializes the growth of the heap by threads created on different workers.
+//
+
+typedef struct _FAIR_ENTRY {
+    ULONG64 VirtualRuntime;
+    PUTHREAD Thread;
+} FAIR_ENTRY, *PFAIR_ENTRY;
+
+typedef struct _FAIR_QUEUE {
+    UT_SPIN_LOCK Lock;
+    PFAIR_ENTRY Entries;
+    ULONG Count;
+    ULONG Capacity;
+    ULONG64 MinVirtualRuntime;
+    ULONG64 WakeupCredit;
+    ULONG64 SliceStart;
+    PUTHREAD ChargedThread;
+} FAIR_QUEUE, *PFAIR_QUEUE;
+
+#define FAIR_HEAP_ARITY 4
+
+//
+// A scheduler runs its user threads on one or more workers, and shares nothing with
+// other schedulers but the configuration of the thread block pools, the pools of each
+// NUMA node, the stack profile, and the reactor and io_uring instance, which only the
+// threads of the default scheduler can use. A scheduler is reached through the worker
+// running on the current operating system thread, and before it runs, through the 
+// scheduler the thread selected. The primary worker runs on the operating system thread
+// that calls UtRun, and is the only worker when the scheduler runs on a single worker. 
+// Threads created before the scheduler starts are placed in its ready queue. Workers are
+// the workers of the running scheduler, and MultipleWorkers tells whether there is more
+// than one. When Processors is set, the workers are pinned to those processors, and 
+// MultipleNodes tells whether they span more than one NUMA node. FairShare tells whether
+// fair scheduling is enabled, in which case, on a single worker, the ready threads of 
+// normal priority are held in FairQueue instead of the primary worker's ready queue.
+//
+
+struct _UT_SCHEDULER {
+    INBOUND_QUEUE InboundQueue;
+    IDLE_WORKERS IdleWorkers;
+    UT_WORKER PrimaryWorker;
+    PUT_WORKER * Workers;
+    ULONG NumberOfActiveWorkers;
+    BOOL MultipleWorkers;
+    BOOL FairShare;
+    BOOL MultipleNodes;
+    PULONG Processors;
+    ULONG NumberOfProcessors;
+    volatile LONG NumberOfThreads;
+    SHARED_STACK SharedStack;
+    FAIR_QUEUE FairQueue;
+};
+
+//
+// The scheduler of the operating system threads that didn't select another one.
+//
+
+static UT_SCHEDULER DefaultScheduler;
+
+//
+// The scheduler selected by the current operating system thread, or NULL if it uses
+// the default scheduler.
+//
+
+static THREAD_LOCAL PUT_SCHEDULER CurrentScheduler;
+
+//
+// The worker running on the current operating system thread, or NULL if no scheduler
+// is running on it.
+//
+
+static THREAD_LOCAL PUT_WORKER CurrentWorker;
+
+//
+// Whether the current operating system thread runs a scheduler on a single worker, 
+// mirroring the MultipleWorkers flag of the scheduler of CurrentWorker.
+//
+
+THREAD_LOCAL BOOL UtSingleWorker;
+
+//
+// Whether any scheduler runs on more than one worker, and the number of those that do.
+// MultipleWorkersLock serializes the updates to both.
+//
+
+BOOL UtMultipleWorkers;
+static ULONG NumberOfMultipleWorkerSchedulers;
+static UT_SPIN_LOCK MultipleWorkersLock;
+
+//
+// The limits of the thread block pools.
 //
 
-static ULONG NumberOfThreads;
+static ULONG PoolLowWatermark = POOL_LOW_WATERMARK;
+static ULONG PoolHighWatermark = POOL_HIGH_WATERMARK;
 
 //
-// The sentinel of the circular list linking the user threads that are schedulable. 
-// The next thread to run is retrieved from the head of the list.
+// Whether stacks are zeroed before being handed to a new thread.
 //
 
-static LIST_ENTRY ReadyQueue = { &ReadyQueue, &ReadyQueue };
+static BOOL PoolZeroStacks = TRUE;
 
 //
-// The currently executing thread.
+// The pools of thread blocks per NUMA node, shared by all schedulers. When a secondary
+// worker leaves the scheduler, its blocks, whose pages were touched on its node, go to 
+// the pool of that node instead of the primary worker's, and workers on the node take 
+// blocks from it when their own pool runs dry. Each pool holds up to HighWatermark 
+// blocks. The lists are initialized on first use.
 //
 
-PUTHREAD RunningThread;
+typedef struct _NODE_POOL {
+    DECLSPEC_CACHEALIGN UT_SPIN_LOCK Lock;
+    LIST_ENTRY ThreadBlockPool[NUMBER_OF_STACK_CLASSES];
+    ULONG NumberOfPooledBlocks;
+} NODE_POOL, *PNODE_POOL;
+
+static NODE_POOL NodePools[MAXIMUM_NODES];
 
 //
-// The user thread proxy of the main operating system thread. This thread 
-// is switched back in when there are no more runnable user threads and the 
-// scheduler will exit.
+// The stack profile, which keeps, for each function that threads ran, the number of 
+// those threads that exited while profiling was enabled and the deepest stack any of
+// them used. Once enough threads ran a function, StackSize is the size class that new
+// threads running it get in adaptive mode. The table is open addressed, and entries 
+// are inserted and updated while holding Lock, but looked up without it.
 //
 
-PUTHREAD MainThread;
+typedef struct _STACK_PROFILE_ENTRY {
+    UT_FUNCTION Function;
+    ULONG Threads;
+    SIZE_T HighWater;
+    SIZE_T StackSize;
+} STACK_PROFILE_ENTRY, *PSTACK_PROFILE_ENTRY;
+
+typedef struct _STACK_PROFILE {
+    UT_SPIN_LOCK Lock;
+    BOOL Enabled;
+    BOOL Adaptive;
+    STACK_PROFILE_ENTRY Entries[STACK_PROFILE_ENTRIES];
+} STACK_PROFILE, *PSTACK_PROFILE;
+
+static STACK_PROFILE StackProfile;
 
 //
 // Forward declaration of helper functions.
@@ -96,7 +648,7 @@ InternalStart (
 //
 // Performs a context switch from CurrentThread (switch out) to NextThread (switch in).
 // __fastcall sets the calling convention such that CurrentThread is in ECX and 
-// NextThread in EDX.
+// NextThread in EDX. On x86-64, CurrentThread is in RDI and NextThread in RSI.
 //
 
 static
@@ -110,10 +662,11 @@ ContextSwitch (
 //
 // Frees the resources associated with CurrentThread and switches to NextThread.
 // __fastcall sets the calling convention such that CurrentThread is in ECX and 
-// NextThread in EDX.
+// NextThread in EDX. On x86-64, CurrentThread is in RDI and NextThread in RSI.
 //
 
 static
+DECLSPEC_NORETURN
 VOID
 __fastcall
 InternalExit (
@@ -122,224 +675,3728 @@ InternalExit (
     );
 
 //
-// Returns and removes the first user thread in the ready queue. If the ready queue is empty, 
-// the main thread is returned.
+// Releases the resources associated with the specified exited thread.
+//
+
+static
+VOID
+__fastcall
+CleanupThread (
+    __inout PUTHREAD Thread
+    );
+
+//
+// Acquires a spin lock protecting state shared by all the schedulers, which must be
+// taken even while no scheduler runs on multiple workers. Such a lock is released 
+// with UtReleaseSpinLock.
 //
 
 FORCEINLINE
+VOID
+AcquireGlobalSpinLock (
+    __inout PUT_SPIN_LOCK Lock
+    )
+{
+    while (InterlockedExchange(Lock, 1) != 0) {
+        do {
+            YieldProcessor();
+        } while (*Lock != 0);
+    }
+}
+
+//
+// Reserves the memory block of a thread with a stack of StackSize bytes, a multiple 
+// of the page size. Pages are only backed by physical memory when first touched, 
+// so the resident size of the block tracks the actual depth of the stack. Returns 
+// the thread descriptor, placed at the top of the block, or NULL on failure.
+//
+
+static
 PUTHREAD
-PluckNextReadyThread (
+AllocateThreadBlock (
+    __in SIZE_T StackSize
     )
 {
-    return IsListEmpty(&ReadyQueue) 
-         ? MainThread 
-         : CONTAINING_RECORD(RemoveHeadList(&ReadyQueue), UTHREAD, Link);
+    PUCHAR Block;
+    PUTHREAD Thread;
+
+#if defined(_WIN32)
+
+    //
+    // Reserve the whole block and commit everything but the guard page. Committed
+    // pages are only charged against the commit limit until they are first touched.
+    //
+
+    Block = (PUCHAR) VirtualAlloc(NULL, GUARD_SIZE + StackSize, MEM_RESERVE, PAGE_NOACCESS);
+    if (Block == NULL) {
+        return NULL;
+    }
+
+    if (VirtualAlloc(Block + GUARD_SIZE, StackSize, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+        VirtualFree(Block, 0, MEM_RELEASE);
+        return NULL;
+    }
+
+#else
+
+    //
+    // Map the block without reserving swap space and revoke access to the guard page.
+    // Note that each block takes two VMAs, so very large numbers of threads require
+    // raising vm.max_map_count.
+    //
+
+    Block = (PUCHAR) mmap(NULL, GUARD_SIZE + StackSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (Block == (PUCHAR) MAP_FAILED) {
+        return NULL;
+    }
+
+    if (mprotect(Block, GUARD_SIZE, PROT_NONE) != 0) {
+        munmap(Block, GUARD_SIZE + StackSize);
+        return NULL;
+    }
+
+#endif
+
+    Thread = (PUTHREAD) (Block + GUARD_SIZE + StackSize - DESCRIPTOR_SIZE);
+    Thread->Stack = Block + GUARD_SIZE;
+    Thread->StackSize = StackSize;
+    Thread->UsesSharedStack = FALSE;
+    Thread->SavedFrames = NULL;
+    return Thread;
 }
 
 //
-// Definition of the public interface.
+// Releases the memory block of the specified thread, or the descriptor and the saved
+// frames of a thread that runs on the shared stack.
 //
 
+static
+VOID
+FreeThreadBlock (
+    __inout PUTHREAD Thread
+    )
+{
+    if (Thread->UsesSharedStack) {
+        free(Thread->SavedFrames);
+        _aligned_free(Thread);
+        return;
+    }
+
+#if defined(_WIN32)
+    VirtualFree(Thread->Stack - GUARD_SIZE, 0, MEM_RELEASE);
+#else
+    munmap(Thread->Stack - GUARD_SIZE, GUARD_SIZE + Thread->StackSize);
+#endif
+}
+
+//
+// Returns all the pages of the specified thread's stack but the topmost one, which 
+// holds the descriptor, to the operating system, to be zero-filled on demand when 
+// touched again. The saved frames of a thread that runs on the shared stack are freed.
+//
+
+static
+VOID
+DecommitThreadStack (
+    __inout PUTHREAD Thread
+    )
+{
+    SIZE_T Size;
+
+    if (Thread->UsesSharedStack) {
+        free(Thread->SavedFrames);
+        Thread->SavedFrames = NULL;
+        return;
+    }
+
+    Size = Thread->StackSize - PAGE_SIZE;
+
+#if defined(_WIN32)
+    VirtualFree(Thread->Stack, Size, MEM_DECOMMIT);
+    VirtualAlloc(Thread->Stack, Size, MEM_COMMIT, PAGE_READWRITE);
+#else
+    madvise(Thread->Stack, Size, MADV_DONTNEED);
+#endif
+}
+
+//
+// Zeroes the stack of a recycled thread block.
+//
+
+static
+VOID
+ResetThreadStack (
+    __inout PUTHREAD Thread
+    )
+{
+    DecommitThreadStack(Thread);
+    RtlZeroMemory(Thread->Stack + Thread->StackSize - PAGE_SIZE, PAGE_SIZE - DESCRIPTOR_SIZE);
+}
+
+//
+// Frees blocks of the specified thread block pool, a list per size class holding 
+// NumberOfPooledBlocks blocks in all, until at most Watermark blocks remain.
+//
+
+static
+VOID
+TrimThreadBlockPool (
+    __inout_ecount(NUMBER_OF_STACK_CLASSES) PLIST_ENTRY ThreadBlockPool,
+    __inout PULONG NumberOfPooledBlocks,
+    __in ULONG Watermark
+    )
+{
+    ULONG Class;
+    PUTHREAD Thread;
+
+    //
+    // Free the blocks of the largest size class first.
+    //
+
+    for (Class = NUMBER_OF_STACK_CLASSES - 1; *NumberOfPooledBlocks > Watermark; --Class) {
+        while (!IsListEmpty(&ThreadBlockPool[Class]) && *NumberOfPooledBlocks > Watermark) {
+            Thread = CONTAINING_RECORD(RemoveHeadList(&ThreadBlockPool[Class]), UTHREAD, Link);
+            *NumberOfPooledBlocks -= 1;
+            FreeThreadBlock(Thread);
+        }
+    }
+}
+
+//
+// Frees pooled thread blocks of the specified worker until at most Watermark blocks remain.
+//
+
+FORCEINLINE
+VOID
+TrimWorkerThreadBlockPool (
+    __inout PUT_WORKER Worker,
+    __in ULONG Watermark
+    )
+{
+    TrimThreadBlockPool(Worker->ThreadBlockPool, &Worker->NumberOfPooledBlocks, Watermark);
+}
+
+//
+// Acquires the lock of the pool of the specified NUMA node, initializing the pool
+// on first use.
+//
+
+static
+PNODE_POOL
+AcquireNodePool (
+    __in ULONG Node
+    )
+{
+    ULONG Class;
+    PNODE_POOL Pool;
+
+    Pool = &NodePools[Node];
+    AcquireGlobalSpinLock(&Pool->Lock);
+
+    if (Pool->ThreadBlockPool[0].Flink == NULL) {
+        for (Class = 0; Class < NUMBER_OF_STACK_CLASSES; ++Class) {
+            InitializeListHead(&Pool->ThreadBlockPool[Class]);
+        }
+    }
+
+    return Pool;
+}
+
+//
+// Takes a block of the specified size class from the pool of the specified worker or,
+// if it has none, from the pool of the worker's NUMA node. Returns NULL if neither has
+// a block of that class.
+//
+
+FORCEINLINE
+PUTHREAD
+TakePooledThreadBlock (
+    __inout PUT_WORKER Worker,
+    __in ULONG Class
+    )
+{
+    PNODE_POOL Pool;
+    PUTHREAD Thread;
+
+    if (!IsListEmpty(&Worker->ThreadBlockPool[Class])) {
+        Worker->NumberOfPooledBlocks -= 1;
+        return CONTAINING_RECORD(RemoveHeadList(&Worker->ThreadBlockPool[Class]), UTHREAD, Link);
+    }
+
+    //
+    // Peek at the node's pool before taking its lock, as it is usually empty.
+    //
+
+    if (NodePools[Worker->Node].NumberOfPooledBlocks == 0) {
+        return NULL;
+    }
+
+    Thread = NULL;
+    Pool = AcquireNodePool(Worker->Node);
+    if (!IsListEmpty(&Pool->ThreadBlockPool[Class])) {
+        Thread = CONTAINING_RECORD(RemoveHeadList(&Pool->ThreadBlockPool[Class]), UTHREAD, Link);
+        Pool->NumberOfPooledBlocks -= 1;
+    }
+    UtReleaseSpinLock(&Pool->Lock);
+    return Thread;
+}
+
+//
+// Moves the pooled blocks of a worker that leaves the scheduler to the pool of its NUMA
+// node, up to the pool's HighWatermark, and frees the remaining ones.
+//
+
+static
+VOID
+SpillThreadBlockPool (
+    __inout PUT_WORKER Worker
+    )
+{
+    ULONG Class;
+    PNODE_POOL Pool;
+
+    Pool = AcquireNodePool(Worker->Node);
+    for (Class = 0; Class < NUMBER_OF_STACK_CLASSES; ++Class) {
+        while (!IsListEmpty(&Worker->ThreadBlockPool[Class]) && Pool->NumberOfPooledBlocks < PoolHighWatermark) {
+            InsertHeadList(&Pool->ThreadBlockPool[Class], RemoveHeadList(&Worker->ThreadBlockPool[Class]));
+            Pool->NumberOfPooledBlocks += 1;
+            Worker->NumberOfPooledBlocks -= 1;
+        }
+    }
+    UtReleaseSpinLock(&Pool->Lock);
+
+    TrimWorkerThreadBlockPool(Worker, 0);
+}
+
+//
+// Returns the size class of stack blocks of StackSize bytes, or NUMBER_OF_STACK_CLASSES
+// if StackSize isn't the size of a class.
+//
+
+FORCEINLINE
+ULONG
+GetStackClass (
+    __in SIZE_T StackSize
+    )
+{
+    ULONG Class;
+
+    for (Class = 0; Class < NUMBER_OF_STACK_CLASSES && STACK_CLASS_SIZE(Class) != StackSize; ++Class) {
+    }
+
+    return Class;
+}
+
+//
+// Returns the block of an exited thread to the pool of the specified worker, trimming
+// the pool if it grew too large. Blocks whose stack size isn't that of a size class
+// are freed right away.
+//
+
+static
+VOID
+ReleaseThreadBlock (
+    __inout PUT_WORKER Worker,
+    __inout PUTHREAD Thread
+    )
+{
+    ULONG Class;
+
+    if ((Class = GetStackClass(Thread->StackSize)) == NUMBER_OF_STACK_CLASSES) {
+        FreeThreadBlock(Thread);
+        return;
+    }
+
+    InsertHeadList(&Worker->ThreadBlockPool[Class], &Thread->Link);
+
+    if ((Worker->NumberOfPooledBlocks += 1) > PoolHighWatermark) {
+        TrimWorkerThreadBlockPool(Worker, PoolLowWatermark);
+    }
+}
+
+//
+// Returns the number of bytes between the descriptor of the specified thread and the
+// deepest non-zero word of its stack, which is zero-filled when handed to the thread
+// unless disabled by UtConfigureThreadBlockPool. For a thread that runs on the shared
+// stack, returns the size of the largest frames it had saved.
+//
+
+static
+SIZE_T
+MeasureStackHighWater (
+    __in PUTHREAD Thread
+    )
+{
+    PULONG_PTR Top;
+    PULONG_PTR Word;
+#if !defined(_WIN32)
+    SIZE_T Index;
+    SIZE_T Pages;
+    UCHAR Resident[64];
+#endif
+
+    if (Thread->UsesSharedStack) {
+        return Thread->StackHighWater;
+    }
+
+    Word = (PULONG_PTR) Thread->Stack;
+    Top = (PULONG_PTR) Thread;
+
+#if !defined(_WIN32)
+
+    //
+    // Skip the pages that aren't resident, which the thread never touched, rather than
+    // faulting them in.
+    //
+
+    while (Word < Top) {
+        Pages = ((PUCHAR) Top - (PUCHAR) Word + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (Pages > sizeof(Resident)) {
+            Pages = sizeof(Resident);
+        }
+
+        if (mincore(Word, Pages * PAGE_SIZE, Resident) != 0) {
+            break;
+        }
+
+        for (Index = 0; Index < Pages && (Resident[Index] & 1) == 0; ++Index) {
+        }
+
+        Word = (PULONG_PTR) ((PUCHAR) Word + Index * PAGE_SIZE);
+        if (Index < Pages) {
+            break;
+        }
+    }
+
+#endif
+
+    while (Word < Top && *Word == 0) {
+        ++Word;
+    }
+
+    return (PUCHAR) Top - (PUCHAR) Word;
+}
+
+//
+// Returns the entry of the stack profile for the specified function, or NULL if there
+// is none. If Insert is TRUE, an entry is inserted if there is room for it, which must 
+// be done while holding the lock of the profile.
+//
+
+static
+PSTACK_PROFILE_ENTRY
+LookupStackProfileEntry (
+    __in UT_FUNCTION Function,
+    __in BOOL Insert
+    )
+{
+    PSTACK_PROFILE_ENTRY Entry;
+    ULONG Index;
+    ULONG Probes;
+
+    Index = (ULONG) ((ULONG_PTR) Function >> 4) * 2654435761u;
+
+    for (Probes = 0; Probes < STACK_PROFILE_ENTRIES; ++Probes, ++Index) {
+        Entry = &StackProfile.Entries[Index & (STACK_PROFILE_ENTRIES - 1)];
+
+        if (Entry->Function == Function) {
+            return Entry;
+        }
+
+        if (Entry->Function == NULL) {
+            if (Insert) {
+                Entry->Function = Function;
+                return Entry;
+            }
+
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Measures the stack depth reached by the specified exiting thread and adds it to the 
+// stack profile of the thread's function. Once enough threads ran the function, new
+// ones get the smallest size class that holds the deepest stack, plus one page.
+//
+
+static
+VOID
+ProfileThreadStack (
+    __inout PUTHREAD Thread
+    )
+{
+    PSTACK_PROFILE_ENTRY Entry;
+    ULONG Class;
+
+    Thread->StackHighWater = MeasureStackHighWater(Thread);
+
+    AcquireGlobalSpinLock(&StackProfile.Lock);
+
+    if ((Entry = LookupStackProfileEntry(Thread->Function, TRUE)) != NULL) {
+        if (Thread->StackHighWater > Entry->HighWater) {
+            Entry->HighWater = Thread->StackHighWater;
+        }
+
+        if ((Entry->Threads += 1) >= STACK_PROFILE_SAMPLES) {
+            for (Class = 0; 
+                 Class < NUMBER_OF_STACK_CLASSES - 1 
+                 && STACK_CLASS_SIZE(Class) < Entry->HighWater + DESCRIPTOR_SIZE + PAGE_SIZE; 
+                 ++Class) {
+            }
+
+            Entry->StackSize = STACK_CLASS_SIZE(Class);
+        }
+    }
+
+    UtReleaseSpinLock(&StackProfile.Lock);
+}
+
+//
+// Returns the stack size for a new thread running the specified function when no size
+// is requested: the size class chosen by adaptive stack sizing, if any, or the default.
+//
+
+FORCEINLINE
+SIZE_T
+GetDefaultStackSize (
+    __in UT_FUNCTION Function
+    )
+{
+    PSTACK_PROFILE_ENTRY Entry;
+
+    if (StackProfile.Adaptive 
+        && (Entry = LookupStackProfileEntry(Function, FALSE)) != NULL 
+        && Entry->StackSize != 0) {
+        return Entry->StackSize;
+    }
+
+    return STACK_SIZE;
+}
+
+//
+// Sets the initial context of the specified thread on the stack growing down from 
+// StackTop, so that the first context switch to the thread enters StartAddress.
+//
+
+static
+VOID
+InitializeThreadContext (
+    __inout PUTHREAD Thread,
+    __in PUCHAR StackTop,
+    __in VOID (*StartAddress)()
+    )
+{
+#if defined(_M_IX86)
+
+    //
+    // Map an UTHREAD_CONTEXT instance on the thread's stack.
+    // We'll use it to save the initial context of the thread.
+    //
+    // +------------+
+    // | 0x00000000 |    <- Highest word of a thread's stack space
+    // +============+       (needs to be set to 0 for Visual Studio to
+    // |  RetAddr   | \     correctly present a thread's call stack).
+    // +------------+  |
+    // |    EBP     |  |
+    // +------------+  |
+    // |    EBX     |   >   Thread->ThreadContext mapped on the stack.
+    // +------------+  |
+    // |    ESI     |  |
+    // +------------+  |
+    // |    EDI     | /  <- The stack pointer will be set to this address
+    // +============+       at the next context switch to this thread.
+    // |            | -+
+    // +------------+  |
+    // |     :      |  |
+    //       :         +->  Remaining stack space.
+    // |     :      |  |
+    // +------------+  |
+    // |            | -+  <- Lowest word of a thread's stack space
+    // +------------+       (Thread->Stack always points to this location).
+    //
+
+    Thread->ThreadContext = (PUTHREAD_CONTEXT) (StackTop
+                                                - sizeof(ULONG_PTR)
+                                                - sizeof *Thread->ThreadContext);
+
+    //
+    // Set the thread's initial context by initializing the values of EDI, EBX, ESI 
+    // and EBP (must be zero for Visual Studio to correctly present a thread's call stack)
+    // and by hooking the return address. Upon the first context switch to this thread, 
+    // after popping the dummy values of the "saved" registers, a ret instruction will 
+    // place StartAddress on the processor's IP.
+    //
+    
+    *(PULONG_PTR) (StackTop - sizeof(ULONG_PTR)) = 0;
+    Thread->ThreadContext->EDI = 0x33333333;
+    Thread->ThreadContext->EBX = 0x11111111;
+    Thread->ThreadContext->ESI = 0x22222222;
+    Thread->ThreadContext->EBP = 0x00000000;
+    Thread->ThreadContext->RetAddr = StartAddress;
+
+#elif defined(__x86_64__)
+
+    //
+    // Map an UTHREAD_CONTEXT instance on the thread's stack.
+    // We'll use it to save the initial context of the thread.
+    //
+    // +------------+
+    // |     0      |    <- Highest quadword of a thread's stack space, acting
+    // +============+       as StartAddress's return address (ends unwinding).
+    // |  RetAddr   | \    <- 16-byte aligned, so that StartAddress is entered
+    // +------------+  |      with RSP + 8 aligned, as after a call instruction.
+    // |    RBP     |  |
+    // +------------+  |
+    // |    RBX     |  |
+    // +------------+  |
+    // |    R12     |  |
+    // +------------+  |
+    // |    R13     |   >   Thread->ThreadContext mapped on the stack.
+    // +------------+  |
+    // |    R14     |  |
+    // +------------+  |
+    // |    R15     |  |
+    // +------------+  |
+    // |FPUCW|MXCSR | /  <- The stack pointer will be set to this address
+    // +============+       at the next context switch to this thread.
+    // |            | -+
+    // +------------+  |
+    // |     :      |  |
+    //       :         +->  Remaining stack space.
+    // |     :      |  |
+    // +------------+  |
+    // |            | -+  <- Lowest quadword of a thread's stack space
+    // +------------+       (Thread->Stack always points to this location).
+    //
+
+    Thread->ThreadContext = (PUTHREAD_CONTEXT) (StackTop
+                                                - sizeof(ULONG_PTR)
+                                                - sizeof *Thread->ThreadContext);
+
+    //
+    // Set the thread's initial context with the default floating point control
+    // state, zero for the callee-saved registers (RBP must be zero to terminate
+    // frame pointer based stack walks) and StartAddress as the return address.
+    //
+
+    *(PULONG_PTR) (StackTop - sizeof(ULONG_PTR)) = 0;
+    RtlZeroMemory(Thread->ThreadContext, sizeof *Thread->ThreadContext);
+    Thread->ThreadContext->MXCSR = INITIAL_MXCSR;
+    Thread->ThreadContext->FPUCW = INITIAL_FPUCW;
+    Thread->ThreadContext->RetAddr = StartAddress;
+
+#endif
+}
+
+//
+// Copies the frames of the owner of the shared stack, which isn't running, to its
+// buffer, which is resized if the frames don't fit or take much less room. If a 
+// smaller buffer can't be allocated, the current one is kept; if a larger one can't,
+// the frames can't be saved anywhere and the process is terminated.
+//
+
+static
+VOID
+SaveSharedStackFrames (
+    __in PSHARED_STACK SharedStack,
+    __inout PUTHREAD Thread
+    )
+{
+    PUCHAR Frames;
+    SIZE_T Length;
+    SIZE_T Size;
+
+    Length = SharedStack->Top - (PUCHAR) Thread->ThreadContext;
+
+    if (Length > Thread->SavedFramesSize || Length < Thread->SavedFramesSize / 4) {
+        Size = (Length + CACHE_LINE_SIZE - 1) & ~((SIZE_T) CACHE_LINE_SIZE - 1);
+        if ((Frames = (PUCHAR) malloc(Size)) != NULL) {
+            free(Thread->SavedFrames);
+            Thread->SavedFrames = Frames;
+            Thread->SavedFramesSize = Size;
+        } else if (Length > Thread->SavedFramesSize) {
+            _ASSERTE(!"failed to grow the buffer of the saved frames");
+            abort();
+        }
+    }
+
+    RtlCopyMemory(Thread->SavedFrames, Thread->ThreadContext, Length);
+
+    if (Length > Thread->StackHighWater) {
+        Thread->StackHighWater = Length;
+    }
+}
+
+//
+// Makes the specified thread the owner of the shared stack, copying out the frames of 
+// the current owner, if any, and copying in those of Thread. Must not be called on the 
+// shared stack.
+//
+
+static
+VOID
+AcquireSharedStack (
+    __inout PSHARED_STACK SharedStack,
+    __inout PUTHREAD Thread
+    )
+{
+    if (SharedStack->Owner != NULL) {
+        SaveSharedStackFrames(SharedStack, SharedStack->Owner);
+    }
+
+    RtlCopyMemory(Thread->ThreadContext, Thread->SavedFrames, SharedStack->Top - (PUCHAR) Thread->ThreadContext);
+    SharedStack->Owner = Thread;
+}
+
+//
+// The function run by the transit thread, which switches between two threads that run
+// on the shared stack while neither of them does. A scheduler whose threads use the 
+// shared stack runs on a single worker, so the transit thread always resumes on it.
+//
+
+static
+VOID
+SharedStackTransit (
+    )
+{
+    PSHARED_STACK SharedStack;
+
+    SharedStack = &CurrentWorker->Scheduler->SharedStack;
+
+    for (;;) {
+        if (SharedStack->TransitExit) {
+            SharedStack->Owner = NULL;
+            CleanupThread(SharedStack->TransitFrom);
+        }
+
+        AcquireSharedStack(SharedStack, SharedStack->TransitTo);
+        ContextSwitch(SharedStack->Transit, SharedStack->TransitTo);
+    }
+}
+
+//
+// Allocates the shared stack and the transit thread, on first use. The shared stack
+// is a thread block whose descriptor is left unused, with frames anchored right below
+// it. Returns FALSE on failure, in which case allocation is retried on the next use.
+//
+
+static
+BOOL
+InitializeSharedStack (
+    __inout PSHARED_STACK SharedStack
+    )
+{
+    PUTHREAD Block;
+
+    if (SharedStack->Top == NULL) {
+        if ((Block = AllocateThreadBlock(SHARED_STACK_SIZE)) == NULL) {
+            return FALSE;
+        }
+
+        if ((SharedStack->Transit = AllocateThreadBlock(STACK_CLASS_SIZE(0))) == NULL) {
+            FreeThreadBlock(Block);
+            return FALSE;
+        }
+
+        SharedStack->Top = (PUCHAR) Block;
+        InitializeThreadContext(SharedStack->Transit, (PUCHAR) SharedStack->Transit, SharedStackTransit);
+    }
+
+    return TRUE;
+}
+
+//
+// Allocates the descriptor of a thread that runs on the shared stack, along with a 
+// buffer for its initial frames, which are copied in when the thread first runs.
+// Returns NULL on failure.
+//
+
+static
+PUTHREAD
+AllocateSharedStackThread (
+    __inout PSHARED_STACK SharedStack
+    )
+{
+    PUTHREAD Thread;
+
+    if (!InitializeSharedStack(SharedStack)) {
+        return NULL;
+    }
+
+    Thread = (PUTHREAD) _aligned_malloc(DESCRIPTOR_SIZE, 16);
+    if (Thread == NULL) {
+        return NULL;
+    }
+
+    if ((Thread->SavedFrames = (PUCHAR) malloc(INITIAL_FRAMES_SIZE)) == NULL) {
+        _aligned_free(Thread);
+        return NULL;
+    }
+
+    Thread->Stack = NULL;
+    Thread->StackSize = 0;
+    Thread->UsesSharedStack = TRUE;
+    Thread->SavedFramesSize = INITIAL_FRAMES_SIZE;
+    return Thread;
+}
+
+//
+// Switches from CurrentThread to NextThread, one of which runs on the shared stack.
+// The frames of NextThread are copied in if another thread owns the shared stack.
+// Kept out of line, as this is only done for threads created with UT_CREATE_SHARED_STACK.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+SwitchSharedStack (
+    __inout PSHARED_STACK SharedStack,
+    __inout PUTHREAD CurrentThread,
+    __in PUTHREAD NextThread
+    )
+{
+    if (NextThread->UsesSharedStack && SharedStack->Owner != NextThread) {
+        if (CurrentThread->UsesSharedStack) {
+            SharedStack->TransitFrom = CurrentThread;
+            SharedStack->TransitTo = NextThread;
+            SharedStack->TransitExit = FALSE;
+            ContextSwitch(CurrentThread, SharedStack->Transit);
+            return;
+        }
+
+        AcquireSharedStack(SharedStack, NextThread);
+    }
+
+    ContextSwitch(CurrentThread, NextThread);
+}
+
+//
+// Prepares the switch from the exiting CurrentThread to NextThread, one of which runs
+// on the shared stack. If both do, the switch is completed by the transit thread and
+// the function doesn't return.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+ExitSharedStack (
+    __inout PSHARED_STACK SharedStack,
+    __inout PUTHREAD CurrentThread,
+    __in PUTHREAD NextThread
+    )
+{
+    if (CurrentThread->UsesSharedStack) {
+
+        //
+        // The frames of the exiting thread are abandoned.
+        //
+
+        SharedStack->Owner = NULL;
+
+        if (NextThread->UsesSharedStack) {
+            SharedStack->TransitFrom = CurrentThread;
+            SharedStack->TransitTo = NextThread;
+            SharedStack->TransitExit = TRUE;
+            ContextSwitch(CurrentThread, SharedStack->Transit);
+            _ASSERTE(!"supposed to be here!");
+        }
+    } else if (SharedStack->Owner != NextThread) {
+        AcquireSharedStack(SharedStack, NextThread);
+    }
+}
+
+//
+// Initializes the specified worker.
+//
+
+static
+VOID
+InitializeWorker (
+    __out PUT_WORKER Worker,
+    __in PUT_SCHEDULER Scheduler,
+    __in ULONG Index
+    )
+{
+    ULONG Class;
+    ULONG Level;
+
+    RtlZeroMemory(Worker, sizeof(*Worker));
+    for (Level = 0; Level < UT_PRIORITY_LEVELS; ++Level) {
+        InitializeListHead(&Worker->ReadyQueues[Level]);
+    }
+
+    Worker->Scheduler = Scheduler;
+    for (Class = 0; Class < NUMBER_OF_STACK_CLASSES; ++Class) {
+        InitializeListHead(&Worker->ThreadBlockPool[Class]);
+    }
+
+    Worker->StealSeed = Index * 2654435761u + 1;
+    Worker->Processor = PROCESSOR_ANY;
+    UtInitializeSpinLock(&Worker->TimerLock);
+    InitializeTimerWheel(&Worker->TimerWheel, UtReadClock(FALSE));
+#if !defined(_WIN32)
+    Worker->IoPollCountdown = IO_POLL_INTERVAL;
+#endif
+}
+
+//
+// The processor affinity of an operating system thread.
+//
+
+#if defined(_WIN32)
+typedef DWORD_PTR THREAD_AFFINITY;
+#else
+typedef cpu_set_t THREAD_AFFINITY;
+#endif
+
+//
+// Returns the NUMA node of the specified processor, or 0 if it can't be determined.
+// Nodes beyond the last one with a thread block pool are folded into it.
+//
+
+static
+ULONG
+GetProcessorNode (
+    __in ULONG Processor
+    )
+{
+    ULONG Node;
+#if defined(_WIN32)
+    UCHAR ProcessorNode;
+
+    Node = 0;
+    if (Processor <= UCHAR_MAX && GetNumaProcessorNode((UCHAR) Processor, &ProcessorNode) 
+        && ProcessorNode != 0xFF) {
+        Node = ProcessorNode;
+    }
+#else
+    CHAR Path[64];
+    DIR * Directory;
+    struct dirent * Entry;
+
+    //
+    // The directory of a processor in sysfs links to the directory of its node.
+    //
+
+    Node = 0;
+    snprintf(Path, sizeof(Path), "/sys/devices/system/cpu/cpu%u", Processor);
+    if ((Directory = opendir(Path)) != NULL) {
+        while ((Entry = readdir(Directory)) != NULL) {
+            if (strncmp(Entry->d_name, "node", 4) == 0) {
+                Node = (ULONG) strtoul(Entry->d_name + 4, NULL, 10);
+                break;
+            }
+        }
+        closedir(Directory);
+    }
+#endif
+
+    return Node < MAXIMUM_NODES ? Node : MAXIMUM_NODES - 1;
+}
+
+//
+// Assigns to the worker with the specified index the processor it is pinned to, 
+// according to the affinity configured for its scheduler, along with its NUMA node.
+//
+
+static
+VOID
+AssignWorkerProcessor (
+    __inout PUT_WORKER Worker,
+    __in ULONG Index
+    )
+{
+    PUT_SCHEDULER Scheduler;
+
+    Scheduler = Worker->Scheduler;
+
+    if (Scheduler->Processors == NULL) {
+        Worker->Processor = PROCESSOR_ANY;
+        Worker->Node = 0;
+    } else {
+        Worker->Processor = Scheduler->Processors[Index % Scheduler->NumberOfProcessors];
+        Worker->Node = GetProcessorNode(Worker->Processor);
+    }
+}
+
+//
+// Pins the calling operating system thread to the processor of the specified worker, 
+// saving its previous affinity in Previous, if specified. Returns FALSE if the worker 
+// has no processor or the thread couldn't be pinned, in which case it runs anywhere.
+//
+
+static
+BOOL
+PinWorker (
+    __in PUT_WORKER Worker,
+    __out_opt THREAD_AFFINITY * Previous
+    )
+{
+    THREAD_AFFINITY Affinity;
+
+    if (Worker->Processor == PROCESSOR_ANY) {
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+
+    //
+    // Processors are numbered within the group of the calling thread.
+    //
+
+    if (Worker->Processor >= sizeof(DWORD_PTR) * 8) {
+        return FALSE;
+    }
+
+    if ((Affinity = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << Worker->Processor)) == 0) {
+        return FALSE;
+    }
+
+    if (Previous != NULL) {
+        *Previous = Affinity;
+    }
+
+    return TRUE;
+#else
+    if (Worker->Processor >= CPU_SETSIZE
+        || (Previous != NULL && pthread_getaffinity_np(pthread_self(), sizeof(*Previous), Previous) != 0)) {
+        return FALSE;
+    }
+
+    CPU_ZERO(&Affinity);
+    CPU_SET(Worker->Processor, &Affinity);
+    return pthread_setaffinity_np(pthread_self(), sizeof(Affinity), &Affinity) == 0;
+#endif
+}
+
+//
+// Restores the affinity of the calling operating system thread saved by PinWorker.
+//
+
+static
+VOID
+RestoreAffinity (
+    __in THREAD_AFFINITY * Affinity
+    )
+{
+#if defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), *Affinity);
+#else
+    pthread_setaffinity_np(pthread_self(), sizeof(*Affinity), Affinity);
+#endif
+}
+
+//
+// Returns the primary worker of the specified scheduler, initializing it on first use.
+// The reactor and io_uring instance are set up along with the default scheduler.
+//
+
+FORCEINLINE
+PUT_WORKER
+GetPrimaryWorker (
+    __inout PUT_SCHEDULER Scheduler
+    )
+{
+    if (Scheduler->PrimaryWorker.ReadyQueues[0].Flink == NULL) {
+        InitializeWorker(&Scheduler->PrimaryWorker, Scheduler, 0);
+
+#if defined(_WIN32)
+        Scheduler->IdleWorkers.WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        _ASSERTE(Scheduler->IdleWorkers.WakeEvent != NULL);
+#else
+        Scheduler->IdleWorkers.WakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        _ASSERTE(Scheduler->IdleWorkers.WakeEvent >= 0);
+
+        if (Scheduler == &DefaultScheduler) {
+            InitializeReactor(Scheduler->IdleWorkers.WakeEvent);
+            InitializeUring(Scheduler->IdleWorkers.WakeEvent);
+        }
+#endif
+    }
+
+    return &Scheduler->PrimaryWorker;
+}
+
+//
+// Returns the scheduler of the current operating system thread: the one its worker 
+// belongs to, if it runs a scheduler, or else the one it selected.
+//
+
+FORCEINLINE
+PUT_SCHEDULER
+GetCurrentScheduler (
+    )
+{
+    if (CurrentWorker != NULL) {
+        return CurrentWorker->Scheduler;
+    }
+
+    return CurrentScheduler != NULL ? CurrentScheduler : &DefaultScheduler;
+}
+
+//
+// Signals the event on which the poller of the specified scheduler blocks.
+//
+
+static
+VOID
+SignalWakeEvent (
+    __in PUT_SCHEDULER Scheduler
+    )
+{
+#if defined(_WIN32)
+    SetEvent(Scheduler->IdleWorkers.WakeEvent);
+#else
+    ULONG64 Value = 1;
+
+    while (write(Scheduler->IdleWorkers.WakeEvent, &Value, sizeof(Value)) < 0) {
+        ;
+    }
+#endif
+}
+
+//
+// Blocks the calling worker on the WakeSequence futex of the specified scheduler for up
+// to Timeout milliseconds, unless it no longer holds the specified value.
+//
+
+FORCEINLINE
+VOID
+WaitOnWakeSequence (
+    __in PUT_SCHEDULER Scheduler,
+    __in LONG Sequence,
+    __in ULONG Timeout
+    )
+{
+#if defined(_WIN32)
+    WaitOnAddress((PVOID) &Scheduler->IdleWorkers.WakeSequence, &Sequence, sizeof(LONG), Timeout);
+#else
+    struct timespec Interval;
+
+    Interval.tv_sec = Timeout / 1000;
+    Interval.tv_nsec = (Timeout % 1000) * 1000000;
+    syscall(SYS_futex, &Scheduler->IdleWorkers.WakeSequence, FUTEX_WAIT_PRIVATE, Sequence, 
+            Timeout == INFINITE ? NULL : &Interval, NULL, 0);
+#endif
+}
+
+//
+// Advances the WakeSequence futex of the specified scheduler, waking up one of the 
+// workers blocked on it, or all of them.
+//
+
+FORCEINLINE
+VOID
+AdvanceWakeSequence (
+    __inout PUT_SCHEDULER Scheduler,
+    __in BOOL WakeAll
+    )
+{
+    InterlockedIncrement(&Scheduler->IdleWorkers.WakeSequence);
+
+#if defined(_WIN32)
+    if (WakeAll) {
+        WakeByAddressAll((PVOID) &Scheduler->IdleWorkers.WakeSequence);
+    } else {
+        WakeByAddressSingle((PVOID) &Scheduler->IdleWorkers.WakeSequence);
+    }
+#else
+    syscall(SYS_futex, &Scheduler->IdleWorkers.WakeSequence, FUTEX_WAKE_PRIVATE, 
+            WakeAll ? INT_MAX : 1, NULL, NULL, 0);
+#endif
+}
+
+//
+// Wakes up a blocked worker of the specified scheduler, preferring the poller. The 
+// caller must have made the work available before calling the function, with a full
+// barrier. 
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+WakeIdleWorker (
+    __inout PUT_SCHEDULER Scheduler
+    )
+{
+    if (Scheduler->IdleWorkers.Poller) {
+        SignalWakeEvent(Scheduler);
+    } else if (Scheduler->IdleWorkers.NumberOfSleepingWorkers != 0) {
+        AdvanceWakeSequence(Scheduler, FALSE);
+    }
+}
+
+//
+// Wakes up all the blocked workers of the specified scheduler, so that they reevaluate
+// whether to leave the scheduler.
+//
+
+static
+VOID
+WakeAllIdleWorkers (
+    __inout PUT_SCHEDULER Scheduler
+    )
+{
+    MemoryBarrier();
+    SignalWakeEvent(Scheduler);
+    AdvanceWakeSequence(Scheduler, TRUE);
+}
+
+//
+// Pushes the specified thread onto the deque of Worker. The deque operations are
+// kept out of line, so that they don't weigh on the single worker paths. If there
+// are blocked workers and none spinning, one is woken up to take the thread; the
+// check is racy, but the thread is never stranded, as Worker itself is running.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+PushReadyThread (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD Thread
+    )
+{
+    PIDLE_WORKERS IdleWorkers;
+
+    PushWorkDeque(&Worker->Deque, Thread);
+
+    IdleWorkers = &Worker->Scheduler->IdleWorkers;
+    if ((IdleWorkers->Poller | IdleWorkers->NumberOfSleepingWorkers) != 0 
+        && IdleWorkers->NumberOfSpinningWorkers == 0) {
+        WakeIdleWorker(Worker->Scheduler);
+    }
+}
+
+//
+// Takes a thread from the deque of Worker, or returns NULL if the deque is empty.
+//
+
+static
+DECLSPEC_NOINLINE
+PUTHREAD
+PopReadyThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    return (PUTHREAD) TakeWorkDeque(&Worker->Deque);
+}
+
+#if defined(UT_STATS)
+
+//
+// Starts accumulating time for the specified state of Thread, charging the time since
+// the thread entered its previous state to the matching counter.
+//
+
+FORCEINLINE
+VOID
+SetThreadStatsState (
+    __inout PUTHREAD Thread,
+    __in ULONG State,
+    __in ULONG64 Now
+    )
+{
+    ULONG64 Elapsed;
+
+    Elapsed = Now - Thread->StatsTimestamp;
+
+    switch (Thread->StatsState) {
+    case STATS_PARKED:
+        Thread->Stats.ParkedTicks += Elapsed;
+        break;
+    case STATS_READY:
+        Thread->Stats.ReadyTicks += Elapsed;
+        break;
+    default:
+        Thread->Stats.RunTicks += Elapsed;
+        break;
+    }
+
+    Thread->StatsState = State;
+    Thread->StatsTimestamp = Now;
+}
+
+//
+// Initializes the runtime counters of a new thread, which starts out parked.
+//
+
+FORCEINLINE
+VOID
+InitializeThreadStats (
+    __out PUTHREAD Thread
+    )
+{
+    RtlZeroMemory(&Thread->Stats, sizeof(Thread->Stats));
+    Thread->StatsState = STATS_PARKED;
+    Thread->StatsTimestamp = __rdtsc();
+}
+
+//
+// Accounts for Thread becoming ready. A thread readied while it runs, as when it
+// yields, stops accumulating run time.
+//
+
+FORCEINLINE
+VOID
+AccountReadyThread (
+    __inout PUTHREAD Thread
+    )
+{
+    SetThreadStatsState(Thread, STATS_READY, __rdtsc());
+}
+
+//
+// Accounts for Count threads having been placed in the ready queue of Worker, 
+// updating the worker's high watermark.
+//
+
+FORCEINLINE
+VOID
+AccountReadyQueue (
+    __inout PUT_WORKER Worker,
+    __in ULONG Count
+    )
+{
+    ULONG Length;
+
+    if (Worker->Scheduler->MultipleWorkers) {
+        Length = Worker->Deque.Bottom - Worker->Deque.Top + Worker->PrioritizedCount;
+    } else {
+        Length = Worker->ReadyCount += Count;
+    }
+
+    if (Length > Worker->ReadyHighWatermark) {
+        Worker->ReadyHighWatermark = Length;
+    }
+}
+
+//
+// Accounts for a thread having been taken from the ready queue of Worker.
+//
+
+#define AccountTakenThread(Worker) ((Worker)->ReadyCount -= 1)
+
+//
+// Accounts for a thread having been placed in, or taken from, a ready queue of other
+// than normal priority of Worker.
+//
+
+#define AccountPrioritizedThread(Worker) ((Worker)->PrioritizedCount += 1)
+#define AccountTakenPrioritizedThread(Worker) ((Worker)->PrioritizedCount -= 1)
+
+//
+// Accounts for the switch from CurrentThread to NextThread. A thread switched out
+// while running is parking; one switched out after being readied keeps its state.
+//
+
+FORCEINLINE
+VOID
+AccountContextSwitch (
+    __inout PUTHREAD CurrentThread,
+    __inout PUTHREAD NextThread
+    )
+{
+    ULONG64 Now;
+
+    Now = __rdtsc();
+
+    CurrentThread->Stats.SwitchesOut += 1;
+    if (CurrentThread->StatsState == STATS_RUNNING) {
+        SetThreadStatsState(CurrentThread, STATS_PARKED, Now);
+    }
+
+    NextThread->Stats.SwitchesIn += 1;
+    SetThreadStatsState(NextThread, STATS_RUNNING, Now);
+}
+
+#define AccountCreatedThread(Worker) ((Worker)->Creations += 1)
+#define AccountExitedThread(Worker) ((Worker)->Exits += 1)
+
+#else
+
+#define InitializeThreadStats(Thread) ((VOID) 0)
+#define AccountReadyThread(Thread) ((VOID) 0)
+#define AccountReadyQueue(Worker, Count) ((VOID) 0)
+#define AccountTakenThread(Worker) ((VOID) 0)
+#define AccountPrioritizedThread(Worker) ((VOID) 0)
+#define AccountTakenPrioritizedThread(Worker) ((VOID) 0)
+#define AccountContextSwitch(CurrentThread, NextThread) ((VOID) 0)
+#define AccountCreatedThread(Worker) ((VOID) 0)
+#define AccountExitedThread(Worker) ((VOID) 0)
+
+#endif
+
+//
+// Makes room in the specified fair queue for at least Count threads. Returns FALSE if
+// the heap can't be grown.
+//
+
+static
+BOOL
+ReserveFairQueue (
+    __inout PFAIR_QUEUE Queue,
+    __in ULONG Count
+    )
+{
+    ULONG Capacity;
+    PFAIR_ENTRY Entries;
+
+    if (Count <= Queue->Capacity) {
+        return TRUE;
+    }
+
+    Capacity = Queue->Capacity == 0 ? 64 : Queue->Capacity * 2;
+    if (Capacity < Count) {
+        Capacity = Count;
+    }
+
+    if ((Entries = (PFAIR_ENTRY) realloc(Queue->Entries, Capacity * sizeof(FAIR_ENTRY))) == NULL) {
+        return FALSE;
+    }
+
+    Queue->Entries = Entries;
+    Queue->Capacity = Capacity;
+    return TRUE;
+}
+
+//
+// Adds the time since the running thread was switched in, or last charged, to its 
+// virtual runtime, scaled inversely to its weight.
+//
+
+FORCEINLINE
+VOID
+ChargeVirtualRuntime (
+    __inout PFAIR_QUEUE Queue,
+    __inout PUTHREAD Thread
+    )
+{
+    ULONG64 Elapsed;
+    ULONG64 Now;
+
+    Now = __rdtsc();
+    Elapsed = Now - Queue->SliceStart;
+    Queue->SliceStart = Now;
+
+    if (Thread->Weight != UT_WEIGHT_NORMAL) {
+        Elapsed = Elapsed * UT_WEIGHT_NORMAL / Thread->Weight;
+    }
+
+    Thread->VirtualRuntime += Elapsed;
+}
+
+//
+// Charges the thread being switched out for the time it ran, unless it was charged
+// right before.
+//
+
+FORCEINLINE
+VOID
+ChargeSwitchedOutThread (
+    __inout PFAIR_QUEUE Queue,
+    __inout PUTHREAD Thread
+    )
+{
+    if (Queue->ChargedThread != Thread) {
+        ChargeVirtualRuntime(Queue, Thread);
+    }
+
+    Queue->ChargedThread = NULL;
+}
+
+//
+// Inserts the specified thread, of normal priority, in the fair queue of the scheduler
+// of Worker. The running thread, readied as it yields, must have been charged for the
+// time it ran, while a thread that was parked is placed no further than the wakeup credit
+// behind the minimum virtual runtime, so that it neither waits behind all the threads
+// that ran in the meantime nor runs ahead of them for long.
+//
+
+static
+VOID
+InsertFairThread (
+    __inout PUT_WORKER Worker,
+    __inout PUTHREAD Thread
+    )
+{
+    PFAIR_ENTRY Entries;
+    ULONG Index;
+    ULONG Parent;
+    PFAIR_QUEUE Queue;
+
+    Queue = &Worker->Scheduler->FairQueue;
+    _ASSERTE(Queue->Count < Queue->Capacity);
+
+    if (Thread != Worker->RunningThread
+        && Thread->VirtualRuntime + Queue->WakeupCredit < Queue->MinVirtualRuntime) {
+        Thread->VirtualRuntime = Queue->MinVirtualRuntime - Queue->WakeupCredit;
+    }
+
+    Entries = Queue->Entries;
+    for (Index = Queue->Count++; Index != 0; Index = Parent) {
+        Parent = (Index - 1) / FAIR_HEAP_ARITY;
+        if (Entries[Parent].VirtualRuntime <= Thread->VirtualRuntime) {
+            break;
+        }
+
+        Entries[Index] = Entries[Parent];
+    }
+
+    Entries[Index].VirtualRuntime = Thread->VirtualRuntime;
+    Entries[Index].Thread = Thread;
+    Worker->ReadyLevels |= 1u << NORMAL_PRIORITY_LEVEL;
+}
+
+//
+// Removes and returns the thread with the least virtual runtime from the fair queue of
+// the scheduler of Worker, which must not be empty.
+//
+
+static
+PUTHREAD
+RemoveFairThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    ULONG Child;
+    ULONG End;
+    PFAIR_ENTRY Entries;
+    ULONG First;
+    ULONG Index;
+    FAIR_ENTRY Last;
+    PFAIR_QUEUE Queue;
+    PUTHREAD Thread;
+
+    Queue = &Worker->Scheduler->FairQueue;
+    Entries = Queue->Entries;
+    Thread = Entries[0].Thread;
+
+    if (Entries[0].VirtualRuntime > Queue->MinVirtualRuntime) {
+        Queue->MinVirtualRuntime = Entries[0].VirtualRuntime;
+    }
+
+    if (--Queue->Count == 0) {
+        Worker->ReadyLevels &= ~(1u << NORMAL_PRIORITY_LEVEL);
+        return Thread;
+    }
+
+    //
+    // Sift the last entry down from the root, moving up the least of the children.
+    //
+
+    Last = Entries[Queue->Count];
+    Index = 0;
+    while ((First = Index * FAIR_HEAP_ARITY + 1) < Queue->Count) {
+        End = First + FAIR_HEAP_ARITY < Queue->Count ? First + FAIR_HEAP_ARITY : Queue->Count;
+        for (Child = First++; First < End; ++First) {
+            if (Entries[First].VirtualRuntime < Entries[Child].VirtualRuntime) {
+                Child = First;
+            }
+        }
+
+        if (Last.VirtualRuntime <= Entries[Child].VirtualRuntime) {
+            break;
+        }
+
+        Entries[Index] = Entries[Child];
+        Index = Child;
+    }
+
+    Entries[Index] = Last;
+    return Thread;
+}
+
+//
+// Inserts the specified thread of normal priority in the ready queue of Worker, which
+// runs on a single worker, or in the fair queue under fair scheduling.
+//
+
+FORCEINLINE
+VOID
+InsertNormalThread (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD Thread
+    )
+{
+    if (Worker->Scheduler->FairShare) {
+        InsertFairThread(Worker, Thread);
+    } else {
+        InsertTailList(&Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL], &Thread->Link);
+    }
+}
+
+//
+// Inserts the specified thread, of other than normal priority, at the tail of the ready
+// queue of its priority in Worker.
+//
+
+FORCEINLINE
+VOID
+InsertReadyQueue (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD Thread
+    )
+{
+    _ASSERTE(Thread->PriorityLevel != NORMAL_PRIORITY_LEVEL);
+
+    InsertTailList(&Worker->ReadyQueues[Thread->PriorityLevel], &Thread->Link);
+    Worker->ReadyLevels |= 1u << Thread->PriorityLevel;
+    AccountPrioritizedThread(Worker);
+}
+
+//
+// Removes and returns the thread at the head of the highest priority ready queue of
+// Worker other than the normal one, found through the bitmap of non-empty queues,
+// which must not be zero, or the next thread of the fair queue if its bit is set.
+//
+
+FORCEINLINE
+PUTHREAD
+RemoveReadyQueue (
+    __inout PUT_WORKER Worker
+    )
+{
+    PLIST_ENTRY Entry;
+    ULONG Level;
+
+    _BitScanReverse(&Level, Worker->ReadyLevels);
+    if (Level == NORMAL_PRIORITY_LEVEL) {
+        return RemoveFairThread(Worker);
+    }
+
+    Entry = Worker->ReadyQueues[Level].Flink;
+    if (RemoveEntryList(Entry)) {
+        Worker->ReadyLevels &= ~(1u << Level);
+    }
+
+    AccountTakenPrioritizedThread(Worker);
+
+    return CONTAINING_RECORD(Entry, UTHREAD, Link);
+}
+
+//
+// Places the specified thread in the ready queue of Worker.
+//
+
+FORCEINLINE
+VOID
+ReadyThread (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD Thread
+    )
+{
+    AccountReadyThread(Thread);
+
+    if (Thread->PriorityLevel != NORMAL_PRIORITY_LEVEL) {
+        InsertReadyQueue(Worker, Thread);
+    } else if (Worker->Scheduler->MultipleWorkers) {
+        PushReadyThread(Worker, Thread);
+    } else {
+        InsertNormalThread(Worker, Thread);
+    }
+
+    AccountReadyQueue(Worker, 1);
+}
+
+//
+// Pushes the chain of threads linked from First to Last through their Blink fields onto 
+// the inbound queue of the specified scheduler, so that they are drained in that order,
+// waking the scheduler if it is blocked waiting for inbound threads. Called by operating
+// system threads that aren't running the scheduler.
+//
+
+static
+VOID
+PostInboundThreads (
+    __inout PUT_SCHEDULER Scheduler,
+    __inout PLIST_ENTRY First,
+    __inout PLIST_ENTRY Last
+    )
+{
+    PLIST_ENTRY Entry;
+    PLIST_ENTRY Head;
+
+    //
+    // The inbound queue is a stack, so the chain is pushed from Last back to First.
+    //
+
+    for (Entry = Last; Entry != First; Entry = Entry->Blink) {
+        Entry->Flink = Entry->Blink;
+    }
+
+    do {
+        Head = Scheduler->InboundQueue.Head;
+        First->Flink = Head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &Scheduler->InboundQueue.Head,
+                                               Last, Head) != Head);
+
+    //
+    // The interlocked operation orders the push before the reads of the idle state, 
+    // which blocking workers update before checking for work a last time.
+    //
+
+    WakeIdleWorker(Scheduler);
+}
+
+//
+// Moves the threads in the inbound queue to the ready queue of Worker, in the order
+// in which they were posted. Kept out of line, as the inbound queue is usually empty.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+DrainInboundQueue (
+    __inout PUT_WORKER Worker
+    )
+{
+    PLIST_ENTRY Entry;
+    PLIST_ENTRY Next;
+    PLIST_ENTRY Reversed;
+
+    Entry = (PLIST_ENTRY) InterlockedExchangePointer((PVOID volatile *) &Worker->Scheduler->InboundQueue.Head, 
+                                                     NULL);
+
+    for (Reversed = NULL; Entry != NULL; Entry = Next) {
+        Next = Entry->Flink;
+        Entry->Flink = Reversed;
+        Reversed = Entry;
+    }
+
+    for (Entry = Reversed; Entry != NULL; Entry = Next) {
+        Next = Entry->Flink;
+        ReadyThread(Worker, CONTAINING_RECORD(Entry, UTHREAD, Link));
+    }
+}
+
+
+//
+// Advances the timer wheel of Worker to the current time, readying the threads whose
+// timers expired, in a batch. A thread that was unparked before its timer expired is
+// left alone. Returns true if any thread was readied. Kept out of line, as it's only 
+// called when there are timers.
+//
+
+static
+DECLSPEC_NOINLINE
+BOOL
+ExpireTimers (
+    __inout PUT_WORKER Worker,
+    __in BOOL Coarse
+    )
+{
+    LIST_ENTRY Expired;
+    ULONG64 Now;
+    LIST_ENTRY Ready;
+    PUTHREAD Thread;
+
+    Now = UtReadClock(Coarse);
+    if (Now < Worker->TimerWheel.CurrentTick) {
+        return FALSE;
+    }
+
+    InitializeListHead(&Expired);
+    InitializeListHead(&Ready);
+
+    UtAcquireSpinLock(&Worker->TimerLock);
+
+    if (AdvanceTimerWheel(&Worker->TimerWheel, Now, &Expired) == 0) {
+        UtReleaseSpinLock(&Worker->TimerLock);
+        return FALSE;
+    }
+
+    //
+    // Mark each expired timer as unlinked and claim its thread, while holding the lock,
+    // so that a thread that resumes on another worker neither cancels a timer that is no
+    // longer in the wheel nor sees a stale claim after it parks again.
+    //
+
+    do {
+        Thread = CONTAINING_RECORD(RemoveHeadList(&Expired), UTHREAD, Timer.Link);
+        Thread->Timer.Link.Flink = NULL;
+
+        if (InterlockedCompareExchange(&Thread->ParkState, PARK_TIMED_OUT, PARK_TIMED) == PARK_TIMED) {
+            InsertTailList(&Ready, &Thread->Link);
+        }
+    } while (!IsListEmpty(&Expired));
+
+    UtReleaseSpinLock(&Worker->TimerLock);
+
+    if (IsListEmpty(&Ready)) {
+        return FALSE;
+    }
+
+    do {
+        ReadyThread(Worker, CONTAINING_RECORD(RemoveHeadList(&Ready), UTHREAD, Link));
+    } while (!IsListEmpty(&Ready));
+
+    return TRUE;
+}
+
+//
+// Returns the number of milliseconds until the timer wheel of Worker must next be 
+// advanced, or INFINITE if there are no timers.
+//
+
+static
+ULONG
+GetIdleTimeout (
+    __in PUT_WORKER Worker
+    )
+{
+    ULONG64 Next;
+    ULONG64 Now;
+
+    UtAcquireSpinLock(&Worker->TimerLock);
+    Next = GetNextWheelEvent(&Worker->TimerWheel);
+    UtReleaseSpinLock(&Worker->TimerLock);
+
+    if (Next == TIMER_WHEEL_NO_EVENT) {
+        return INFINITE;
+    }
+
+    Now = UtReadClock(FALSE);
+    return Next <= Now ? 0 : Next - Now >= INFINITE ? INFINITE - 1 : (ULONG) (Next - Now);
+}
+
+#if !defined(_WIN32)
+
+//
+// Unparks the threads whose I/O completed or whose descriptors became ready. The 
+// queued io_uring operations are submitted in a single system call once the ready 
+// queue of Worker runs dry, so that all the threads that queued operations while it 
+// was running are served by one submission, or every IO_POLL_INTERVAL calls, as is the 
+// reactor polled. Completions are reaped at every call, as that takes no system call.
+// Only the workers of the default scheduler, whose threads are the ones that perform
+// I/O, poll. Kept out of line, as it's only called when there are threads waiting for I/O.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+PollIo (
+    __inout PUT_WORKER Worker
+    )
+{
+    BOOL Periodic;
+
+    if (Worker->Scheduler != &DefaultScheduler) {
+        return;
+    }
+
+    if ((Periodic = --Worker->IoPollCountdown == 0)) {
+        Worker->IoPollCountdown = IO_POLL_INTERVAL;
+        if (NumberOfIoWaiters != 0) {
+            PollReactor(0, FALSE);
+        }
+    }
+
+    if (NumberOfUringRequests != 0) {
+        ServiceUring(Periodic 
+                     || (Worker->ReadyLevels == 0 
+                         && (Worker->Scheduler->MultipleWorkers
+                             ? IsWorkDequeEmpty(&Worker->Deque)
+                             : IsListEmpty(&Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL]))));
+    }
+}
+
+#endif
+
+//
+// Takes the next thread of Worker when it has ready threads of other than normal priority:
+// those of higher priority run before the threads of normal priority, and those of lower
+// priority once there are none. Kept out of line, as most threads have normal priority.
+//
+
+static
+DECLSPEC_NOINLINE
+PUTHREAD
+TakePrioritizedThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    PLIST_ENTRY ReadyQueue;
+    PUTHREAD Thread;
+
+    if (Worker->Scheduler->MultipleWorkers) {
+        if (Worker->ReadyLevels < (1u << NORMAL_PRIORITY_LEVEL) && (Thread = PopReadyThread(Worker)) != NULL) {
+            return Thread;
+        }
+
+        return RemoveReadyQueue(Worker);
+    }
+
+    AccountTakenThread(Worker);
+
+    ReadyQueue = &Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL];
+    if (Worker->ReadyLevels < (1u << NORMAL_PRIORITY_LEVEL) && !IsListEmpty(ReadyQueue)) {
+        return CONTAINING_RECORD(RemoveHeadList(ReadyQueue), UTHREAD, Link);
+    }
+
+    return RemoveReadyQueue(Worker);
+}
+
+//
+// Returns and removes the first user thread in the ready queue of Worker,
+// or NULL if the ready queue is empty. Threads posted to the inbound queue,
+// and those whose timers expired according to the coarse clock, are moved 
+// to the ready queue first, as are the threads whose I/O completed.
+//
+
+FORCEINLINE
+PUTHREAD
+TakeReadyThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    PLIST_ENTRY ReadyQueue;
+    PUT_SCHEDULER Scheduler;
+
+    Scheduler = Worker->Scheduler;
+
+    if (Scheduler->InboundQueue.Head != NULL) {
+        DrainInboundQueue(Worker);
+    }
+
+    if (Worker->TimerWheel.NumberOfTimers != 0) {
+        ExpireTimers(Worker, TRUE);
+    }
+
+#if !defined(_WIN32)
+    if ((NumberOfIoWaiters | NumberOfUringRequests) != 0) {
+        PollIo(Worker);
+    }
+#endif
+
+    if (Worker->ReadyLevels != 0) {
+        return TakePrioritizedThread(Worker);
+    }
+
+    if (Scheduler->MultipleWorkers) {
+        return PopReadyThread(Worker);
+    }
+
+    ReadyQueue = &Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL];
+    if (IsListEmpty(ReadyQueue)) {
+        return NULL;
+    }
+
+    AccountTakenThread(Worker);
+    return CONTAINING_RECORD(RemoveHeadList(ReadyQueue), UTHREAD, Link);
+}
+
+//
+// Returns a thread just taken from the ready queue of Worker to the front of its ready
+// queue, as the running thread has a higher priority. A thread of normal priority taken
+// from the deque, with multiple workers, can only be pushed back at its tail. Kept out
+// of line, as it only happens to threads of other than normal priority.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+ReturnReadyThread (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD Thread
+    )
+{
+    if (Thread->PriorityLevel == NORMAL_PRIORITY_LEVEL) {
+        if (Worker->Scheduler->MultipleWorkers) {
+            PushWorkDeque(&Worker->Deque, Thread);
+        } else if (Worker->Scheduler->FairShare) {
+            InsertFairThread(Worker, Thread);
+        } else {
+            InsertHeadList(&Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL], &Thread->Link);
+        }
+    } else {
+        InsertHeadList(&Worker->ReadyQueues[Thread->PriorityLevel], &Thread->Link);
+        Worker->ReadyLevels |= 1u << Thread->PriorityLevel;
+        AccountPrioritizedThread(Worker);
+    }
+
+    AccountReadyQueue(Worker, 1);
+}
+
+//
+// Returns and removes the first user thread in the ready queue. If the ready queue is empty, 
+// the main thread is returned.
+//
+
+FORCEINLINE
+PUTHREAD
+PluckNextReadyThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    PUTHREAD Thread;
+
+    return (Thread = TakeReadyThread(Worker)) != NULL ? Thread : Worker->MainThread;
+}
+
+//
+// Takes a ready thread from the deque of another worker, starting with a randomly 
+// chosen victim. Returns NULL if no worker has ready threads.
+//
+
+static
+PUTHREAD
+StealReadyThread (
+    __inout PUT_WORKER Worker
+    )
+{
+    ULONG Index;
+    ULONG NumberOfWorkers;
+    ULONG Victim;
+    PUTHREAD Thread;
+    PUT_WORKER * Workers;
+
+    Workers = Worker->Scheduler->Workers;
+    NumberOfWorkers = Worker->Scheduler->NumberOfActiveWorkers;
+
+    Worker->StealSeed ^= Worker->StealSeed << 13;
+    Worker->StealSeed ^= Worker->StealSeed >> 17;
+    Worker->StealSeed ^= Worker->StealSeed << 5;
+    Victim = Worker->StealSeed % NumberOfWorkers;
+
+    //
+    // Look for victims on the worker's own NUMA node first, so that threads keep running
+    // next to their stacks while the node has work.
+    //
+
+    for (Index = 0; Index < NumberOfWorkers; ++Index, Victim = (Victim + 1) % NumberOfWorkers) {
+        if (Workers[Victim] != Worker && Workers[Victim]->Node == Worker->Node
+            && (Thread = (PUTHREAD) TakeWorkDeque(&Workers[Victim]->Deque)) != NULL) {
+            return Thread;
+        }
+    }
+
+    if (Worker->Scheduler->MultipleNodes) {
+        for (Index = 0; Index < NumberOfWorkers; ++Index, Victim = (Victim + 1) % NumberOfWorkers) {
+            if (Workers[Victim]->Node != Worker->Node
+                && (Thread = (PUTHREAD) TakeWorkDeque(&Workers[Victim]->Deque)) != NULL) {
+                return Thread;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Returns true if an idle worker of the specified scheduler must not block: there are
+// threads in the inbound queue or in the deque of some worker, or the worker must leave
+// the scheduler.
+//
+
+static
+BOOL
+MustIdleWorkerWake (
+    __in PUT_SCHEDULER Scheduler
+    )
+{
+    ULONG Index;
+
+    if (Scheduler->InboundQueue.Head != NULL || Scheduler->NumberOfThreads == 0 
+        || Scheduler->IdleWorkers.ShutdownRequested) {
+        return TRUE;
+    }
+
+    for (Index = 0; Index < Scheduler->NumberOfActiveWorkers; ++Index) {
+        if (!IsWorkDequeEmpty(&Scheduler->Workers[Index]->Deque)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// Blocks the calling worker of the specified scheduler on its wake event, for up to
+// Timeout milliseconds, resetting the event if it was signalled. On Linux, the poller
+// of the default scheduler blocks in the reactor instead.
+//
+
+static
+VOID
+WaitOnWakeEvent (
+    __in PUT_SCHEDULER Scheduler,
+    __in ULONG Timeout
+    )
+{
+#if defined(_WIN32)
+    WaitForSingleObject(Scheduler->IdleWorkers.WakeEvent, Timeout);
+#else
+    struct pollfd Descriptor;
+    ULONG64 Value;
+
+    Descriptor.fd = Scheduler->IdleWorkers.WakeEvent;
+    Descriptor.events = POLLIN;
+
+    if (poll(&Descriptor, 1, Timeout == INFINITE ? -1 : (int) Timeout) > 0) {
+        read(Descriptor.fd, &Value, sizeof(Value));
+    }
+#endif
+}
+
+//
+// Blocks the calling worker, which found nothing to run, until there may be work 
+// for it or Timeout milliseconds elapse. The first worker of the scheduler to block 
+// becomes the poller and waits on WakeEvent, together with the descriptors of the 
+// reactor where there is one and the scheduler is the default one, readying the threads
+// waiting for I/O; the others wait on the WakeSequence futex. Each announces itself 
+// before checking for work a last time, so that a worker making work available 
+// afterwards sees it blocked. The wait may end spuriously.
+//
+
+static
+VOID
+WaitForWork (
+    __inout PUT_SCHEDULER Scheduler,
+    __in ULONG Timeout
+    )
+{
+    PIDLE_WORKERS IdleWorkers;
+    LONG Sequence;
+
+    IdleWorkers = &Scheduler->IdleWorkers;
+
+    if (InterlockedCompareExchange(&IdleWorkers->Poller, TRUE, FALSE) == FALSE) {
+        if (!MustIdleWorkerWake(Scheduler)) {
+#if defined(_WIN32)
+            WaitOnWakeEvent(Scheduler, Timeout);
+#else
+            if (Scheduler == &DefaultScheduler) {
+                PollReactor(Timeout, TRUE);
+            } else {
+                WaitOnWakeEvent(Scheduler, Timeout);
+            }
+#endif
+        }
+
+        IdleWorkers->Poller = FALSE;
+        return;
+    }
+
+    Sequence = IdleWorkers->WakeSequence;
+    InterlockedIncrement(&IdleWorkers->NumberOfSleepingWorkers);
+
+    if (!MustIdleWorkerWake(Scheduler)) {
+        WaitOnWakeSequence(Scheduler, Sequence, Timeout);
+    }
+
+    InterlockedDecrement(&IdleWorkers->NumberOfSleepingWorkers);
+}
+
+//
+// Acquires the context of Thread, which is about to be switched in. With multiple 
+// workers, a thread can be readied, and even taken by another worker, before the 
+// worker switching it out has saved its context, so we wait for Running to be 
+// cleared by that worker. Only used with multiple workers.
+//
+
+FORCEINLINE
+VOID
+AcquireThreadContext (
+    __inout PUTHREAD Thread
+    )
+{
+    while (Thread->Running) {
+        YieldProcessor();
+    }
+
+    Thread->Running = TRUE;
+}
+
+//
+// Completes the context switch that resumed the current thread, by releasing the 
+// context of the thread that was switched out. With multiple workers, this must 
+// run right after every switch, on the stack of the thread switched in.
+//
+
+FORCEINLINE
+VOID
+FinishContextSwitch (
+    )
+{
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    if (Worker->SwitchedOutThread != NULL) {
+        _ReadWriteBarrier();
+        Worker->SwitchedOutThread->Running = FALSE;
+        Worker->SwitchedOutThread = NULL;
+    }
+}
+
+//
+// Switches from CurrentThread to NextThread with multiple workers. When the function
+// returns, the calling thread may be running on a different worker.
+//
+
+static
+DECLSPEC_NOINLINE
+VOID
+SwitchToNextThreadShared (
+    __inout PUT_WORKER Worker,
+    __inout PUTHREAD CurrentThread,
+    __in PUTHREAD NextThread
+    )
+{
+    if (CurrentThread == NextThread) {
+        return;
+    }
+
+    //
+    // The next thread may still be being switched out by another worker, which in turn
+    // may be waiting for the context of the current thread, if the current thread was
+    // readied before switching out, as when it yields or hands off to a thread that is
+    // about to park. Rather than waiting, a user thread readies the next thread again 
+    // and switches to the worker's main thread, which holds no context other workers 
+    // can wait for, and can therefore wait itself.
+    //
+
+    if (NextThread->Running && CurrentThread != Worker->MainThread) {
+        ReadyThread(Worker, NextThread);
+        NextThread = Worker->MainThread;
+    }
+
+    _ASSERTE(!NextThread->UsesSharedStack);
+    AcquireThreadContext(NextThread);
+    AccountContextSwitch(CurrentThread, NextThread);
+    Worker->SwitchedOutThread = CurrentThread;
+    Worker->RunningThread = NextThread;
+    ContextSwitch(CurrentThread, NextThread);
+    FinishContextSwitch();
+}
+
+//
+// Switches from the running thread of Worker to NextThread. On a single worker
+// there is nothing to do after the switch, so ContextSwitch can be a tail call.
+//
+
+FORCEINLINE
+VOID
+SwitchToNextThread (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD NextThread
+    )
+{
+    PUTHREAD CurrentThread;
+
+    CurrentThread = Worker->RunningThread;
+
+    if (Worker->Scheduler->MultipleWorkers) {
+        SwitchToNextThreadShared(Worker, CurrentThread, NextThread);
+        return;
+    }
+
+    if (Worker->Scheduler->FairShare) {
+        ChargeSwitchedOutThread(&Worker->Scheduler->FairQueue, CurrentThread);
+    }
+
+    AccountContextSwitch(CurrentThread, NextThread);
+    Worker->RunningThread = NextThread;
+
+    if ((CurrentThread->UsesSharedStack | NextThread->UsesSharedStack) != 0) {
+        SwitchSharedStack(&Worker->Scheduler->SharedStack, CurrentThread, NextThread);
+        return;
+    }
+
+    ContextSwitch(CurrentThread, NextThread);
+}
+
+//
+// Runs the scheduling loop of Worker on the calling operating system thread, switching
+// to the worker's ready threads, until all user threads have exited or the scheduler is
+// shut down. With multiple workers, a worker without ready threads steals them from the 
+// other workers, spinning for a while before blocking. A single worker blocks right away.
+//
+
+static
+VOID
+RunWorker (
+    __inout PUT_WORKER Worker
+    )
+{
+    PIDLE_WORKERS IdleWorkers;
+    PUTHREAD NextThread;
+    PUT_SCHEDULER Scheduler;
+    ULONG Spins;
+    UTHREAD Thread;
+
+    Scheduler = Worker->Scheduler;
+    IdleWorkers = &Scheduler->IdleWorkers;
+
+#if DEBUG
+    Thread.Function = (UT_FUNCTION) UtRun;
+#endif
+    Thread.Running = TRUE;
+    Thread.UsesSharedStack = FALSE;
+    Thread.Scheduler = Scheduler;
+    Thread.Weight = UT_WEIGHT_NORMAL;
+    InitializeThreadStats(&Thread);
+    Worker->MainThread = Worker->RunningThread = &Thread;
+
+    Spins = 0;
+    for (;;) {
+        if ((NextThread = TakeReadyThread(Worker)) != NULL 
+            || (Scheduler->MultipleWorkers && (NextThread = StealReadyThread(Worker)) != NULL)) {
+            if (Spins != 0) {
+                InterlockedDecrement(&IdleWorkers->NumberOfSpinningWorkers);
+                Spins = 0;
+            }
+
+            SwitchToNextThread(Worker, NextThread);
+        } else if (Scheduler->NumberOfThreads == 0 || IdleWorkers->ShutdownRequested) {
+            break;
+        } else if (Scheduler->MultipleWorkers && Spins < IDLE_SPIN_COUNT) {
+            if (Spins++ == 0) {
+                InterlockedIncrement(&IdleWorkers->NumberOfSpinningWorkers);
+            }
+
+            YieldProcessor();
+        } else {
+            if (Spins != 0) {
+                InterlockedDecrement(&IdleWorkers->NumberOfSpinningWorkers);
+                Spins = 0;
+            }
+
+            //
+            // Before blocking, expire timers according to the precise clock, and 
+            // block at most until the next timer is due.
+            //
+
+            if (Worker->TimerWheel.NumberOfTimers == 0 || !ExpireTimers(Worker, FALSE)) {
+                WaitForWork(Scheduler, GetIdleTimeout(Worker));
+            }
+        }
+    }
+
+    if (Spins != 0) {
+        InterlockedDecrement(&IdleWorkers->NumberOfSpinningWorkers);
+    }
+
+    Worker->MainThread = Worker->RunningThread = NULL;
+}
+
+//
+// The entry point of the operating system threads running secondary workers.
+//
+
+static
+#if defined(_WIN32)
+DWORD
+WINAPI
+#else
+PVOID
+#endif
+WorkerThreadStart (
+    __in PVOID Argument
+    )
+{
+    CurrentWorker = (PUT_WORKER) Argument;
+    PinWorker(CurrentWorker, NULL);
+    RunWorker(CurrentWorker);
+    CurrentWorker = NULL;
+    return 0;
+}
+
+//
+// Definition of the public interface.
+//
+
+//
+// Runs the scheduler. The operating system thread that calls the function 
+// switches to a user thread and resumes execution only when all user threads 
+// have exited, or when the scheduler is shut down. While all the user threads are
+// parked, the scheduler blocks without using processor time.
+//
+
+VOID
+UtRun (
+    )
+{
+    UtRunEx(1);
+}
+
+//
+// Runs the scheduler on the specified number of workers: the calling operating 
+// system thread and NumberOfWorkers - 1 additional ones. The calling thread resumes 
+// execution only when all user threads have exited, or when the scheduler is shut 
+// down and no threads are ready.
+//
+
+VOID
+UtRunEx (
+    __in ULONG NumberOfWorkers
+    )
+{
+    THREAD_AFFINITY Affinity;
+    ULONG Index;
+    ULONG NumberOfStartedWorkers;
+    BOOL Pinned;
+    PUT_WORKER PrimaryWorker;
+    PLIST_ENTRY ReadyQueue;
+    PUT_SCHEDULER Scheduler;
+    PUTHREAD Thread;
+    LIST_ENTRY Timers;
+    PUT_WORKER Worker;
+    PUT_WORKER * Workers = NULL;
+
+    //
+    // An operating system thread can run only one scheduler at a time.
+    //
+
+    _ASSERTE(CurrentWorker == NULL);
+    _ASSERTE(NumberOfWorkers >= 1);
+
+    Scheduler = GetCurrentScheduler();
+    CurrentWorker = PrimaryWorker = GetPrimaryWorker(Scheduler);
+    UtSingleWorker = TRUE;
+    DrainInboundQueue(PrimaryWorker);
+
+    if (Scheduler->NumberOfThreads == 0) {
+        CurrentWorker = NULL;
+        UtSingleWorker = FALSE;
+        return;
+    }
+
+    //
+    // Pin the calling thread to the processor of the primary worker, if configured.
+    //
+
+    AssignWorkerProcessor(PrimaryWorker, 0);
+    Pinned = PinWorker(PrimaryWorker, &Affinity);
+
+    //
+    // Create the secondary workers. If memory runs out, run on the workers created
+    // so far, which may be just the primary one.
+    //
+
+    if (NumberOfWorkers > 1) {
+        Workers = (PUT_WORKER *) malloc(NumberOfWorkers * sizeof(PUT_WORKER));
+        if (Workers == NULL) {
+            NumberOfWorkers = 1;
+        } else {
+            Workers[0] = PrimaryWorker;
+            for (Index = 1; Index < NumberOfWorkers; ++Index) {
+                Workers[Index] = (PUT_WORKER) _aligned_malloc(sizeof(UT_WORKER), CACHE_LINE_SIZE);
+                if (Workers[Index] == NULL) {
+                    NumberOfWorkers = Index;
+                    break;
+                }
+
+                InitializeWorker(Workers[Index], Scheduler, Index);
+                AssignWorkerProcessor(Workers[Index], Index);
+                if (Workers[Index]->Node != PrimaryWorker->Node) {
+                    Scheduler->MultipleNodes = TRUE;
+                }
+            }
+
+            if (NumberOfWorkers == 1) {
+                free(Workers);
+                Scheduler->MultipleNodes = FALSE;
+            }
+        }
+    }
+
+    if (NumberOfWorkers == 1) {
+
+        //
+        // Switch to the user threads.
+        //
+    
+        RunWorker(PrimaryWorker);
+    } else {
+
+        //
+        // Spread the ready threads of normal priority among all the workers' deques 
+        // before starting the secondary workers. The threads of other priorities stay
+        // in the ready queues of the primary worker.
+        //
+
+        for (Index = 0; Index < NumberOfWorkers; ++Index) {
+            InitializeWorkDeque(&Workers[Index]->Deque);
+        }
+
+        ReadyQueue = &PrimaryWorker->ReadyQueues[NORMAL_PRIORITY_LEVEL];
+        for (Index = 0; !IsListEmpty(ReadyQueue); Index = (Index + 1) % NumberOfWorkers) {
+            PushWorkDeque(&Workers[Index]->Deque, CONTAINING_RECORD(RemoveHeadList(ReadyQueue), UTHREAD, Link));
+        }
+
+        for (; (PrimaryWorker->ReadyLevels & (1u << NORMAL_PRIORITY_LEVEL)) != 0; Index = (Index + 1) % NumberOfWorkers) {
+            PushWorkDeque(&Workers[Index]->Deque, RemoveFairThread(PrimaryWorker));
+        }
+
+#if defined(UT_STATS)
+        PrimaryWorker->ReadyCount = 0;
+#endif
+
+        //
+        // From now on, spin locks are taken by all the workers of the scheduler.
+        //
+
+        AcquireGlobalSpinLock(&MultipleWorkersLock);
+        NumberOfMultipleWorkerSchedulers += 1;
+        UtMultipleWorkers = TRUE;
+        UtReleaseSpinLock(&MultipleWorkersLock);
+
+        Scheduler->Workers = Workers;
+        Scheduler->NumberOfActiveWorkers = NumberOfWorkers;
+        Scheduler->MultipleWorkers = TRUE;
+        UtSingleWorker = FALSE;
+
+        for (NumberOfStartedWorkers = 1; NumberOfStartedWorkers < NumberOfWorkers; ++NumberOfStartedWorkers) {
+            Worker = Workers[NumberOfStartedWorkers];
+#if defined(_WIN32)
+            if ((Worker->OsThread = CreateThread(NULL, 0, WorkerThreadStart, Worker, 0, NULL)) == NULL) {
+                break;
+            }
+#else
+            if (pthread_create(&Worker->OsThread, NULL, WorkerThreadStart, Worker) != 0) {
+                break;
+            }
+#endif
+        }
+
+        if (NumberOfStartedWorkers < NumberOfWorkers) {
+
+            //
+            // Run only on the workers that started, which stop stealing from the others,
+            // and move the threads left in the deques of the others to the primary worker.
+            // Workers that read the previous count may still steal some of them meanwhile.
+            //
+
+            Scheduler->NumberOfActiveWorkers = NumberOfStartedWorkers;
+            MemoryBarrier();
+
+            for (Index = NumberOfStartedWorkers; Index < NumberOfWorkers; ++Index) {
+                while ((Thread = (PUTHREAD) TakeWorkDeque(&Workers[Index]->Deque)) != NULL) {
+                    PushWorkDeque(&PrimaryWorker->Deque, Thread);
+                }
+            }
+        }
+
+        RunWorker(PrimaryWorker);
+
+        //
+        // Wait for all the secondary workers to finish, as they may still be trying
+        // to steal from each other, and then move their thread block pools to the pools
+        // of their nodes, and the timers of the threads parked on them to the primary
+        // worker.
+        //
+
+        for (Index = 1; Index < NumberOfStartedWorkers; ++Index) {
+            Worker = Workers[Index];
+#if defined(_WIN32)
+            WaitForSingleObject(Worker->OsThread, INFINITE);
+            CloseHandle(Worker->OsThread);
+#else
+            pthread_join(Worker->OsThread, NULL);
+#endif
+        }
+
+        for (Index = 1; Index < NumberOfWorkers; ++Index) {
+            Worker = Workers[Index];
+            SpillThreadBlockPool(Worker);
+
+            InitializeListHead(&Timers);
+            FlushWheelTimers(&Worker->TimerWheel, &Timers);
+            while (!IsListEmpty(&Timers)) {
+                Thread = CONTAINING_RECORD(RemoveHeadList(&Timers), UTHREAD, Timer.Link);
+                Thread->TimerWorker = PrimaryWorker;
+                AddWheelTimer(&PrimaryWorker->TimerWheel, &Thread->Timer);
+            }
+
+#if defined(UT_STATS)
+            if (Worker->ReadyHighWatermark > PrimaryWorker->ReadyHighWatermark) {
+                PrimaryWorker->ReadyHighWatermark = Worker->ReadyHighWatermark;
+            }
+
+            PrimaryWorker->Creations += Worker->Creations;
+            PrimaryWorker->Exits += Worker->Exits;
+#endif
+
+            DeleteWorkDeque(&Worker->Deque);
+            _aligned_free(Worker);
+        }
+
+        _ASSERTE(IsWorkDequeEmpty(&PrimaryWorker->Deque));
+        DeleteWorkDeque(&PrimaryWorker->Deque);
+        free(Workers);
+
+        Scheduler->Workers = NULL;
+        Scheduler->NumberOfActiveWorkers = 0;
+        Scheduler->MultipleWorkers = FALSE;
+        Scheduler->MultipleNodes = FALSE;
+        UtSingleWorker = TRUE;
+
+        AcquireGlobalSpinLock(&MultipleWorkersLock);
+        if ((NumberOfMultipleWorkerSchedulers -= 1) == 0) {
+            UtMultipleWorkers = FALSE;
+        }
+        UtReleaseSpinLock(&MultipleWorkersLock);
+    }
+
+    //
+    // When we get here, there are no more runnable user threads. Unless the scheduler
+    // was shut down, there are no user threads at all; otherwise, the remaining ones 
+    // are parked and resume when unparked and the scheduler runs again.
+    //
+
+    _ASSERTE(PrimaryWorker->ReadyLevels == 0);
+    _ASSERTE(IsListEmpty(&PrimaryWorker->ReadyQueues[NORMAL_PRIORITY_LEVEL]));
+    _ASSERTE(Scheduler->NumberOfThreads == 0 || Scheduler->IdleWorkers.ShutdownRequested);
+
+    Scheduler->IdleWorkers.ShutdownRequested = FALSE;
+
+    //
+    // Keep only the blocks that the next call to UtRun is likely to need.
+    //
+
+    TrimWorkerThreadBlockPool(PrimaryWorker, PoolLowWatermark);
+
+    if (Pinned) {
+        RestoreAffinity(&Affinity);
+    }
+
+    //
+    // Allow another call to UtRun().
+    //
+
+    CurrentWorker = NULL;
+    UtSingleWorker = FALSE;
+}
+
+//
+// Shuts down the scheduler of the calling thread: the call to UtRun returns as soon as
+// there are no ready threads, instead of waiting for parked threads to be unparked. 
+// Threads that remain parked are kept, and resume running when unparked and the 
+// scheduler runs again. Can be called from any operating system thread.
+//
+
+VOID
+UtShutdown (
+    )
+{
+    PUT_SCHEDULER Scheduler;
+
+    Scheduler = GetCurrentScheduler();
+    Scheduler->IdleWorkers.ShutdownRequested = TRUE;
+    WakeAllIdleWorkers(Scheduler);
+}
+
+//
+// Creates a scheduler, whose primary worker is initialized on first use.
+//
+
+PUT_SCHEDULER
+UtCreateScheduler (
+    )
+{
+    PUT_SCHEDULER Scheduler;
+
+    Scheduler = (PUT_SCHEDULER) _aligned_malloc(sizeof(UT_SCHEDULER), CACHE_LINE_SIZE);
+    if (Scheduler != NULL) {
+        RtlZeroMemory(Scheduler, sizeof(*Scheduler));
+    }
+
+    return Scheduler;
+}
+
+//
+// Deletes the specified scheduler, releasing its pooled thread blocks, its shared 
+// stack and its wake event.
+//
+
+VOID
+UtDeleteScheduler (
+    __inout PUT_SCHEDULER Scheduler
+    )
+{
+    _ASSERTE(Scheduler != &DefaultScheduler);
+    _ASSERTE(Scheduler->NumberOfThreads == 0);
+    _ASSERTE(Scheduler->PrimaryWorker.MainThread == NULL);
+
+    if (CurrentScheduler == Scheduler) {
+        CurrentScheduler = NULL;
+    }
+
+    if (Scheduler->PrimaryWorker.ReadyQueues[0].Flink != NULL) {
+        TrimWorkerThreadBlockPool(&Scheduler->PrimaryWorker, 0);
+
+#if defined(_WIN32)
+        CloseHandle(Scheduler->IdleWorkers.WakeEvent);
+#else
+        close(Scheduler->IdleWorkers.WakeEvent);
+#endif
+    }
+
+    if (Scheduler->SharedStack.Top != NULL) {
+        FreeThreadBlock((PUTHREAD) Scheduler->SharedStack.Top);
+        FreeThreadBlock(Scheduler->SharedStack.Transit);
+    }
+
+    free(Scheduler->Processors);
+    free(Scheduler->FairQueue.Entries);
+    _aligned_free(Scheduler);
+}
+
+//
+// Selects the scheduler of the calling operating system thread.
+//
+
+PUT_SCHEDULER
+UtSelectScheduler (
+    __in_opt PUT_SCHEDULER Scheduler
+    )
+{
+    PUT_SCHEDULER Previous;
+
+    _ASSERTE(CurrentWorker == NULL);
+
+    Previous = CurrentScheduler;
+    CurrentScheduler = Scheduler;
+    return Previous;
+}
+
+//
+// Pins the workers of the current scheduler to the specified processors while it runs,
+// or lets them run on any processor if Processors is NULL.
+//
+
+BOOL
+UtConfigureWorkerAffinity (
+    __in_ecount_opt(NumberOfProcessors) const ULONG * Processors,
+    __in ULONG NumberOfProcessors
+    )
+{
+    PULONG Copy;
+    PUT_SCHEDULER Scheduler;
+
+    _ASSERTE(Processors == NULL || NumberOfProcessors != 0);
+
+    Scheduler = GetCurrentScheduler();
+    _ASSERTE(Scheduler->PrimaryWorker.MainThread == NULL);
+
+    Copy = NULL;
+    if (Processors != NULL) {
+        if ((Copy = (PULONG) malloc(NumberOfProcessors * sizeof(ULONG))) == NULL) {
+            return FALSE;
+        }
+
+        RtlCopyMemory(Copy, Processors, NumberOfProcessors * sizeof(ULONG));
+    }
+
+    free(Scheduler->Processors);
+    Scheduler->Processors = Copy;
+    Scheduler->NumberOfProcessors = Copy != NULL ? NumberOfProcessors : 0;
+    return TRUE;
+}
+
+//
+// Enables or disables fair scheduling on the current scheduler, moving its ready threads
+// of normal priority between the ready queue of the primary worker and the fair queue.
+//
+
+BOOL
+UtConfigureFairScheduling (
+    __in BOOL Enable,
+    __in ULONG WakeupCredit
+    )
+{
+    PLIST_ENTRY ReadyQueue;
+    PUT_SCHEDULER Scheduler;
+    PUT_WORKER Worker;
+
+    Scheduler = GetCurrentScheduler();
+    _ASSERTE(Scheduler->PrimaryWorker.MainThread == NULL);
+
+    Worker = GetPrimaryWorker(Scheduler);
+    ReadyQueue = &Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL];
+    Scheduler->FairQueue.WakeupCredit = WakeupCredit;
+
+    if (Enable && !Scheduler->FairShare) {
+        if (!ReserveFairQueue(&Scheduler->FairQueue, Scheduler->NumberOfThreads)) {
+            return FALSE;
+        }
+
+        Scheduler->FairShare = TRUE;
+        while (!IsListEmpty(ReadyQueue)) {
+            InsertFairThread(Worker, CONTAINING_RECORD(RemoveHeadList(ReadyQueue), UTHREAD, Link));
+        }
+    } else if (!Enable && Scheduler->FairShare) {
+        while ((Worker->ReadyLevels & (1u << NORMAL_PRIORITY_LEVEL)) != 0) {
+            InsertTailList(ReadyQueue, &RemoveFairThread(Worker)->Link);
+        }
+
+        Scheduler->FairShare = FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Creates a user thread to run the specified function. 
+// The new thread is placed at the end of the ready queue.
+//
+
+HANDLE
+UtCreate (
+    __in UT_FUNCTION Function,
+    __in UT_ARGUMENT Argument
+    )
+{
+    return UtCreateEx(Function, Argument, 0, 0);
+}
+
+//
+// Creates a user thread to run the specified function, with a stack of at least 
+// StackSize bytes, or of the default size if StackSize is zero. If Flags includes
+// UT_CREATE_JOINABLE, the thread's descriptor outlives the thread until it is joined
+// or detached. If Flags includes UT_CREATE_SHARED_STACK, StackSize is ignored and the
+// thread runs on the shared stack. The new thread is placed at the end of the ready 
+// queue. Returns NULL if the stack can't be allocated.
+//
+
+HANDLE
+UtCreateEx (
+    __in UT_FUNCTION Function,
+    __in UT_ARGUMENT Argument,
+    __in SIZE_T StackSize,
+    __in ULONG Flags
+    )
+{
+    ULONG Class;
+    PUT_SCHEDULER Scheduler;
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
+
+    //
+    // Threads created before the scheduler starts go to its primary worker.
+    //
+
+    if ((Worker = CurrentWorker) == NULL) {
+        Worker = GetPrimaryWorker(GetCurrentScheduler());
+    }
+
+    Scheduler = Worker->Scheduler;
+
+    if ((Flags & UT_CREATE_SHARED_STACK) != 0) {
+
+        //
+        // The thread runs on the shared stack, which only a single worker can use.
+        //
+
+        _ASSERTE(!Scheduler->MultipleWorkers);
+
+        Thread = AllocateSharedStackThread(&Scheduler->SharedStack);
+        if (Thread == NULL) {
+            return NULL;
+        }
+    } else {
+        StackSize = StackSize == 0 ? GetDefaultStackSize(Function) : ROUND_TO_PAGES(StackSize + DESCRIPTOR_SIZE);
+
+        if ((Class = GetStackClass(StackSize)) != NUMBER_OF_STACK_CLASSES 
+            && (Thread = TakePooledThreadBlock(Worker, Class)) != NULL) {
+
+            //
+            // Reuse the descriptor and stack of an exited thread. Zero the stack for 
+            // emotional confort, unless disabled by UtConfigureThreadBlockPool.
+            //
+
+            if (PoolZeroStacks) {
+                ResetThreadStack(Thread);
+            }
+        } else {
+
+            //
+            // Reserve a new block, whose pages are zero-filled on demand.
+            //
+
+            Thread = AllocateThreadBlock(StackSize);
+            if (Thread == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    Thread->Function = Function;
+    Thread->Argument = Argument;
+    Thread->Running = FALSE;
+    Thread->ParkState = PARK_NONE;
+    Thread->PriorityLevel = (ULONG) (GET_CREATE_PRIORITY(Flags) - UT_PRIORITY_LOWEST);
+    Thread->Weight = UT_WEIGHT_NORMAL;
+    Thread->VirtualRuntime = Scheduler->FairQueue.MinVirtualRuntime;
+    Thread->Scheduler = Scheduler;
+    Thread->SharedLocks = 0;
+    Thread->JoinState = (Flags & UT_CREATE_JOINABLE) != 0 ? JOIN_JOINABLE : JOIN_DETACHED;
+    Thread->ExitValue = NULL;
+    Thread->StackHighWater = 0;
+    InitializeThreadStats(Thread);
+
+    //
+    // The initial frames of a thread that runs on the shared stack are built in its 
+    // buffer, to be copied to the top of the shared stack.
+    //
+
+    if (Thread->UsesSharedStack) {
+        InitializeThreadContext(Thread, Thread->SavedFrames + INITIAL_FRAMES_SIZE, InternalStart);
+        Thread->ThreadContext = (PUTHREAD_CONTEXT) (Scheduler->SharedStack.Top - INITIAL_FRAMES_SIZE);
+    } else {
+        InitializeThreadContext(Thread, (PUCHAR) Thread, InternalStart);
+    }
+
+    //
+    // With fair scheduling, the fair queue must have room for every thread, even while
+    // the scheduler runs on multiple workers and doesn't use it, so that the thread can
+    // be readied into it once the scheduler runs on a single worker. The room is made 
+    // and the thread counted under the lock of the queue, as threads may be created on 
+    // several workers at the same time.
+    //
+
+    if (Scheduler->FairShare) {
+        UtAcquireSpinLock(&Scheduler->FairQueue.Lock);
+
+        if (!ReserveFairQueue(&Scheduler->FairQueue, Scheduler->NumberOfThreads + 1)) {
+            UtReleaseSpinLock(&Scheduler->FairQueue.Lock);
+            FreeThreadBlock(Thread);
+            return NULL;
+        }
+
+        InterlockedIncrement(&Scheduler->NumberOfThreads);
+        UtReleaseSpinLock(&Scheduler->FairQueue.Lock);
+    } else if (Scheduler->MultipleWorkers) {
+        InterlockedIncrement(&Scheduler->NumberOfThreads);
+    } else {
+        Scheduler->NumberOfThreads += 1;
+    }
+
+    //
+    // Ready the thread and return a handle to it.
+    //
+
+    AccountCreatedThread(Worker);
+    ReadyThread(Worker, Thread);
+    
+    return (HANDLE) Thread;
+}
+
+//
+// Configures the scheduler's pool of descriptor and stack blocks. Up to HighWatermark
+// blocks of exited threads are kept for reuse by UtCreate; when that limit is exceeded, 
+// and when UtRun returns, the pool is trimmed down to LowWatermark blocks. If ZeroStacks 
+// is FALSE, stacks are handed to new threads without being zeroed. The pools that hold
+// the blocks of workers on each NUMA node are also kept within HighWatermark blocks.
+//
+
+VOID
+UtConfigureThreadBlockPool (
+    __in ULONG LowWatermark,
+    __in ULONG HighWatermark,
+    __in BOOL ZeroStacks
+    )
+{
+    ULONG Node;
+    PNODE_POOL Pool;
+
+    _ASSERTE(LowWatermark <= HighWatermark);
+
+    PoolLowWatermark = LowWatermark;
+    PoolHighWatermark = HighWatermark;
+    PoolZeroStacks = ZeroStacks;
+    TrimWorkerThreadBlockPool(CurrentWorker != NULL ? CurrentWorker : GetPrimaryWorker(GetCurrentScheduler()), 
+                              HighWatermark);
+
+    for (Node = 0; Node < MAXIMUM_NODES; ++Node) {
+        Pool = AcquireNodePool(Node);
+        TrimThreadBlockPool(Pool->ThreadBlockPool, &Pool->NumberOfPooledBlocks, HighWatermark);
+        UtReleaseSpinLock(&Pool->Lock);
+    }
+}
+
+//
+// Enables or disables stack profiling, which measures the stack depth reached by each 
+// thread when it exits and aggregates it per thread function. In adaptive mode, which
+// implies profiling, threads created without a stack size get the smallest size class
+// that holds the deepest stack used by STACK_PROFILE_SAMPLES threads running the same
+// function, with one page to spare.
+//
+
+VOID
+UtConfigureStackProfiling (
+    __in BOOL Enable,
+    __in BOOL Adaptive
+    )
+{
+    StackProfile.Enabled = Enable || Adaptive;
+    StackProfile.Adaptive = Adaptive;
+}
+
+//
+// Returns the number of stack bytes used by the specified thread, measured as the
+// distance from its descriptor to the deepest non-zero stack word. The value of an 
+// exited joinable thread is the one measured when it exited, which is zero unless
+// stack profiling was enabled.
+//
+
+SIZE_T
+UtGetStackHighWater (
+    __in HANDLE ThreadHandle
+    )
+{
+    PUTHREAD Thread;
+
+    Thread = (PUTHREAD) ThreadHandle;
+    return Thread->JoinState == JOIN_EXITED ? Thread->StackHighWater : MeasureStackHighWater(Thread);
+}
+
+//
+// Stores the stack profile of the specified thread function in Profile. Returns FALSE
+// if no thread running the function exited while stack profiling was enabled, or if
+// the profile table is full.
+//
+
+BOOL
+UtGetStackProfile (
+    __in UT_FUNCTION Function,
+    __out PUT_STACK_PROFILE Profile
+    )
+{
+    PSTACK_PROFILE_ENTRY Entry;
+
+    AcquireGlobalSpinLock(&StackProfile.Lock);
+
+    if ((Entry = LookupStackProfileEntry(Function, FALSE)) != NULL) {
+        Profile->Threads = Entry->Threads;
+        Profile->HighWater = Entry->HighWater;
+        Profile->StackSize = Entry->StackSize;
+    }
+
+    UtReleaseSpinLock(&StackProfile.Lock);
+    return Entry != NULL;
+}
+
+//
+// Terminates the execution of the currently running thread. All associated resources
+// will be released after the context switch to the next ready thread.
+//
+
+DECLSPEC_NORETURN
+VOID
+UtExit (
+    )
+{
+    UtExitEx(NULL);
+}
+
+//
+// Terminates the execution of the currently running thread with the specified exit 
+// value, which is handed to the thread that joins it. The resources associated with
+// the thread are released after the context switch to the next ready thread, except 
+// for the descriptor of a joinable thread.
+//
+
+DECLSPEC_NORETURN
+VOID
+UtExitEx (
+    __in PVOID ExitValue
+    )
+{
+    PUTHREAD CurrentThread;
+    PUTHREAD NextThread;
+    PUT_SCHEDULER Scheduler;
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    Scheduler = Worker->Scheduler;
+
+    if (Scheduler->MultipleWorkers) {
+        if (InterlockedDecrement(&Scheduler->NumberOfThreads) == 0) {
+            WakeAllIdleWorkers(Scheduler);
+        }
+    } else {
+        Scheduler->NumberOfThreads -= 1;
+    }
+
+    CurrentThread = Worker->RunningThread;
+    CurrentThread->ExitValue = ExitValue;
+    NextThread = PluckNextReadyThread(Worker);
+
+    if (Scheduler->MultipleWorkers) {
+        AcquireThreadContext(NextThread);
+    } else if (Scheduler->FairShare) {
+        ChargeSwitchedOutThread(&Scheduler->FairQueue, CurrentThread);
+    }
+
+    AccountExitedThread(Worker);
+    AccountContextSwitch(CurrentThread, NextThread);
+    Worker->RunningThread = NextThread;
+
+    if ((CurrentThread->UsesSharedStack | NextThread->UsesSharedStack) != 0) {
+        ExitSharedStack(&Scheduler->SharedStack, CurrentThread, NextThread);
+    }
+
+    InternalExit(CurrentThread, NextThread);
+    _ASSERTE(!"supposed to be here!");
+}
+
+//
+// Waits for the specified joinable thread to exit, and stores its exit value in 
+// ExitValue, if specified. The descriptor of the thread is then released, and its 
+// handle becomes invalid. A thread can be joined by a single thread.
+//
+
+VOID
+UtJoin (
+    __in HANDLE ThreadHandle,
+    __out_opt PVOID * ExitValue
+    )
+{
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
+
+    Thread = (PUTHREAD) ThreadHandle;
+    Worker = CurrentWorker;
+    _ASSERTE(Thread != Worker->RunningThread);
+    _ASSERTE(Thread->JoinState == JOIN_JOINABLE || Thread->JoinState == JOIN_EXITED);
+
+    //
+    // Park until the thread exits, unless it already has. The exiting thread's worker
+    // unparks the current thread once it has switched away from the exiting thread.
+    //
+
+    Thread->Joiner = Worker->RunningThread;
+
+    if (InterlockedCompareExchange(&Thread->JoinState, JOIN_JOINING, JOIN_JOINABLE) == JOIN_JOINABLE) {
+        UtPark();
+        Worker = CurrentWorker;
+    }
+
+    _ASSERTE(Thread->JoinState == JOIN_EXITED);
+
+    if (ExitValue != NULL) {
+        *ExitValue = Thread->ExitValue;
+    }
+
+    ReleaseThreadBlock(Worker, Thread);
+}
+
+//
+// Detaches the specified joinable thread, whose resources are then released as soon
+// as it exits, or right away if it already has. Must be called by a user thread, or
+// while the scheduler isn't running.
+//
+
+VOID
+UtDetach (
+    __in HANDLE ThreadHandle
+    )
+{
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
+
+    Thread = (PUTHREAD) ThreadHandle;
+
+    if (InterlockedCompareExchange(&Thread->JoinState, JOIN_DETACHED, JOIN_JOINABLE) == JOIN_JOINABLE) {
+        return;
+    }
+
+    _ASSERTE(Thread->JoinState == JOIN_EXITED);
+
+    if ((Worker = CurrentWorker) == NULL) {
+        Worker = GetPrimaryWorker(GetCurrentScheduler());
+    }
+
+    ReleaseThreadBlock(Worker, Thread);
+}
+
+//
+// Returns TRUE if the running thread of Worker, which yields, should switch to NextThread
+// under fair scheduling. On a single worker, the running thread is charged for the time
+// it ran, and between threads of normal priority, it only switches to a thread with no
+// greater virtual runtime. Kept out of line, as fair scheduling is optional.
+//
+
+static
+DECLSPEC_NOINLINE
+BOOL
+IsFairSwitch (
+    __inout PUT_WORKER Worker,
+    __in PUTHREAD NextThread
+    )
+{
+    PFAIR_QUEUE Queue;
+    PUTHREAD RunningThread;
+
+    if (Worker->Scheduler->MultipleWorkers) {
+        return TRUE;
+    }
+
+    Queue = &Worker->Scheduler->FairQueue;
+    RunningThread = Worker->RunningThread;
+    ChargeVirtualRuntime(Queue, RunningThread);
+
+    if (NextThread->PriorityLevel == NORMAL_PRIORITY_LEVEL
+        && RunningThread->PriorityLevel == NORMAL_PRIORITY_LEVEL
+        && NextThread->VirtualRuntime > RunningThread->VirtualRuntime) {
+        return FALSE;
+    }
+
+    Queue->ChargedThread = RunningThread;
+    return TRUE;
+}
+
+//
+// Relinquishes the processor to the first user thread in the ready queue.
+// If there are no ready threads, or none of the priority of the running thread
+// or higher, the function returns immediately. Under fair scheduling, neither
+// does it switch to a thread with a greater virtual runtime.
+//
+
+VOID
+UtYield (
+    ) 
+{
+    PUTHREAD NextThread;
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    if ((NextThread = TakeReadyThread(Worker)) != NULL) {
+        if (NextThread->PriorityLevel < Worker->RunningThread->PriorityLevel
+            || (Worker->Scheduler->FairShare && !IsFairSwitch(Worker, NextThread))) {
+            ReturnReadyThread(Worker, NextThread);
+            return;
+        }
+
+        //
+        // Insert the running thread at the tail of the ready queue
+        // and switch to the thread that was at front of the ready queue.
+        //
+
+        ReadyThread(Worker, Worker->RunningThread);
+        SwitchToNextThread(Worker, NextThread);
+    }
+}
+
+//
+// Suspends the execution of the current user thread for at least the specified number 
+// of milliseconds. The thread parks with a timer in the timer wheel of the worker, which 
+// readies the thread when the timer expires. While the worker has other threads to run,
+// timers are expired at switch points according to a coarse clock, so they may fire a 
+// few milliseconds late. If Milliseconds is zero, the function yields.
+//
+
+VOID
+UtSleep (
+    __in ULONG Milliseconds
+    )
+{
+    if (Milliseconds == 0) {
+        UtYield();
+        return;
+    }
+
+    UtPrepareParkTimeout();
+    if (!UtParkTimeout(Milliseconds)) {
+        UtCompleteParkTimeout(FALSE);
+    }
+}
+
+//
+// Returns a HANDLE to the executing user thread.
+//
+
+HANDLE
+UtSelf (
+    )
+{
+    return (HANDLE) CurrentWorker->RunningThread;
+}
+
+//
+// Sets the priority of the specified user thread, which takes effect the next time the
+// thread is readied. A ready thread stays in the ready queue it was placed in.
+//
+
+VOID
+UtSetPriority (
+    __in HANDLE ThreadHandle,
+    __in LONG Priority
+    )
+{
+    _ASSERTE(Priority >= UT_PRIORITY_LOWEST && Priority <= UT_PRIORITY_HIGHEST);
+
+    ((PUTHREAD) ThreadHandle)->PriorityLevel = (ULONG) (Priority - UT_PRIORITY_LOWEST);
+}
+
+//
+// Returns the priority of the specified user thread.
+//
+
+LONG
+UtGetPriority (
+    __in HANDLE ThreadHandle
+    )
+{
+    return (LONG) ((PUTHREAD) ThreadHandle)->PriorityLevel + UT_PRIORITY_LOWEST;
+}
+
+//
+// Sets the weight of the specified user thread under fair scheduling, which applies to
+// the time the thread runs from then on.
+//
+
+VOID
+UtSetWeight (
+    __in HANDLE ThreadHandle,
+    __in ULONG Weight
+    )
+{
+    _ASSERTE(Weight != 0);
+
+    ((PUTHREAD) ThreadHandle)->Weight = Weight;
+}
+
+//
+// Returns the weight of the specified user thread.
+//
+
+ULONG
+UtGetWeight (
+    __in HANDLE ThreadHandle
+    )
+{
+    return ((PUTHREAD) ThreadHandle)->Weight;
+}
+
+//
+// Returns a pointer to the counter of the shared acquisitions of reader-writer locks
+// held by the current user thread.
+//
+
+PULONG
+UtGetSharedLockCount (
+    )
+{
+    return &CurrentWorker->RunningThread->SharedLocks;
+}
+
+//
+// Returns the time of the monotonic clock, in milliseconds, on which the timeouts of 
+// parked threads are based. The coarse clock is cheaper to read, but lags behind by up
+// to a scheduling tick of the operating system.
+//
+
+ULONG64
+UtReadClock (
+    __in BOOL Coarse
+    )
+{
+#if defined(_WIN32)
+    UNREFERENCED_PARAMETER(Coarse);
+    return GetTickCount64();
+#else
+    struct timespec Time;
+
+    clock_gettime(Coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &Time);
+    return (ULONG64) Time.tv_sec * 1000 + Time.tv_nsec / 1000000;
+#endif
+}
+
+//
+// Halts the execution of the current user thread.
+//
+
+VOID
+UtPark (
+    )
+{
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    SwitchToNextThread(Worker, PluckNextReadyThread(Worker));
+}
+
+//
+// Announces that the current user thread is about to park with a timeout. Must be called
+// before the thread becomes visible to the threads that may unpark it, such as before 
+// its wait block is inserted in the wait list of a synchronization object.
+//
+
+VOID
+UtPrepareParkTimeout (
+    )
+{
+    CurrentWorker->RunningThread->ParkState = PARK_TIMED;
+}
+
+//
+// Halts the execution of the current user thread until it is unparked or the specified
+// number of milliseconds elapse. The thread's timer is placed in the timer wheel of the
+// worker; if the thread is unparked first, it cancels the timer when it resumes, from 
+// whichever worker it resumes on. Returns TRUE if the thread was unparked, or FALSE if 
+// the timeout expired, in which case UtCompleteParkTimeout must be called.
+//
+
+BOOL
+UtParkTimeout (
+    __in ULONG Milliseconds
+    )
+{
+    PUTHREAD Thread;
+    PUT_WORKER TimerWorker;
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    Thread = Worker->RunningThread;
+
+    //
+    // With multiple workers, the thread may have been unparked, and readied, since it
+    // announced the timed park, in which case it only has to switch out.
+    //
+
+    if (Milliseconds == INFINITE || Thread->ParkState == PARK_NONE) {
+        Thread->TimerWorker = NULL;
+    } else {
+        Thread->TimerWorker = Worker;
+        Thread->Timer.Deadline = UtReadClock(FALSE) + Milliseconds + 1;
+        UtAcquireSpinLock(&Worker->TimerLock);
+        AddWheelTimer(&Worker->TimerWheel, &Thread->Timer);
+        UtReleaseSpinLock(&Worker->TimerLock);
+    }
+
+    SwitchToNextThread(Worker, PluckNextReadyThread(Worker));
+
+    //
+    // The thread was readied either by an unpark or by the expiry of its timer.
+    //
+
+    if (Thread->ParkState == PARK_TIMED_OUT) {
+        return FALSE;
+    }
+
+    _ASSERTE(Thread->ParkState == PARK_NONE);
+
+    if ((TimerWorker = Thread->TimerWorker) != NULL) {
+        UtAcquireSpinLock(&TimerWorker->TimerLock);
+        if (Thread->Timer.Link.Flink != NULL) {
+            CancelWheelTimer(&TimerWorker->TimerWheel, &Thread->Timer);
+        }
+        UtReleaseSpinLock(&TimerWorker->TimerLock);
+    }
+
+    return TRUE;
+}
+
+//
+// Completes a timed park of the current user thread whose timeout expired. If UnparkPending 
+// is TRUE, the thread was chosen to be unparked after its timer expired, by a thread that 
+// hasn't necessarily unparked it yet, so the function waits for that unpark to be absorbed. 
+// Otherwise, no thread must unpark the current thread for the timed park.
+//
+
+VOID
+UtCompleteParkTimeout (
+    __in BOOL UnparkPending
+    )
+{
+    PUTHREAD Thread;
+
+    Thread = CurrentWorker->RunningThread;
+    _ASSERTE(Thread->ParkState == PARK_TIMED_OUT || (UnparkPending && Thread->ParkState == PARK_NONE));
+
+    if (UnparkPending) {
+
+        //
+        // The unparking thread is about to call UtUnpark, without switching out.
+        //
+
+        while (Thread->ParkState != PARK_NONE) {
+            YieldProcessor();
+        }
+    } else {
+        Thread->ParkState = PARK_NONE;
+    }
+}
+
 //
-// Runs the scheduler. The operating system thread that calls the function 
-// switches to a user thread and resumes execution only when all user threads 
-// have exited.
+// Places the specified user thread in the ready queue, where it becomes eligible to run.
+// When called from an operating system thread that isn't running the thread's scheduler,
+// the thread is posted to the scheduler's inbound queue instead. A thread in a timed park 
+// whose timer already readied it isn't readied again.
 //
 
 VOID
-UtRun (
+UtUnpark (
+    __in HANDLE ThreadHandle
     )
 {
-    UTHREAD Thread;
-
-    //
-    // There can be only one scheduler instance running.
-    //
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
 
-    _ASSERTE(RunningThread == NULL);
+    Thread = (PUTHREAD) ThreadHandle;
 
-    if (IsListEmpty(&ReadyQueue)) {
+    if (Thread->ParkState != PARK_NONE 
+        && InterlockedExchange(&Thread->ParkState, PARK_NONE) == PARK_TIMED_OUT) {
         return;
     }
 
-    //
-    // Switch to a user thread.
-    //
-    
-#if DEBUG
-    Thread.Function = (UT_FUNCTION) UtRun;
-#endif
-    MainThread = &Thread;
-    ContextSwitch(&Thread, PluckNextReadyThread());
-
-    //
-    // When we get here, there are no more runnable user threads.
-    //
-
-    _ASSERTE(IsListEmpty(&ReadyQueue));
-    _ASSERTE(NumberOfThreads == 0);
-
-    //
-    // Allow another call to Uth_Run().
-    //
-
-    RunningThread = NULL;
+    if ((Worker = CurrentWorker) != NULL && Worker->Scheduler == Thread->Scheduler) {
+        ReadyThread(Worker, Thread);
+    } else {
+        PostInboundThreads(Thread->Scheduler, &Thread->Link, &Thread->Link);
+    }
 }
 
 //
-// Creates a user thread to run the specified function. 
-// The new thread is placed at the end of the ready queue.
+// Unparks the specified user thread and switches to it right away, placing the current
+// thread in the ready queue instead. When called from an operating system thread that
+// isn't running the thread's scheduler, the thread is just unparked.
 //
 
-HANDLE
-UtCreate (
-    __in UT_FUNCTION Function,
-    __in UT_ARGUMENT Argument
+VOID
+UtUnparkAndSwitch (
+    __in HANDLE ThreadHandle
     )
 {
     PUTHREAD Thread;
+    PUT_WORKER Worker;
 
-    //
-    // Dynamically allocate an instance of UTHREAD and the associated stack.
-    //
-
-    Thread = (PUTHREAD) malloc(sizeof(*Thread));
-    Thread->Stack = (PUCHAR) malloc(STACK_SIZE);
-    _ASSERTE(Thread != NULL && Thread->Stack != NULL);
+    Thread = (PUTHREAD) ThreadHandle;
 
-    //
-    // Zero the stack for emotional confort.
-    //
-    
-    RtlZeroMemory(Thread->Stack, STACK_SIZE);
-
-    Thread->Function = Function;
-    Thread->Argument = Argument;
+    if ((Worker = CurrentWorker) == NULL || Worker->Scheduler != Thread->Scheduler) {
+        UtUnpark(ThreadHandle);
+        return;
+    }
 
-    //
-    // Map an UTHREAD_CONTEXT instance on the thread's stack.
-    // We'll use it to save the initial context of the thread.
-    //
-    // +------------+
-    // | 0x00000000 |    <- Highest word of a thread's stack space
-    // +============+       (needs to be set to 0 for Visual Studio to
-    // |  RetAddr   | \     correctly present a thread's call stack).
-    // +------------+  |
-    // |    EBP     |  |
-    // +------------+  |
-    // |    EBX     |   >   Thread->ThreadContext mapped on the stack.
-    // +------------+  |
-    // |    ESI     |  |
-    // +------------+  |
-    // |    EDI     | /  <- The stack pointer will be set to this address
-    // +============+       at the next context switch to this thread.
-    // |            | \
-    // +------------+  |
-    // |     :      |  |
-    //       :          >   Remaining stack space.
-    // |     :      |  |
-    // +------------+  |
-    // |            | /  <- Lowest word of a thread's stack space
-    // +------------+       (Thread->Stack always points to this location).
-    //
+    _ASSERTE(Thread != Worker->RunningThread);
 
-    Thread->ThreadContext = (PUTHREAD_CONTEXT) (Thread->Stack 
-                                                + STACK_SIZE 
-                                                - sizeof(ULONG)
-                                                - sizeof *Thread->ThreadContext);
+    if (Thread->ParkState != PARK_NONE
+        && InterlockedExchange(&Thread->ParkState, PARK_NONE) == PARK_TIMED_OUT) {
+        return;
+    }
 
-    //
-    // Set the thread's initial context by initializing the values of EDI, EBX, ESI 
-    // and EBP (must be zero for Visual Studio to correctly present a thread's call stack)
-    // and by hooking the return address. Upon the first context switch to this thread, 
-    // after popping the dummy values of the "saved" registers, a ret instruction will 
-    // place InternalStart's address on the processor's IP.
-    //
-    
-    Thread->ThreadContext->EDI = 0x33333333;
-    Thread->ThreadContext->EBX = 0x11111111;
-    Thread->ThreadContext->ESI = 0x22222222;
-    Thread->ThreadContext->EBP = 0x00000000;
-    Thread->ThreadContext->RetAddr = InternalStart;
+    if (Worker->Scheduler->FairShare && !Worker->Scheduler->MultipleWorkers) {
+        ChargeVirtualRuntime(&Worker->Scheduler->FairQueue, Worker->RunningThread);
+        Worker->Scheduler->FairQueue.ChargedThread = Worker->RunningThread;
+    }
 
-    //
-    // Ready the thread and return a handle to it.
-    //
-    
-    NumberOfThreads += 1;
-    UtUnpark((HANDLE) Thread);
-    
-    return (HANDLE) Thread;
+    ReadyThread(Worker, Worker->RunningThread);
+    SwitchToNextThread(Worker, Thread);
 }
 
 //
-// Terminates the execution of the currently running thread. All associated resources
-// will be released after the context switch to the next ready thread.
+// Parks the current user thread and switches directly to the specified parked user
+// thread. If the target's timer already readied it, the current thread just parks.
 //
 
-__declspec(noreturn)
 VOID
-UtExit (
+UtSwitchTo (
+    __in HANDLE ThreadHandle
     )
 {
-    NumberOfThreads -= 1;	
-    InternalExit(RunningThread, PluckNextReadyThread());
-    _ASSERTE(!"supposed to be here!");
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
+
+    Worker = CurrentWorker;
+    Thread = (PUTHREAD) ThreadHandle;
+    _ASSERTE(Thread != Worker->RunningThread);
+    _ASSERTE(Thread->Scheduler == Worker->Scheduler);
+
+    if (Thread->ParkState != PARK_NONE
+        && InterlockedExchange(&Thread->ParkState, PARK_NONE) == PARK_TIMED_OUT) {
+        Thread = PluckNextReadyThread(Worker);
+    }
+
+    SwitchToNextThread(Worker, Thread);
 }
 
 //
-// Relinquishes the processor to the first user thread in the ready queue. 
-// If there are no ready threads, the function returns immediately.
+// Places the user threads linked through their list entries in the specified list in
+// the ready queue, in order, leaving the list empty. On multiple workers, the threads
+// are pushed and at most one idle worker is woken up. None of the threads must be in a timed park,
+// and all must belong to the same scheduler.
 //
 
 VOID
-UtYield (
-    ) 
+UtUnparkList (
+    __inout PLIST_ENTRY ListHead
+    )
 {
-    if (!IsListEmpty(&ReadyQueue)) {
+    PLIST_ENTRY Entry;
+    PIDLE_WORKERS IdleWorkers;
+    PLIST_ENTRY Next;
+    PUT_SCHEDULER Scheduler;
+    PUTHREAD Thread;
+    PUT_WORKER Worker;
+#if defined(UT_STATS)
+    ULONG Count;
+#endif
+
+    if (IsListEmpty(ListHead)) {
+        return;
+    }
+
+    Scheduler = CONTAINING_RECORD(ListHead->Flink, UTHREAD, Link)->Scheduler;
+
+    if ((Worker = CurrentWorker) == NULL || Worker->Scheduler != Scheduler) {
+        PostInboundThreads(Scheduler, ListHead->Flink, ListHead->Blink);
+        InitializeListHead(ListHead);
+        return;
+    }
+
+#if defined(UT_STATS)
+    Count = 0;
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink) {
+        AccountReadyThread(CONTAINING_RECORD(Entry, UTHREAD, Link));
+        Count += 1;
+    }
+#endif
+
+    if (!Scheduler->MultipleWorkers && Scheduler->FairShare) {
+        do {
+            Thread = CONTAINING_RECORD(RemoveHeadList(ListHead), UTHREAD, Link);
+            if (Thread->PriorityLevel == NORMAL_PRIORITY_LEVEL) {
+                InsertFairThread(Worker, Thread);
+            } else {
+                InsertReadyQueue(Worker, Thread);
+            }
+        } while (!IsListEmpty(ListHead));
+    } else if (!Scheduler->MultipleWorkers) {
 
         //
-        // Insert the running thread at the tail of the ready queue
-        // and switch to the thread that is at front of the ready list.
+        // Only the prioritized threads are moved one by one; the normal ones left
+        // behind keep their order and are spliced onto the ready queue at once.
+        //
+
+        for (Entry = ListHead->Flink; Entry != ListHead; Entry = Next) {
+            Next = Entry->Flink;
+            Thread = CONTAINING_RECORD(Entry, UTHREAD, Link);
+            if (Thread->PriorityLevel != NORMAL_PRIORITY_LEVEL) {
+                RemoveEntryList(Entry);
+                InsertReadyQueue(Worker, Thread);
+            }
+        }
+
+        SpliceTailList(&Worker->ReadyQueues[NORMAL_PRIORITY_LEVEL], ListHead);
+    } else {
+
+        //
+        // A pushed thread may be stolen and run right away, reusing its link.
         //
 
-        InsertTailList(&ReadyQueue, &RunningThread->Link);
-        ContextSwitch(RunningThread, CONTAINING_RECORD(RemoveHeadList(&ReadyQueue), UTHREAD, Link));
+        for (Entry = ListHead->Flink; Entry != ListHead; Entry = Next) {
+            Next = Entry->Flink;
+            Thread = CONTAINING_RECORD(Entry, UTHREAD, Link);
+            _ASSERTE(Thread->ParkState == PARK_NONE);
+
+            if (Thread->PriorityLevel == NORMAL_PRIORITY_LEVEL) {
+                PushWorkDeque(&Worker->Deque, Thread);
+            } else {
+                InsertReadyQueue(Worker, Thread);
+            }
+        }
+
+        InitializeListHead(ListHead);
+
+        IdleWorkers = &Scheduler->IdleWorkers;
+        if ((IdleWorkers->Poller | IdleWorkers->NumberOfSleepingWorkers) != 0 
+            && IdleWorkers->NumberOfSpinningWorkers == 0) {
+            WakeIdleWorker(Scheduler);
+        }
     }
+
+    AccountReadyQueue(Worker, Count);
 }
 
 //
-// Returns a HANDLE to the executing user thread.
+// Stores the counters of the specified user thread in Stats. The running thread is
+// charged for the time it has been running since it was last switched in.
 //
 
-HANDLE
-UtSelf (
+BOOL
+UtGetThreadStats (
+    __in HANDLE ThreadHandle,
+    __out PUT_THREAD_STATS Stats
     )
 {
-    return (HANDLE) RunningThread;
-}
+#if defined(UT_STATS)
+    PUTHREAD Thread;
 
-//
-// Halts the execution of the current user thread.
-//
+    Thread = (PUTHREAD) ThreadHandle;
+    *Stats = Thread->Stats;
 
-VOID
-UtPark (
-    )
-{
-    ContextSwitch(RunningThread, PluckNextReadyThread());
+    if (CurrentWorker != NULL && CurrentWorker->RunningThread == Thread) {
+        Stats->RunTicks += __rdtsc() - Thread->StatsTimestamp;
+    }
+
+    return TRUE;
+#else
+    UNREFERENCED_PARAMETER(ThreadHandle);
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    return FALSE;
+#endif
 }
 
 //
-// Places the specified user thread in the ready queue, where it becomes eligible to run.
+// Stores the gauges of the current scheduler in Stats, adding up the shares of the 
+// workers. With multiple workers, the ready threads are those in the workers' deques.
 //
 
-VOID
-UtUnpark (
-    __in HANDLE ThreadHandle
+BOOL
+UtGetSchedulerStats (
+    __out PUT_SCHEDULER_STATS Stats
     )
 {
-    InsertTailList(&ReadyQueue, &((PUTHREAD) ThreadHandle)->Link);
+#if defined(UT_STATS)
+    ULONG Index;
+    LONG Length;
+    PUT_WORKER PrimaryWorker;
+    PUT_SCHEDULER Scheduler;
+    PUT_WORKER Worker;
+
+    Scheduler = GetCurrentScheduler();
+    PrimaryWorker = GetPrimaryWorker(Scheduler);
+
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    Stats->LiveThreads = Scheduler->NumberOfThreads;
+
+    if (!Scheduler->MultipleWorkers) {
+        Stats->ReadyThreads = PrimaryWorker->ReadyCount;
+        Stats->ReadyHighWatermark = PrimaryWorker->ReadyHighWatermark;
+        Stats->Creations = PrimaryWorker->Creations;
+        Stats->Exits = PrimaryWorker->Exits;
+        return TRUE;
+    }
+
+    for (Index = 0; Index < Scheduler->NumberOfActiveWorkers; ++Index) {
+        Worker = Scheduler->Workers[Index];
+
+        if ((Length = (LONG) (Worker->Deque.Bottom - Worker->Deque.Top)) > 0) {
+            Stats->ReadyThreads += Length;
+        }
+
+        Stats->ReadyThreads += Worker->PrioritizedCount;
+
+        if (Worker->ReadyHighWatermark > Stats->ReadyHighWatermark) {
+            Stats->ReadyHighWatermark = Worker->ReadyHighWatermark;
+        }
+
+        Stats->Creations += Worker->Creations;
+        Stats->Exits += Worker->Exits;
+    }
+
+    return TRUE;
+#else
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    return FALSE;
+#endif
 }
 
 //
@@ -355,10 +4412,19 @@ VOID
 InternalStart (
     )
 {
-    RunningThread->Function(RunningThread->Argument);
+    PUTHREAD Thread;
+
+    if (CurrentWorker->Scheduler->MultipleWorkers) {
+        FinishContextSwitch();
+    }
+
+    Thread = CurrentWorker->RunningThread;
+    Thread->Function(Thread->Argument);
     UtExit();
 }
 
+#if defined(_M_IX86)
+
 //
 // Perform a context switch from CurrentThread (switch out) to NextThread (switch in).
 // __fastcall sets the calling convention such that CurrentThread is in ECX and NextThread
@@ -393,12 +4459,6 @@ ContextSwitch (
 
         mov     dword ptr [ecx].ThreadContext, esp
 
-        //
-        // Set NextThread as the running thread.
-        //
-
-        mov     RunningThread, edx
-
         //
         // Load NextThread's context, starting by switching to its stack,
         // where the registers are saved.
@@ -420,22 +4480,126 @@ ContextSwitch (
     }
 }
 
+#elif defined(__x86_64__)
+
+#define STRINGIFY_(Value) #Value
+#define STRINGIFY(Value) STRINGIFY_(Value)
+
+//
+// Perform a context switch from CurrentThread (switch out) to NextThread (switch in).
+// The System V calling convention places CurrentThread in RDI and NextThread in RSI.
+// __attribute__((naked)) directs the compiler to omit any prologue or epilogue code.
+//
+
+__attribute__((naked))
+VOID
+ContextSwitch (
+    __inout PUTHREAD CurrentThread,
+    __in PUTHREAD NextThread
+    )
+{
+    __asm__ (
+
+        //
+        // Switch out the running CurrentThread, saving the execution context
+        // on the thread's own stack. The return address is atop the stack,
+        // having been placed there by the call to this function.
+        //
+
+        "pushq   %rbp\n\t"
+        "pushq   %rbx\n\t"
+        "pushq   %r12\n\t"
+        "pushq   %r13\n\t"
+        "pushq   %r14\n\t"
+        "pushq   %r15\n\t"
+        "subq    $8, %rsp\n\t"
+        "stmxcsr (%rsp)\n\t"
+        "fnstcw  4(%rsp)\n\t"
+
+        //
+        // Save RSP in CurrentThread->ThreadContext.
+        //
+
+        "movq    %rsp, " STRINGIFY(UTHREAD_CONTEXT_OFFSET) "(%rdi)\n\t"
+
+        //
+        // Load NextThread's context, starting by switching to its stack,
+        // where the registers are saved.
+        //
+
+        "movq    " STRINGIFY(UTHREAD_CONTEXT_OFFSET) "(%rsi), %rsp\n\t"
+
+        "ldmxcsr (%rsp)\n\t"
+        "fldcw   4(%rsp)\n\t"
+        "addq    $8, %rsp\n\t"
+        "popq    %r15\n\t"
+        "popq    %r14\n\t"
+        "popq    %r13\n\t"
+        "popq    %r12\n\t"
+        "popq    %rbx\n\t"
+        "popq    %rbp\n\t"
+
+        //
+        // Jump to the return address saved on NextThread's stack when 
+        // the function was called.
+        //
+
+        "ret"
+    );
+}
+
+#endif
+
 //
-// Frees the resources associated with Thread.
+// Releases the resources associated with Thread, returning its block to the pool
+// of the current worker, or only its stack if the thread is joinable, after adding
+// the depth its stack reached to the stack profile, if enabled.
 // __fastcall sets the calling convention such that Thread is in ECX.
 //
 
 static
+#if defined(__GNUC__)
+__attribute__((used, noinline))
+#endif
 VOID
 __fastcall
 CleanupThread (
     __inout PUTHREAD Thread
     )
 {
-    free(Thread->Stack);
-    free(Thread);
+    LONG JoinState;
+
+    if (StackProfile.Enabled) {
+        ProfileThreadStack(Thread);
+    }
+
+    if (Thread->JoinState == JOIN_DETACHED) {
+        ReleaseThreadBlock(CurrentWorker, Thread);
+        return;
+    }
+
+    //
+    // The thread is joinable. Release its stack, which is no longer in use, but keep 
+    // the descriptor until the thread is joined, unparking the joiner if it's waiting.
+    // The thread may be detached concurrently, in which case its block is released.
+    //
+
+    DecommitThreadStack(Thread);
+
+    do {
+        if ((JoinState = Thread->JoinState) == JOIN_DETACHED) {
+            ReleaseThreadBlock(CurrentWorker, Thread);
+            return;
+        }
+    } while (InterlockedCompareExchange(&Thread->JoinState, JOIN_EXITED, JoinState) != JoinState);
+
+    if (JoinState == JOIN_JOINING) {
+        UtUnpark(Thread->Joiner);
+    }
 }
 
+#if defined(_M_IX86)
+
 //
 // Frees the resources associated with CurrentThread and switches to NextThread.
 // __fastcall sets the calling convention such that CurrentThread is in ECX and 
@@ -444,6 +4608,7 @@ CleanupThread (
 //
 
 __declspec(naked)
+DECLSPEC_NORETURN
 VOID
 __fastcall
 InternalExit (
@@ -453,12 +4618,6 @@ InternalExit (
 {
     __asm {
 
-        //
-        // Set NextThread as the running thread.
-        //
-
-        mov     RunningThread, edx
-        
         //
         // Load NextThread's stack pointer before calling CleanupThread(): making 
         // the call while using CurrentThread's stack would mean using the same 
@@ -481,3 +4640,57 @@ InternalExit (
         ret
     }
 }
+
+#elif defined(__x86_64__)
+
+//
+// Frees the resources associated with CurrentThread and switches to NextThread.
+// The System V calling convention places CurrentThread in RDI and NextThread in RSI.
+// __attribute__((naked)) directs the compiler to omit any prologue or epilogue code.
+//
+
+__attribute__((naked))
+DECLSPEC_NORETURN
+VOID
+InternalExit (
+    __inout PUTHREAD CurrentThread,
+    __in PUTHREAD NextThread
+    )
+{
+    __asm__ (
+
+        //
+        // Load NextThread's stack pointer before calling CleanupThread(): making 
+        // the call while using CurrentThread's stack would mean using the same 
+        // memory being freed -- the stack. The callee-saved registers of the
+        // exiting thread are dead, so RBX can keep NextThread's saved context
+        // across the call, which must be made with a 16-byte aligned stack below
+        // that context. CurrentThread is already in RDI.
+        //
+
+        "movq    " STRINGIFY(UTHREAD_CONTEXT_OFFSET) "(%rsi), %rbx\n\t"
+        "movq    %rbx, %rsp\n\t"
+        "andq    $-16, %rsp\n\t"
+
+        "call    CleanupThread\n\t"
+
+        //
+        // Finish switching in NextThread.
+        //
+
+        "movq    %rbx, %rsp\n\t"
+        "ldmxcsr (%rsp)\n\t"
+        "fldcw   4(%rsp)\n\t"
+        "addq    $8, %rsp\n\t"
+        "popq    %r15\n\t"
+        "popq    %r14\n\t"
+        "popq    %r13\n\t"
+        "popq    %r12\n\t"
+        "popq    %rbx\n\t"
+        "popq    %rbp\n\t"
+
+        "ret"
+    );
+}
+
+#endif
@@ -6,9 +6,15 @@
 // UThread library:
 //     User threads supporting cooperative multithreading.
 //     The current version of the library provides:
-//        - Threads
+//        - Threads, with priorities and fair scheduling, on one or more workers
 //        - Mutexes
 //        - Semaphores
+//        - Condition variables
+//        - Events
+//        - Reader-writer locks
+//        - Channels
+//        - Timed waits
+//        - Non-blocking I/O through epoll and io_uring
 //
 // Authors: Carlos Martins, Joao Trindade, Duarte Nunes
 // 
@@ -16,7 +22,7 @@
 
 #pragma once
 
-#include <Windows.h>
+#include "Platform.h"
 
 typedef VOID * UT_ARGUMENT;
 typedef VOID (*UT_FUNCTION)(UT_ARGUMENT);
@@ -24,13 +30,120 @@ typedef VOID (*UT_FUNCTION)(UT_ARGUMENT);
 //
 // Runs the scheduler. The operating system thread that calls the function 
 // switches to a user thread and resumes execution only when all user threads 
-// have exited.
+// have exited, or when the scheduler is shut down. While all the user threads are
+// parked, the scheduler blocks without using processor time.
 //
 
 VOID
 UtRun (
     );
 
+//
+// Runs the scheduler on the specified number of workers: the calling operating 
+// system thread and NumberOfWorkers - 1 additional ones. Each worker owns a deque 
+// of ready threads, and workers that run out of ready threads steal from the others. 
+// The calling thread resumes execution only when all user threads have exited, 
+// or when the scheduler is shut down and no threads are ready.
+//
+
+VOID
+UtRunEx (
+    __in ULONG NumberOfWorkers
+    );
+
+//
+// Shuts down the scheduler: the call to UtRun returns as soon as there are no ready 
+// threads, instead of waiting for parked threads to be unparked. Threads that remain 
+// parked are kept, and resume running when unparked and the scheduler runs again. 
+// Can be called from any operating system thread.
+//
+
+VOID
+UtShutdown (
+    );
+
+//
+// A scheduler runs its own user threads on its own workers. An operating system thread
+// uses the default scheduler unless it selects another one, so that several operating
+// system threads, each pinned to a processor, can each run a scheduler that shares 
+// nothing with the others. Outside of user threads, UtRun, UtRunEx, UtShutdown and the
+// functions that create threads apply to the scheduler of the calling operating system
+// thread; within a user thread, they apply to the scheduler the thread runs on. Threads
+// of different schedulers can unpark and join each other, but must not share 
+// synchronization objects or switch directly to each other, and only the threads of
+// the default scheduler can perform I/O through the reactor and io_uring.
+//
+
+typedef struct _UT_SCHEDULER UT_SCHEDULER, *PUT_SCHEDULER;
+
+//
+// Creates a scheduler. Returns NULL if it can't be allocated.
+//
+
+PUT_SCHEDULER
+UtCreateScheduler (
+    );
+
+//
+// Deletes the specified scheduler, which must not be the default scheduler, must not
+// be running and must have no user threads.
+//
+
+VOID
+UtDeleteScheduler (
+    __inout PUT_SCHEDULER Scheduler
+    );
+
+//
+// Selects the scheduler of the calling operating system thread, or the default scheduler
+// if Scheduler is NULL. Returns the previously selected scheduler, or NULL if it was the
+// default scheduler. Must not be called while the calling thread runs a scheduler.
+//
+
+PUT_SCHEDULER
+UtSelectScheduler (
+    __in_opt PUT_SCHEDULER Scheduler
+    );
+
+//
+// Pins the workers of the current scheduler to processors while it runs: the worker
+// with index i runs on Processors[i % NumberOfProcessors], the primary worker being 0.
+// The affinity of the operating system thread that calls UtRun is restored when the 
+// call returns. Pinned workers steal from workers on their own NUMA node first, and the
+// blocks of exited threads are kept in a pool per node, so that stacks stay local to
+// the node whose workers first touched them. If Processors is NULL, workers run on any
+// processor. On Windows, processors are numbered within the calling thread's group.
+// Must not be called while the scheduler runs. Returns FALSE on allocation failure.
+//
+
+BOOL
+UtConfigureWorkerAffinity (
+    __in_ecount_opt(NumberOfProcessors) const ULONG * Processors,
+    __in ULONG NumberOfProcessors
+    );
+
+//
+// Enables or disables fair scheduling on the current scheduler. While enabled, ready
+// threads of normal priority run in order of virtual runtime rather than in FIFO order.
+// The time a thread runs, read from the processor's time-stamp counter at every context
+// switch, is added to its virtual runtime, scaled by UT_WEIGHT_NORMAL over the thread's
+// weight, and the ready thread with the least virtual runtime runs next. A yielding
+// thread keeps running while its virtual runtime is still the least, so that threads 
+// get processor time in proportion to their weights however often they yield. New threads
+// start at the minimum virtual runtime, and readied threads resume at most WakeupCredit
+// ticks behind it, so that a thread that was parked for long runs soon after waking, but
+// not ahead of the others for longer than that. Fair scheduling applies while the
+// scheduler runs on a single worker; with multiple workers, threads of normal priority
+// are spread through work stealing. Must not be called while the scheduler runs. 
+// Returns FALSE on allocation failure.
+//
+
+BOOL
+UtConfigureFairScheduling (
+    __in BOOL Enable,
+    __in ULONG WakeupCredit
+    );
+
 //
 // Creates a user thread to run the specified function. 
 // The new thread is placed at the end of the ready queue.
@@ -42,16 +155,178 @@ UtCreate (
     __in UT_ARGUMENT Argument
     );
 
+//
+// Creates a user thread that can be joined, rather than being detached. The thread's
+// descriptor is kept after it exits, until it is joined or detached.
+//
+
+#define UT_CREATE_JOINABLE 0x00000001
+
+//
+// Creates a user thread that runs on the scheduler's shared stack rather than on a
+// stack of its own. While the thread doesn't run, its frames are kept in a heap buffer
+// sized to fit them, so that a parked thread takes a few hundred bytes. Frames are
+// copied out only when another such thread runs, and copied back in before the thread
+// runs again, at the same addresses. Only the threads created with this flag share
+// the stack, and only while the scheduler runs on a single worker.
+//
+// As the stack of a parked thread is reused by other threads, nothing may write to it
+// until the thread runs again. Such a thread can park with UtPark, UtParkTimeout and
+// UtSleep, wait for sockets to become ready, and join other threads, but must not wait
+// on the synchronization objects or perform io_uring operations, which place wait blocks
+// and buffers on the waiting thread's stack.
+//
+
+#define UT_CREATE_SHARED_STACK 0x00000002
+
+//
+// The priorities of user threads. The ready thread with the highest priority runs next,
+// and ready threads of the same priority run in FIFO order, so threads of a priority run
+// only while no thread of a higher priority is ready. With multiple workers, threads of
+// normal priority are spread among the workers through work stealing, while threads of
+// other priorities run on the worker that readied them, before or after the threads in
+// its deque, and are never stolen.
+//
+
+#define UT_PRIORITY_LOWEST (-16)
+#define UT_PRIORITY_NORMAL 0
+#define UT_PRIORITY_HIGHEST 15
+#define UT_PRIORITY_LEVELS (UT_PRIORITY_HIGHEST - UT_PRIORITY_LOWEST + 1)
+
+//
+// Creates a user thread with the specified priority, rather than UT_PRIORITY_NORMAL.
+//
+
+#define UT_CREATE_PRIORITY(Priority) ((((ULONG) (Priority)) & 0x1F) << 8)
+
+//
+// Creates a user thread to run the specified function, with a stack of at least 
+// StackSize bytes, or of the default size if StackSize is zero, and with the specified
+// UT_CREATE_* flags. Stacks are reserved rather than committed, so memory is only used 
+// as the stack actually grows, and overflowing into the guard page below the stack 
+// faults. The new thread is placed at the end of the ready queue of its priority. Returns
+// NULL if the stack can't be allocated.
+//
+
+HANDLE
+UtCreateEx (
+    __in UT_FUNCTION Function,
+    __in UT_ARGUMENT Argument,
+    __in SIZE_T StackSize,
+    __in ULONG Flags
+    );
+
+//
+// Configures the scheduler's pool of descriptor and stack blocks. Up to HighWatermark
+// blocks of exited threads are kept for reuse by UtCreate; when that limit is exceeded, 
+// and when UtRun returns, the pool is trimmed down to LowWatermark blocks. If ZeroStacks 
+// is FALSE, stacks are handed to new threads without being zeroed. The pools that hold
+// the blocks of workers on each NUMA node are also kept within HighWatermark blocks.
+//
+
+VOID
+UtConfigureThreadBlockPool (
+    __in ULONG LowWatermark,
+    __in ULONG HighWatermark,
+    __in BOOL ZeroStacks
+    );
+
+//
+// Enables or disables stack profiling. While enabled, the stack depth reached by each
+// thread is measured when it exits, and aggregated per thread function. In adaptive
+// mode, which implies profiling, threads created without a stack size get the smallest
+// stack size class, of 8, 16, 32 or 64 KB, that holds the deepest stack used by the
+// threads that ran the same function, with one page to spare, once enough of them exited.
+// Measurements rely on stacks being zeroed; with ZeroStacks FALSE they overestimate.
+//
+
+VOID
+UtConfigureStackProfiling (
+    __in BOOL Enable,
+    __in BOOL Adaptive
+    );
+
+//
+// Returns the number of bytes of its stack that the specified thread used so far, as
+// the distance from the top of the stack to the deepest non-zero word. The value of
+// an exited joinable thread is the one measured when it exited, or zero if stack
+// profiling wasn't enabled then.
+//
+
+SIZE_T
+UtGetStackHighWater (
+    __in HANDLE ThreadHandle
+    );
+
+//
+// The stack profile of a thread function: the number of threads running it that exited
+// while stack profiling was enabled, the deepest stack any of them used, and the stack
+// size that new threads running it get in adaptive mode, or zero if not chosen yet.
+//
+
+typedef struct _UT_STACK_PROFILE {
+    ULONG Threads;
+    SIZE_T HighWater;
+    SIZE_T StackSize;
+} UT_STACK_PROFILE, *PUT_STACK_PROFILE;
+
+//
+// Stores the stack profile of the specified thread function in Profile. Returns FALSE
+// if there is no profile for the function.
+//
+
+BOOL
+UtGetStackProfile (
+    __in UT_FUNCTION Function,
+    __out PUT_STACK_PROFILE Profile
+    );
+
 //
 // Terminates the execution of the currently running thread. All associated resources
 // will be released after the context switch to the next ready thread.
 //
 
-__declspec(noreturn)
+DECLSPEC_NORETURN
 VOID
 UtExit (
     );
 
+//
+// Terminates the execution of the currently running thread with the specified exit
+// value, which is handed to the thread that joins it. Returning from the thread's
+// function exits with a NULL value.
+//
+
+DECLSPEC_NORETURN
+VOID
+UtExitEx (
+    __in PVOID ExitValue
+    );
+
+//
+// Waits for the specified joinable thread to exit, and stores its exit value in 
+// ExitValue, if specified. A joinable thread's stack is released as soon as it exits,
+// but its descriptor is only released when it is joined, after which the handle 
+// becomes invalid. A thread can be joined by a single thread.
+//
+
+VOID
+UtJoin (
+    __in HANDLE ThreadHandle,
+    __out_opt PVOID * ExitValue
+    );
+
+//
+// Detaches the specified joinable thread, whose resources are then released as soon
+// as it exits, or right away if it already has. Must be called by a user thread, or
+// while the scheduler isn't running.
+//
+
+VOID
+UtDetach (
+    __in HANDLE ThreadHandle
+    );
+
 //
 // Relinquishes the processor to the first user thread in the ready queue. 
 // If there are no ready threads, the function returns immediately.
@@ -61,6 +336,18 @@ VOID
 UtYield (
     );
 
+//
+// Suspends the execution of the current user thread for at least the specified number 
+// of milliseconds. Timers are kept in a hierarchical timing wheel per worker, so that 
+// sleeping and waking up take constant time regardless of the number of sleeping threads.
+// If Milliseconds is zero, the function yields.
+//
+
+VOID
+UtSleep (
+    __in ULONG Milliseconds
+    );
+
 //
 // Returns a HANDLE to the executing user thread.
 //
@@ -69,6 +356,73 @@ HANDLE
 UtSelf (
     );
 
+//
+// Sets the priority of the specified user thread, which takes effect the next time the
+// thread is readied.
+//
+
+VOID
+UtSetPriority (
+    __in HANDLE ThreadHandle,
+    __in LONG Priority
+    );
+
+//
+// Returns the priority of the specified user thread.
+//
+
+LONG
+UtGetPriority (
+    __in HANDLE ThreadHandle
+    );
+
+//
+// The weight of a user thread under fair scheduling, which gets processor time in 
+// proportion to its weight. Threads are created with UT_WEIGHT_NORMAL.
+//
+
+#define UT_WEIGHT_NORMAL 1024
+
+//
+// Sets the weight of the specified user thread, which must not be zero, and applies to
+// the time the thread runs from then on.
+//
+
+VOID
+UtSetWeight (
+    __in HANDLE ThreadHandle,
+    __in ULONG Weight
+    );
+
+//
+// Returns the weight of the specified user thread.
+//
+
+ULONG
+UtGetWeight (
+    __in HANDLE ThreadHandle
+    );
+
+//
+// Returns a pointer to the counter of the shared acquisitions of reader-writer locks
+// held by the current user thread, which only the thread itself updates.
+//
+
+PULONG
+UtGetSharedLockCount (
+    );
+
+//
+// Returns the time of the monotonic clock on which the timeouts of parked threads are
+// based, in milliseconds. The coarse clock is cheaper to read, but lags behind by up to
+// a scheduling tick of the operating system.
+//
+
+ULONG64
+UtReadClock (
+    __in BOOL Coarse
+    );
+
 //
 // Halts the execution of the current user thread.
 //
@@ -77,11 +431,239 @@ VOID
 UtPark (
     );
 
+//
+// Announces that the current user thread is about to park with a timeout. Must be called
+// before the thread becomes visible to the threads that may unpark it, such as before 
+// its wait block is inserted in the wait list of a synchronization object.
+//
+
+VOID
+UtPrepareParkTimeout (
+    );
+
+//
+// Halts the execution of the current user thread until it is unparked or the specified
+// number of milliseconds elapse, or indefinitely if Milliseconds is INFINITE. Returns 
+// TRUE if the thread was unparked, or FALSE if the timeout expired, in which case 
+// UtCompleteParkTimeout must be called once the caller knows whether an unpark for the 
+// timed park is still to come, as a thread may be chosen to be unparked right after 
+// its timer expired.
+//
+
+BOOL
+UtParkTimeout (
+    __in ULONG Milliseconds
+    );
+
+//
+// Completes a timed park of the current user thread whose timeout expired. If UnparkPending 
+// is TRUE, the thread was chosen to be unparked after its timer expired, and the function 
+// waits for that unpark to be absorbed. Otherwise, no thread must unpark the current 
+// thread for the timed park.
+//
+
+VOID
+UtCompleteParkTimeout (
+    __in BOOL UnparkPending
+    );
+
 //
 // Places the specified user thread in the ready queue, where it becomes eligible to run.
+// Can be called from any operating system thread: threads unparked from outside their
+// scheduler are posted to its lock-free inbound queue, which the scheduler drains at 
+// its next switch point, or as soon as it is woken up if it has nothing to run.
 //
 
 VOID
 UtUnpark (
     __in HANDLE ThreadHandle
     );
+
+//
+// Unparks the specified user thread and switches to it right away, rather than placing
+// it at the tail of the ready queue, where it would run only after all the threads ahead
+// of it. The current thread is placed in the ready queue instead. A thread in a timed park
+// whose timer already readied it isn't switched to. When called from an operating system
+// thread that isn't running the thread's scheduler, the thread is just unparked.
+//
+
+VOID
+UtUnparkAndSwitch (
+    __in HANDLE ThreadHandle
+    );
+
+//
+// Parks the current user thread and switches directly to the specified parked user
+// thread, as if it had been unparked and was first in the ready queue. Must be called
+// by a user thread. If the target is in a timed park whose timer already readied it,
+// the current thread just parks.
+//
+
+VOID
+UtSwitchTo (
+    __in HANDLE ThreadHandle
+    );
+
+//
+// Returns the list entry through which the specified user thread is linked in the
+// ready queue. The entry is unused while the thread is parked, so synchronization
+// objects may link their waiters through it, and unpark all of them at once with
+// UtUnparkList. The entry is the first field of the thread's descriptor.
+//
+
+FORCEINLINE
+PLIST_ENTRY
+UtGetThreadListEntry (
+    __in HANDLE ThreadHandle
+    )
+{
+    return (PLIST_ENTRY) ThreadHandle;
+}
+
+//
+// Returns the handle of the user thread linked through the specified list entry.
+//
+
+FORCEINLINE
+HANDLE
+UtGetListEntryThread (
+    __in PLIST_ENTRY Entry
+    )
+{
+    return (HANDLE) Entry;
+}
+
+//
+// Places the user threads linked through their list entries in the specified list in
+// the ready queue, in order, leaving the list empty. On a single worker, the whole list
+// is spliced onto the ready queue at once; on multiple workers, the threads are pushed
+// and at most one idle worker is woken up. None of the threads must be in a timed park.
+//
+
+VOID
+UtUnparkList (
+    __inout PLIST_ENTRY ListHead
+    );
+
+//
+// The runtime counters of a user thread: how many times it was switched in and out,
+// and how long it spent running, ready but waiting for a worker, and parked, in ticks
+// of the processor's timestamp counter. The time spent in the current state is included
+// only for the running thread. Counters are kept only when the library is built with
+// UT_STATS defined; otherwise they compile out, and the functions that query them return
+// FALSE. Counters updated by more than one worker are approximate.
+//
+
+typedef struct _UT_THREAD_STATS {
+    ULONG64 SwitchesIn;
+    ULONG64 SwitchesOut;
+    ULONG64 RunTicks;
+    ULONG64 ReadyTicks;
+    ULONG64 ParkedTicks;
+} UT_THREAD_STATS, *PUT_THREAD_STATS;
+
+//
+// The scheduler-wide gauges: the number of ready threads, the highest length a ready
+// queue reached, the number of live user threads, and how many threads were created
+// and exited since the program started. With multiple workers, ReadyHighWatermark is
+// the highest number of ready threads held by a single worker, not by all of them.
+//
+
+typedef struct _UT_SCHEDULER_STATS {
+    ULONG ReadyThreads;
+    ULONG ReadyHighWatermark;
+    ULONG LiveThreads;
+    ULONG64 Creations;
+    ULONG64 Exits;
+} UT_SCHEDULER_STATS, *PUT_SCHEDULER_STATS;
+
+//
+// Stores the counters of the specified user thread, which must be alive or an exited
+// joinable thread that wasn't joined yet, in Stats. Returns FALSE, zeroing Stats, if
+// the library was built without UT_STATS.
+//
+
+BOOL
+UtGetThreadStats (
+    __in HANDLE ThreadHandle,
+    __out PUT_THREAD_STATS Stats
+    );
+
+//
+// Stores the gauges of the current scheduler in Stats. Must be called by a user thread,
+// or while the scheduler isn't running. Returns FALSE, zeroing Stats, if the library was built
+// without UT_STATS.
+//
+
+BOOL
+UtGetSchedulerStats (
+    __out PUT_SCHEDULER_STATS Stats
+    );
+
+//
+// Whether any scheduler runs on more than one worker.
+//
+
+extern BOOL UtMultipleWorkers;
+
+//
+// Whether the current operating system thread runs a scheduler on a single worker.
+//
+
+extern THREAD_LOCAL BOOL UtSingleWorker;
+
+//
+// A spin lock, used by synchronization objects to protect their state when user 
+// threads run on more than one worker. Synchronization objects aren't shared across
+// schedulers, so acquiring a spin lock is a no-op on the worker of a scheduler that
+// runs on a single worker, and only there. Releasing one always clears it, so that a
+// lock that was taken isn't left set when its scheduler stops running on multiple workers.
+//
+
+typedef volatile LONG UT_SPIN_LOCK, *PUT_SPIN_LOCK;
+
+//
+// Initializes the specified spin lock.
+//
+
+FORCEINLINE
+VOID
+UtInitializeSpinLock (
+    __out PUT_SPIN_LOCK Lock
+    )
+{
+    *Lock = 0;
+}
+
+//
+// Acquires the specified spin lock.
+//
+
+FORCEINLINE
+VOID
+UtAcquireSpinLock (
+    __inout PUT_SPIN_LOCK Lock
+    )
+{
+    if (!UtSingleWorker) {
+        while (InterlockedExchange(Lock, 1) != 0) {
+            do {
+                YieldProcessor();
+            } while (*Lock != 0);
+        }
+    }
+}
+
+//
+// Releases the specified spin lock. The store has release semantics on x86.
+//
+
+FORCEINLINE
+VOID
+UtReleaseSpinLock (
+    __inout PUT_SPIN_LOCK Lock
+    )
+{
+    _ReadWriteBarrier();
+    *Lock = 0;
+}
@@ -0,0 +1,512 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#include "Uring.h"
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+
+//
+// The number of submission queue entries requested for the ring. The completion queue
+// has twice as many entries.
+//
+
+#define URING_ENTRIES 4096
+
+//
+// The number of queued entries that are submitted without waiting for the scheduler
+// to run out of ready threads.
+//
+
+#define URING_SUBMIT_BATCH 64
+
+//
+// The maximum number of completions reaped while holding the ring's lock.
+//
+
+#define URING_REAP_BATCH 64
+
+//
+// An operation queued by a user thread, which lives on the thread's stack while it is
+// parked waiting for the operation to complete.
+//
+
+typedef struct _URING_REQUEST {
+    HANDLE Thread;
+    LONG Result;
+} URING_REQUEST, *PURING_REQUEST;
+
+//
+// The states of the ring.
+//
+
+#define URING_UNINITIALIZED 0
+#define URING_READY 1
+#define URING_UNAVAILABLE 2
+
+//
+// The ring, with the views of its submission and completion queues. Lock protects the
+// ring when the scheduler runs on multiple workers. NumberOfUnsubmitted counts the
+// entries queued since the last submission, and NumberOfInFlight the operations that
+// were queued and haven't been reaped, which must not exceed the size of the completion
+// queue.
+//
+
+typedef struct _URING {
+    UT_SPIN_LOCK Lock;
+    ULONG State;
+    int Descriptor;
+    int WakeEvent;
+
+    volatile ULONG * SqHead;
+    volatile ULONG * SqTail;
+    ULONG SqMask;
+    ULONG SqEntries;
+    ULONG * SqArray;
+    struct io_uring_sqe * Sqes;
+
+    volatile ULONG * CqHead;
+    volatile ULONG * CqTail;
+    ULONG CqMask;
+    ULONG CqEntries;
+    struct io_uring_cqe * Cqes;
+
+    ULONG NumberOfUnsubmitted;
+    ULONG NumberOfInFlight;
+} URING, *PURING;
+
+static URING Uring = { .State = URING_UNINITIALIZED, .Descriptor = -1, .WakeEvent = -1 };
+
+//
+// The number of operations that were queued and haven't been reaped yet.
+//
+
+volatile LONG NumberOfUringRequests;
+
+//
+// Sets up the ring and maps its queues, registering the wake event to be signalled as
+// operations complete. Returns FALSE if io_uring isn't available. Called with the lock held.
+//
+
+static
+BOOL
+SetupUring (
+    )
+{
+    struct io_uring_params Parameters;
+    PUCHAR CqRing;
+    SIZE_T CqRingSize;
+    PUCHAR SqRing;
+    SIZE_T SqRingSize;
+    SIZE_T SqesSize;
+    int Descriptor;
+
+    RtlZeroMemory(&Parameters, sizeof(Parameters));
+    if ((Descriptor = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &Parameters)) < 0) {
+        return FALSE;
+    }
+
+    SqRingSize = Parameters.sq_off.array + Parameters.sq_entries * sizeof(ULONG);
+    CqRingSize = Parameters.cq_off.cqes + Parameters.cq_entries * sizeof(struct io_uring_cqe);
+    SqesSize = Parameters.sq_entries * sizeof(struct io_uring_sqe);
+
+    SqRing = (PUCHAR) mmap(NULL, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           Descriptor, IORING_OFF_SQ_RING);
+    CqRing = (PUCHAR) mmap(NULL, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           Descriptor, IORING_OFF_CQ_RING);
+    Uring.Sqes = (struct io_uring_sqe *) mmap(NULL, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              Descriptor, IORING_OFF_SQES);
+
+    if (SqRing == MAP_FAILED || CqRing == MAP_FAILED || Uring.Sqes == MAP_FAILED
+        || (Uring.WakeEvent >= 0
+            && syscall(__NR_io_uring_register, Descriptor, IORING_REGISTER_EVENTFD, &Uring.WakeEvent, 1) < 0)) {
+
+        //
+        // The mappings that succeeded keep the ring alive after its descriptor is closed,
+        // so unmap them first.
+        //
+
+        if (SqRing != MAP_FAILED) {
+            munmap(SqRing, SqRingSize);
+        }
+
+        if (CqRing != MAP_FAILED) {
+            munmap(CqRing, CqRingSize);
+        }
+
+        if (Uring.Sqes != MAP_FAILED) {
+            munmap(Uring.Sqes, SqesSize);
+        }
+
+        Uring.Sqes = NULL;
+        close(Descriptor);
+        return FALSE;
+    }
+
+    Uring.Descriptor = Descriptor;
+
+    Uring.SqHead = (volatile ULONG *) (SqRing + Parameters.sq_off.head);
+    Uring.SqTail = (volatile ULONG *) (SqRing + Parameters.sq_off.tail);
+    Uring.SqMask = *(PULONG) (SqRing + Parameters.sq_off.ring_mask);
+    Uring.SqEntries = Parameters.sq_entries;
+    Uring.SqArray = (PULONG) (SqRing + Parameters.sq_off.array);
+
+    Uring.CqHead = (volatile ULONG *) (CqRing + Parameters.cq_off.head);
+    Uring.CqTail = (volatile ULONG *) (CqRing + Parameters.cq_off.tail);
+    Uring.CqMask = *(PULONG) (CqRing + Parameters.cq_off.ring_mask);
+    Uring.CqEntries = Parameters.cq_entries;
+    Uring.Cqes = (struct io_uring_cqe *) (CqRing + Parameters.cq_off.cqes);
+
+    return TRUE;
+}
+
+//
+// Submits the queued entries to the kernel. Entries that the kernel can't take right
+// now remain queued for the next submission. Called with the lock held.
+//
+
+static
+VOID
+SubmitUring (
+    )
+{
+    long Submitted;
+
+    if (Uring.NumberOfUnsubmitted != 0
+        && (Submitted = syscall(__NR_io_uring_enter, Uring.Descriptor, Uring.NumberOfUnsubmitted, 0, 0, NULL, 0)) > 0) {
+        Uring.NumberOfUnsubmitted -= (ULONG) Submitted;
+    }
+}
+
+//
+// Returns TRUE if the submission queue has room for another entry, submitting the
+// queued entries to make room if it is full. Called with the lock held.
+//
+
+static
+BOOL
+HasUringSubmissionRoom (
+    )
+{
+    if (*Uring.SqTail - __atomic_load_n(Uring.SqHead, __ATOMIC_ACQUIRE) < Uring.SqEntries) {
+        return TRUE;
+    }
+
+    SubmitUring();
+    return *Uring.SqTail - __atomic_load_n(Uring.SqHead, __ATOMIC_ACQUIRE) < Uring.SqEntries;
+}
+
+//
+// Performs the operation described by Entry synchronously, for when io_uring isn't available.
+//
+
+static
+LONG
+ExecuteSynchronously (
+    __in struct io_uring_sqe * Entry
+    )
+{
+    LONG_PTR Result;
+    PVOID Buffer;
+
+    Buffer = (PVOID) (ULONG_PTR) Entry->addr;
+
+    switch (Entry->opcode) {
+    case IORING_OP_OPENAT:
+        Result = openat(Entry->fd, (const char *) Buffer, (int) Entry->open_flags, (mode_t) Entry->len);
+        break;
+    case IORING_OP_READ:
+        Result = (LONGLONG) Entry->off == -1
+               ? read(Entry->fd, Buffer, Entry->len)
+               : pread(Entry->fd, Buffer, Entry->len, (off_t) Entry->off);
+        break;
+    case IORING_OP_WRITE:
+        Result = (LONGLONG) Entry->off == -1
+               ? write(Entry->fd, Buffer, Entry->len)
+               : pwrite(Entry->fd, Buffer, Entry->len, (off_t) Entry->off);
+        break;
+    case IORING_OP_FSYNC:
+        Result = (Entry->fsync_flags & IORING_FSYNC_DATASYNC) ? fdatasync(Entry->fd) : fsync(Entry->fd);
+        break;
+    default:
+        _ASSERTE(!"unexpected operation");
+        errno = EINVAL;
+        Result = -1;
+        break;
+    }
+
+    return Result < 0 ? -errno : (LONG) Result;
+}
+
+//
+// Queues the operation described by Entry on the ring and parks the current thread until
+// it completes. Returns the result of the operation, which is a negated errno value on
+// failure.
+//
+
+static
+LONG
+ExecuteUringRequest (
+    __in struct io_uring_sqe * Entry
+    )
+{
+    ULONG Index;
+    URING_REQUEST Request;
+    ULONG Tail;
+
+    UtAcquireSpinLock(&Uring.Lock);
+
+    if (Uring.State == URING_UNINITIALIZED) {
+        Uring.State = SetupUring() ? URING_READY : URING_UNAVAILABLE;
+    }
+
+    if (Uring.State == URING_UNAVAILABLE) {
+        UtReleaseSpinLock(&Uring.Lock);
+        return ExecuteSynchronously(Entry);
+    }
+
+    //
+    // Wait for room in the completion queue, which threads that yield help reap, and
+    // make room in the submission queue by submitting the queued entries. The kernel 
+    // may take only some of them, or none when it is short of resources, in which case
+    // we also yield and try again.
+    //
+
+    while (Uring.NumberOfInFlight >= Uring.CqEntries || !HasUringSubmissionRoom()) {
+        UtReleaseSpinLock(&Uring.Lock);
+        UtYield();
+        UtAcquireSpinLock(&Uring.Lock);
+    }
+
+    Tail = *Uring.SqTail;
+
+    Request.Thread = UtSelf();
+    Entry->user_data = (ULONG64) (ULONG_PTR) &Request;
+
+    Index = Tail & Uring.SqMask;
+    Uring.Sqes[Index] = *Entry;
+    Uring.SqArray[Index] = Index;
+    __atomic_store_n(Uring.SqTail, Tail + 1, __ATOMIC_RELEASE);
+
+    Uring.NumberOfUnsubmitted += 1;
+    Uring.NumberOfInFlight += 1;
+    InterlockedIncrement(&NumberOfUringRequests);
+
+    UtReleaseSpinLock(&Uring.Lock);
+
+    //
+    // The thread is unparked by the worker that reaps the completion.
+    //
+
+    UtPark();
+    return Request.Result;
+}
+
+//
+// Initializes Entry with the specified operation on Descriptor.
+//
+
+FORCEINLINE
+VOID
+PrepareUringEntry (
+    __out struct io_uring_sqe * Entry,
+    __in UCHAR Opcode,
+    __in int Descriptor,
+    __in const VOID * Buffer,
+    __in ULONG Length,
+    __in LONGLONG Offset
+    )
+{
+    RtlZeroMemory(Entry, sizeof(*Entry));
+    Entry->opcode = Opcode;
+    Entry->fd = Descriptor;
+    Entry->addr = (ULONG64) (ULONG_PTR) Buffer;
+    Entry->len = Length;
+    Entry->off = (ULONG64) Offset;
+}
+
+//
+// Converts the result of an operation to the convention of the system calls.
+//
+
+FORCEINLINE
+LONG
+TranslateUringResult (
+    __in LONG Result
+    )
+{
+    if (Result < 0) {
+        errno = -Result;
+        return -1;
+    }
+
+    return Result;
+}
+
+//
+// The largest transfer performed by a single operation, as read and write do.
+//
+
+#define URING_MAX_TRANSFER 0x7FFFF000
+
+//
+// Opens the file at Path, relative to DirectoryDescriptor, as openat does. Returns the
+// descriptor of the file, or -1 with errno set on failure.
+//
+
+int
+UtOpenAt (
+    __in int DirectoryDescriptor,
+    __in const char * Path,
+    __in int Flags,
+    __in ULONG Mode
+    )
+{
+    struct io_uring_sqe Entry;
+
+    PrepareUringEntry(&Entry, IORING_OP_OPENAT, DirectoryDescriptor, Path, Mode, 0);
+    Entry.open_flags = (ULONG) (Flags | O_CLOEXEC);
+    return TranslateUringResult(ExecuteUringRequest(&Entry));
+}
+
+//
+// Reads up to Length bytes from the specified descriptor into Buffer, starting at Offset,
+// or at the current file position if Offset is -1. Returns the number of bytes read, 0 at
+// end of file, or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtReadAt (
+    __in int Descriptor,
+    __out PVOID Buffer,
+    __in SIZE_T Length,
+    __in LONGLONG Offset
+    )
+{
+    struct io_uring_sqe Entry;
+
+    PrepareUringEntry(&Entry, IORING_OP_READ, Descriptor, Buffer,
+                      (ULONG) (Length > URING_MAX_TRANSFER ? URING_MAX_TRANSFER : Length), Offset);
+    return TranslateUringResult(ExecuteUringRequest(&Entry));
+}
+
+//
+// Writes up to Length bytes from Buffer to the specified descriptor, starting at Offset,
+// or at the current file position if Offset is -1. Returns the number of bytes written,
+// or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtWriteAt (
+    __in int Descriptor,
+    __in const VOID * Buffer,
+    __in SIZE_T Length,
+    __in LONGLONG Offset
+    )
+{
+    struct io_uring_sqe Entry;
+
+    PrepareUringEntry(&Entry, IORING_OP_WRITE, Descriptor, Buffer,
+                      (ULONG) (Length > URING_MAX_TRANSFER ? URING_MAX_TRANSFER : Length), Offset);
+    return TranslateUringResult(ExecuteUringRequest(&Entry));
+}
+
+//
+// Flushes the specified file to storage, along with its metadata unless DataOnly is TRUE.
+// Returns 0, or -1 with errno set on failure.
+//
+
+int
+UtFsync (
+    __in int Descriptor,
+    __in BOOL DataOnly
+    )
+{
+    struct io_uring_sqe Entry;
+
+    PrepareUringEntry(&Entry, IORING_OP_FSYNC, Descriptor, NULL, 0, 0);
+    Entry.fsync_flags = DataOnly ? IORING_FSYNC_DATASYNC : 0;
+    return TranslateUringResult(ExecuteUringRequest(&Entry));
+}
+
+//
+// Records the event that the ring signals as operations complete. The ring itself is
+// set up when the first operation is queued.
+//
+
+VOID
+InitializeUring (
+    __in int WakeEvent
+    )
+{
+    Uring.WakeEvent = WakeEvent;
+}
+
+//
+// Submits the queued operations if Submit is TRUE or URING_SUBMIT_BATCH are queued, and
+// unparks the threads whose operations completed, in batches: the completions are
+// collected while holding the lock, and the threads unparked after releasing it.
+// Must be called by a worker.
+//
+
+VOID
+ServiceUring (
+    __in BOOL Submit
+    )
+{
+    ULONG Count;
+    ULONG Head;
+    ULONG Index;
+    PURING_REQUEST Requests[URING_REAP_BATCH];
+    LONG Results[URING_REAP_BATCH];
+    ULONG Tail;
+
+    if (Uring.State != URING_READY) {
+        return;
+    }
+
+    do {
+        UtAcquireSpinLock(&Uring.Lock);
+
+        if (Submit || Uring.NumberOfUnsubmitted >= URING_SUBMIT_BATCH) {
+            SubmitUring();
+            Submit = FALSE;
+        }
+
+        Head = *Uring.CqHead;
+        Tail = __atomic_load_n(Uring.CqTail, __ATOMIC_ACQUIRE);
+
+        for (Count = 0; Count < URING_REAP_BATCH && Head != Tail; ++Count, ++Head) {
+            Requests[Count] = (PURING_REQUEST) (ULONG_PTR) Uring.Cqes[Head & Uring.CqMask].user_data;
+            Results[Count] = Uring.Cqes[Head & Uring.CqMask].res;
+        }
+
+        __atomic_store_n(Uring.CqHead, Head, __ATOMIC_RELEASE);
+        Uring.NumberOfInFlight -= Count;
+
+        UtReleaseSpinLock(&Uring.Lock);
+
+        if (Count != 0) {
+            InterlockedExchangeAdd(&NumberOfUringRequests, -(LONG) Count);
+        }
+
+        for (Index = 0; Index < Count; ++Index) {
+            Requests[Index]->Result = Results[Index];
+            UtUnpark(Requests[Index]->Thread);
+        }
+    } while (Count == URING_REAP_BATCH);
+}
+
+#endif
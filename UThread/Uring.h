@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#pragma once
+
+#include "UThread.h"
+
+#if !defined(_WIN32)
+
+//
+// The io_uring engine performs file and socket I/O on behalf of user threads. Each
+// operation is queued as a submission queue entry on a ring shared by all workers, and
+// the calling thread parks until the operation completes. Rather than making a system
+// call per operation, the scheduler submits all the queued entries at once when a worker
+// runs out of ready threads, or at least every few switches, and reaps completions in
+// bulk from the completion queue, which is mapped in memory, unparking the threads whose
+// operations completed. The ring signals the scheduler's wake event as operations
+// complete, so that an idle scheduler wakes up to reap them. Where io_uring isn't
+// available, the operations are performed synchronously.
+//
+
+//
+// Opens the file at Path, relative to DirectoryDescriptor, as openat does. Returns the
+// descriptor of the file, or -1 with errno set on failure.
+//
+
+int
+UtOpenAt (
+    __in int DirectoryDescriptor,
+    __in const char * Path,
+    __in int Flags,
+    __in ULONG Mode
+    );
+
+//
+// Reads up to Length bytes from the specified descriptor into Buffer, starting at Offset,
+// or at the current file position if Offset is -1. Returns the number of bytes read, 0 at
+// end of file, or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtReadAt (
+    __in int Descriptor,
+    __out PVOID Buffer,
+    __in SIZE_T Length,
+    __in LONGLONG Offset
+    );
+
+//
+// Writes up to Length bytes from Buffer to the specified descriptor, starting at Offset,
+// or at the current file position if Offset is -1. Returns the number of bytes written,
+// or -1 with errno set on failure.
+//
+
+LONG_PTR
+UtWriteAt (
+    __in int Descriptor,
+    __in const VOID * Buffer,
+    __in SIZE_T Length,
+    __in LONGLONG Offset
+    );
+
+//
+// Flushes the specified file to storage, along with its metadata unless DataOnly is TRUE.
+// Returns 0, or -1 with errno set on failure.
+//
+
+int
+UtFsync (
+    __in int Descriptor,
+    __in BOOL DataOnly
+    );
+
+//
+// The scheduler's interface to the io_uring engine.
+//
+
+//
+// The number of operations that were queued and haven't been reaped yet.
+//
+
+extern volatile LONG NumberOfUringRequests;
+
+//
+// Records the event that the ring signals as operations complete. The ring itself is
+// set up when the first operation is queued.
+//
+
+VOID
+InitializeUring (
+    __in int WakeEvent
+    );
+
+//
+// Submits the queued operations if Submit is TRUE or many are queued, and
+// unparks the threads whose operations completed. Must be called by a worker.
+//
+
+VOID
+ServiceUring (
+    __in BOOL Submit
+    );
+
+#endif
@@ -0,0 +1,187 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL
+// 2007-2011
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+//
+//
+
+#pragma once
+
+#include "Platform.h"
+
+//
+// A work-stealing deque, after Chase and Lev, holding the ready threads of a worker.
+// Only the owner pushes items, at the bottom. Items are taken from the top, both by
+// the owner, so that ready threads keep their FIFO order, and by other workers that
+// run out of work. The owner publishes items with plain stores, as x86 doesn't
+// reorder stores with other stores; taking an item requires an interlocked operation.
+// Indices are free running and only compared by difference, so they can wrap around.
+//
+
+typedef struct _WORK_DEQUE_ARRAY {
+    struct _WORK_DEQUE_ARRAY * Previous;
+    ULONG Mask;
+    PVOID Slots[1];
+} WORK_DEQUE_ARRAY, *PWORK_DEQUE_ARRAY;
+
+typedef struct _WORK_DEQUE {
+    DECLSPEC_CACHEALIGN volatile ULONG Top;
+    DECLSPEC_CACHEALIGN volatile ULONG Bottom;
+    PWORK_DEQUE_ARRAY volatile Array;
+} WORK_DEQUE, *PWORK_DEQUE;
+
+//
+// The initial number of slots of a work deque, which must be a power of 2.
+//
+
+#define WORK_DEQUE_INITIAL_SIZE 256
+
+//
+// Allocates an array with the specified number of slots.
+//
+
+FORCEINLINE
+PWORK_DEQUE_ARRAY
+AllocateWorkDequeArray (
+    __in ULONG Size
+    )
+{
+    PWORK_DEQUE_ARRAY Array;
+
+    Array = (PWORK_DEQUE_ARRAY) malloc(FIELD_OFFSET(WORK_DEQUE_ARRAY, Slots) + Size * sizeof(PVOID));
+    _ASSERTE(Array != NULL);
+
+    Array->Previous = NULL;
+    Array->Mask = Size - 1;
+    return Array;
+}
+
+//
+// Initializes the specified work deque.
+//
+
+FORCEINLINE
+VOID
+InitializeWorkDeque (
+    __out PWORK_DEQUE Deque
+    )
+{
+    Deque->Top = 0;
+    Deque->Bottom = 0;
+    Deque->Array = AllocateWorkDequeArray(WORK_DEQUE_INITIAL_SIZE);
+}
+
+//
+// Frees the arrays of the specified work deque. Replaced arrays are only freed here,
+// because other workers may still be reading from them while the deque is in use.
+//
+
+FORCEINLINE
+VOID
+DeleteWorkDeque (
+    __inout PWORK_DEQUE Deque
+    )
+{
+    PWORK_DEQUE_ARRAY Array;
+    PWORK_DEQUE_ARRAY Previous;
+
+    for (Array = Deque->Array; Array != NULL; Array = Previous) {
+        Previous = Array->Previous;
+        free(Array);
+    }
+
+    Deque->Array = NULL;
+}
+
+//
+// Returns true if the specified work deque is empty. The result is only a hint when
+// other workers may be taking items concurrently.
+//
+
+FORCEINLINE
+BOOL
+IsWorkDequeEmpty (
+    __in PWORK_DEQUE Deque
+    )
+{
+    return (LONG) (Deque->Bottom - Deque->Top) <= 0;
+}
+
+//
+// Pushes the specified item at the bottom of the deque. Must only be called by the
+// owner, which grows the deque when it is full.
+//
+
+FORCEINLINE
+VOID
+PushWorkDeque (
+    __inout PWORK_DEQUE Deque,
+    __in PVOID Item
+    )
+{
+    PWORK_DEQUE_ARRAY Array;
+    PWORK_DEQUE_ARRAY NewArray;
+    ULONG Bottom;
+    ULONG Index;
+    ULONG Top;
+
+    Bottom = Deque->Bottom;
+    Top = Deque->Top;
+    Array = Deque->Array;
+
+    if (Bottom - Top > Array->Mask) {
+
+        //
+        // The deque is full. Copy the live items to an array twice the size, which
+        // is published before the new item, and keep the old one reachable.
+        //
+
+        NewArray = AllocateWorkDequeArray((Array->Mask + 1) * 2);
+        for (Index = Top; Index != Bottom; ++Index) {
+            NewArray->Slots[Index & NewArray->Mask] = Array->Slots[Index & Array->Mask];
+        }
+
+        NewArray->Previous = Array;
+        Deque->Array = Array = NewArray;
+    }
+
+    Array->Slots[Bottom & Array->Mask] = Item;
+    _ReadWriteBarrier();
+    Deque->Bottom = Bottom + 1;
+}
+
+//
+// Takes the item at the top of the deque, or returns NULL if the deque is empty.
+// Can be called by any worker.
+//
+
+FORCEINLINE
+PVOID
+TakeWorkDeque (
+    __inout PWORK_DEQUE Deque
+    )
+{
+    PWORK_DEQUE_ARRAY Array;
+    PVOID Item;
+    ULONG Top;
+
+    do {
+        Top = Deque->Top;
+        _ReadWriteBarrier();
+
+        if ((LONG) (Deque->Bottom - Top) <= 0) {
+            return NULL;
+        }
+
+        Array = Deque->Array;
+        Item = Array->Slots[Top & Array->Mask];
+    } while ((ULONG) InterlockedCompareExchange((volatile LONG *) &Deque->Top, 
+                                                (LONG) (Top + 1), (LONG) Top) != Top);
+
+    return Item;
+}